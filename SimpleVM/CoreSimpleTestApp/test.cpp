@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <atomic>
 #include <iostream>
+#include <chrono>
 
 
 #pragma comment(lib, "../CoreStaticLib.lib")
@@ -18,7 +19,9 @@
 #include "../CoreStaticLib/svm/vmmemory.h"
 #include "../CoreStaticLib/svm/bc_emitter.h"
 #include "../CoreStaticLib/svm/bc_interpreter.h"
+#include "../CoreStaticLib/svm/vmtrace.h"
 #include "../CoreStaticLib/svm/integer.h"
+#include "../CoreStaticLib/svm/vmscheduler.h"
 
 using namespace VM_NAMESPACE;
 
@@ -420,8 +423,738 @@ void test_integer()
     #undef int_param
 }
 
+//
+// Guest used by benchmarks: code at 0x1000 (private, or Image if given),
+// data at 0x800000 and 4 stacks.
+//
+
+class BenchmarkGuest
+{
+public:
+    struct Inst
+    {
+        Opcode::T Code;
+        Operand Op;
+        int Target; // index of branch target instruction (-1 if none)
+    };
+
+    BenchmarkGuest(bool GuardedAddressSpace = false, const std::shared_ptr<VMCodeImage>& Image = nullptr) :
+        Memory_(0x4000000, GuardedAddressSpace), CodeAddress_(), DataAddress_(), StackAddress_{}
+    {
+        if (Image)
+        {
+            DASSERT(Memory_.MapImage(Image, 0x1000, 0,
+                VMMemoryManager::Options::UsePreferredAddress, CodeAddress_));
+        }
+        else
+        {
+            DASSERT(Memory_.Allocate(0x1000, 0xf000, MemoryType::Bytecode, 0,
+                VMMemoryManager::Options::UsePreferredAddress, CodeAddress_));
+        }
+
+        DASSERT(Memory_.Allocate(0x800000, 0x1000, MemoryType::Data, 0,
+            VMMemoryManager::Options::UsePreferredAddress, DataAddress_));
+        Memory_.Fill(DataAddress_, 0x1000, 0);
+
+        for (auto& it : StackAddress_)
+        {
+            DASSERT(Memory_.Allocate(0, StackSize, MemoryType::Stack, 0, 0, it));
+            Memory_.Fill(it, StackSize, 0xdd);
+        }
+    }
+
+    bool Load(const std::vector<Inst>& Program)
+    {
+        std::vector<unsigned char> Code;
+        if (!Encode(Program, Code))
+            return false;
+
+        return Memory_.Write(CodeAddress_, Code.size(), Code.data()) == Code.size();
+    }
+
+    // Branch offsets are resolved from Inst::Target (relative to the next instruction)
+    static bool Encode(const std::vector<Inst>& Program, std::vector<unsigned char>& Code)
+    {
+        std::vector<uint32_t> Offset(Program.size() + 1);
+        unsigned char Buffer[0x100];
+        VMBytecodeEmitter Emitter;
+
+        auto Emit = [&Emitter](const Inst& Instruction, Operand Op, unsigned char* Buffer, size_t Size, size_t* SizeRequired)
+        {
+            Emitter.BeginEmit();
+            if (Op.Type == OperandType::T::None)
+                Emitter.Emit(Instruction.Code);
+            else
+                Emitter.Emit(Instruction.Code, Op);
+
+            return Emitter.EndEmit(Buffer, Size, SizeRequired);
+        };
+
+        for (size_t i = 0; i < Program.size(); i++)
+        {
+            size_t Size = 0;
+            Emit(Program[i], Program[i].Op, Buffer, sizeof(Buffer), &Size);
+            Offset[i + 1] = Offset[i] + static_cast<uint32_t>(Size);
+        }
+
+        Code.resize(Offset.back());
+        for (size_t i = 0; i < Program.size(); i++)
+        {
+            Operand Op = Program[i].Op;
+            if (Program[i].Target >= 0)
+                Op.Value = static_cast<uint32_t>(Offset[Program[i].Target] - Offset[i + 1]);
+
+            size_t Size = 0;
+            if (!Emit(Program[i], Op, &Code[Offset[i]], Code.size() - Offset[i], &Size))
+                return false;
+        }
+
+        return true;
+    }
+
+    VMExecutionContext NewContext()
+    {
+        const int DefaultAlignment = sizeof(intptr_t);
+
+        VMExecutionContext Context{};
+        Context.IP = static_cast<uint32_t>(CodeAddress_);
+        Context.ExceptionState = ExceptionState::T::None;
+        Context.Stack = VMStack(Memory_.HostAddress(StackAddress_[0]), StackSize, DefaultAlignment);
+        Context.ShadowStack = VMStack(Memory_.HostAddress(StackAddress_[1]), StackSize, DefaultAlignment);
+        Context.LocalVariableStack = VMStack(Memory_.HostAddress(StackAddress_[2]), StackSize, DefaultAlignment);
+        Context.ArgumentStack = VMStack(Memory_.HostAddress(StackAddress_[3]), StackSize, DefaultAlignment);
+
+        if (DefaultAlignment == sizeof(int64_t))
+            Context.Mode |= ModeBits::T::VMStackOper64Bit;
+
+        return Context;
+    }
+
+    VMMemoryManager& Memory()
+    {
+        return Memory_;
+    }
+
+    uint64_t DataAddress() const
+    {
+        return DataAddress_;
+    }
+
+private:
+    static constexpr const size_t StackSize = 0x10000;
+
+    VMMemoryManager Memory_;
+    uint64_t CodeAddress_;
+    uint64_t DataAddress_;
+    uint64_t StackAddress_[4];
+};
+
+struct BenchmarkLoop
+{
+    const char* Name;
+    std::vector<BenchmarkGuest::Inst> Program;
+};
+
+std::vector<BenchmarkLoop> benchmark_loops(int32_t LoopCount)
+{
+    return
+    {
+        {
+            "countdown",
+            {
+                { Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, LoopCount), -1 },
+                { Opcode::T::Dup, Operand(), -1 },                          // 1: loop
+                { Opcode::T::Br_z_I4, Operand(OperandType::Imm32, 0), 6 },
+                { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 1), -1 },
+                { Opcode::T::Sub_I4, Operand(), -1 },
+                { Opcode::T::Br_I4, Operand(OperandType::Imm32, 0), 1 },
+                { Opcode::T::Bp, Operand(), -1 },                           // 6: exit
+            },
+        },
+        {
+            "arithmetic",
+            {
+                { Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, 1), -1 },
+                { Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, LoopCount), -1 },
+                { Opcode::T::Xch, Operand(), -1 },                          // 2: loop
+                { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 3), -1 },
+                { Opcode::T::Mul_U4, Operand(), -1 },
+                { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 0x5a), -1 },
+                { Opcode::T::Xor_X4, Operand(), -1 },
+                { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 1), -1 },
+                { Opcode::T::Shr_U4, Operand(), -1 },
+                { Opcode::T::Xch, Operand(), -1 },
+                { Opcode::T::Dup, Operand(), -1 },
+                { Opcode::T::Br_z_I4, Operand(OperandType::Imm32, 0), 15 },
+                { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 1), -1 },
+                { Opcode::T::Sub_I4, Operand(), -1 },
+                { Opcode::T::Br_I4, Operand(OperandType::Imm32, 0), 2 },
+                { Opcode::T::Xch, Operand(), -1 },                          // 15: exit
+                { Opcode::T::Bp, Operand(), -1 },
+            },
+        },
+    };
+}
+
+void benchmark_dispatch()
+{
+    using ExecuteFunction = int (VMBytecodeInterpreter::*)(VMExecutionContext&, int);
+
+    const int32_t LoopCount = 1000000;
+
+    struct
+    {
+        const char* Name;
+        ExecuteFunction Execute;
+    } EngineList[] =
+    {
+        { "switch", &VMBytecodeInterpreter::ExecuteSwitch },
+#if M_VM_THREADED_DISPATCH
+        { "threaded", &VMBytecodeInterpreter::ExecuteThreaded },
+#endif
+#if M_VM_JIT
+        { "jit", &VMBytecodeInterpreter::ExecuteJit },
+#endif
+    };
+
+    for (auto& Loop : benchmark_loops(LoopCount))
+    {
+        BenchmarkGuest Guest;
+        DASSERT(Guest.Load(Loop.Program));
+
+        for (auto& Engine : EngineList)
+        {
+            VMBytecodeInterpreter Interpreter(Guest.Memory());
+            VMExecutionContext Context = Guest.NewContext();
+
+            auto Start = std::chrono::steady_clock::now();
+            int StepCount = (Interpreter.*Engine.Execute)(Context, INT_MAX);
+            auto End = std::chrono::steady_clock::now();
+
+            uint64_t Top = 0;
+            Context.Stack.PeekFrom(&Top, 0);
+
+            double Elapsed = std::chrono::duration<double>(End - Start).count();
+            printf("%-12s %-10s steps %10d, top %016llx, %8.3f ms, %8.2f Msteps/s, exception %d\n",
+                Loop.Name, Engine.Name, StepCount, Top, Elapsed * 1000.0,
+                StepCount / Elapsed / 1000000.0, Context.ExceptionState);
+        }
+
+        // Runs until the bp without a step count
+        {
+            VMBytecodeInterpreter Interpreter(Guest.Memory());
+            VMExecutionContext Context = Guest.NewContext();
+
+            auto Start = std::chrono::steady_clock::now();
+            auto Result = Interpreter.ExecuteUntilEvent(Context, ExecuteBudget{});
+            auto End = std::chrono::steady_clock::now();
+
+            uint64_t Top = 0;
+            Context.Stack.PeekFrom(&Top, 0);
+
+            double Elapsed = std::chrono::duration<double>(End - Start).count();
+            printf("%-12s %-10s steps %10llu, top %016llx, %8.3f ms, %8.2f Msteps/s, event %d\n",
+                Loop.Name, "event", Result.StepCount, Top, Elapsed * 1000.0,
+                Result.StepCount / Elapsed / 1000000.0, Result.Event);
+        }
+    }
+}
+
+void benchmark_memory()
+{
+    using Inst = BenchmarkGuest::Inst;
+
+    const int32_t LoopCount = 1000000;
+    const uint32_t Counter = 0x800010;
+
+    // Increments a guest memory counter on each iteration
+    std::vector<Inst> Program
+    {
+        { Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, LoopCount), -1 },
+        { Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, Counter), -1 },  // 1: loop
+        { Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, Counter), -1 },
+        { Opcode::T::Ldpv_X4, Operand(), -1 },
+        { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 1), -1 },
+        { Opcode::T::Add_I4, Operand(), -1 },
+        { Opcode::T::Stpv_X4, Operand(), -1 },
+        { Opcode::T::Ldimm_I1, Operand(OperandType::Imm8, 1), -1 },
+        { Opcode::T::Sub_I4, Operand(), -1 },
+        { Opcode::T::Dup, Operand(), -1 },
+        { Opcode::T::Br_nz_I4, Operand(OperandType::Imm32, 0), 1 },
+        { Opcode::T::Bp, Operand(), -1 },
+    };
+
+    for (bool GuardedAddressSpace : { false, true })
+    {
+        BenchmarkGuest Guest(GuardedAddressSpace);
+        DASSERT(Guest.Load(Program));
+
+        VMBytecodeInterpreter Interpreter(Guest.Memory());
+        VMExecutionContext Context = Guest.NewContext();
+
+        auto Start = std::chrono::steady_clock::now();
+        int StepCount = Interpreter.Execute(Context, INT_MAX);
+        auto End = std::chrono::steady_clock::now();
+
+        uint32_t Value = 0;
+        Guest.Memory().Read(Counter, sizeof(Value), reinterpret_cast<uint8_t*>(&Value));
+
+        double Elapsed = std::chrono::duration<double>(End - Start).count();
+        printf("%-12s %-10s steps %10d, counter %08x, %8.3f ms, %8.2f Msteps/s, exception %d\n",
+            "memory", GuardedAddressSpace ? "guarded" : "checked", StepCount, Value, Elapsed * 1000.0,
+            StepCount / Elapsed / 1000000.0, Context.ExceptionState);
+    }
+}
+
+//
+// Compares time slicing by step count with time slicing by fuel.
+//
+
+void benchmark_fuel()
+{
+    const int32_t LoopCount = 1000000;
+
+    for (auto& Loop : benchmark_loops(LoopCount))
+    {
+        BenchmarkGuest Guest;
+        DASSERT(Guest.Load(Loop.Program));
+
+        for (uint32_t Slice : { 1, 100, 10000 })
+        {
+            for (bool MeterFuel : { false, true })
+            {
+                VMBytecodeInterpreter Interpreter(Guest.Memory());
+                VMExecutionContext Context = Guest.NewContext();
+
+                uint64_t StepCount = 0;
+                uint64_t SliceCount = 0;
+
+                auto Start = std::chrono::steady_clock::now();
+                while (Context.ExceptionState == ExceptionState::T::None)
+                {
+                    if (MeterFuel)
+                    {
+                        ExecuteBudget Budget{};
+                        Budget.MeterFuel = true;
+
+                        Context.Fuel = Slice;
+                        StepCount += Interpreter.ExecuteUntilEvent(Context, Budget).StepCount;
+                    }
+                    else
+                    {
+                        StepCount += Interpreter.Execute(Context, Slice);
+                    }
+
+                    SliceCount++;
+                }
+                auto End = std::chrono::steady_clock::now();
+
+                double Elapsed = std::chrono::duration<double>(End - Start).count();
+                printf("%-12s %-10s slice %6u, steps %10llu, slices %10llu, %8.3f ms, %8.2f Msteps/s\n",
+                    Loop.Name, MeterFuel ? "fuel" : "count", Slice, StepCount, SliceCount,
+                    Elapsed * 1000.0, StepCount / Elapsed / 1000000.0);
+            }
+        }
+    }
+}
+
+//
+// Runs many independent guests on VMScheduler with 1 to all hardware threads.
+//
+
+void benchmark_scheduler()
+{
+    const size_t TaskCount = 1000;
+    const int32_t LoopCount = 20000;
+
+    auto Loop = benchmark_loops(LoopCount).front();
+
+    std::vector<std::unique_ptr<BenchmarkGuest>> Guests;
+    for (size_t i = 0; i < TaskCount; i++)
+    {
+        Guests.push_back(std::make_unique<BenchmarkGuest>());
+        DASSERT(Guests.back()->Load(Loop.Program));
+    }
+
+    uint32_t MaximumWorkerCount = std::thread::hardware_concurrency();
+    if (!MaximumWorkerCount)
+        MaximumWorkerCount = 1;
+    std::vector<uint32_t> WorkerCounts;
+    for (uint32_t WorkerCount = 1; WorkerCount < MaximumWorkerCount; WorkerCount *= 2)
+        WorkerCounts.push_back(WorkerCount);
+    WorkerCounts.push_back(MaximumWorkerCount);
+
+    for (auto WorkerCount : WorkerCounts)
+    {
+        std::vector<VMExecutionContext> Contexts;
+        for (auto& Guest : Guests)
+            Contexts.push_back(Guest->NewContext());
+
+        VMScheduler Scheduler(WorkerCount);
+        Scheduler.ResetStatistics();
+
+        for (size_t i = 0; i < TaskCount; i++)
+            Scheduler.Submit(Guests[i]->Memory(), Contexts[i]);
+
+        Scheduler.Wait();
+
+        auto Statistics = Scheduler.Statistics();
+        printf("scheduler %3u workers, tasks %6llu, slices %8llu, steals %6llu, %8.3f ms, %10.1f tasks/s, %8.2f Msteps/s, "
+            "latency p50 %8.3f ms, p99 %8.3f ms, p99.9 %8.3f ms, max %8.3f ms\n",
+            WorkerCount, Statistics.TaskCount, Statistics.SliceCount, Statistics.StealCount,
+            Statistics.Elapsed * 1000.0, Statistics.TasksPerSecond, Statistics.StepsPerSecond / 1000000.0,
+            Statistics.LatencyMedian * 1000.0, Statistics.Latency99 * 1000.0,
+            Statistics.Latency999 * 1000.0, Statistics.LatencyMaximum * 1000.0);
+    }
+}
+
+//
+// Starts many guests running the same program, with private copies of the
+// code or with one shared VMCodeImage, and keeps them (and their
+// interpreters) alive like sandboxes.
+//
+
+void benchmark_code_image()
+{
+    const size_t GuestCount = 1000;
+
+    auto Loop = benchmark_loops(1000).back();
+
+    std::vector<unsigned char> Code;
+    DASSERT(BenchmarkGuest::Encode(Loop.Program, Code));
+
+    for (bool Shared : { false, true })
+    {
+        std::vector<std::unique_ptr<BenchmarkGuest>> Guests;
+        std::vector<std::unique_ptr<VMBytecodeInterpreter>> Interpreters;
+        uint64_t StepCount = 0;
+
+        auto Start = std::chrono::steady_clock::now();
+
+        auto Image = Shared ? VMCodeImage::Create(Code.data(), Code.size()) : nullptr;
+
+        for (size_t i = 0; i < GuestCount; i++)
+        {
+            Guests.push_back(std::make_unique<BenchmarkGuest>(false, Image));
+            if (!Shared)
+                DASSERT(Guests.back()->Load(Loop.Program));
+
+            Interpreters.push_back(std::make_unique<VMBytecodeInterpreter>(Guests.back()->Memory()));
+
+            VMExecutionContext Context = Guests.back()->NewContext();
+            StepCount += Interpreters.back()->Execute(Context, INT_MAX);
+        }
+
+        auto End = std::chrono::steady_clock::now();
+
+        double Elapsed = std::chrono::duration<double>(End - Start).count();
+        printf("code image %-8s guests %6zu, steps %10llu, %8.3f ms, %8.3f us/guest\n",
+            Shared ? "shared" : "private", GuestCount, StepCount,
+            Elapsed * 1000.0, Elapsed * 1000000.0 / GuestCount);
+    }
+}
+
+//
+// Starts many guests from a warmed state (initialization is simulated by a
+// long loop), by replaying the initialization for each guest, by forking a
+// snapshot taken after it, or by loading the snapshot from a file.
+//
+
+void benchmark_snapshot_fork()
+{
+    enum class WarmStart { Replay, Fork, Load };
+
+    const size_t GuestCount = 1000;
+    const char* Path = "benchmark_snapshot.bin";
+
+    auto Loop = benchmark_loops(10000).back();
+
+    for (auto Method : { WarmStart::Replay, WarmStart::Fork, WarmStart::Load })
+    {
+        std::vector<std::unique_ptr<BenchmarkGuest>> Guests;
+        std::vector<std::unique_ptr<VMMemoryManager>> Forks;
+        std::shared_ptr<VMMemorySnapshot> Snapshot;
+        VMExecutionContext Warm{};
+
+        if (Method != WarmStart::Replay)
+        {
+            Guests.push_back(std::make_unique<BenchmarkGuest>());
+            DASSERT(Guests.back()->Load(Loop.Program));
+
+            VMBytecodeInterpreter Interpreter(Guests.back()->Memory());
+            Warm = Guests.back()->NewContext();
+            Interpreter.Execute(Warm, INT_MAX);
+
+            Snapshot = Guests.back()->Memory().Snapshot(Warm);
+            DASSERT(Snapshot);
+
+            if (Method == WarmStart::Load)
+                DASSERT(Snapshot->Save(Path));
+        }
+
+        auto Start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < GuestCount; i++)
+        {
+            VMExecutionContext Context{};
+
+            if (Method == WarmStart::Fork)
+            {
+                Forks.push_back(VMMemoryManager::Fork(*Snapshot, Context));
+                DASSERT(Forks.back());
+            }
+            else if (Method == WarmStart::Load)
+            {
+                Forks.push_back(VMMemoryManager::Deserialize(Path, Context));
+                DASSERT(Forks.back());
+            }
+            else
+            {
+                Guests.push_back(std::make_unique<BenchmarkGuest>());
+                DASSERT(Guests.back()->Load(Loop.Program));
+
+                VMBytecodeInterpreter Interpreter(Guests.back()->Memory());
+                Context = Guests.back()->NewContext();
+                Interpreter.Execute(Context, INT_MAX);
+            }
+        }
+
+        auto End = std::chrono::steady_clock::now();
+
+        const char* Names[] = { "replay", "fork", "load" };
+
+        double Elapsed = std::chrono::duration<double>(End - Start).count();
+        printf("warm start %-8s guests %6zu, saved %8zu bytes, %8.3f ms, %8.3f us/guest\n",
+            Names[static_cast<int>(Method)], GuestCount, Snapshot ? Snapshot->SavedSize() : 0,
+            Elapsed * 1000.0, Elapsed * 1000000.0 / GuestCount);
+    }
+
+    std::remove(Path);
+}
+
+//
+// Resets a guest with a large heap to a baseline after each short run, by
+// forking a full snapshot, or by rolling back the dirty pages since a
+// checkpoint.
+//
+
+void benchmark_checkpoint_rollback()
+{
+    const size_t ResetCount = 1000;
+    const size_t HeapSize = 0x400000;
+    const size_t DirtyPageCount = 4;
+
+    auto Loop = benchmark_loops(100).front();
+
+    for (auto Rollback : { false, true })
+    {
+        BenchmarkGuest Guest;
+        DASSERT(Guest.Load(Loop.Program));
+
+        auto& Memory = Guest.Memory();
+
+        uint64_t HeapAddress = 0;
+        DASSERT(Memory.Allocate(0, HeapSize, MemoryType::Data, 0, 0, HeapAddress));
+        Memory.Fill(HeapAddress, HeapSize, 0x5a);
+
+        VMExecutionContext Baseline = Guest.NewContext();
+        std::shared_ptr<VMMemorySnapshot> Snapshot = Rollback ? Memory.Checkpoint(Baseline) : Memory.Snapshot(Baseline);
+        DASSERT(Snapshot);
+
+        std::unique_ptr<VMMemoryManager> Fork;
+        VMExecutionContext Context = Baseline;
+        size_t DirtySize = 0;
+
+        auto Start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < ResetCount; i++)
+        {
+            auto& Current = Fork ? *Fork : Memory;
+
+            VMBytecodeInterpreter Interpreter(Current);
+            Interpreter.Execute(Context, INT_MAX);
+
+            for (size_t j = 0; j < DirtyPageCount; j++)
+                Current.Fill(HeapAddress + ((i + j * 0x100) % (HeapSize / VMMemoryManager::PageSize)) * VMMemoryManager::PageSize, 8, static_cast<uint8_t>(i));
+
+            if (Rollback)
+            {
+                for (const auto& Range : Memory.DirtyRanges())
+                    DirtySize += static_cast<size_t>(Range.Size);
+
+                DASSERT(Memory.Rollback(Context));
+            }
+            else
+            {
+                Fork = VMMemoryManager::Fork(*Snapshot, Context);
+                DASSERT(Fork);
+            }
+        }
+
+        auto End = std::chrono::steady_clock::now();
+
+        double Elapsed = std::chrono::duration<double>(End - Start).count();
+        printf("reset %-8s resets %6zu, restored %8zu bytes/reset, %8.3f ms, %8.3f us/reset\n",
+            Rollback ? "rollback" : "fork", ResetCount,
+            Rollback ? DirtySize / ResetCount : Snapshot->SavedSize(),
+            Elapsed * 1000.0, Elapsed * 1000000.0 / ResetCount);
+    }
+}
+
+//
+// Searches a page bitmap of a 4 GiB guest (1M pages) in which most pages
+// are allocated, bit by bit and by Bitmap searches.
+//
+
+void benchmark_bitmap()
+{
+    const size_t BitCount = 0x100000;
+    const size_t SearchCount = 100;
+    const size_t RunSize = 16;
+
+    Bitmap Pages(BitCount);
+    Pages.SetAll();
+
+    // Single free pages, and one free run near the end
+    for (size_t i = 0x1000; i < BitCount; i += 0x1000)
+        Pages.Clear(i + 1);
+
+    Pages.ClearRange(BitCount - 0x100, RunSize);
+
+    auto Measure = [&](const char* Name, const std::function<size_t()>& Search)
+    {
+        size_t Result = 0;
+
+        auto Start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < SearchCount; i++)
+            Result = Search();
+
+        auto End = std::chrono::steady_clock::now();
+
+        double Elapsed = std::chrono::duration<double>(End - Start).count();
+        printf("bitmap %-22s bits %8zu, found %8zx, %10.3f us/search\n",
+            Name, BitCount, Result, Elapsed * 1000000.0 / SearchCount);
+    };
+
+    Measure("clear run (per bit)", [&]()
+    {
+        size_t Run = 0;
+        for (size_t i = 0; i < BitCount; i++)
+        {
+            bool State = false;
+            Pages.Get(i, State);
+
+            Run = State ? 0 : Run + 1;
+            if (Run == RunSize)
+                return i + 1 - RunSize;
+        }
+
+        return static_cast<size_t>(Bitmap::Position::Invalid);
+    });
+
+    Measure("clear run", [&]() { return Pages.FindFirstClearRange(0, RunSize); });
+    Measure("first clear", [&]() { return Pages.FindFirstClear(2); });
+    Measure("last set", [&]() { return Pages.FindLastSet(BitCount - 0x100 + RunSize - 1); });
+
+    SummaryBitmap Summary(BitCount);
+    Summary.SetAll();
+
+    for (size_t i = 0x1000; i < BitCount; i += 0x1000)
+        Summary.Clear(i + 1);
+
+    Summary.ClearRange(BitCount - 0x100, RunSize);
+
+    Measure("clear run (summary)", [&]() { return Summary.FindFirstClearRange(0, RunSize); });
+    Measure("first clear (summary)", [&]() { return Summary.FindFirstClear(2); });
+
+    Pages.ClearAll();
+    Measure("first set (empty)", [&]() { return Pages.FindFirstSet(0); });
+
+    Summary.ClearAll();
+    Measure("first set (empty, summary)", [&]() { return Summary.FindFirstSet(0); });
+}
+
+//
+// Allocates and frees a block without a preferred address while memory is
+// fragmented by an increasing number of 1-page holes, which the block does
+// not fit.
+//
+
+void benchmark_allocation()
+{
+    const size_t MemorySize = 0x40000000;
+    const size_t AllocationCount = 1000;
+    const size_t PageSize = VMMemoryManager::PageSize;
+
+    for (size_t HoleCount : { 16, 1024, 4096, 16384 })
+    {
+        VMMemoryManager Memory(MemorySize);
+
+        for (size_t i = 0; i < HoleCount; i++)
+        {
+            uint64_t Address = 0;
+            DASSERT(Memory.Allocate((2 * i + 1) * PageSize, PageSize, MemoryType::Data, 0,
+                VMMemoryManager::Options::UsePreferredAddress, Address));
+        }
+
+        uint64_t Address = 0;
+
+        auto Start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < AllocationCount; i++)
+        {
+            DASSERT(Memory.Allocate(0, 2 * PageSize, MemoryType::Data, 0, 0, Address));
+            DASSERT(Memory.Free(Address, 0));
+        }
+
+        auto End = std::chrono::steady_clock::now();
+
+        double Elapsed = std::chrono::duration<double>(End - Start).count();
+        printf("%-12s holes %8zu, address %08llx, %10.3f us/allocation\n",
+            "allocation", HoleCount, Address, Elapsed * 1000000.0 / AllocationCount);
+    }
+}
+
+//
+// Prints the most frequent instruction sequences of benchmark loops
+// (candidates for inst_fused_table.inc).
+//
+
+void profile_superinstructions()
+{
+    VMNgramTraceSink Sink;
+
+    for (auto& Loop : benchmark_loops(1000))
+    {
+        BenchmarkGuest Guest;
+        DASSERT(Guest.Load(Loop.Program));
+
+        VMBytecodeInterpreterT<SinkTracePolicy> Interpreter(Guest.Memory());
+        VMExecutionContext Context = Guest.NewContext();
+        Context.TraceSink = &Sink;
+
+        Interpreter.Execute(Context, INT_MAX);
+    }
+
+    Sink.Report(16);
+}
+
 int main()
 {
+    benchmark_dispatch();
+    benchmark_memory();
+    benchmark_fuel();
+    benchmark_scheduler();
+    benchmark_code_image();
+    benchmark_snapshot_fork();
+    benchmark_checkpoint_rollback();
+    benchmark_bitmap();
+    benchmark_allocation();
+    profile_superinstructions();
+
+    return 0;
+
     test_integer();
 
     return 0;
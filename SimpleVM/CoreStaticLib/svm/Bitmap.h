@@ -1,10 +1,43 @@
 #pragma once
 
+#include "arch.h"
+
 #include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <memory>
 
+//
+// With AVX2, searches skip runs of empty or full words 256 bits at a time.
+// It is used if the compiler targets AVX2 (/arch:AVX2 or -mavx2); define
+// M_BITMAP_AVX2=0 to disable it.
+//
+
+#if !defined(M_BITMAP_AVX2)
+#if defined(__AVX2__)
+#define M_BITMAP_AVX2               1
+#else
+#define M_BITMAP_AVX2               0
+#endif
+#endif
+
+#if M_COMPILER_TYPE == M_COMPILER_MSVC
+#include <intrin.h>
+#endif
+
+#if M_BITMAP_AVX2
+#include <immintrin.h>
+#endif
+
 class Bitmap
 {
+    //
+    // Bit i is bit (i & 7) of byte (i >> 3). Ranges and searches work on
+    // 64-bit words (bytes 8n to 8n + 7) loaded in host byte order, which
+    // keeps the bit order on little-endian hosts. The last word may be
+    // partial; bits past Count() are neither modified nor found.
+    //
+
 public:
     using BitPosition = size_t;
 
@@ -89,173 +122,605 @@ public:
 
     bool SetRange(BitPosition Index, BitPosition Count)
     {
-        BitPosition Start = Index;
-        BitPosition End = Index + Count - 1;
-
-        if (Start > End)
+        if (!IsRangeValid(Index, Count))
             return false;
 
-        if (!(0 <= Start && End < BitCount_))
+        FillRange(Index, Index + Count, true);
+        return true;
+    }
+
+    bool ClearRange(BitPosition Index, BitPosition Count)
+    {
+        if (!IsRangeValid(Index, Count))
             return false;
 
-        uint8_t* p = Bits_ + (Start >> 3);
-        uint8_t* p_end = Bits_ + (End >> 3);
-        size_t u = Start & 7;
-        size_t v = End & 7;
+        FillRange(Index, Index + Count, false);
+        return true;
+    }
 
-        if ((Start >> 3) == (End >> 3))
-        {
-            // 2 ~ 6
-            // -> (~((1 << 2) - 1) & ((1 << (6 + 1)) - 1)
-            // same byte
-            *p |= ~((1 << u) - 1) & ((1 << (v + 1)) - 1);
-            return true;
-        }
+    void SetAll()
+    {
+        SetRange(0, BitCount_);
+    }
 
-        if (u)
-        {
-            *p |= ~((1 << u) - 1); p++;
-        }
+    void ClearAll()
+    {
+        ClearRange(0, BitCount_);
+    }
 
-        while (p < p_end)
-        {
-            *p = 0xff; p++;
-        }
+    BitPosition FindFirstClear(BitPosition Start) const
+    {
+        return FindFirst(Start, BitCount_, AllOnes);
+    }
+
+    BitPosition FindFirstSet(BitPosition Start) const
+    {
+        return FindFirst(Start, BitCount_, 0);
+    }
+
+    // First set bit from Start up to End (exclusive, clamped to Count())
+    BitPosition FindFirstSet(BitPosition Start, BitPosition End) const
+    {
+        return FindFirst(Start, End < BitCount_ ? End : BitCount_, 0);
+    }
+
+    BitPosition FindLastClear(BitPosition Start) const
+    {
+        return FindLast(Start, AllOnes);
+    }
+
+    BitPosition FindLastSet(BitPosition Start) const
+    {
+        return FindLast(Start, 0);
+    }
+
+    //
+    // Returns the first bit at or after Start which begins Count consecutive
+    // clear bits, or Position::Invalid.
+    //
+
+    BitPosition FindFirstClearRange(BitPosition Start, BitPosition Count) const
+    {
+        if (!Count)
+            return Position::Invalid;
 
-        if (v)
+        auto First = FindFirstClear(Start);
+
+        while (First != Position::Invalid && Count <= BitCount_ - First)
         {
-            *p |= (1 << (v + 1)) - 1; p++;
+            // Only the bits of the candidate range are searched
+            auto Next = FindFirst(First, First + Count, 0);
+            if (Next == Position::Invalid)
+                return First;
+
+            First = FindFirstClear(Next);
         }
-        else
+
+        return Position::Invalid;
+    }
+
+    struct Position
+    {
+        constexpr static const BitPosition Invalid = ~0;
+    };
+
+private:
+    friend class SummaryBitmap;
+
+    using Word = uint64_t;
+
+    constexpr static const unsigned int WordShift = 6;
+    constexpr static const unsigned int WordBits = 1 << WordShift;
+    constexpr static const Word AllOnes = ~static_cast<Word>(0);
+
+    bool IsRangeValid(BitPosition Index, BitPosition Count) const
+    {
+        BitPosition End = Index + Count - 1;
+
+        // Count is not zero and does not wrap around
+        return Index <= End && End < BitCount_;
+    }
+
+    // Word at Index; bytes past the end of the bitmap are read as zero
+    Word LoadWord(size_t Index) const
+    {
+        Word Value = 0;
+        size_t Offset = Index << 3;
+        size_t Size = ((BitCount_ + 8 - 1) >> 3) - Offset;
+
+        memcpy(&Value, Bits_ + Offset, Size < sizeof(Word) ? Size : sizeof(Word));
+        return Value;
+    }
+
+    // Bits of word Index which are in the bitmap
+    Word ValidBits(size_t Index) const
+    {
+        BitPosition Last = BitCount_ - 1;
+
+        if (Index < (Last >> WordShift))
+            return AllOnes;
+
+        return AllOnes >> (WordBits - 1 - (Last & (WordBits - 1)));
+    }
+
+    // Word at Index, which is not the last word
+    Word LoadWholeWord(size_t Index) const
+    {
+        Word Value;
+        memcpy(&Value, Bits_ + (Index << 3), sizeof(Word));
+        return Value;
+    }
+
+    void StoreWord(size_t Index, Word Value)
+    {
+        size_t Offset = Index << 3;
+        size_t Size = ((BitCount_ + 8 - 1) >> 3) - Offset;
+
+        memcpy(Bits_ + Offset, &Value, Size < sizeof(Word) ? Size : sizeof(Word));
+    }
+
+    // Sets or clears bits from Start to End (exclusive)
+    void FillRange(BitPosition Start, BitPosition End, bool State)
+    {
+        size_t First = Start >> WordShift;
+        size_t Last = (End - 1) >> WordShift;
+        Word FirstMask = AllOnes << (Start & (WordBits - 1));
+        Word LastMask = AllOnes >> (WordBits - 1 - ((End - 1) & (WordBits - 1)));
+
+        if (First == Last)
         {
-            *p_end = 0xff;
+            FillWord(First, FirstMask & LastMask, State);
+            return;
         }
 
-        return true;
+        FillWord(First, FirstMask, State);
+        memset(Bits_ + ((First + 1) << 3), State ? 0xff : 0, (Last - First - 1) << 3);
+        FillWord(Last, LastMask, State);
     }
 
-    bool ClearRange(BitPosition Index, BitPosition Count)
+    void FillWord(size_t Index, Word Mask, bool State)
     {
-        BitPosition Start = Index;
-        BitPosition End = Index + Count - 1;
+        Word Value = LoadWord(Index);
+        StoreWord(Index, State ? (Value | Mask) : (Value & ~Mask));
+    }
 
-        if (Start > End)
-            return false;
+    //
+    // Searches bits which differ from Invert (0 to find set bits, AllOnes
+    // to find clear bits), from Start up to End (exclusive), or from Start
+    // down to bit 0.
+    //
 
-        if (!(0 <= Start && End < BitCount_))
-            return false;
+    BitPosition FindFirst(BitPosition Start, BitPosition End, Word Invert) const
+    {
+        if (Start >= End)
+            return Position::Invalid;
 
-        uint8_t* p = Bits_ + (Start >> 3);
-        uint8_t* p_end = Bits_ + (End >> 3);
-        size_t u = Start & 7;
-        size_t v = End & 7;
+        size_t Index = Start >> WordShift;
+        size_t Last = (End - 1) >> WordShift;
+        Word Value = (LoadWord(Index) ^ Invert) & (AllOnes << (Start & (WordBits - 1)));
 
-        if ((Start >> 3) == (End >> 3))
+        if (Index < Last)
         {
-            // 2 ~ 6
-            // -> (~((1 << 2) - 1) & ((1 << (6 + 1)) - 1)
-            // same byte
-            *p &= ~(~((1 << u) - 1) & ((1 << (v + 1)) - 1));
-            return true;
+            if (Value)
+                return (Index << WordShift) + TrailingZeros(Value);
+
+            for (Index = SkipForward(Index + 1, Last, Invert); Index < Last; Index++)
+            {
+                Value = LoadWholeWord(Index) ^ Invert;
+                if (Value)
+                    return (Index << WordShift) + TrailingZeros(Value);
+            }
+
+            Value = LoadWord(Last) ^ Invert;
         }
 
-        if (u)
+        Value &= AllOnes >> (WordBits - 1 - ((End - 1) & (WordBits - 1)));
+
+        if (Value)
+            return (Index << WordShift) + TrailingZeros(Value);
+
+        return Position::Invalid;
+    }
+
+    BitPosition FindLast(BitPosition Start, Word Invert) const
+    {
+        if (Start >= BitCount_)
+            return Position::Invalid;
+
+        size_t Index = Start >> WordShift;
+        Word Value = (LoadWord(Index) ^ Invert) & (AllOnes >> (WordBits - 1 - (Start & (WordBits - 1))));
+
+        while (!Value)
         {
-            *p &= ((1 << u) - 1); p++;
+            if (!Index)
+                return Position::Invalid;
+
+            Index = SkipBackward(Index - 1, Invert);
+            Value = LoadWholeWord(Index) ^ Invert;
         }
 
-        while (p < p_end)
+        return (Index << WordShift) + HighestBit(Value);
+    }
+
+    // First word from Index (but not past Last) which may have a bit to find
+    size_t SkipForward(size_t Index, size_t Last, Word Invert) const
+    {
+#if M_BITMAP_AVX2
+        // Words before Last are whole
+        auto Pattern = _mm256_set1_epi64x(static_cast<long long>(Invert));
+
+        while (Index + 4 <= Last)
         {
-            *p = 0; p++;
+            auto Value = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Bits_ + (Index << 3))), Pattern);
+            if (!_mm256_testz_si256(Value, Value))
+                break;
+
+            Index += 4;
         }
+#else
+        (void)Last;
+        (void)Invert;
+#endif
 
-        if (v)
+        return Index;
+    }
+
+    // Last word from Index down which may have a bit to find
+    size_t SkipBackward(size_t Index, Word Invert) const
+    {
+#if M_BITMAP_AVX2
+        auto Pattern = _mm256_set1_epi64x(static_cast<long long>(Invert));
+
+        while (Index >= 4)
         {
-            *p &= ~((1 << (v + 1)) - 1); p++;
+            auto Value = _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Bits_ + ((Index - 3) << 3))), Pattern);
+            if (!_mm256_testz_si256(Value, Value))
+                break;
+
+            Index -= 4;
         }
-        else
+#else
+        (void)Invert;
+#endif
+
+        return Index;
+    }
+
+    // Value is not zero
+    static unsigned int TrailingZeros(Word Value)
+    {
+#if M_COMPILER_TYPE == M_COMPILER_MSVC
+        unsigned long Index = 0;
+#if M_IS_ARCH_64
+        _BitScanForward64(&Index, Value);
+#else
+        if (!_BitScanForward(&Index, static_cast<unsigned long>(Value)))
         {
-            *p_end = 0;
+            _BitScanForward(&Index, static_cast<unsigned long>(Value >> 32));
+            Index += 32;
         }
+#endif
+        return Index;
+#else
+        return static_cast<unsigned int>(__builtin_ctzll(Value));
+#endif
+    }
+
+    // Value is not zero
+    static unsigned int HighestBit(Word Value)
+    {
+#if M_COMPILER_TYPE == M_COMPILER_MSVC
+        unsigned long Index = 0;
+#if M_IS_ARCH_64
+        _BitScanReverse64(&Index, Value);
+#else
+        if (_BitScanReverse(&Index, static_cast<unsigned long>(Value >> 32)))
+            Index += 32;
+        else
+            _BitScanReverse(&Index, static_cast<unsigned long>(Value));
+#endif
+        return Index;
+#else
+        return static_cast<unsigned int>(63 - __builtin_clzll(Value));
+#endif
+    }
+
+    std::unique_ptr<uint8_t[]> BitsUnique_;
+    uint8_t* Bits_;
+    size_t BitCount_;
+};
+
+class SummaryBitmap
+{
+    //
+    // Bitmap with two summary levels for searches over large bitmaps (e.g.
+    // one bit per page of a 4 GiB guest). Bit i of level 1 summarizes word
+    // i of the bitmap, and bit i of level 2 summarizes word i of level 1.
+    // Each level has two bitmaps: Full (all bits of the word are set) and
+    // Empty (all bits are clear). Searches skip words which are full (or
+    // empty) 64 or 4096 at a time, so searching a million bits reads a few
+    // hundred words at most, however the bits are fragmented.
+    //
+
+public:
+    using BitPosition = Bitmap::BitPosition;
+    using Position = Bitmap::Position;
+
+    SummaryBitmap()
+    {
+    }
+
+    SummaryBitmap(BitPosition BitCount) :
+        Bits_(BitCount)
+    {
+        size_t Words = ((BitCount - 1) >> Bitmap::WordShift) + 1;
+
+        Full_[0] = Bitmap(Words);
+        Empty_[0] = Bitmap(Words);
+        Full_[1] = Bitmap(((Words - 1) >> Bitmap::WordShift) + 1);
+        Empty_[1] = Bitmap(Full_[1].Count());
+
+        Empty_[0].SetAll();
+        Empty_[1].SetAll();
+    }
+
+    BitPosition Count() const
+    {
+        return Bits_.Count();
+    }
+
+    const Bitmap& Bits() const
+    {
+        return Bits_;
+    }
+
+    bool Get(BitPosition Index, bool& State)
+    {
+        return Bits_.Get(Index, State);
+    }
+
+    bool Set(BitPosition Index)
+    {
+        if (!Bits_.Set(Index))
+            return false;
+
+        Update(Index, Index);
+        return true;
+    }
+
+    bool Clear(BitPosition Index)
+    {
+        if (!Bits_.Clear(Index))
+            return false;
+
+        Update(Index, Index);
+        return true;
+    }
+
+    bool SetRange(BitPosition Index, BitPosition Count)
+    {
+        if (!Bits_.SetRange(Index, Count))
+            return false;
+
+        UpdateRange(Index, Index + Count - 1, true);
+        return true;
+    }
+
+    bool ClearRange(BitPosition Index, BitPosition Count)
+    {
+        if (!Bits_.ClearRange(Index, Count))
+            return false;
 
+        UpdateRange(Index, Index + Count - 1, false);
         return true;
     }
 
     void SetAll()
     {
-        SetRange(0, BitCount_);
+        SetRange(0, Count());
     }
 
     void ClearAll()
     {
-        ClearRange(0, BitCount_);
+        ClearRange(0, Count());
+    }
+
+    BitPosition FindFirstClear(BitPosition Start) const
+    {
+        return FindFirst(Start, false);
     }
 
-    BitPosition FindFirstClear(BitPosition Start)
+    BitPosition FindFirstSet(BitPosition Start) const
     {
-        // NOTE: Find the better way to do this...
-        for (BitPosition i = Start; i < BitCount_; i++)
+        return FindFirst(Start, true);
+    }
+
+    //
+    // Returns the first bit at or after Start which begins Count consecutive
+    // clear bits, or Position::Invalid. Words are read in order, skipping
+    // full words; each word is checked for a run in a few operations.
+    //
+
+    BitPosition FindFirstClearRange(BitPosition Start, BitPosition Count) const
+    {
+        using Word = Bitmap::Word;
+
+        if (!Count || Start >= this->Count() || Count > this->Count() - Start)
+            return Position::Invalid;
+
+        size_t Index = Start >> Bitmap::WordShift;
+        BitPosition RunStart = Start;           // clear bits from RunStart to word Index
+        BitPosition RunLength = 0;
+
+        // Bits before Start and past the end are treated as set
+        Word Value = Bits_.LoadWord(Index) | ~(Bitmap::AllOnes << (Start & (Bitmap::WordBits - 1)));
+
+        while (true)
         {
-            if (!(Bits_[i >> 3] & (1 << (i & 7))))
-                return i;
+            Value |= ~Bits_.ValidBits(Index);
+
+            if (!Value)
+            {
+                RunLength += Bitmap::WordBits;
+                if (RunLength >= Count)
+                    return RunStart;
+            }
+            else
+            {
+                if (RunLength + Bitmap::TrailingZeros(Value) >= Count)
+                    return RunStart;
+
+                if (Count <= Bitmap::WordBits)
+                {
+                    Word Runs = ClearRuns(Value, Count);
+                    if (Runs)
+                        return (Index << Bitmap::WordShift) + Bitmap::TrailingZeros(Runs);
+                }
+
+                RunLength = Bitmap::WordBits - 1 - Bitmap::HighestBit(Value);
+                RunStart = ((Index + 1) << Bitmap::WordShift) - RunLength;
+            }
+
+            // Full words end the run
+            size_t Next = FindWord(Index + 1, false);
+            if (Next == Position::Invalid)
+                return Position::Invalid;
+
+            if (Next != Index + 1)
+            {
+                RunStart = Next << Bitmap::WordShift;
+                RunLength = 0;
+            }
+
+            Index = Next;
+            Value = Bits_.LoadWord(Index);
         }
+    }
 
-        return Position::Invalid;
+private:
+    // Searches bits which are State from Start
+    BitPosition FindFirst(BitPosition Start, bool State) const
+    {
+        if (Start >= Count())
+            return Position::Invalid;
+
+        Bitmap::Word Invert = State ? 0 : Bitmap::AllOnes;
+        size_t Index = Start >> Bitmap::WordShift;
+        BitPosition End = (Index + 1) << Bitmap::WordShift;
+
+        auto Result = Bits_.FindFirst(Start, End < Count() ? End : Count(), Invert);
+        if (Result != Position::Invalid)
+            return Result;
+
+        Index = FindWord(Index + 1, State);
+        if (Index == Position::Invalid)
+            return Position::Invalid;
+
+        Result = Bits_.FindFirst(Index << Bitmap::WordShift, Count(), Invert);
+        DASSERT(Result != Position::Invalid);
+
+        return Result;
+    }
+
+    // First word from Index which has a bit of State (is not empty or not full)
+    size_t FindWord(size_t Index, bool State) const
+    {
+        const Bitmap& Level1 = State ? Empty_[0] : Full_[0];
+        const Bitmap& Level2 = State ? Empty_[1] : Full_[1];
+
+        if (Index >= Level1.Count())
+            return Position::Invalid;
+
+        size_t Group = Index >> Bitmap::WordShift;
+        BitPosition End = (Group + 1) << Bitmap::WordShift;
+
+        auto Result = Level1.FindFirst(Index, End < Level1.Count() ? End : Level1.Count(), Bitmap::AllOnes);
+        if (Result != Position::Invalid)
+            return Result;
+
+        Group = Level2.FindFirstClear(Group + 1);
+        if (Group == Position::Invalid)
+            return Position::Invalid;
+
+        Result = Level1.FindFirstClear(Group << Bitmap::WordShift);
+        DASSERT(Result != Position::Invalid);
+
+        return Result;
     }
 
-    BitPosition FindFirstSet(BitPosition Start)
+    // Bit i is set if Count bits of Value from bit i are clear (1 <= Count <= 64)
+    static Bitmap::Word ClearRuns(Bitmap::Word Value, BitPosition Count)
     {
-        // NOTE: Find the better way to do this...
-        for (BitPosition i = Start; i < BitCount_; i++)
+        Bitmap::Word Runs = ~Value;
+        BitPosition Length = 1;
+
+        while (Length * 2 <= Count)
         {
-            if (Bits_[i >> 3] & (1 << (i & 7)))
-                return i;
+            Runs &= Runs >> Length;
+            Length *= 2;
         }
 
-        return Position::Invalid;
+        if (Length < Count)
+            Runs &= Runs >> (Count - Length);
+
+        return Runs;
     }
 
-    BitPosition FindLastClear(BitPosition Start)
+    // Updates summaries after bits from First to Last (inclusive) are set or cleared
+    void UpdateRange(BitPosition First, BitPosition Last, bool State)
     {
-        if (Start >= BitCount_)
-            return Position::Invalid;
+        size_t FirstWord = First >> Bitmap::WordShift;
+        size_t LastWord = Last >> Bitmap::WordShift;
 
-        // NOTE: Find the better way to do this...
-        auto i = Start;
-        while (i != Position::Invalid)
+        if (LastWord - FirstWord > 1)
         {
-            if (!(Bits_[i >> 3] & (1 << (i & 7))))
-                return i;
-            i--;
+            // Words in between are whole
+            Full_[0].FillRange(FirstWord + 1, LastWord, State);
+            Empty_[0].FillRange(FirstWord + 1, LastWord, !State);
         }
 
-        return Position::Invalid;
+        Update(First, Last);
     }
 
-    BitPosition FindLastSet(BitPosition Start)
+    // Updates summaries of the words of First and Last, and of their groups of words
+    void Update(BitPosition First, BitPosition Last)
     {
-        if (Start >= BitCount_)
-            return Position::Invalid;
+        size_t FirstWord = First >> Bitmap::WordShift;
+        size_t LastWord = Last >> Bitmap::WordShift;
+
+        for (auto Index : { FirstWord, LastWord })
+        {
+            Bitmap::Word Mask = Bits_.ValidBits(Index);
+            Bitmap::Word Value = Bits_.LoadWord(Index) & Mask;
+
+            Assign(Full_[0], Index, Value == Mask);
+            Assign(Empty_[0], Index, !Value);
+        }
 
-        // NOTE: Find the better way to do this...
-        auto i = Start;
-        while (i != Position::Invalid)
+        for (size_t i = FirstWord >> Bitmap::WordShift; i <= (LastWord >> Bitmap::WordShift); i++)
         {
-            if (Bits_[i >> 3] & (1 << (i & 7)))
-                return i;
-            i--;
+            Assign(Full_[1], i, IsWordFull(Full_[0], i));
+            Assign(Empty_[1], i, IsWordFull(Empty_[0], i));
         }
+    }
 
-        return Position::Invalid;
+    static bool IsWordFull(const Bitmap& Source, size_t Index)
+    {
+        Bitmap::Word Mask = Source.ValidBits(Index);
+        return (Source.LoadWord(Index) & Mask) == Mask;
     }
 
-    struct Position
+    static void Assign(Bitmap& Target, size_t Index, bool State)
     {
-        constexpr static const BitPosition Invalid = ~0;
-    };
+        if (State)
+            Target.Set(Index);
+        else
+            Target.Clear(Index);
+    }
 
-private:
-    std::unique_ptr<uint8_t[]> BitsUnique_;
-    uint8_t* Bits_;
-    size_t BitCount_;
+    Bitmap Bits_;
+    Bitmap Full_[2];                            //< words which are full (level 1, level 2)
+    Bitmap Empty_[2];                           //< words which are empty (level 1, level 2)
 };
@@ -3,8 +3,10 @@
 #include "arch.h"
 
 #include <numeric>
+#include <limits>
 #include <cstdint>
 #include <climits>
+#include <type_traits>
 
 #ifdef min
 #undef min
@@ -17,6 +19,9 @@
 
 namespace Base
 {
+    template <typename T>
+    struct ToIntegralType;
+
     static_assert(
         static_cast<uint8_t>(static_cast<int8_t>(-1)) == 0xff && 
         static_cast<uint16_t>(static_cast<int16_t>(-1)) == 0xffff &&
@@ -0,0 +1,443 @@
+
+#include "vmbase.h"
+#include "bc_decode_cache.h"
+#include "bc_verifier.h"
+#include "bc_decoder.h"
+
+namespace VM_NAMESPACE
+{
+    VMDecodeCache::VMDecodeCache(VMMemoryManager& MemoryManager) :
+        Tables_(), Regions_(), LastRegion_(), Uncached_(), HandlerTable_(), UncheckedHandlerTable_(), Mode_(), Generation_(MemoryManager.CodeGeneration()),
+        MemoryManager_(MemoryManager)
+    {
+        Regions_ = &Tables_[HandlerTable_];
+    }
+
+    void VMDecodeCache::Flush()
+    {
+        Tables_.clear();
+        Regions_ = &Tables_[HandlerTable_];
+        LastRegion_ = nullptr;
+        Generation_ = MemoryManager_.CodeGeneration();
+    }
+
+    void VMDecodeCache::SetMode(uint32_t Mode)
+    {
+        if (VMBlockVerifier::ModeKey(Mode) == VMBlockVerifier::ModeKey(Mode_))
+            return;
+
+        // Complete regions are verified for the previous mode
+        Flush();
+        Mode_ = Mode;
+    }
+
+    void VMDecodeCache::SetHandlerTable(const void* const* HandlerTable, const void* const* UncheckedHandlerTable)
+    {
+        if (HandlerTable_ == HandlerTable &&
+            UncheckedHandlerTable_ == UncheckedHandlerTable)
+            return;
+
+        // Regions of the previous table are kept for when it is set again
+        HandlerTable_ = HandlerTable;
+        UncheckedHandlerTable_ = UncheckedHandlerTable;
+        Regions_ = &Tables_[HandlerTable_];
+        LastRegion_ = nullptr;
+    }
+
+    const DecodedInstruction* VMDecodeCache::VerifyBlock(const DecodedInstruction* Entry, uint32_t Mode)
+    {
+        auto Current = LastRegion_;
+
+        if (!Current ||
+            Current->Complete ||
+            Entry < Current->Entries.data() ||
+            Entry >= Current->Entries.data() + Current->Entries.size())
+        {
+            // Not cached or complete (verified when decoded); executed with
+            // stack checks unless verified for Mode
+            return Entry;
+        }
+
+        size_t EntryIndex = static_cast<size_t>(Entry - Current->Entries.data());
+        uint64_t Address = Entry->NextIP - Entry->Length;
+
+        VMBlockVerifier Verifier(Mode);
+
+        while (!Verifier.Ended() &&
+            Address - Current->Base < Current->Size)
+        {
+            ExceptionState::T Exception = ExceptionState::T::None;
+            auto Next = Fetch(Address, Exception);
+            if (!Next)
+                break;
+
+            if (!Verifier.Append(Next->Op.Opcode()))
+                break;
+
+            Address = Next->NextIP;
+        }
+
+        // Fetch() does not leave the region, but may grow Entries
+        DASSERT(LastRegion_ == Current);
+
+        auto& Target = Current->Entries[EntryIndex];
+        Target.BlockMode = VMBlockVerifier::ModeKey(Mode);
+        Target.BlockLength = static_cast<uint8_t>(Verifier.Length());
+        Target.BlockPopSize = static_cast<uint16_t>(Verifier.PopSize());
+        Target.BlockPushSize = static_cast<uint16_t>(Verifier.PushSize());
+
+        return &Target;
+    }
+
+    const DecodedInstruction* VMDecodeCache::FetchLink(const DecodedInstruction* Previous, uint64_t Address, ExceptionState::T& Exception)
+    {
+        auto Current = LastRegion_;
+        size_t PreviousIndex = SIZE_MAX;
+
+        if (Previous &&
+            Current &&
+            Generation_ == MemoryManager_.CodeGeneration() &&
+            Previous >= Current->Entries.data() &&
+            Previous < Current->Entries.data() + Current->Entries.size())
+        {
+            PreviousIndex = static_cast<size_t>(Previous - Current->Entries.data());
+        }
+
+        auto Entry = Fetch(Address, Exception);
+
+        if (!Entry ||
+            PreviousIndex == SIZE_MAX ||
+            LastRegion_ != Current ||
+            Current->Complete ||
+            Entry < Current->Entries.data() ||
+            Entry >= Current->Entries.data() + Current->Entries.size())
+        {
+            // Not linkable; different region, not cached or complete (linked when decoded)
+            return Entry;
+        }
+
+        // Fetch() may grow Entries
+        auto& Source = Current->Entries[PreviousIndex];
+
+        // Use a free link, or replace the second one
+        size_t Slot = Source.Link[0] ? 1 : 0;
+        Source.LinkIP[Slot] = Address;
+        Source.Link[Slot] = static_cast<uint32_t>(Entry - Current->Entries.data()) + 1;
+
+        return Entry;
+    }
+
+    const DecodedInstruction* VMDecodeCache::FetchSlow(uint64_t Address, ExceptionState::T& Exception)
+    {
+        if (Generation_ != MemoryManager_.CodeGeneration())
+        {
+            // Some block changed; each region is checked against its block below
+            LastRegion_ = nullptr;
+            Generation_ = MemoryManager_.CodeGeneration();
+        }
+
+        MemoryInfo Info{};
+        if (!MemoryManager_.Query(Address, Info))
+        {
+            Exception = ExceptionState::T::InvalidAccess;
+            return nullptr;
+        }
+
+        uint64_t Offset = Address - Info.Base;
+        uint64_t RemainingSize = Info.Size - Offset;
+
+        Region* Target = nullptr;
+
+        if (Info.Type == MemoryType::Bytecode &&
+            Info.Size <= MaximumRegionSize &&
+            Offset < Info.Size)
+        {
+            auto Iterator = Regions_->find(Info.Base);
+            if (Iterator == Regions_->end() ||
+                Iterator->second.Generation != Info.Generation ||
+                Iterator->second.Target->Size != Info.Size)
+            {
+                std::shared_ptr<Region> NewRegion;
+
+                if (Info.Image)
+                {
+                    NewRegion = SharedRegion(Info);
+                }
+                else if (auto Bytecode = reinterpret_cast<const uint8_t*>(
+                    MemoryManager_.HostAddress(Info.Base, static_cast<size_t>(Info.Size))))
+                {
+                    NewRegion = VerifiedRegion(Info, Bytecode);
+                }
+
+                if (!NewRegion)
+                {
+                    NewRegion = std::make_shared<Region>();
+                    NewRegion->Base = Info.Base;
+                    NewRegion->Size = Info.Size;
+                    NewRegion->Index.resize(static_cast<size_t>(Info.Size));
+                }
+
+                Iterator = Regions_->insert_or_assign(Info.Base, CachedRegion{ std::move(NewRegion), Info.Generation }).first;
+            }
+
+            Target = Iterator->second.Target.get();
+            LastRegion_ = Target;
+
+            auto Index = Target->Index[static_cast<size_t>(Offset)];
+            if (Index)
+                return &Target->Entries[Index - 1];
+        }
+
+        DecodedInstruction Entry{};
+        auto FetchAddress = reinterpret_cast<uint8_t*>(MemoryManager_.HostAddress(Address));
+
+        if (!Decode(Address, FetchAddress, static_cast<size_t>(RemainingSize), Entry))
+        {
+            // Failed to decode...
+            Exception = ExceptionState::T::InvalidInstruction;
+            return nullptr;
+        }
+
+        if (!Target || Target->Complete)
+        {
+            Uncached_ = Entry;
+            return &Uncached_;
+        }
+
+        Fuse(Entry,
+            FetchAddress + Entry.Length,
+            static_cast<size_t>(RemainingSize) - Entry.Length);
+
+        Target->Entries.push_back(Entry);
+        Target->Index[static_cast<size_t>(Offset)] = static_cast<uint32_t>(Target->Entries.size());
+
+        return &Target->Entries.back();
+    }
+
+    bool VMDecodeCache::Decode(uint64_t Address, uint8_t* Bytecode, size_t Size, DecodedInstruction& Entry) const
+    {
+        size_t Length = VMInstruction::Decode(Bytecode, Size, &Entry.Op);
+
+        if (!Length)
+            return false;
+
+        uint8_t ImmediateBytes[sizeof(Entry.Operand)]{};
+        Entry.Op.Operand(0, ImmediateBytes, sizeof(ImmediateBytes));
+
+        Entry.Handler = HandlerTable_ ? HandlerTable_[Entry.Op.Opcode()] : nullptr;
+        Entry.UncheckedHandler = UncheckedHandlerTable_ ? UncheckedHandlerTable_[Entry.Op.Opcode()] : nullptr;
+        Entry.Operand = Base::FromBytesLe<uint64_t>(ImmediateBytes);
+        Entry.NextIP = Address + Length;
+        Entry.Target = VMDecodedStream::ResolveTarget(Entry.Op.Opcode(), Entry.NextIP, Entry.Operand);
+        Entry.Length = static_cast<uint8_t>(Length);
+
+        return true;
+    }
+
+    std::shared_ptr<VMDecodeCache::Region> VMDecodeCache::SharedRegion(const MemoryInfo& Info)
+    {
+        // Entries hold handler addresses and are verified for a mode
+        VMCodeImage::SharedKey Key(HandlerTable_, Info.Base, VMBlockVerifier::ModeKey(Mode_));
+
+        auto Shared = Info.Image->Shared(Key, [this, &Info]()
+            {
+                auto Built = VerifiedRegion(Info, Info.Image->Data());
+                if (!Built)
+                    Built = BuildRegion(Info, Info.Image->Data());
+
+                return std::static_pointer_cast<void>(Built);
+            });
+
+        return std::static_pointer_cast<Region>(Shared);
+    }
+
+    std::shared_ptr<VMDecodeCache::Region> VMDecodeCache::VerifiedRegion(const MemoryInfo& Info, const uint8_t* Bytecode) const
+    {
+        // Verified once per generation of the block; the region is replaced when it changes
+        std::vector<ModuleStackDepth> Depths;
+        auto Result = VMModuleVerifier::Verify(Info.Base, Bytecode, static_cast<size_t>(Info.Size), Mode_, &Depths);
+        if (!Result.Verified())
+            return nullptr;
+
+        auto Target = BuildRegion(Info, Bytecode);
+
+        // Bounds must fit in entries; blocks are verified anyway
+        if (Result.MaximumDepth > UINT32_MAX)
+            return Target;
+
+        for (const auto& Depth : Depths)
+        {
+            auto Index = Target->Index[static_cast<size_t>(Depth.Address - Info.Base)];
+            if (!Index)
+                continue;
+
+            auto& Entry = Target->Entries[Index - 1];
+            auto Opcode = Entry.Op.Opcode();
+
+            // Leave the function; the instruction after them is checked again
+            if (Opcode == Opcode::T::Call_I1 ||
+                Opcode == Opcode::T::Call_I2 ||
+                Opcode == Opcode::T::Call_I4 ||
+                Opcode == Opcode::T::Ret)
+                continue;
+
+            Entry.FunctionMode = VMBlockVerifier::ModeKey(Mode_);
+            Entry.FunctionPopSize = static_cast<uint32_t>(Depth.Depth);
+            Entry.FunctionPushSize = static_cast<uint32_t>(Result.MaximumDepth - Depth.Depth);
+        }
+
+        Target->Verified = true;
+
+        return Target;
+    }
+
+    std::shared_ptr<VMDecodeCache::Region> VMDecodeCache::BuildRegion(const MemoryInfo& Info, const uint8_t* Code) const
+    {
+        auto Bytecode = const_cast<uint8_t*>(Code);
+        auto Size = static_cast<size_t>(Info.Size);
+
+        auto Target = std::make_shared<Region>();
+        Target->Base = Info.Base;
+        Target->Size = Info.Size;
+        Target->Index.resize(Size);
+        Target->Shared = !!Info.Image;
+        Target->Complete = true;
+        Target->Verified = false;
+
+        auto& Index = Target->Index;
+        auto& Entries = Target->Entries;
+
+        //
+        // Decode instructions reachable from the start of the region and from
+        // targets of relative branches and calls.
+        //
+
+        std::vector<size_t> Pending{ 0 };
+
+        while (!Pending.empty())
+        {
+            size_t Offset = Pending.back();
+            Pending.pop_back();
+
+            while (Offset < Size && !Index[Offset])
+            {
+                DecodedInstruction Entry{};
+                if (!Decode(Info.Base + Offset, Bytecode + Offset, Size - Offset, Entry))
+                    break;
+
+                Fuse(Entry, Bytecode + Offset + Entry.Length, Size - Offset - Entry.Length);
+
+                Entries.push_back(Entry);
+                Index[Offset] = static_cast<uint32_t>(Entries.size());
+
+                if (Entry.Target && Entry.Target - Info.Base < Info.Size)
+                    Pending.push_back(static_cast<size_t>(Entry.Target - Info.Base));
+
+                Offset += Entry.Length;
+            }
+        }
+
+        for (auto& Entry : Entries)
+        {
+            //
+            // Link fallthrough and branch target; a superinstruction links
+            // the instruction after it and the target of its last branch.
+            //
+
+            uint64_t Successors[2] = { Entry.NextIP, Entry.Target };
+
+            if (Entry.Fused)
+            {
+                for (uint32_t i = 0; i < Entry.FusedCount - 1u; i++)
+                    Successors[0] += Entry.FusedLength[i];
+
+                Successors[1] = Entry.FusedTarget ? Entry.FusedTarget : Entry.NextIP;
+            }
+
+            for (size_t Slot = 0; Slot < std::size(Successors); Slot++)
+            {
+                uint64_t Successor = Successors[Slot];
+
+                if (Successor - Info.Base < Info.Size &&
+                    Index[static_cast<size_t>(Successor - Info.Base)])
+                {
+                    Entry.LinkIP[Slot] = Successor;
+                    Entry.Link[Slot] = Index[static_cast<size_t>(Successor - Info.Base)];
+                }
+            }
+
+            //
+            // Verify block (see VerifyBlock()).
+            //
+
+            VMBlockVerifier Verifier(Mode_);
+            uint64_t Address = Entry.NextIP - Entry.Length;
+
+            while (!Verifier.Ended() &&
+                Address - Info.Base < Info.Size)
+            {
+                auto Next = Index[static_cast<size_t>(Address - Info.Base)];
+                if (!Next ||
+                    !Verifier.Append(Entries[Next - 1].Op.Opcode()))
+                    break;
+
+                Address = Entries[Next - 1].NextIP;
+            }
+
+            Entry.BlockMode = VMBlockVerifier::ModeKey(Mode_);
+            Entry.BlockLength = static_cast<uint8_t>(Verifier.Length());
+            Entry.BlockPopSize = static_cast<uint16_t>(Verifier.PopSize());
+            Entry.BlockPushSize = static_cast<uint16_t>(Verifier.PushSize());
+        }
+
+        return Target;
+    }
+
+    void VMDecodeCache::Fuse(DecodedInstruction& Entry, uint8_t* Bytecode, size_t Size)
+    {
+        // Following instructions are decoded only if a superinstruction starts here
+        auto Info = VMInstruction::Info(Entry.Op.Opcode());
+        if (!Info || !(Info->Flags & InstructionFlags::T::Fusible))
+            return;
+
+        VMInstruction Following[VMFusion::MaximumCount - 1];
+        size_t Length[VMFusion::MaximumCount - 1]{};
+        Opcode::T Opcodes[VMFusion::MaximumCount]{ Entry.Op.Opcode() };
+        uint32_t Count = 1;
+
+        for (; Count < VMFusion::MaximumCount; Count++)
+        {
+            auto& Op = Following[Count - 1];
+            size_t OpLength = VMInstruction::Decode(Bytecode, Size, &Op);
+            if (!OpLength)
+                break;
+
+            Opcodes[Count] = Op.Opcode();
+            Length[Count - 1] = OpLength;
+            Bytecode += OpLength;
+            Size -= OpLength;
+        }
+
+        uint32_t FusedCount = 0;
+        auto Fused = VMFusion::Match(Opcodes, Count, FusedCount);
+        if (Fused == FusedOpcode::T::None)
+            return;
+
+        Entry.Fused = static_cast<uint8_t>(Fused);
+        Entry.FusedCount = static_cast<uint8_t>(FusedCount);
+
+        uint64_t NextIP = Entry.NextIP;
+
+        for (uint32_t i = 0; i < FusedCount - 1; i++)
+        {
+            uint8_t ImmediateBytes[sizeof(Entry.Operand)]{};
+            Following[i].Operand(0, ImmediateBytes, sizeof(ImmediateBytes));
+
+            Entry.FusedLength[i] = static_cast<uint8_t>(Length[i]);
+            Entry.FusedOperand[i] = Base::FromBytesLe<uint64_t>(ImmediateBytes);
+
+            NextIP += Length[i];
+            Entry.FusedTarget = VMDecodedStream::ResolveTarget(Following[i].Opcode(), NextIP, Entry.FusedOperand[i]);
+        }
+    }
+}
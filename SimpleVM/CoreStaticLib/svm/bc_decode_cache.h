@@ -0,0 +1,228 @@
+#pragma once
+
+#include "vmbase.h"
+#include "vmmemory.h"
+#include "bc_fusion.h"
+#include "bc_verifier.h"
+
+namespace VM_NAMESPACE
+{
+    struct DecodedInstruction
+    {
+        const void* Handler;            //< handler address for threaded dispatch
+        const void* UncheckedHandler;   //< handler address for threaded dispatch in verified block
+        uint64_t Operand;               //< immediate operand (zero-extended)
+        uint64_t NextIP;
+        uint64_t Target;                //< target of relative branch or call, resolved at decode
+        uint8_t Length;
+
+        //
+        // Verified block which starts at this instruction (see VMBlockVerifier).
+        //
+
+        uint8_t BlockMode;              //< VMBlockVerifier::ModeKey() of block, 0 if not verified yet
+        uint8_t BlockLength;            //< instruction count, 0 if the instruction runs with stack checks
+        uint16_t BlockPopSize;          //< operand stack bytes required above the top at block entry
+        uint16_t BlockPushSize;         //< operand stack bytes required below the top at block entry
+
+        //
+        // Function bounds in a region verified by VMModuleVerifier. If the
+        // operand stack has FunctionPopSize bytes above the top and
+        // FunctionPushSize bytes free below it here, no instruction up to the
+        // next call or ret of the function can overflow or underflow it.
+        //
+
+        uint8_t FunctionMode;           //< VMBlockVerifier::ModeKey() of region, 0 if not verified, call or ret
+        uint32_t FunctionPopSize;       //< operand stack bytes pushed since function entry
+        uint32_t FunctionPushSize;      //< operand stack bytes the function may push beyond the current top
+
+        //
+        // Superinstruction which starts at this instruction (see VMFusion).
+        // Following instructions keep their own entries.
+        //
+
+        uint8_t Fused;                  //< FusedOpcode::T, FusedOpcode::T::None if not fused
+        uint8_t FusedCount;             //< instruction count of superinstruction
+        uint8_t FusedLength[VMFusion::MaximumCount - 1];    //< lengths of following instructions
+        uint64_t FusedOperand[VMFusion::MaximumCount - 1];  //< immediate operands of following instructions
+        uint64_t FusedTarget;           //< target of branch which ends superinstruction
+
+        //
+        // Successors in the same region, linked when control first reaches
+        // them from this instruction (see VMDecodeCache::FetchNext()).
+        // Fallthrough and taken branch usually occupy one link each.
+        //
+
+        uint64_t LinkIP[2];             //< address of linked successor
+        uint32_t Link[2];               //< (entry index + 1) of linked successor, 0 if not linked
+
+        VMInstruction Op;
+    };
+
+    class VMDecodeCache
+    {
+        //
+        // Per-region cache of decoded instructions.
+        //
+        // Region.Index[IP - Region.Base] holds (entry index + 1) of the
+        // instruction that starts at IP, or 0 if IP is not decoded yet.
+        // Only MemoryType::Bytecode regions are cached. A region is decoded
+        // again when MemoryInfo::Generation of its block changes; a change of
+        // VMMemoryManager::CodeGeneration() only makes the next fetch check
+        // the block. Entries hold handler addresses, so regions are kept per
+        // handler table and switching tables keeps those decoded for the
+        // other tables.
+        //
+        // A region of a VMCodeImage is decoded, linked and verified once for
+        // the handler table and mode, and shared by all caches through the
+        // image. Other regions which pass VMModuleVerifier are built the same
+        // way when first fetched, instead of instruction by instruction.
+        // Complete regions are never modified; instructions which were not
+        // reached when decoding it run uncached.
+        //
+        // Entries of a region which passes VMModuleVerifier carry function
+        // bounds (DecodedInstruction::FunctionMode), with which the dispatch
+        // loop checks the operand stack once per function instead of once
+        // per block, and compiled code runs without stack checks.
+        //
+
+        struct Region
+        {
+            uint64_t Base;
+            uint64_t Size;
+            std::vector<uint32_t> Index;
+            std::vector<DecodedInstruction> Entries;
+            bool Shared;                //< region of a VMCodeImage
+            bool Complete;              //< decoded, linked and verified when created
+            bool Verified;              //< passed VMModuleVerifier; entries have function bounds
+        };
+
+        struct CachedRegion
+        {
+            std::shared_ptr<Region> Target;
+            uint64_t Generation;        //< MemoryInfo::Generation of the block decoded
+        };
+
+    public:
+        constexpr static const uint64_t MaximumRegionSize = 0x1000000;
+
+        VMDecodeCache(VMMemoryManager& MemoryManager);
+
+        const DecodedInstruction* Fetch(uint64_t Address, ExceptionState::T& Exception)
+        {
+            auto Current = LastRegion_;
+            if (Current &&
+                Generation_ == MemoryManager_.CodeGeneration() &&
+                Address - Current->Base < Current->Size)
+            {
+                auto Index = Current->Index[static_cast<size_t>(Address - Current->Base)];
+                if (Index)
+                    return &Current->Entries[Index - 1];
+            }
+
+            return FetchSlow(Address, Exception);
+        }
+
+        //
+        // Fetches instruction at Address which is executed after Previous.
+        // Previous must be returned by the last fetch, or nullptr. Follows a
+        // link of Previous if one exists for Address, so transfers inside
+        // decoded code neither look up the region nor the index; links are
+        // patched by the first transfer.
+        //
+
+        const DecodedInstruction* FetchNext(const DecodedInstruction* Previous, uint64_t Address, ExceptionState::T& Exception)
+        {
+            if (Previous &&
+                Generation_ == MemoryManager_.CodeGeneration())
+            {
+                // Linked entries are always in LastRegion_
+                if (Previous->Link[0] && Previous->LinkIP[0] == Address)
+                    return &LastRegion_->Entries[Previous->Link[0] - 1];
+
+                if (Previous->Link[1] && Previous->LinkIP[1] == Address)
+                    return &LastRegion_->Entries[Previous->Link[1] - 1];
+            }
+
+            return FetchLink(Previous, Address, Exception);
+        }
+
+        //
+        // Instruction at Address if it is decoded in the region of the last
+        // fetch, or nullptr. Unlike Fetch(), never decodes or changes the
+        // region, so it may be called between fetches of a dispatch loop.
+        //
+
+        const DecodedInstruction* Find(uint64_t Address) const
+        {
+            auto Current = LastRegion_;
+            if (!Current ||
+                Generation_ != MemoryManager_.CodeGeneration() ||
+                !(Address - Current->Base < Current->Size))
+                return nullptr;
+
+            auto Index = Current->Index[static_cast<size_t>(Address - Current->Base)];
+            return Index ? &Current->Entries[Index - 1] : nullptr;
+        }
+
+        // Tests that Address is in the region of the last fetch and the region passed VMModuleVerifier for Mode
+        bool IsVerified(uint64_t Address, uint32_t Mode) const
+        {
+            auto Current = LastRegion_;
+            return Current &&
+                Current->Verified &&
+                Generation_ == MemoryManager_.CodeGeneration() &&
+                Address - Current->Base < Current->Size &&
+                VMBlockVerifier::ModeKey(Mode) == VMBlockVerifier::ModeKey(Mode_);
+        }
+
+        void Flush();
+
+        // Mode (ModeBits::T) which shared regions are verified for; flushes if it changes
+        void SetMode(uint32_t Mode);
+
+        // Handler addresses indexed by opcode, stored to DecodedInstruction::Handler
+        // and DecodedInstruction::UncheckedHandler. UncheckedHandlerTable must
+        // be the same whenever HandlerTable is, as regions are kept per HandlerTable.
+        void SetHandlerTable(const void* const* HandlerTable, const void* const* UncheckedHandlerTable = nullptr);
+
+        //
+        // Verifies block which starts at Entry for Mode and stores the result
+        // to the entry. Entry must be returned by the last Fetch(). Returns the
+        // entry, which may be moved by decoding following instructions.
+        //
+
+        const DecodedInstruction* VerifyBlock(const DecodedInstruction* Entry, uint32_t Mode);
+
+    private:
+        // Decodes instruction at Address (Bytecode[0..Size)) without fusion
+        bool Decode(uint64_t Address, uint8_t* Bytecode, size_t Size, DecodedInstruction& Entry) const;
+
+        // Region of the image mapped to Info, shared with other caches
+        std::shared_ptr<Region> SharedRegion(const MemoryInfo& Info);
+
+        // Complete region of Info at Bytecode with function bounds if it passes VMModuleVerifier, or nullptr
+        std::shared_ptr<Region> VerifiedRegion(const MemoryInfo& Info, const uint8_t* Bytecode) const;
+
+        // Decodes, links and verifies blocks of Info at Bytecode at once
+        std::shared_ptr<Region> BuildRegion(const MemoryInfo& Info, const uint8_t* Bytecode) const;
+
+        const DecodedInstruction* FetchSlow(uint64_t Address, ExceptionState::T& Exception);
+        const DecodedInstruction* FetchLink(const DecodedInstruction* Previous, uint64_t Address, ExceptionState::T& Exception);
+
+        // Fuses Entry with instructions at Bytecode[0..Size) (see VMFusion)
+        static void Fuse(DecodedInstruction& Entry, uint8_t* Bytecode, size_t Size);
+
+        using RegionMap = std::map<uint64_t, CachedRegion>;
+
+        std::map<const void* const*, RegionMap> Tables_;    //< regions by handler table
+        RegionMap* Regions_;                                //< regions of HandlerTable_
+        Region* LastRegion_;
+        DecodedInstruction Uncached_;
+        const void* const* HandlerTable_;
+        const void* const* UncheckedHandlerTable_;
+        uint32_t Mode_;
+        uint64_t Generation_;
+        VMMemoryManager& MemoryManager_;
+    };
+}
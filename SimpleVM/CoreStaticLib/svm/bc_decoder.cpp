@@ -0,0 +1,126 @@
+#include "vmbase.h"
+#include "bc_decoder.h"
+
+namespace VM_NAMESPACE
+{
+    VMDecodedStream::VMDecodedStream() noexcept :
+        DecodedSize_(), Status_(DecodeStatus::T::Complete)
+    {
+    }
+
+    DecodeStatus::T VMDecodedStream::Decode(uint64_t Address, const uint8_t* Bytecode, size_t Size, size_t MaximumCount)
+    {
+        constexpr uint8_t OpcodeExtendBit = 0x80;
+
+        Opcodes.clear();
+        Operands.clear();
+        Lengths.clear();
+        Addresses.clear();
+
+        size_t Offset = 0;
+        DecodeStatus::T Status = DecodeStatus::T::Complete;
+
+        while (Offset < Size)
+        {
+            if (Opcodes.size() >= MaximumCount)
+            {
+                Status = DecodeStatus::T::CountLimit;
+                break;
+            }
+
+            //
+            // Same encoding as VMInstruction::Decode(); immediate size comes
+            // from InstructionInfo, so no VMInstruction is built.
+            //
+
+            const uint8_t* p = Bytecode + Offset;
+            size_t Remaining = Size - Offset;
+            uint32_t Opcode = p[0];
+            size_t OpcodeSize = 1;
+
+            if (Opcode & OpcodeExtendBit)
+            {
+                if (Remaining < 2)
+                {
+                    Status = DecodeStatus::T::Truncated;
+                    break;
+                }
+
+                if (p[1] & OpcodeExtendBit)
+                {
+                    Status = DecodeStatus::T::InvalidInstruction;
+                    break;
+                }
+
+                Opcode = (p[0] & ~OpcodeExtendBit) | (p[1] << 7);
+                OpcodeSize = 2;
+            }
+
+            auto Info = VMInstruction::Info(Opcode);
+            if (!Info)
+            {
+                Status = DecodeStatus::T::InvalidInstruction;
+                break;
+            }
+
+            size_t Length = OpcodeSize + Info->ImmediateSize;
+            if (Remaining < Length)
+            {
+                Status = DecodeStatus::T::Truncated;
+                break;
+            }
+
+            uint8_t ImmediateBytes[sizeof(uint64_t)]{};
+            std::memcpy(ImmediateBytes, p + OpcodeSize, Info->ImmediateSize);
+
+            Opcodes.push_back(static_cast<uint16_t>(Opcode));
+            Operands.push_back(Base::FromBytesLe<uint64_t>(ImmediateBytes));
+            Lengths.push_back(static_cast<uint8_t>(Length));
+            Addresses.push_back(Address + Offset);
+
+            Offset += Length;
+        }
+
+        DecodedSize_ = Offset;
+        Status_ = Status;
+
+        return Status;
+    }
+
+    uint64_t VMDecodedStream::ResolveTarget(Opcode::T Op, uint64_t NextIP, uint64_t Operand) noexcept
+    {
+        using PointerType = decltype(VMExecutionContext::IP);
+
+        int64_t Offset = 0;
+
+        switch (Op)
+        {
+        case Opcode::T::Br_I1:
+        case Opcode::T::Br_z_I1:
+        case Opcode::T::Br_nz_I1:
+        case Opcode::T::Call_I1:
+            Offset = static_cast<int8_t>(Operand);
+            break;
+
+        case Opcode::T::Br_I2:
+        case Opcode::T::Br_z_I2:
+        case Opcode::T::Br_nz_I2:
+        case Opcode::T::Call_I2:
+            Offset = static_cast<int16_t>(Operand);
+            break;
+
+        case Opcode::T::Br_I4:
+        case Opcode::T::Br_z_I4:
+        case Opcode::T::Br_nz_I4:
+        case Opcode::T::Call_I4:
+            Offset = static_cast<int32_t>(Operand);
+            break;
+
+        default:
+            return 0;
+        }
+
+        // Wraps around like IP arithmetic of the interpreter
+        return static_cast<PointerType>(NextIP + Offset);
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "vmbase.h"
+
+namespace VM_NAMESPACE
+{
+    struct DecodeStatus
+    {
+        enum T : uint32_t
+        {
+            Complete,               // decoded up to the end of the range
+            CountLimit,             // decoded maximum count of instructions
+            Truncated,              // instruction crosses the end of the range
+            InvalidInstruction,     // undefined opcode or bad encoding
+        };
+    };
+
+    class VMDecodedStream
+    {
+        //
+        // Instructions of a contiguous bytecode range, decoded in one pass
+        // into parallel arrays indexed by instruction. Decoding stops before
+        // the first instruction which cannot be decoded; Status() tells why
+        // and DecodedSize() where.
+        //
+        // Decode() reuses capacity of the arrays, so a stream kept across
+        // calls does not allocate once it has grown.
+        //
+
+    public:
+        VMDecodedStream() noexcept;
+
+        // Decodes Bytecode[0..Size) which is at Address, up to MaximumCount instructions
+        DecodeStatus::T Decode(uint64_t Address, const uint8_t* Bytecode, size_t Size, size_t MaximumCount = SIZE_MAX);
+
+        size_t Count() const noexcept
+        {
+            return Opcodes.size();
+        }
+
+        size_t DecodedSize() const noexcept
+        {
+            return DecodedSize_;
+        }
+
+        DecodeStatus::T Status() const noexcept
+        {
+            return Status_;
+        }
+
+        // Target of Op if it is a relative branch or call, or 0
+        static uint64_t ResolveTarget(Opcode::T Op, uint64_t NextIP, uint64_t Operand) noexcept;
+
+        std::vector<uint16_t> Opcodes;      //< Opcode::T
+        std::vector<uint64_t> Operands;     //< immediate operand (zero-extended)
+        std::vector<uint8_t> Lengths;       //< instruction length in bytes
+        std::vector<uint64_t> Addresses;    //< address of instruction
+
+    private:
+        size_t DecodedSize_;
+        DecodeStatus::T Status_;
+    };
+}
@@ -0,0 +1,49 @@
+#include "vmbase.h"
+#include "bc_fusion.h"
+
+namespace VM_NAMESPACE
+{
+    namespace
+    {
+        struct FusedEntry
+        {
+            FusedOpcode::T Fused;
+            uint32_t Count;
+            Opcode::T Opcodes[VMFusion::MaximumCount];
+        };
+
+        const FusedEntry FusedTable[] =
+        {
+#define DEFINE_FUSED_INST2(_op, _op1, _op2) \
+            { FusedOpcode::T::_op, 2, { Opcode::T::_op1, Opcode::T::_op2 } },
+#define DEFINE_FUSED_INST3(_op, _op1, _op2, _op3) \
+            { FusedOpcode::T::_op, 3, { Opcode::T::_op1, Opcode::T::_op2, Opcode::T::_op3 } },
+#define DEFINE_FUSED_INST4(_op, _op1, _op2, _op3, _op4) \
+            { FusedOpcode::T::_op, 4, { Opcode::T::_op1, Opcode::T::_op2, Opcode::T::_op3, Opcode::T::_op4 } },
+#include "inst_fused_table.inc"
+#undef DEFINE_FUSED_INST4
+#undef DEFINE_FUSED_INST3
+#undef DEFINE_FUSED_INST2
+        };
+    }
+
+    FusedOpcode::T VMFusion::Match(const Opcode::T* Opcodes, uint32_t Count, uint32_t& FusedCount) noexcept
+    {
+        FusedOpcode::T Result = FusedOpcode::T::None;
+        FusedCount = 0;
+
+        for (const auto& Entry : FusedTable)
+        {
+            if (Entry.Count > Count || Entry.Count <= FusedCount)
+                continue;
+
+            if (!std::equal(Entry.Opcodes, Entry.Opcodes + Entry.Count, Opcodes))
+                continue;
+
+            Result = Entry.Fused;
+            FusedCount = Entry.Count;
+        }
+
+        return Result;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "vmbase.h"
+
+namespace VM_NAMESPACE
+{
+    struct FusedOpcode
+    {
+        enum T : uint32_t
+        {
+            None,
+
+#define DEFINE_FUSED_INST2(_op, _op1, _op2)                 _op,
+#define DEFINE_FUSED_INST3(_op, _op1, _op2, _op3)           _op,
+#define DEFINE_FUSED_INST4(_op, _op1, _op2, _op3, _op4)     _op,
+#include "inst_fused_table.inc"
+#undef DEFINE_FUSED_INST4
+#undef DEFINE_FUSED_INST3
+#undef DEFINE_FUSED_INST2
+
+            Count,
+        };
+    };
+
+    class VMFusion
+    {
+        //
+        // Matches opcode sequences against superinstructions of
+        // inst_fused_table.inc.
+        //
+
+    public:
+        constexpr static const uint32_t MaximumCount = 4;
+
+        //
+        // Returns the longest superinstruction which is a prefix of
+        // Opcodes[0..Count) and stores its instruction count to FusedCount,
+        // or FusedOpcode::T::None if nothing matches.
+        //
+
+        static FusedOpcode::T Match(const Opcode::T* Opcodes, uint32_t Count, uint32_t& FusedCount) noexcept;
+    };
+}
@@ -4,20 +4,139 @@
 #include "base.h"
 #include "integer.h"
 #include "vmmemory.h"
+#include "bc_decode_cache.h"
+#include "bc_verifier.h"
+#include "bc_fusion.h"
+#include "bc_jit.h"
+#include "vmtrace.h"
+
+//
+// Dispatch engine.
+//
+// Direct-threaded dispatch (computed goto) needs "labels as values"
+// extension of GCC/Clang. Define M_VM_THREADED_DISPATCH=0 to use the
+// portable switch-based dispatch instead.
+//
+
+#if !defined(M_VM_THREADED_DISPATCH)
+#if M_COMPILER_TYPE == M_COMPILER_GCC || M_COMPILER_TYPE == M_COMPILER_CLANG
+#define M_VM_THREADED_DISPATCH      1
+#else
+#define M_VM_THREADED_DISPATCH      0
+#endif
+#elif M_VM_THREADED_DISPATCH && M_COMPILER_TYPE == M_COMPILER_MSVC
+#error M_VM_THREADED_DISPATCH is not supported by MSVC
+#endif
+
+//
+// Tracing.
+//
+// M_VM_TRACE selects trace policy of VMBytecodeInterpreter. If it is 0,
+// no trace code is compiled (see NoTracePolicy); otherwise events are sent to
+// VMExecutionContext::TraceSink when the context has one (see SinkTracePolicy).
+//
+
+#if !defined(M_VM_TRACE)
+#if defined(NDEBUG)
+#define M_VM_TRACE                  0
+#else
+#define M_VM_TRACE                  1
+#endif
+#endif
+
+//
+// Top-of-stack caching.
+//
+// If M_VM_STACK_CACHE is 1, dispatch loops keep the two topmost operand stack
+// slots in VMCachedStack. Context.Stack is written back when the dispatch loop
+// exits and before guest memory access, so it may be stale while a trace sink
+// is called from the loop.
+//
+
+#if !defined(M_VM_STACK_CACHE)
+#define M_VM_STACK_CACHE            1
+#endif
+
+//
+// Block stack verification.
+//
+// If M_VM_BLOCK_VERIFY is 1, dispatch loops check operand stack capacity
+// once at entry of each basic block (see VMBlockVerifier) and execute the
+// block with VMUncheckedStack. Handlers are compiled twice (checked and
+// unchecked). Requires M_VM_STACK_CACHE.
+//
+
+#if !defined(M_VM_BLOCK_VERIFY)
+#define M_VM_BLOCK_VERIFY           M_VM_STACK_CACHE
+#elif M_VM_BLOCK_VERIFY && !M_VM_STACK_CACHE
+#error M_VM_BLOCK_VERIFY requires M_VM_STACK_CACHE
+#endif
+
+//
+// Superinstructions.
+//
+// If M_VM_SUPERINSTRUCTIONS is 1, instruction sequences fused by the decode
+// cache (see inst_fused_table.inc) are executed by a single handler of
+// bc_fused_handlers.inc. Fusion is skipped while a trace sink is attached.
+//
+
+#if !defined(M_VM_SUPERINSTRUCTIONS)
+#define M_VM_SUPERINSTRUCTIONS      1
+#endif
 
 namespace VM_NAMESPACE
 {
-    class VMBytecodeInterpreter
+    //
+    // Halting events of VMBytecodeInterpreterT::ExecuteUntilEvent().
+    //
+
+    struct HaltEvent
+    {
+        enum T : uint32_t
+        {
+            None,
+
+            Return,         // ret from the frame which was current at entry
+            Exception,      // VMExecutionContext::ExceptionState is set
+            Vmcall,         // vmcall requests host service
+            StepBudget,     // step budget is used up
+            TimeBudget,     // deadline has passed
+            OutOfFuel,      // VMExecutionContext::Fuel is used up
+        };
+    };
+
+    struct ExecuteBudget
+    {
+        uint64_t StepCount;                                 //< step budget, 0 if unlimited
+        std::chrono::steady_clock::time_point Deadline;     //< time budget, time_point() if unlimited
+        bool MeterFuel;                                     //< charge instructions to VMExecutionContext::Fuel
+    };
+
+    struct ExecuteResult
+    {
+        HaltEvent::T Event;
+        uint64_t StepCount;         //< executed step count
+        uint32_t VmcallId;          //< operand of vmcall if Event is HaltEvent::T::Vmcall
+    };
+
+    template <typename TTracePolicy>
+    class VMBytecodeInterpreterT
     {
         using StackType = VMStack;
+        using OperandStack = std::conditional_t<M_VM_STACK_CACHE, VMCachedStack, VMStack&>;
         using VMPointerType = Base::ToIntegralType<decltype(VMExecutionContext::IP)>::type;
 
         constexpr const static int StackNativePushSize32 = sizeof(int32_t);
         constexpr const static int StackNativePushSize64 = sizeof(int64_t);
 
     public:
-        VMBytecodeInterpreter(VMMemoryManager& MemoryManager) :
-            MemoryManager_(MemoryManager)
+        constexpr static const uint32_t ClockCheckInterval = 256;   //< budget checks between deadline checks
+
+        VMBytecodeInterpreterT(VMMemoryManager& MemoryManager) :
+            MemoryManager_(MemoryManager), DecodeCache_(MemoryManager), Event_()
+#if M_VM_JIT
+            , Jit_(MemoryManager), JitActive_()
+#endif
         {
         }
 
@@ -71,8 +190,11 @@ namespace VM_NAMESPACE
                 Message = "single step exception was raised by the debugger.";
                 break;
 
-            case ExceptionState::T::FloatingPointInvalid:
             case ExceptionState::T::IntegerOverflow:
+                Message = "An integer operation overflowed with the CheckOverflow prefix.";
+                break;
+
+            case ExceptionState::T::FloatingPointInvalid:
                 DASSERT(false); // TBD
                 break;
 
@@ -86,7 +208,7 @@ namespace VM_NAMESPACE
 
         static bool RaiseException(VMExecutionContext& Context, ExceptionState::T State)
         {
-            printf("Exception (0x%08x): %s\n", State, ExceptionStateToDescription(State));
+            Trace(Context, TraceEventType::T::Exception, nullptr, State);
 
             Context.ExceptionState = State;
             Context.NextIP = Context.IP;
@@ -116,1094 +238,1040 @@ namespace VM_NAMESPACE
 
         int Execute(VMExecutionContext& Context, int Count)
         {
-            VMInstruction Op;
-            size_t FetchSize = 0;
-            int StepCount = 0;
+#if M_VM_THREADED_DISPATCH
+            return ExecuteThreaded(Context, Count);
+#else
+            return ExecuteSwitch(Context, Count);
+#endif
+        }
 
-            printf("[VM Execute, Step %d]\n", Count);
+        //
+        // Switch-based dispatch (portable).
+        //
 
-            //
-            // Check stack alignment and operating mode.
-            //
+        int ExecuteSwitch(VMExecutionContext& Context, int Count)
+        {
+            return RunDispatch(Context, Count,
+                [this](VMExecutionContext& Context, int Count, int& StepCount)
+                {
+                    if (IsOverflowChecked(Context))
+                        DispatchSwitch<false, true>(Context, Count, StepCount);
+                    else
+                        DispatchSwitch<false, false>(Context, Count, StepCount);
+                });
+        }
 
-            auto Alignment = Context.Stack.Alignment();
-            if (Alignment != Context.ShadowStack.Alignment() ||
-                Alignment != Context.ArgumentStack.Alignment())
-            {
-                RaiseException(Context, ExceptionState::T::FatalError);
-                return 0;
-            }
+#if M_VM_THREADED_DISPATCH
+        int ExecuteThreaded(VMExecutionContext& Context, int Count)
+        {
+            return RunDispatch(Context, Count,
+                [this](VMExecutionContext& Context, int Count, int& StepCount)
+                {
+                    if (IsOverflowChecked(Context))
+                        DispatchThreaded<false, true>(Context, Count, StepCount);
+                    else
+                        DispatchThreaded<false, false>(Context, Count, StepCount);
+                });
+        }
+#endif
 
-            bool StackOper64 = IsStackOper64Bit(Context);
-            if (!(Alignment == sizeof(int32_t) && !StackOper64) &&
-                !(Alignment == sizeof(int64_t) && StackOper64))
-            {
-                RaiseException(Context, ExceptionState::T::FatalError);
-                return 0;
-            }
+        //
+        // Runs until a halting event (see HaltEvent::T).
+        //
+        // Unlike Execute(), the step count is not checked on every
+        // instruction. Budgets are checked only after calls and backward
+        // branches (the deadline on every ClockCheckInterval-th check), so a
+        // run may exceed the step budget by the straight-line code which
+        // follows the last check. Context is resumable after any event; after
+        // HaltEvent::T::Vmcall, IP points past the vmcall and the host pushes
+        // the result (see PushVmcallResult()) before resuming.
+        //
+        // If Budget.MeterFuel is set, instructions are charged to Context.Fuel
+        // and the run halts with HaltEvent::T::OutOfFuel before the first
+        // instruction which does not fit. A verified block (see
+        // VMBlockVerifier) is charged its instruction count once at entry, and
+        // is entered only if the whole block fits; other instructions are
+        // charged one at a time. Fuel is therefore charged exactly for the
+        // executed steps, except that an instruction which raises an exception
+        // and the rest of its block are charged too.
+        //
+
+        ExecuteResult ExecuteUntilEvent(VMExecutionContext& Context, const ExecuteBudget& Budget)
+        {
+            const uint64_t ChunkCount = INT_MAX / 2;
+
+            ExecuteResult Result{};
 
-            MemoryInfo QueryResult{};
+            Event_ = {};
+            Event_.ShadowStackTop = Context.ShadowStack.TopOffset();
+            Event_.Deadline = Budget.Deadline;
+            Event_.ClockCountdown = ClockCheckInterval;
+            Event_.MeterFuel = Budget.MeterFuel;
 
             do
             {
-                if (StepCount >= Count)
-                    break;
+                uint64_t Remaining = Budget.StepCount ? Budget.StepCount - Result.StepCount : ChunkCount;
+                int Count = static_cast<int>(Remaining < ChunkCount ? Remaining : ChunkCount);
+
+                Result.StepCount += RunDispatch(Context, Count,
+                    [this](VMExecutionContext& Context, int Count, int& StepCount)
+                    {
+#if M_VM_THREADED_DISPATCH
+                        if (IsOverflowChecked(Context))
+                            DispatchThreaded<true, true>(Context, Count, StepCount);
+                        else
+                            DispatchThreaded<true, false>(Context, Count, StepCount);
+#else
+                        if (IsOverflowChecked(Context))
+                            DispatchSwitch<true, true>(Context, Count, StepCount);
+                        else
+                            DispatchSwitch<true, false>(Context, Count, StepCount);
+#endif
+                    });
 
                 if (Context.ExceptionState != ExceptionState::T::None)
-                    break;
+                    Result.Event = HaltEvent::T::Exception;
+                else if (Event_.Event != HaltEvent::T::None)
+                    Result.Event = Event_.Event;
+                else if (Budget.StepCount && Result.StepCount >= Budget.StepCount)
+                    Result.Event = HaltEvent::T::StepBudget;
+            }
+            while (Result.Event == HaltEvent::T::None);
 
-                if (!MemoryManager_.Query(Context.IP, QueryResult))
-                {
-                    RaiseException(Context, ExceptionState::T::InvalidAccess);
-                    break;
-                }
+            Result.VmcallId = Event_.VmcallId;
+
+            return Result;
+        }
 
-                uint64_t RemainingSize = QueryResult.Size - (static_cast<uint64_t>(Context.IP) - QueryResult.Base);
+        //
+        // Pushes the result of a vmcall before resuming (see
+        // ExecuteUntilEvent()). While the memory manager tracks writes, the
+        // stack page may be write-protected, so the push runs in its memory
+        // context. Returns false if the stack is full.
+        //
+
+        template <typename T>
+        bool PushVmcallResult(VMExecutionContext& Context, const T& Value)
+        {
+            if (!MemoryManager_.IsTrackingWrites())
+                return Context.Stack.Push(Value);
 
-                uintptr_t FetchAddress = MemoryManager_.HostAddress(Context.IP);
-                FetchSize = VMInstruction::Decode(
-                    reinterpret_cast<uint8_t*>(FetchAddress),
-                    RemainingSize,
-                    &Op);
+            bool Result = false;
 
-                if (!FetchSize)
+            if (!MemoryManager_.ExecuteInMemoryContext([&]()
                 {
-                    // Failed to decode...
-                    RaiseException(Context, ExceptionState::T::InvalidInstruction);
-                    break;
-                }
+                    Result = Context.Stack.Push(Value);
+                }))
+            {
+                return false;
+            }
+
+            return Result;
+        }
+
+#if M_VM_JIT
+        //
+        // Dispatch with baseline JIT (see VMJit).
+        //
+        // While interpreting, calls and backward branches are profiled and
+        // the dispatch loop leaves when control reaches compiled code, which
+        // then runs until it leaves to the interpreter again. Compiled code is
+        // not used while a trace sink is attached or a prefix is fetched.
+        //
+        // Nor is it used while the memory manager tracks writes: compiled
+        // code writes the operand stack, whose pages may be write-protected,
+        // and it has no unwind information through which a fault could reach
+        // the handler of ExecuteInMemoryContext() on Windows.
+        //
+
+        int ExecuteJit(VMExecutionContext& Context, int Count)
+        {
+            if ((TTracePolicy::TraceEnabled && Context.TraceSink) ||
+                MemoryManager_.IsTrackingWrites())
+            {
+                return Execute(Context, Count);
+            }
 
-                DASSERT(Op.Valid());
+            if (!BeginExecute(Context, Count))
+                return 0;
+
+            int StepCount = 0;
+
+            JitActive_ = true;
 
-#if 1 // debug
-                char Mnemonic[64];
-                DASSERT(Op.ToMnemonic(Mnemonic, std::size(Mnemonic), nullptr));
+            while (StepCount < Count &&
+                Context.ExceptionState == ExceptionState::T::None)
+            {
+                int Executed = 0;
 
-                unsigned char Bytes[32];
-                size_t BytesSize = 0;
-                DASSERT(Op.ToBytes(Bytes, std::size(Bytes), &BytesSize));
-                DASSERT(BytesSize == FetchSize);
+                auto Entry = Context.FetchedPrefix ? nullptr : Jit_.Lookup(Context.IP, Context.Mode);
+                if (Entry && CanRunCompiled(Context, *Entry, Context.Stack))
+                    Executed = RunCompiled(Context, *Entry, Count - StepCount);
 
-                char BytecodeDump[200]{};
-                for (size_t i = 0; i < BytesSize; i++)
+                if (!Executed)
                 {
-                    char Value[10];
-                    sprintf_s(Value, "%02hhx ", Bytes[i]);
-                    strcat_s(BytecodeDump, Value);
+                    Executed = Execute(Context, Count - StepCount);
+                    if (!Executed)
+                        break;
                 }
 
-                printf("%08x: %-30s%s\n", Context.IP, BytecodeDump, Mnemonic);
+                StepCount += Executed;
+            }
+
+            JitActive_ = false;
+
+            EndExecute(Context, StepCount);
+
+            return StepCount;
+        }
 #endif
 
-                bool Result = true;
 
-                // Calculate next IP before execution
-                Context.NextIP = Base::IntegerAssertCast<VMPointerType>(Context.IP + FetchSize);
+    private:
 
+        //
+        // Runs Dispatch between BeginExecute() and EndExecute().
+        // With guarded address space, Ldpv/Stpv access guest memory without
+        // checks; a fault aborts the dispatch and raises InvalidAccess on the
+        // current instruction (its IP is updated after the handler returns).
+        // While the memory manager tracks writes, stack and memory writes
+        // fault on clean pages, so dispatch also runs in its memory context.
+        //
 
-                switch (auto Opcode = Op.Opcode())
-                {
-                case Opcode::T::Add_I4:
-                {
-                    Result = Inst_Add<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Add_I8:
-                {
-                    Result = Inst_Add<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Add_U4:
-                {
-                    Result = Inst_Add<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Add_U8:
-                {
-                    Result = Inst_Add<uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Add_F4:
-                {
-                    Result = Inst_Add<float>(Context);
-                    break;
-                }
-                case Opcode::T::Add_F8:
-                {
-                    Result = Inst_Add<double>(Context);
-                    break;
-                }
+        template <typename TDispatch>
+        int RunDispatch(VMExecutionContext& Context, int Count, TDispatch&& Dispatch)
+        {
+            int StepCount = 0;
 
-                case Opcode::T::Sub_I4:
-                {
-                    Result = Inst_Sub<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Sub_I8:
-                {
-                    Result = Inst_Sub<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Sub_U4:
-                {
-                    Result = Inst_Sub<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Sub_U8:
-                {
-                    Result = Inst_Sub<uint64_t>(Context);
-                    break;
-                }
+            if (!BeginExecute(Context, Count))
+                return 0;
 
-                case Opcode::T::Sub_F4:
-                {
-                    Result = Inst_Sub<float>(Context);
-                    break;
-                }
-                case Opcode::T::Sub_F8:
+            if (!MemoryManager_.IsAddressSpaceGuarded() && !MemoryManager_.IsTrackingWrites())
+            {
+                Dispatch(Context, Count, StepCount);
+            }
+            else if (!MemoryManager_.ExecuteInMemoryContext([&]()
                 {
-                    Result = Inst_Sub<double>(Context);
-                    break;
-                }
+                    Dispatch(Context, Count, StepCount);
+                }))
+            {
+                RaiseException(Context, ExceptionState::T::InvalidAccess);
+            }
 
-                case Opcode::T::Mul_I4:
-                {
-                    Result = Inst_Mul<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mul_I8:
-                {
-                    Result = Inst_Mul<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mul_U4:
-                {
-                    Result = Inst_Mul<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mul_U8:
-                {
-                    Result = Inst_Mul<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mul_F4:
-                {
-                    Result = Inst_Mul<float>(Context);
-                    break;
-                }
-                case Opcode::T::Mul_F8:
-                {
-                    Result = Inst_Mul<double>(Context);
-                    break;
-                }
+            EndExecute(Context, StepCount);
 
+            return StepCount;
+        }
 
-                case Opcode::T::Mulh_I4:
-                {
-                    Result = Inst_Mulh<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mulh_I8:
-                {
-                    Result = Inst_Mulh<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mulh_U4:
-                {
-                    Result = Inst_Mulh<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mulh_U8:
-                {
-                    Result = Inst_Mulh<uint64_t>(Context);
-                    break;
-                }
+        //
+        // Integer handlers are instantiated with and without overflow checks
+        // (see VM_CHECK_OVERFLOW in bc_handlers.inc). The prefix is fetched
+        // by the host, so it is tested once per dispatch, not per instruction.
+        //
 
+        static bool IsOverflowChecked(const VMExecutionContext& Context)
+        {
+            return !!(Context.FetchedPrefix & InstructionPrefixBits::T::CheckOverflow);
+        }
 
-                case Opcode::T::Div_I4:
-                {
-                    Result = Inst_Div<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Div_I8:
-                {
-                    Result = Inst_Div<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Div_U4:
-                {
-                    Result = Inst_Div<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Div_U8:
-                {
-                    Result = Inst_Div<uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Div_F4:
-                {
-                    Result = Inst_Div<float>(Context);
-                    break;
-                }
-                case Opcode::T::Div_F8:
-                {
-                    Result = Inst_Div<double>(Context);
-                    break;
-                }
+        //
+        // If TUntilEvent is true, Count is checked only by CheckEvent() (see
+        // ExecuteUntilEvent()).
+        //
 
-                case Opcode::T::Mod_I4:
-                {
-                    Result = Inst_Mod<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mod_I8:
-                {
-                    Result = Inst_Mod<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mod_U4:
-                {
-                    Result = Inst_Mod<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Mod_U8:
-                {
-                    Result = Inst_Mod<uint64_t>(Context);
+        template <bool TUntilEvent, bool TCheckOverflow>
+        void DispatchSwitch(VMExecutionContext& Context, int Count, int& StepCount)
+        {
+            OperandStack Stack(Context.Stack);
+            uint32_t BlockRemaining = 0;
+            bool EventPending = false;
+            uint64_t* Fuel = (TUntilEvent && Event_.MeterFuel) ? &Context.Fuel : nullptr;
+            const DecodedInstruction* Decoded = nullptr;
+#if M_VM_BLOCK_VERIFY
+            VMUncheckedStack UncheckedStack(Stack);
+            bool FunctionChecked = false;
+            uint64_t FunctionGeneration = 0;
+#endif
+
+            do
+            {
+                if (!TUntilEvent && StepCount >= Count)
                     break;
-                }
-                case Opcode::T::Mod_F4:
-                {
-                    Result = Inst_Mod<float>(Context);
+
+                if (Context.ExceptionState != ExceptionState::T::None)
                     break;
-                }
-                case Opcode::T::Mod_F8:
+
+                ExceptionState::T FetchException = ExceptionState::T::None;
+                Decoded = DecodeCache_.FetchNext(Decoded, Context.IP, FetchException);
+
+                if (!Decoded)
                 {
-                    Result = Inst_Mod<double>(Context);
+                    RaiseException(Context, FetchException);
                     break;
                 }
 
-                case Opcode::T::Shl_I4:
+                TraceInstruction(Context, *Decoded);
+
+                // Calculate next IP before execution
+                Context.NextIP = Base::IntegerAssertCast<VMPointerType>(Decoded->NextIP);
+
+#define VM_HANDLER(_op)         case Opcode::T::_op:
+#define VM_HANDLER_END          break;
+#define VM_OPERAND(_type)       static_cast<_type>(Decoded->Operand)
+#define VM_TARGET()             static_cast<VMPointerType>(Decoded->Target)
+#define VM_EVENT()              EventPending = true
+#define VM_CHECK_OVERFLOW       TCheckOverflow
+
+#if M_VM_SUPERINSTRUCTIONS
+                if (CanFuse(Context, *Decoded, TUntilEvent ? INT_MAX : Count - StepCount, BlockRemaining, Fuel))
+                {
+#define VM_FUSED_HANDLER(_op)   case FusedOpcode::T::_op:
+#define VM_FUSED_OPERAND(_index, _type) \
+                    static_cast<_type>((_index) ? Decoded->FusedOperand[(_index) - 1] : Decoded->Operand)
+#define VM_FUSED_TARGET()       static_cast<VMPointerType>(Decoded->FusedTarget)
+#define VM_FUSED_NEXT(_index) \
+                    { \
+                        if (Context.ExceptionState != ExceptionState::T::None) \
+                            break; \
+                        Context.PrevIP = Context.IP; \
+                        Context.IP = Context.NextIP; \
+                        StepCount++; \
+                        Context.NextIP = static_cast<VMPointerType>(Context.IP + Decoded->FusedLength[(_index) - 1]); \
+                    }
+#define VM_STACK                Stack
+                    switch (Decoded->Fused)
+                    {
+#include "bc_fused_handlers.inc"
+
+                    default:
+                    {
+                        DASSERT(false);
+                    }
+
+                    }
+#undef VM_STACK
+#undef VM_FUSED_NEXT
+#undef VM_FUSED_TARGET
+#undef VM_FUSED_OPERAND
+#undef VM_FUSED_HANDLER
+                }
+                else
+#endif
+#if M_VM_BLOCK_VERIFY
+                if (BlockRemaining ||
+                    (BlockRemaining = EnterBlock(Context, Decoded, Stack, Fuel, FunctionChecked, FunctionGeneration)) != 0)
                 {
-                    Result = Inst_Shl<int32_t>(Context);
-                    break;
+                    BlockRemaining--;
+
+#define VM_STACK                UncheckedStack
+                    switch (Decoded->Op.Opcode())
+                    {
+#include "bc_handlers.inc"
+
+                    default:
+                    {
+                        DASSERT(false);
+                    }
+
+                    }
+#undef VM_STACK
                 }
-                case Opcode::T::Shl_I8:
+                else
+#endif
                 {
-                    Result = Inst_Shl<int64_t>(Context);
-                    break;
+                    if (Fuel && !ChargeFuel(*Fuel))
+                        break;
+
+#define VM_STACK                Stack
+                    switch (Decoded->Op.Opcode())
+                    {
+#include "bc_handlers.inc"
+
+                    default:
+                    {
+                        DASSERT(false);
+                    }
+
+                    }
+#undef VM_STACK
                 }
-                case Opcode::T::Shl_U4:
+
+#undef VM_CHECK_OVERFLOW
+#undef VM_EVENT
+#undef VM_TARGET
+#undef VM_OPERAND
+#undef VM_HANDLER_END
+#undef VM_HANDLER
+
+                if (Context.ExceptionState != ExceptionState::T::None)
                 {
-                    Result = Inst_Shl<uint32_t>(Context);
                     break;
                 }
-                case Opcode::T::Shl_U8:
+
+                Context.PrevIP = Context.IP;
+                Context.IP = Context.NextIP;
+                StepCount++;
+
+#if M_VM_JIT
+                if (Context.IP != Decoded->NextIP &&
+                    JitActive_ && JitTransfer(Context, *Decoded, Stack))
                 {
-                    Result = Inst_Shl<uint64_t>(Context);
                     break;
                 }
+#endif
 
-                case Opcode::T::Shr_I4:
+                if (TUntilEvent)
                 {
-                    Result = Inst_Shr<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Shr_I8:
-                {
-                    Result = Inst_Shr<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Shr_U4:
-                {
-                    Result = Inst_Shr<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Shr_U8:
-                {
-                    Result = Inst_Shr<uint64_t>(Context);
-                    break;
+                    if (EventPending)
+                    {
+                        EventPending = false;
+
+                        if (CheckEvent(Context, *Decoded, Count, StepCount))
+                            break;
+                    }
+                    else if (Context.IP <= Context.PrevIP &&
+                        CheckBudget(Count, StepCount))
+                    {
+                        break;
+                    }
                 }
+            }
+            while (true);
 
-                case Opcode::T::And_X4:
-                {
-                    Result = Inst_And<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::And_X8:
-                {
-                    Result = Inst_And<uint64_t>(Context);
-                    break;
-                }
+            FlushStack(Stack);
+        }
 
-                case Opcode::T::Or_X4:
-                {
-                    Result = Inst_Or<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Or_X8:
-                {
-                    Result = Inst_Or<uint64_t>(Context);
-                    break;
-                }
+#if M_VM_THREADED_DISPATCH
+        //
+        // Direct-threaded dispatch.
+        //
+        // Each decoded instruction carries the address of its handler and
+        // its immediate operand. Every handler ends with its own copy of
+        // fetch-and-dispatch, so each handler has a separate indirect branch.
+        // Instructions of a verified block are dispatched to the unchecked
+        // copy of handlers (UncheckedHandler_*). Each TUntilEvent and
+        // TCheckOverflow has its own handler table, for which the decode
+        // cache keeps its own regions, so switching between Execute() and
+        // ExecuteUntilEvent(), or setting the CheckOverflow prefix, does not
+        // decode again.
+        //
 
-                case Opcode::T::Xor_X4:
-                {
-                    Result = Inst_Xor<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Xor_X8:
-                {
-                    Result = Inst_Xor<uint64_t>(Context);
-                    break;
-                }
+        template <bool TUntilEvent, bool TCheckOverflow>
+        void DispatchThreaded(VMExecutionContext& Context, int Count, int& StepCount)
+        {
+            static const void* const HandlerTable[] =
+            {
+#define DEFINE_INST(_op, _mnemonic)                 &&Handler_##_op,
+#define DEFINE_INST_O1(_op, _mnemonic, _operand)    &&Handler_##_op,
+#include "inst_table.inc"
+#undef DEFINE_INST_O1
+#undef DEFINE_INST
+            };
+
+#if M_VM_BLOCK_VERIFY
+            static const void* const UncheckedHandlerTable[] =
+            {
+#define DEFINE_INST(_op, _mnemonic)                 &&UncheckedHandler_##_op,
+#define DEFINE_INST_O1(_op, _mnemonic, _operand)    &&UncheckedHandler_##_op,
+#include "inst_table.inc"
+#undef DEFINE_INST_O1
+#undef DEFINE_INST
+            };
+#else
+            static const void* const* const UncheckedHandlerTable = nullptr;
+#endif
 
-                case Opcode::T::Not_X4:
-                {
-                    Result = Inst_Not<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Not_X8:
-                {
-                    Result = Inst_Not<uint64_t>(Context);
-                    break;
-                }
+#if M_VM_SUPERINSTRUCTIONS
+            static const void* const FusedHandlerTable[] =
+            {
+#define DEFINE_FUSED_INST2(_op, _op1, _op2)                 &&FusedHandler_##_op,
+#define DEFINE_FUSED_INST3(_op, _op1, _op2, _op3)           &&FusedHandler_##_op,
+#define DEFINE_FUSED_INST4(_op, _op1, _op2, _op3, _op4)     &&FusedHandler_##_op,
+#include "inst_fused_table.inc"
+#undef DEFINE_FUSED_INST4
+#undef DEFINE_FUSED_INST3
+#undef DEFINE_FUSED_INST2
+            };
+#endif
 
-                case Opcode::T::Neg_I4:
-                {
-                    Result = Inst_Neg<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Neg_I8:
-                {
-                    Result = Inst_Neg<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Neg_F4:
-                {
-                    Result = Inst_Neg<float>(Context);
-                    break;
-                }
-                case Opcode::T::Neg_F8:
-                {
-                    Result = Inst_Neg<double>(Context);
-                    break;
-                }
+            const DecodedInstruction* Decoded = nullptr;
+            ExceptionState::T FetchException = ExceptionState::T::None;
+            OperandStack Stack(Context.Stack);
+            uint32_t BlockRemaining = 0;
+            bool EventPending = false;
+            uint64_t* Fuel = (TUntilEvent && Event_.MeterFuel) ? &Context.Fuel : nullptr;
+#if M_VM_BLOCK_VERIFY
+            VMUncheckedStack UncheckedStack(Stack);
+            bool FunctionChecked = false;
+            uint64_t FunctionGeneration = 0;
+#endif
 
-                case Opcode::T::Abs_I4:
-                {
-                    Result = Inst_Abs<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Abs_I8:
-                {
-                    Result = Inst_Abs<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Abs_F4:
-                {
-                    Result = Inst_Abs<float>(Context);
-                    break;
-                }
-                case Opcode::T::Abs_F8:
-                {
-                    Result = Inst_Abs<double>(Context);
-                    break;
-                }
+            DecodeCache_.SetHandlerTable(HandlerTable, UncheckedHandlerTable);
 
-                case Opcode::T::Cvt2i_F4_I4:
-                {
-                    Result = Inst_Cvt2i<float, int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt2i_F4_I8:
-                {
-                    Result = Inst_Cvt2i<float, int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt2i_F8_I4:
-                {
-                    Result = Inst_Cvt2i<double, int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt2i_F8_I8:
-                {
-                    Result = Inst_Cvt2i<double, int64_t>(Context);
-                    break;
-                }
+#if M_VM_BLOCK_VERIFY
+#define VM_THREADED_DISPATCH_BLOCK() \
+            { \
+                if (BlockRemaining || \
+                    (BlockRemaining = EnterBlock(Context, Decoded, Stack, Fuel, FunctionChecked, FunctionGeneration)) != 0) \
+                { \
+                    BlockRemaining--; \
+                    goto *Decoded->UncheckedHandler; \
+                } \
+            }
+#else
+#define VM_THREADED_DISPATCH_BLOCK()
+#endif
 
-                case Opcode::T::Cvt2f_I4_F4:
-                {
-                    Result = Inst_Cvt2f<int32_t, float>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt2f_I4_F8:
-                {
-                    Result = Inst_Cvt2f<int32_t, double>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt2f_I8_F4:
-                {
-                    Result = Inst_Cvt2f<int64_t, float>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt2f_I8_F8:
-                {
-                    Result = Inst_Cvt2f<int64_t, double>(Context);
-                    break;
-                }
+#if M_VM_SUPERINSTRUCTIONS
+#define VM_THREADED_DISPATCH_FUSED() \
+            { \
+                if (CanFuse(Context, *Decoded, TUntilEvent ? INT_MAX : Count - StepCount, BlockRemaining, Fuel)) \
+                    goto *FusedHandlerTable[Decoded->Fused - 1]; \
+            }
+#else
+#define VM_THREADED_DISPATCH_FUSED()
+#endif
 
-                case Opcode::T::Cvtff_F4_F8:
-                {
-                    Result = Inst_Cvtff<float, double>(Context);
-                    break;
-                }
-                case Opcode::T::Cvtff_F8_F4:
-                {
-                    Result = Inst_Cvtff<double, float>(Context);
-                    break;
-                }
+#if M_VM_JIT
+#define VM_THREADED_JIT_TRANSFER() \
+            { \
+                if (Context.IP != Decoded->NextIP && \
+                    JitActive_ && JitTransfer(Context, *Decoded, Stack)) \
+                    goto Exit; \
+            }
+#else
+#define VM_THREADED_JIT_TRANSFER()
+#endif
 
-                case Opcode::T::Cvt_I1_I4:
-                {
-                    Result = Inst_Cvt<int8_t, int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I2_I4:
-                {
-                    Result = Inst_Cvt<int16_t, int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I4_I1:
-                {
-                    Result = Inst_Cvt<int32_t, int8_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I4_I2:
-                {
-                    Result = Inst_Cvt<int32_t, int16_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I4_I8:
-                {
-                    Result = Inst_Cvt<int32_t, int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I8_I4:
-                {
-                    Result = Inst_Cvt<int64_t, int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U1_U4:
-                {
-                    Result = Inst_Cvt<uint8_t, uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U2_U4:
-                {
-                    Result = Inst_Cvt<uint16_t, uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U4_U1:
-                {
-                    Result = Inst_Cvt<uint32_t, uint8_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U4_U2:
-                {
-                    Result = Inst_Cvt<uint32_t, uint16_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U4_U8:
-                {
-                    Result = Inst_Cvt<uint32_t, uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U8_U4:
-                {
-                    Result = Inst_Cvt<uint64_t, uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I1_U1:
-                {
-                    Result = Inst_Cvt<int8_t, uint8_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I2_U2:
-                {
-                    Result = Inst_Cvt<int16_t, uint16_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I4_U4:
-                {
-                    Result = Inst_Cvt<int32_t, uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_I8_U8:
-                {
-                    Result = Inst_Cvt<int64_t, uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U1_I1:
-                {
-                    Result = Inst_Cvt<uint8_t, int8_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U2_I2:
-                {
-                    Result = Inst_Cvt<uint16_t, int16_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U4_I4:
-                {
-                    Result = Inst_Cvt<uint32_t, int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Cvt_U8_I8:
-                {
-                    Result = Inst_Cvt<uint64_t, int64_t>(Context);
-                    break;
-                }
+#define VM_THREADED_EVENT_CHECK() \
+            { \
+                if (TUntilEvent) \
+                { \
+                    if (EventPending) \
+                    { \
+                        EventPending = false; \
+                        if (CheckEvent(Context, *Decoded, Count, StepCount)) \
+                            goto Exit; \
+                    } \
+                    else if (Context.IP <= Context.PrevIP && \
+                        CheckBudget(Count, StepCount)) \
+                        goto Exit; \
+                } \
+            }
+
+#define VM_THREADED_DISPATCH() \
+            { \
+                if ((!TUntilEvent && StepCount >= Count) || \
+                    Context.ExceptionState != ExceptionState::T::None) \
+                    goto Exit; \
+                Decoded = DecodeCache_.FetchNext(Decoded, Context.IP, FetchException); \
+                if (!Decoded) \
+                { \
+                    RaiseException(Context, FetchException); \
+                    goto Exit; \
+                } \
+                TraceInstruction(Context, *Decoded); \
+                Context.NextIP = Base::IntegerAssertCast<VMPointerType>(Decoded->NextIP); \
+                VM_THREADED_DISPATCH_FUSED(); \
+                VM_THREADED_DISPATCH_BLOCK(); \
+                if (Fuel && !ChargeFuel(*Fuel)) \
+                    goto Exit; \
+                goto *Decoded->Handler; \
+            }
+
+#define VM_HANDLER_END \
+            { \
+                if (Context.ExceptionState != ExceptionState::T::None) \
+                    goto Exit; \
+                Context.PrevIP = Context.IP; \
+                Context.IP = Context.NextIP; \
+                StepCount++; \
+                VM_THREADED_JIT_TRANSFER(); \
+                VM_THREADED_EVENT_CHECK(); \
+                VM_THREADED_DISPATCH(); \
+            }
+#define VM_OPERAND(_type)       static_cast<_type>(Decoded->Operand)
+#define VM_TARGET()             static_cast<VMPointerType>(Decoded->Target)
+#define VM_EVENT()              EventPending = true
+#define VM_CHECK_OVERFLOW       TCheckOverflow
+
+            VM_THREADED_DISPATCH();
+
+#define VM_HANDLER(_op)         Handler_##_op:
+#define VM_STACK                Stack
+#include "bc_handlers.inc"
+#undef VM_STACK
+#undef VM_HANDLER
+
+#if M_VM_BLOCK_VERIFY
+#define VM_HANDLER(_op)         UncheckedHandler_##_op:
+#define VM_STACK                UncheckedStack
+#include "bc_handlers.inc"
+#undef VM_STACK
+#undef VM_HANDLER
+#endif
 
-                case Opcode::T::Ldimm_I1:
-                {
-                    int8_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldimm<decltype(Operand1)>(Context, Operand1);
-                    break;
-                }
-                case Opcode::T::Ldimm_I2:
-                {
-                    int16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldimm<decltype(Operand1)>(Context, Operand1);
-                    break;
-                }
-                case Opcode::T::Ldimm_I4:
-                {
-                    int32_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldimm<decltype(Operand1)>(Context, Operand1);
-                    break;
-                }
-                case Opcode::T::Ldimm_I8:
-                {
-                    int64_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldimm<decltype(Operand1)>(Context, Operand1);
-                    break;
-                }
+#if M_VM_SUPERINSTRUCTIONS
+#define VM_FUSED_HANDLER(_op)   FusedHandler_##_op:
+#define VM_FUSED_OPERAND(_index, _type) \
+            static_cast<_type>((_index) ? Decoded->FusedOperand[(_index) - 1] : Decoded->Operand)
+#define VM_FUSED_TARGET()       static_cast<VMPointerType>(Decoded->FusedTarget)
+#define VM_FUSED_NEXT(_index) \
+            { \
+                if (Context.ExceptionState != ExceptionState::T::None) \
+                    goto Exit; \
+                Context.PrevIP = Context.IP; \
+                Context.IP = Context.NextIP; \
+                StepCount++; \
+                Context.NextIP = static_cast<VMPointerType>(Context.IP + Decoded->FusedLength[(_index) - 1]); \
+            }
+#define VM_STACK                Stack
+#include "bc_fused_handlers.inc"
+#undef VM_STACK
+#undef VM_FUSED_NEXT
+#undef VM_FUSED_TARGET
+#undef VM_FUSED_OPERAND
+#undef VM_FUSED_HANDLER
+#endif
 
-                case Opcode::T::Ldarg:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldarg(Context, Operand1, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Ldvar:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldvar(Context, Operand1, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Starg:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Starg(Context, Operand1, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Stvar:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Stvar(Context, Operand1, MemoryManager_);
-                    break;
-                }
+#undef VM_CHECK_OVERFLOW
+#undef VM_EVENT
+#undef VM_TARGET
+#undef VM_OPERAND
+#undef VM_HANDLER_END
+#undef VM_THREADED_DISPATCH_FUSED
+#undef VM_THREADED_DISPATCH_BLOCK
+#undef VM_THREADED_EVENT_CHECK
+#undef VM_THREADED_JIT_TRANSFER
+#undef VM_THREADED_DISPATCH
 
-                case Opcode::T::Dup:
-                {
-                    Result = Inst_Dup_Template(Context);
-                    break;
-                }
-                case Opcode::T::Dup2:
-                {
-                    // duplicate 2 elements
-                    Result = Inst_Dup2_Template(Context);
-                    break;
-                }
+        Exit:
+            FlushStack(Stack);
+        }
+#endif
 
-                case Opcode::T::Xch:
-                {
-                    Result = Inst_Xch_Template(Context);
-                    break;
-                }
 
-                case Opcode::T::Ldvarp:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldvarp(Context, Operand1);
-                    break;
-                }
-                case Opcode::T::Ldargp:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldargp(Context, Operand1);
-                    break;
-                }
+        static void Trace(const VMExecutionContext& Context, TraceEventType::T Type, const VMInstruction* Instruction, uint64_t Value)
+        {
+            if (TTracePolicy::TraceEnabled && Context.TraceSink)
+            {
+                TraceEvent Event{ Type, Context.IP, Instruction, Value };
+                Context.TraceSink->Trace(Context, Event);
+            }
+        }
 
-                case Opcode::T::Ldpv_X1:
-                {
-                    Result = Inst_Ldpv_Template<uint8_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Ldpv_X2:
-                {
-                    Result = Inst_Ldpv_Template<uint16_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Ldpv_X4:
-                {
-                    Result = Inst_Ldpv_Template<uint32_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Ldpv_X8:
-                {
-                    Result = Inst_Ldpv_Template<uint64_t>(Context, MemoryManager_);
-                    break;
-                }
+        bool BeginExecute(VMExecutionContext& Context, int Count)
+        {
+            Trace(Context, TraceEventType::T::ExecuteBegin, nullptr, Count);
 
-                case Opcode::T::Stpv_X1:
-                {
-                    Result = Inst_Stpv_Template<uint8_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Stpv_X2:
-                {
-                    Result = Inst_Stpv_Template<uint16_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Stpv_X4:
-                {
-                    Result = Inst_Stpv_Template<uint32_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Stpv_X8:
-                {
-                    Result = Inst_Stpv_Template<uint64_t>(Context, MemoryManager_);
-                    break;
-                }
+            //
+            // Check stack alignment and operating mode.
+            //
 
-                case Opcode::T::Ppcpy:
-                {
-                    Result = Inst_Ppcpy_Template(Context, MemoryManager_);
-                    break;
-                }
+            auto Alignment = Context.Stack.Alignment();
+            if (Alignment != Context.ShadowStack.Alignment() ||
+                Alignment != Context.ArgumentStack.Alignment())
+            {
+                RaiseException(Context, ExceptionState::T::FatalError);
+                return false;
+            }
 
-                case Opcode::T::Pvfil_X1:
-                {
-                    Result = Inst_Pvfil_Template<uint8_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Pvfil_X2:
-                {
-                    Result = Inst_Pvfil_Template<uint16_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Pvfil_X4:
-                {
-                    Result = Inst_Pvfil_Template<uint32_t>(Context, MemoryManager_);
-                    break;
-                }
-                case Opcode::T::Pvfil_X8:
-                {
-                    Result = Inst_Pvfil_Template<uint64_t>(Context, MemoryManager_);
-                    break;
-                }
+            bool StackOper64 = IsStackOper64Bit(Context);
+            if (!(Alignment == sizeof(int32_t) && !StackOper64) &&
+                !(Alignment == sizeof(int64_t) && StackOper64))
+            {
+                RaiseException(Context, ExceptionState::T::FatalError);
+                return false;
+            }
 
-                case Opcode::T::Initarg:
-                {
-                    Result = Inst_Initarg(Context);
-                    break;
-                }
-                case Opcode::T::Arg:
-                {
-                    uint32_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Arg(Context, Operand1);
-                    break;
-                }
-                case Opcode::T::Var:
-                {
-                    uint32_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Var(Context, Operand1);
-                    break;
-                }
+            // Blocks of shared code images are verified for one mode
+            DecodeCache_.SetMode(Context.Mode);
 
-                case Opcode::T::Dcv:
-                {
-                    Result = Inst_Dcv_Template(Context);
-                    break;
-                }
-                case Opcode::T::Dcvn:
-                {
-                    Result = Inst_Dcvn_Template(Context);
-                    break;
-                }
+            return true;
+        }
 
-                case Opcode::T::Test_e_I4:
-                {
-                    Result = Inst_Test_e<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_e_I8:
-                {
-                    Result = Inst_Test_e<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_e_F4:
-                {
-                    Result = Inst_Test_e<float>(Context);
-                    break;
-                }
-                case Opcode::T::Test_e_F8:
-                {
-                    Result = Inst_Test_e<double>(Context);
-                    break;
-                }
+        void EndExecute(VMExecutionContext& Context, int StepCount)
+        {
+            Trace(Context, TraceEventType::T::ExecuteEnd, nullptr, StepCount);
+        }
 
-                case Opcode::T::Test_ne_I4:
-                {
-                    Result = Inst_Test_ne<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ne_I8:
-                {
-                    Result = Inst_Test_ne<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ne_F4:
-                {
-                    Result = Inst_Test_ne<float>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ne_F8:
-                {
-                    Result = Inst_Test_ne<double>(Context);
-                    break;
-                }
+        static void FlushStack(VMStack&) noexcept
+        {
+            // Context.Stack is used directly
+        }
 
-                case Opcode::T::Test_le_I4:
-                {
-                    Result = Inst_Test_le<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_le_I8:
-                {
-                    Result = Inst_Test_le<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_le_U4:
-                {
-                    Result = Inst_Test_le<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_le_U8:
-                {
-                    Result = Inst_Test_le<uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_le_F4:
-                {
-                    Result = Inst_Test_le<float>(Context);
-                    break;
-                }
-                case Opcode::T::Test_le_F8:
-                {
-                    Result = Inst_Test_le<double>(Context);
-                    break;
-                }
+        static void FlushStack(VMCachedStack& Stack) noexcept
+        {
+            Stack.Flush();
+        }
 
-                case Opcode::T::Test_ge_I4:
-                {
-                    Result = Inst_Test_ge<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ge_I8:
-                {
-                    Result = Inst_Test_ge<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ge_U4:
-                {
-                    Result = Inst_Test_ge<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ge_U8:
-                {
-                    Result = Inst_Test_ge<uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ge_F4:
-                {
-                    Result = Inst_Test_ge<float>(Context);
-                    break;
-                }
-                case Opcode::T::Test_ge_F8:
-                {
-                    Result = Inst_Test_ge<double>(Context);
-                    break;
-                }
+        static void FlushStack(VMUncheckedStack& Stack) noexcept
+        {
+            Stack.Flush();
+        }
 
-                case Opcode::T::Test_l_I4:
-                {
-                    Result = Inst_Test_l<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_l_I8:
-                {
-                    Result = Inst_Test_l<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_l_U4:
-                {
-                    Result = Inst_Test_l<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_l_U8:
-                {
-                    Result = Inst_Test_l<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_l_F4:
-                {
-                    Result = Inst_Test_l<float>(Context);
-                    break;
-                }
-                case Opcode::T::Test_l_F8:
-                {
-                    Result = Inst_Test_l<double>(Context);
-                    break;
-                }
+#if M_VM_BLOCK_VERIFY
+        //
+        // Returns instruction count of the verified block at Decoded if the
+        // operand stack has enough values and free space for the whole block,
+        // or 0 to execute the instruction with stack checks. If Fuel is not
+        // nullptr, the block is entered only if it fits, and is charged.
+        //
+        // In a region verified by VMModuleVerifier, the function bounds of
+        // the first instruction are checked instead, and while they hold
+        // (FunctionChecked), each instruction is entered as a block of its
+        // own without checks. Calls and rets have no function bounds, so the
+        // instruction after them is checked again. So is the instruction
+        // after a write to bytecode (FunctionGeneration is the code generation
+        // of the check): the region is verified again and may have new bounds.
+        //
 
-                case Opcode::T::Test_g_I4:
-                {
-                    Result = Inst_Test_g<int32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_g_I8:
-                {
-                    Result = Inst_Test_g<int64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_g_U4:
-                {
-                    Result = Inst_Test_g<uint32_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_g_U8:
-                {
-                    Result = Inst_Test_g<uint64_t>(Context);
-                    break;
-                }
-                case Opcode::T::Test_g_F4:
-                {
-                    Result = Inst_Test_g<float>(Context);
-                    break;
-                }
-                case Opcode::T::Test_g_F8:
+        uint32_t EnterBlock(const VMExecutionContext& Context, const DecodedInstruction*& Decoded, const VMCachedStack& Stack, uint64_t* Fuel, bool& FunctionChecked, uint64_t& FunctionGeneration)
+        {
+            if (FunctionChecked &&
+                FunctionGeneration != MemoryManager_.CodeGeneration())
+                FunctionChecked = false;
+
+            if (Decoded->FunctionMode != VMBlockVerifier::ModeKey(Context.Mode))
+            {
+                FunctionChecked = false;
+            }
+            else if (FunctionChecked ||
+                (FunctionChecked = Stack.HasCapacity(Decoded->FunctionPopSize, Decoded->FunctionPushSize)))
+            {
+                FunctionGeneration = MemoryManager_.CodeGeneration();
+
+                if (Fuel)
                 {
-                    Result = Inst_Test_g<double>(Context);
-                    break;
+                    if (!*Fuel)
+                        return 0;
+
+                    (*Fuel)--;
                 }
 
+                return 1;
+            }
+
+            if (Decoded->BlockMode != VMBlockVerifier::ModeKey(Context.Mode))
+                Decoded = DecodeCache_.VerifyBlock(Decoded, Context.Mode);
+
+            if (!Decoded->BlockLength ||
+                !Stack.HasCapacity(Decoded->BlockPopSize, Decoded->BlockPushSize))
+                return 0;
+
+            if (Fuel)
+            {
+                if (*Fuel < Decoded->BlockLength)
+                    return 0;
+
+                *Fuel -= Decoded->BlockLength;
+            }
+
+            return Decoded->BlockLength;
+        }
+#endif
+
+        //
+        // Tests that the superinstruction at Decoded may be dispatched. It must
+        // fit in the remaining step count and in the rest of the current
+        // verified block (fused handlers use stack checks), and a trace sink
+        // must see each instruction. Outside a verified block, it must fit in
+        // Fuel (if not nullptr), which is charged.
+        //
+
+        static bool CanFuse(const VMExecutionContext& Context, const DecodedInstruction& Decoded, int RemainingCount, uint32_t& BlockRemaining, uint64_t* Fuel)
+        {
+            if (!Decoded.Fused ||
+                Decoded.FusedCount > RemainingCount)
+                return false;
+
+            if (TTracePolicy::TraceEnabled && Context.TraceSink)
+                return false;
+
+            if (BlockRemaining)
+            {
+                if (BlockRemaining < Decoded.FusedCount)
+                    return false;
+
+                BlockRemaining -= Decoded.FusedCount;
+            }
+            else if (Fuel)
+            {
+                if (*Fuel < Decoded.FusedCount)
+                    return false;
+
+                *Fuel -= Decoded.FusedCount;
+            }
+
+            return true;
+        }
+
+        //
+        // Charges an instruction executed outside verified blocks. Returns
+        // false with HaltEvent::T::OutOfFuel if Fuel is used up.
+        //
 
-                case Opcode::T::Br_I1:
-                {
-                    int8_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Br_I2:
-                {
-                    int16_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Br_I4:
-                {
-                    int32_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br(Offset, Context);
-                    break;
-                }
+        bool ChargeFuel(uint64_t& Fuel)
+        {
+            if (!Fuel)
+            {
+                Event_.Event = HaltEvent::T::OutOfFuel;
+                return false;
+            }
 
-                case Opcode::T::Br_z_I1:
-                {
-                    int8_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br_z_Template(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Br_z_I2:
-                {
-                    int16_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br_z_Template(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Br_z_I4:
-                {
-                    int32_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br_z_Template(Offset, Context);
-                    break;
-                }
+            Fuel--;
 
-                case Opcode::T::Br_nz_I1:
-                {
-                    int8_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br_nz_Template(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Br_nz_I2:
-                {
-                    int16_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br_nz_Template(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Br_nz_I4:
-                {
-                    int32_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Br_nz_Template(Offset, Context);
-                    break;
-                }
+            return true;
+        }
 
-                case Opcode::T::Call_I1:
-                {
-                    int8_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Call(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Call_I2:
-                {
-                    int16_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Call(Offset, Context);
-                    break;
-                }
-                case Opcode::T::Call_I4:
-                {
-                    int32_t Offset{};
-                    DASSERT(Op.Operand(0, Offset));
-                    Result = Inst_Call(Offset, Context);
-                    break;
-                }
+        //
+        // Called by dispatch loops of ExecuteUntilEvent() after instructions
+        // which use VM_EVENT() (call, ret and vmcall). Returns true to leave
+        // the loop, with Event_.Event set unless the chunk of Count steps is
+        // done.
+        //
 
-                case Opcode::T::Ret:
-                {
-                    Result = Inst_Ret(Context);
-                    break;
-                }
-                case Opcode::T::Nop:
-                {
-                    break; // do nothing
-                }
-                case Opcode::T::Bp:
-                {
-                    Result = Inst_Bp(Context);
-                    break;
-                }
+        bool CheckEvent(const VMExecutionContext& Context, const DecodedInstruction& Decoded, int Count, int StepCount)
+        {
+            auto Code = Decoded.Op.Opcode();
 
-                case Opcode::T::Inv:
-                {
-                    Result = Inst_Inv(Context);
-                    break;
-                }
+            if (Code == Opcode::T::Vmcall)
+            {
+                Event_.Event = HaltEvent::T::Vmcall;
+                return true;
+            }
 
-                case Opcode::T::Ldvmsr:
-                {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Ldvmsr(Context, Operand1);
-                    break;
-                }
-                case Opcode::T::Stvmsr:
+            if (Code == Opcode::T::Ret)
+            {
+                // Popped a shadow frame pushed before entry
+                if (Context.ShadowStack.TopOffset() > Event_.ShadowStackTop)
                 {
-                    uint16_t Operand1{};
-                    DASSERT(Op.Operand(0, Operand1));
-                    Result = Inst_Stvmsr(Context, Operand1);
-                    break;
+                    Event_.Event = HaltEvent::T::Return;
+                    return true;
                 }
 
-                case Opcode::T::Vmcall:
-                case Opcode::T::Vmxthrow:
-                    break;
+                return false;
+            }
 
-                default:
-                {
-                    DASSERT(false);
-                }
+            return CheckBudget(Count, StepCount);
+        }
 
-                }
+        //
+        // Called by dispatch loops of ExecuteUntilEvent() after a backward
+        // branch, and by CheckEvent() after a call.
+        //
 
-                if (Context.ExceptionState != ExceptionState::T::None)
+        bool CheckBudget(int Count, int StepCount)
+        {
+            if (StepCount >= Count)
+                return true;
+
+            if (Event_.Deadline != std::chrono::steady_clock::time_point() &&
+                --Event_.ClockCountdown == 0)
+            {
+                Event_.ClockCountdown = ClockCheckInterval;
+
+                if (std::chrono::steady_clock::now() >= Event_.Deadline)
                 {
-                    break;
+                    Event_.Event = HaltEvent::T::TimeBudget;
+                    return true;
                 }
+            }
 
-                Context.PrevIP = Context.IP;
-                Context.IP = Context.NextIP;
-                StepCount++;
+            return false;
+        }
+
+#if M_VM_JIT
+        //
+        // Called by dispatch loops after a control transfer to Context.IP.
+        // Profiles targets of calls and backward branches, and returns true if
+        // compiled code at the target may run.
+        //
+
+        bool JitTransfer(const VMExecutionContext& Context, const DecodedInstruction& Decoded, const OperandStack& Stack)
+        {
+            auto Opcode = Decoded.Op.Opcode();
+
+            if (Opcode == Opcode::T::Call_I1 ||
+                Opcode == Opcode::T::Call_I2 ||
+                Opcode == Opcode::T::Call_I4 ||
+                (Context.IP <= Context.PrevIP && Opcode != Opcode::T::Ret))
+            {
+                Jit_.Profile(Context.IP, Context.Mode, DecodeCache_.IsVerified(Context.IP, Context.Mode));
             }
-            while (FetchSize);
 
-            printf(" ==> VM Returned, Step %d\n\n", StepCount);
+            if (Context.FetchedPrefix)
+                return false;
 
-            return StepCount;
+            auto Entry = Jit_.Lookup(Context.IP, Context.Mode);
+            return Entry && CanRunCompiled(Context, *Entry, Stack);
+        }
+
+        //
+        // Tests that compiled Entry may run at Context.IP with the operand
+        // stack Stack. Code compiled without stack checks (JitEntry::Verified)
+        // runs only if the function bounds of the instruction at Context.IP
+        // hold (see DecodedInstruction::FunctionMode).
+        //
+
+        template <typename TStack>
+        bool CanRunCompiled(const VMExecutionContext& Context, const JitEntry& Entry, const TStack& Stack) const
+        {
+            if (!Entry.Verified)
+                return true;
+
+            auto Decoded = DecodeCache_.Find(Context.IP);
+
+            return Decoded &&
+                Decoded->FunctionMode == VMBlockVerifier::ModeKey(Context.Mode) &&
+                Decoded->FunctionPushSize <= Stack.TopOffset() &&
+                Decoded->FunctionPopSize <= Stack.Limit() - Stack.Top();
         }
 
+        //
+        // Runs compiled code at Context.IP for at most Count steps and
+        // returns the step count. Context is updated as if the instructions
+        // were interpreted.
+        //
+
+        static int RunCompiled(VMExecutionContext& Context, const JitEntry& Entry, int Count)
+        {
+            auto& Stack = Context.Stack;
 
-    private:
+            JitFrame Frame{};
+            Frame.StackBase = Stack.Top() - Stack.TopOffset();
+            Frame.StackLimit = Stack.Limit();
+            Frame.StackTop = Stack.Top();
+            Frame.Budget = Count;
+            Frame.IP = Context.IP;
+            Frame.PrevIP = Context.PrevIP;
+
+            VMJit::Run(Entry, Frame);
+
+            int StepCount = Count - Frame.Budget;
+            if (StepCount)
+            {
+                bool Result = Stack.SetTopOffset(static_cast<uint32_t>(Frame.StackTop - Frame.StackBase));
+                DASSERT(Result);
+
+                Context.PrevIP = Frame.PrevIP;
+                Context.IP = Frame.IP;
+                Context.NextIP = Frame.IP;
+            }
+
+            return StepCount;
+        }
+#endif
+
+        static void TraceInstruction(const VMExecutionContext& Context, const DecodedInstruction& Decoded)
+        {
+            Trace(Context, TraceEventType::T::Instruction, &Decoded.Op, Decoded.Length);
+        }
 
         //
         // Instruction templates.
         //
 
+        //
+        // Integer arithmetic of Inst_Add(), Inst_Sub(), Inst_Mul() and
+        // Inst_Neg(). With std::true_type (TCheckOverflow), the result goes
+        // through Integer<T> and overflow raises IntegerOverflow; with
+        // std::false_type it wraps around and Integer<T> is not instantiated.
+        // (Tag dispatch, as the toolset has no if constexpr.)
+        //
+
+        template <typename T>
+        inline static bool CheckedValue(VMExecutionContext& Context, const Integer<T>& Checked, T& Value)
+        {
+            ExceptionState::T  Exception = IntegerStateToException(Checked.State(), InstructionPrefixBits::T::CheckOverflow);
+            if (Exception != ExceptionState::T::None)
+            {
+                RaiseException(Context, Exception);
+                return false;
+            }
+
+            Value = Checked.Value();
+            return true;
+        }
+
+        template <typename T>
+        inline static bool IntegerAdd(VMExecutionContext& Context, T Op1, T Op2, T& Value, std::true_type)
+        {
+            return CheckedValue(Context, Integer<T>(Op1) + Integer<T>(Op2), Value);
+        }
+
+        template <typename T>
+        inline static bool IntegerAdd(VMExecutionContext&, T Op1, T Op2, T& Value, std::false_type)
+        {
+            using TUnsigned = std::make_unsigned_t<T>;
+            Value = static_cast<T>(static_cast<TUnsigned>(Op1) + static_cast<TUnsigned>(Op2));
+            return true;
+        }
+
+        template <typename T>
+        inline static bool IntegerSub(VMExecutionContext& Context, T Op1, T Op2, T& Value, std::true_type)
+        {
+            return CheckedValue(Context, Integer<T>(Op1) - Integer<T>(Op2), Value);
+        }
+
+        template <typename T>
+        inline static bool IntegerSub(VMExecutionContext&, T Op1, T Op2, T& Value, std::false_type)
+        {
+            using TUnsigned = std::make_unsigned_t<T>;
+            Value = static_cast<T>(static_cast<TUnsigned>(Op1) - static_cast<TUnsigned>(Op2));
+            return true;
+        }
+
+        template <typename T>
+        inline static bool IntegerMul(VMExecutionContext& Context, T Op1, T Op2, T& Value, std::true_type)
+        {
+            return CheckedValue(Context, Integer<T>(Op1) * Integer<T>(Op2), Value);
+        }
+
+        template <typename T>
+        inline static bool IntegerMul(VMExecutionContext&, T Op1, T Op2, T& Value, std::false_type)
+        {
+            using TUnsigned = std::make_unsigned_t<T>;
+            Value = static_cast<T>(static_cast<TUnsigned>(Op1) * static_cast<TUnsigned>(Op2));
+            return true;
+        }
+
+        template <typename T>
+        inline static bool IntegerNeg(VMExecutionContext& Context, T Op1, T& Value, std::true_type)
+        {
+            return CheckedValue(Context, -Integer<T>(Op1), Value);
+        }
+
+        template <typename T>
+        inline static bool IntegerNeg(VMExecutionContext&, T Op1, T& Value, std::false_type)
+        {
+            using TUnsigned = std::make_unsigned_t<T>;
+            Value = static_cast<T>(static_cast<TUnsigned>(0) - static_cast<TUnsigned>(Op1));
+            return true;
+        }
+
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value, bool> = true>
-            inline static bool Inst_Add(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            std::enable_if_t<std::is_integral<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Add(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = Integer<T>(Op1) + Integer<T>(Op2);
+            T Value{};
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
+            if (!IntegerAdd<T>(Context, Op1, Op2, Value, std::integral_constant<bool, TCheckOverflow>()))
                 return false;
-            }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1214,13 +1282,14 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Add(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Add(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1228,7 +1297,7 @@ namespace VM_NAMESPACE
 
             auto Value = Op1 + Op2;
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1239,28 +1308,26 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value, bool> = true>
-            inline static bool Inst_Sub(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            std::enable_if_t<std::is_integral<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Sub(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = Integer<T>(Op1) - Integer<T>(Op2);
+            T Value{};
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
+            if (!IntegerSub<T>(Context, Op1, Op2, Value, std::integral_constant<bool, TCheckOverflow>()))
                 return false;
-            }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1271,13 +1338,14 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Sub(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Sub(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1285,7 +1353,7 @@ namespace VM_NAMESPACE
 
             auto Value = Op1 - Op2;
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1296,28 +1364,26 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value, bool> = true>
-            inline static bool Inst_Mul(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            std::enable_if_t<std::is_integral<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Mul(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = Integer<T>(Op1) * Integer<T>(Op2);
+            T Value{};
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
+            if (!IntegerMul<T>(Context, Op1, Op2, Value, std::integral_constant<bool, TCheckOverflow>()))
                 return false;
-            }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1328,13 +1394,14 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Mul(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Mul(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1342,7 +1409,7 @@ namespace VM_NAMESPACE
 
             auto Value = Op1 * Op2;
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1353,13 +1420,15 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Mulh(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Mulh(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1368,14 +1437,15 @@ namespace VM_NAMESPACE
             Integer<T> Result;
             Integer<T>(Op1).Multiply(Op2, &Result);
 
-            ExceptionState::T  Exception = IntegerStateToException(Result.State(), Context.FetchedPrefix);
+            ExceptionState::T  Exception = IntegerStateToException(Result.State(),
+                TCheckOverflow ? InstructionPrefixBits::T::CheckOverflow : InstructionPrefixBits::T::None);
             if (Exception != ExceptionState::T::None)
             {
                 RaiseException(Context, Exception);
                 return false;
             }
 
-            if (!Context.Stack.Push(Result.Value()))
+            if (!Stack.Push(Result.Value()))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1386,13 +1456,15 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value, bool> = true>
-            inline static bool Inst_Div(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            std::enable_if_t<std::is_integral<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Div(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1400,14 +1472,15 @@ namespace VM_NAMESPACE
 
             Integer<T> Value = Integer<T>(Op1) / Integer<T>(Op2);
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
+            ExceptionState::T  Exception = IntegerStateToException(Value.State(),
+                TCheckOverflow ? InstructionPrefixBits::T::CheckOverflow : InstructionPrefixBits::T::None);
             if (Exception != ExceptionState::T::None)
             {
                 RaiseException(Context, Exception);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value.Value()))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1418,13 +1491,14 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Div(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Div(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1432,7 +1506,7 @@ namespace VM_NAMESPACE
 
             auto Value = Op1 / Op2;
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1443,13 +1517,15 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value, bool> = true>
-            inline static bool Inst_Mod(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            std::enable_if_t<std::is_integral<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Mod(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1464,14 +1540,15 @@ namespace VM_NAMESPACE
 
             Integer<T> Value = Integer<T>(Op1) % Integer<T>(Op2);
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
+            ExceptionState::T  Exception = IntegerStateToException(Value.State(),
+                TCheckOverflow ? InstructionPrefixBits::T::CheckOverflow : InstructionPrefixBits::T::None);
             if (Exception != ExceptionState::T::None)
             {
                 RaiseException(Context, Exception);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value.Value()))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1482,13 +1559,14 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Mod(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Mod(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1526,7 +1604,7 @@ namespace VM_NAMESPACE
                 Value = -Value;
             }
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1537,13 +1615,15 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Shl(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Shl(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1560,14 +1640,15 @@ namespace VM_NAMESPACE
 
             Integer<T> Value = Integer<T>(Op1) << Integer<T>(Op2);
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
+            ExceptionState::T  Exception = IntegerStateToException(Value.State(),
+                TCheckOverflow ? InstructionPrefixBits::T::CheckOverflow : InstructionPrefixBits::T::None);
             if (Exception != ExceptionState::T::None)
             {
                 RaiseException(Context, Exception);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value.Value()))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1578,13 +1659,14 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Shr(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Shr(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1601,14 +1683,14 @@ namespace VM_NAMESPACE
 
             Integer<T> Value = Integer<T>(Op1) >> Integer<T>(Op2);
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
+            ExceptionState::T  Exception = IntegerStateToException(Value.State(), InstructionPrefixBits::T::None);
             if (Exception != ExceptionState::T::None)
             {
                 RaiseException(Context, Exception);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value.Value()))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1619,28 +1701,22 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_And(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_And(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = Integer<T>(Op1) & Integer<T>(Op2);
+            T Value = Op1 & Op2;
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
-                return false;
-            }
-
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1651,28 +1727,22 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Or(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Or(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = Integer<T>(Op1) | Integer<T>(Op2);
-
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
-                return false;
-            }
+            T Value = Op1 | Op2;
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1683,28 +1753,22 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Xor(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Xor(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{}, Op2{};
 
-            if (!Context.Stack.Pop(&Op2) ||
-                !Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op2) ||
+                !Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = Integer<T>(Op1) ^ Integer<T>(Op2);
-
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
-                return false;
-            }
+            T Value = Op1 ^ Op2;
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1715,27 +1779,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Not(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Not(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = ~Integer<T>(Op1);
-
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
-                return false;
-            }
+            T Value = static_cast<T>(~Op1);
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1746,27 +1804,25 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value, bool> = true>
-            inline static bool Inst_Neg(VMExecutionContext& Context)
+            bool TCheckOverflow,
+            std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Neg(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            Integer<T> Value = -Integer<T>(Op1);
+            T Value{};
 
-            ExceptionState::T  Exception = IntegerStateToException(Value.State(), Context.FetchedPrefix);
-            if (Exception != ExceptionState::T::None)
-            {
-                RaiseException(Context, Exception);
+            if (!IntegerNeg<T>(Context, Op1, Value, std::integral_constant<bool, TCheckOverflow>()))
                 return false;
-            }
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1777,12 +1833,13 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Neg(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Neg(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1790,7 +1847,7 @@ namespace VM_NAMESPACE
 
             T Value = -Op1;
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1802,12 +1859,13 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value, bool> = true>
-            inline static bool Inst_Abs(VMExecutionContext& Context)
+            std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Abs(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1817,7 +1875,7 @@ namespace VM_NAMESPACE
             if (Value.Value() < 0)
                 Value = -Value;
 
-            if (!Context.Stack.Push(Value.Value()))
+            if (!Stack.Push(Value.Value()))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1828,12 +1886,13 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
-            inline static bool Inst_Abs(VMExecutionContext& Context)
+            std::enable_if_t<std::is_floating_point<T>::value, bool> = true,
+            typename TStack>
+            inline static bool Inst_Abs(VMExecutionContext& Context, TStack& Stack)
         {
             T Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1843,7 +1902,7 @@ namespace VM_NAMESPACE
             static_assert(std::is_same<decltype(Value), T>::value,
                 "return type of std::abs() is different");
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1856,12 +1915,13 @@ namespace VM_NAMESPACE
             typename TFloat,	// floating point type
             typename TInteger,	// integer type
             typename = std::enable_if_t<
-            std::is_floating_point<TFloat>::value&& std::is_integral<TInteger>::value>>
-            inline static bool Inst_Cvt2i(VMExecutionContext& Context)
+            std::is_floating_point<TFloat>::value&& std::is_integral<TInteger>::value>,
+            typename TStack>
+            inline static bool Inst_Cvt2i(VMExecutionContext& Context, TStack& Stack)
         {
             TFloat Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1869,7 +1929,7 @@ namespace VM_NAMESPACE
 
             auto Value = static_cast<TInteger>(Op1);
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1882,12 +1942,13 @@ namespace VM_NAMESPACE
             typename TInteger,	// integer type
             typename TFloat,	// floating point type
             typename = std::enable_if_t<
-            std::is_integral<TInteger>::value&& std::is_floating_point<TFloat>::value>>
-            inline static bool Inst_Cvt2f(VMExecutionContext& Context)
+            std::is_integral<TInteger>::value&& std::is_floating_point<TFloat>::value>,
+            typename TStack>
+            inline static bool Inst_Cvt2f(VMExecutionContext& Context, TStack& Stack)
         {
             TInteger Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1895,7 +1956,7 @@ namespace VM_NAMESPACE
 
             auto Value = static_cast<TFloat>(Op1);
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1908,12 +1969,13 @@ namespace VM_NAMESPACE
             typename T1,	// floating point type
             typename T2,	// floating point type
             typename = std::enable_if_t<
-            std::is_floating_point<T1>::value&& std::is_floating_point<T2>::value>>
-            inline static bool Inst_Cvtff(VMExecutionContext& Context)
+            std::is_floating_point<T1>::value&& std::is_floating_point<T2>::value>,
+            typename TStack>
+            inline static bool Inst_Cvtff(VMExecutionContext& Context, TStack& Stack)
         {
             T1 Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1921,7 +1983,7 @@ namespace VM_NAMESPACE
 
             auto Value = static_cast<T2>(Op1);
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1934,12 +1996,13 @@ namespace VM_NAMESPACE
             typename T1,	// integer type
             typename T2,	// integer type
             typename = std::enable_if_t<
-            std::is_integral<T1>::value&& std::is_integral<T2>::value>>
-            inline static bool Inst_Cvt(VMExecutionContext& Context)
+            std::is_integral<T1>::value&& std::is_integral<T2>::value>,
+            typename TStack>
+            inline static bool Inst_Cvt(VMExecutionContext& Context, TStack& Stack)
         {
             T1 Op1{};
 
-            if (!Context.Stack.Pop(&Op1))
+            if (!Stack.Pop(&Op1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1962,7 +2025,7 @@ namespace VM_NAMESPACE
 
             auto Value = static_cast<T2>(static_cast<IntermediateType>(Op1));
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1973,10 +2036,11 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Ldimm(VMExecutionContext& Context, T Value)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Ldimm(VMExecutionContext& Context, TStack& Stack, T Value)
         {
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -1987,8 +2051,9 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Ldarg(VMExecutionContext& Context, T Index, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Ldarg(VMExecutionContext& Context, TStack& Stack, T Index, VMMemoryManager& Memory)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2053,7 +2118,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            if (!Context.Stack.Push(reinterpret_cast<unsigned char*>(Source), Entry.Size))
+            if (!Stack.Push(reinterpret_cast<unsigned char*>(Source), Entry.Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2064,8 +2129,9 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Ldvar(VMExecutionContext& Context, T Index, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Ldvar(VMExecutionContext& Context, TStack& Stack, T Index, VMMemoryManager& Memory)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2130,7 +2196,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            if (!Context.Stack.Push(reinterpret_cast<unsigned char*>(Source), Entry.Size))
+            if (!Stack.Push(reinterpret_cast<unsigned char*>(Source), Entry.Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2141,8 +2207,9 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Starg(VMExecutionContext& Context, T Index, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Starg(VMExecutionContext& Context, TStack& Stack, T Index, VMMemoryManager& Memory)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2211,7 +2278,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            if (!Context.Stack.Pop(TempPtr, Entry.Size))
+            if (!Stack.Pop(TempPtr, Entry.Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2224,8 +2291,9 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Stvar(VMExecutionContext& Context, T Index, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Stvar(VMExecutionContext& Context, TStack& Stack, T Index, VMMemoryManager& Memory)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2294,7 +2362,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            if (!Context.Stack.Pop(TempPtr, Entry.Size))
+            if (!Stack.Pop(TempPtr, Entry.Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2305,32 +2373,34 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Dup_Template(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Dup_Template(VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Dup<uint64_t>(Context);
+                return Inst_Dup<uint64_t>(Context, Stack);
             }
             else
             {
-                return Inst_Dup<uint32_t>(Context);
+                return Inst_Dup<uint32_t>(Context, Stack);
             }
         }
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Dup(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Dup(VMExecutionContext& Context, TStack& Stack)
         {
             T Value{};
-            if (!Context.Stack.PeekFrom(&Value, 0))
+            if (!Stack.PeekFrom(&Value, 0))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             // Push only once
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2339,35 +2409,37 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Dup2_Template(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Dup2_Template(VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Dup2<uint64_t>(Context);
+                return Inst_Dup2<uint64_t>(Context, Stack);
             }
             else
             {
-                return Inst_Dup2<uint32_t>(Context);
+                return Inst_Dup2<uint32_t>(Context, Stack);
             }
         }
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Dup2(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Dup2(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1, Value2{};
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value1) ||
-                !Context.Stack.Push(Value2) ||
-                !Context.Stack.Push(Value1) ||
-                !Context.Stack.Push(Value2))
+            if (!Stack.Push(Value1) ||
+                !Stack.Push(Value2) ||
+                !Stack.Push(Value1) ||
+                !Stack.Push(Value2))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2376,34 +2448,36 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Xch_Template(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Xch_Template(VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Xch<uint64_t>(Context);
+                return Inst_Xch<uint64_t>(Context, Stack);
             }
             else
             {
-                return Inst_Xch<uint32_t>(Context);
+                return Inst_Xch<uint32_t>(Context, Stack);
             }
         }
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Xch(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Xch(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value1) ||
-                !Context.Stack.Pop(&Value2))
+            if (!Stack.Pop(&Value1) ||
+                !Stack.Pop(&Value2))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value1) ||
-                !Context.Stack.Push(Value2))
+            if (!Stack.Push(Value1) ||
+                !Stack.Push(Value2))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2414,8 +2488,9 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Ldargp(VMExecutionContext& Context, T Index)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Ldargp(VMExecutionContext& Context, TStack& Stack, T Index)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2460,8 +2535,8 @@ namespace VM_NAMESPACE
             }
             DASSERT(false); // NOTE: verification needed
 
-            if (!Context.Stack.Push(Entry.Address) ||
-                !Context.Stack.Push(Entry.Size))
+            if (!Stack.Push(Entry.Address) ||
+                !Stack.Push(Entry.Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2472,8 +2547,9 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Ldvarp(VMExecutionContext& Context, T Index)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Ldvarp(VMExecutionContext& Context, TStack& Stack, T Index)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2518,8 +2594,8 @@ namespace VM_NAMESPACE
             }
             DASSERT(false); // NOTE: verification needed
 
-            if (!Context.Stack.Push(Entry.Address) ||
-                !Context.Stack.Push(Entry.Size))
+            if (!Stack.Push(Entry.Address) ||
+                !Stack.Push(Entry.Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2528,18 +2604,27 @@ namespace VM_NAMESPACE
             return true;
         }
 
+        template <
+            typename TPointer,
+            typename = std::enable_if_t<std::is_integral<TPointer>::value>>
+            inline static bool IsGuestAddress32(TPointer Reference)
+        {
+            return !(static_cast<uint64_t>(Reference) & ~0xffffffffull);
+        }
+
         template <
             typename TValue,
-            typename = std::enable_if_t<std::is_integral<TValue>::value>>
-            inline static bool Inst_Ldpv_Template(VMExecutionContext& Context, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<TValue>::value>,
+            typename TStack>
+            inline static bool Inst_Ldpv_Template(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Ldpv<TValue, uint64_t>(Context, Memory);
+                return Inst_Ldpv<TValue, uint64_t>(Context, Stack, Memory);
             }
             else
             {
-                return Inst_Ldpv<TValue, uint32_t>(Context, Memory);
+                return Inst_Ldpv<TValue, uint32_t>(Context, Stack, Memory);
             }
         }
 
@@ -2547,25 +2632,40 @@ namespace VM_NAMESPACE
             typename TValue,
             typename TPointer,
             typename = std::enable_if_t<
-            std::is_integral<TValue>::value&& std::is_integral<TPointer>::value>>
-            inline static bool Inst_Ldpv(VMExecutionContext& Context, VMMemoryManager& Memory)
+            std::is_integral<TValue>::value&& std::is_integral<TPointer>::value>,
+            typename TStack>
+            inline static bool Inst_Ldpv(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             TPointer Reference{};
             TValue Value{};
 
-            if (!Context.Stack.Pop(&Reference))
+            if (!Stack.Pop(&Reference))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            if (Memory.Read(Reference, sizeof(TValue), reinterpret_cast<uint8_t*>(&Value)) != sizeof(TValue))
+            // Guest memory may alias the operand stack (and may fault)
+            FlushStack(Stack);
+
+            if (Memory.IsAddressSpaceGuarded())
+            {
+                if (!IsGuestAddress32(Reference))
+                {
+                    RaiseException(Context, ExceptionState::T::InvalidAccess);
+                    return false;
+                }
+
+                // Fault is handled by RunDispatch()
+                Value = Memory.LoadUnchecked<TValue>(static_cast<uint32_t>(Reference));
+            }
+            else if (Memory.Read(Reference, sizeof(TValue), reinterpret_cast<uint8_t*>(&Value)) != sizeof(TValue))
             {
                 RaiseException(Context, ExceptionState::T::InvalidAccess);
                 return false;
             }
 
-            if (!Context.Stack.Push(Value))
+            if (!Stack.Push(Value))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2576,16 +2676,17 @@ namespace VM_NAMESPACE
 
         template <
             typename TValue,
-            typename = std::enable_if_t<std::is_integral<TValue>::value>>
-            inline static bool Inst_Stpv_Template(VMExecutionContext& Context, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<TValue>::value>,
+            typename TStack>
+            inline static bool Inst_Stpv_Template(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Stpv<TValue, uint64_t>(Context, Memory);
+                return Inst_Stpv<TValue, uint64_t>(Context, Stack, Memory);
             }
             else
             {
-                return Inst_Stpv<TValue, uint32_t>(Context, Memory);
+                return Inst_Stpv<TValue, uint32_t>(Context, Stack, Memory);
             }
         }
 
@@ -2593,20 +2694,35 @@ namespace VM_NAMESPACE
             typename TValue,
             typename TPointer,
             typename = std::enable_if_t<
-            std::is_integral<TValue>::value&& std::is_integral<TPointer>::value>>
-            inline static bool Inst_Stpv(VMExecutionContext& Context, VMMemoryManager& Memory)
+            std::is_integral<TValue>::value&& std::is_integral<TPointer>::value>,
+            typename TStack>
+            inline static bool Inst_Stpv(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             TPointer Reference{};
             TValue Value{};
 
-            if (!Context.Stack.Pop(&Value) ||
-                !Context.Stack.Pop(&Reference))
+            if (!Stack.Pop(&Value) ||
+                !Stack.Pop(&Reference))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
-            if (Memory.Write(Reference, sizeof(TValue), reinterpret_cast<uint8_t*>(&Value)) != sizeof(TValue))
+            // Guest memory may alias the operand stack (and may fault)
+            FlushStack(Stack);
+
+            if (Memory.IsAddressSpaceGuarded())
+            {
+                if (!IsGuestAddress32(Reference))
+                {
+                    RaiseException(Context, ExceptionState::T::InvalidAccess);
+                    return false;
+                }
+
+                // Fault is handled by RunDispatch()
+                Memory.StoreUnchecked<TValue>(static_cast<uint32_t>(Reference), Value);
+            }
+            else if (Memory.Write(Reference, sizeof(TValue), reinterpret_cast<uint8_t*>(&Value)) != sizeof(TValue))
             {
                 RaiseException(Context, ExceptionState::T::InvalidAccess);
                 return false;
@@ -2615,33 +2731,38 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Ppcpy_Template(VMExecutionContext& Context, VMMemoryManager& Memory)
+        template <typename TStack>
+        inline static bool Inst_Ppcpy_Template(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             if (IsAddress64Bit(Context))
             {
-                return Inst_Ppcpy<int64_t>(Context, Memory);
+                return Inst_Ppcpy<int64_t>(Context, Stack, Memory);
             }
             else
             {
-                return Inst_Ppcpy<int32_t>(Context, Memory);
+                return Inst_Ppcpy<int32_t>(Context, Stack, Memory);
             }
         }
 
         template <
             typename TPointer,
-            typename = std::enable_if_t<std::is_integral<TPointer>::value>>
-            inline static bool Inst_Ppcpy(VMExecutionContext& Context, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<TPointer>::value>,
+            typename TStack>
+            inline static bool Inst_Ppcpy(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             TPointer Dest{}, Source{}, Size{};
 
-            if (!Context.Stack.Pop(&Size) ||
-                !Context.Stack.Pop(&Source) ||
-                !Context.Stack.Pop(&Dest))
+            if (!Stack.Pop(&Size) ||
+                !Stack.Pop(&Source) ||
+                !Stack.Pop(&Dest))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
+            // Guest memory may alias the operand stack (and may fault)
+            FlushStack(Stack);
+
             auto SourceAddress = Memory.HostAddress(Source, Size);
             auto DestAddress = Memory.HostAddress(Dest, Size);
 
@@ -2656,21 +2777,24 @@ namespace VM_NAMESPACE
                 reinterpret_cast<void*>(SourceAddress),
                 Size);
 
+            Memory.NotifyWrite(Dest, Size);
+
             return true;
         }
 
         template <
             typename TValue,
-            typename = std::enable_if_t<std::is_integral<TValue>::value>>
-            inline static bool Inst_Pvfil_Template(VMExecutionContext& Context, VMMemoryManager& Memory)
+            typename = std::enable_if_t<std::is_integral<TValue>::value>,
+            typename TStack>
+            inline static bool Inst_Pvfil_Template(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             if (IsAddress64Bit(Context))
             {
-                return Inst_Pvfil<int64_t, TValue>(Context, Memory);
+                return Inst_Pvfil<int64_t, TValue>(Context, Stack, Memory);
             }
             else
             {
-                return Inst_Pvfil<int32_t, TValue>(Context, Memory);
+                return Inst_Pvfil<int32_t, TValue>(Context, Stack, Memory);
             }
         }
 
@@ -2678,20 +2802,24 @@ namespace VM_NAMESPACE
             typename TPointer,
             typename TValue,
             typename = std::enable_if_t<
-            std::is_integral<TPointer>::value&& std::is_integral<TValue>::value>>
-            inline static bool Inst_Pvfil(VMExecutionContext& Context, VMMemoryManager& Memory)
+            std::is_integral<TPointer>::value&& std::is_integral<TValue>::value>,
+            typename TStack>
+            inline static bool Inst_Pvfil(VMExecutionContext& Context, TStack& Stack, VMMemoryManager& Memory)
         {
             TPointer Dest{}, Count{};
             TValue Value{};
 
-            if (!Context.Stack.Pop(&Count) ||
-                !Context.Stack.Pop(&Value) ||
-                !Context.Stack.Pop(&Dest))
+            if (!Stack.Pop(&Count) ||
+                !Stack.Pop(&Value) ||
+                !Stack.Pop(&Dest))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
+            // Guest memory may alias the operand stack (and may fault)
+            FlushStack(Stack);
+
             size_t Size = Count * sizeof(TValue);
             auto DestAddress = Memory.HostAddress(Dest, Size);
 
@@ -2740,10 +2868,13 @@ namespace VM_NAMESPACE
             }
             }
 
+            Memory.NotifyWrite(Dest, Size);
+
             return true;
         }
 
-        inline static bool Inst_Initarg(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Initarg(VMExecutionContext& Context, TStack&)
         {
             ShadowFrame Frame{};
             if (!Context.ShadowStack.PeekFrom(&Frame, 0))
@@ -2765,7 +2896,8 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Arg(VMExecutionContext& Context, uint32_t Size)
+        template <typename TStack>
+        inline static bool Inst_Arg(VMExecutionContext& Context, TStack& Stack, uint32_t Size)
         {
             if (Size == 0 ||
                 Size > Constants::MaximumSizeSingleArgument)
@@ -2804,7 +2936,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            auto SP = Context.Stack.TopOffset();
+            auto SP = Stack.TopOffset();
             if (!(Frame.ReturnSP >= SP))
             {
                 // Strange SP
@@ -2813,7 +2945,7 @@ namespace VM_NAMESPACE
             }
 
             // Reserve stack
-            if (!Context.Stack.Push(nullptr, Size))
+            if (!Stack.Push(nullptr, Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2822,7 +2954,7 @@ namespace VM_NAMESPACE
             // Add argument entry.
             ArgumentTableEntry Entry{};
             Entry.Size = Size;
-            Entry.Address = Base::IntegerAssertCast<uint32_t>(Context.Stack.TopOffset());
+            Entry.Address = Base::IntegerAssertCast<uint32_t>(Stack.TopOffset());
             if (!Context.ArgumentStack.Push(Entry))
             {
                 RaiseException(Context, ExceptionState::T::InvalidAccess);
@@ -2835,7 +2967,8 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Var(VMExecutionContext& Context, uint32_t Size)
+        template <typename TStack>
+        inline static bool Inst_Var(VMExecutionContext& Context, TStack& Stack, uint32_t Size)
         {
             if (Size == 0 ||
                 Size > Constants::MaximumSizeSingleLocalVariable)
@@ -2874,7 +3007,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            auto SP = Context.Stack.TopOffset();
+            auto SP = Stack.TopOffset();
             if (!(Frame.ReturnSP >= SP))
             {
                 // Strange SP
@@ -2883,7 +3016,7 @@ namespace VM_NAMESPACE
             }
 
             // Reserve stack
-            if (!Context.Stack.Push(nullptr, Size))
+            if (!Stack.Push(nullptr, Size))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2892,7 +3025,7 @@ namespace VM_NAMESPACE
             // Add local variable entry.
             LocalVariableTableEntry Entry{};
             Entry.Size = Size;
-            Entry.Address = Base::IntegerAssertCast<uint32_t>(Context.Stack.TopOffset());
+            Entry.Address = Base::IntegerAssertCast<uint32_t>(Stack.TopOffset());
             if (!Context.LocalVariableStack.Push(Entry))
             {
                 RaiseException(Context, ExceptionState::T::InvalidAccess);
@@ -2905,25 +3038,27 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Dcv_Template(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Dcv_Template(VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Dcv<int64_t>(Context);
+                return Inst_Dcv<int64_t>(Context, Stack);
             }
             else
             {
-                return Inst_Dcv<int32_t>(Context);
+                return Inst_Dcv<int32_t>(Context, Stack);
             }
         }
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Dcv(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Dcv(VMExecutionContext& Context, TStack& Stack)
         {
             T Temp{};
-            if (!Context.Stack.Pop(&Temp))
+            if (!Stack.Pop(&Temp))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2932,25 +3067,27 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Dcvn_Template(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Dcvn_Template(VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Dcvn<int64_t>(Context);
+                return Inst_Dcvn<int64_t>(Context, Stack);
             }
             else
             {
-                return Inst_Dcvn<int32_t>(Context);
+                return Inst_Dcvn<int32_t>(Context, Stack);
             }
         }
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            inline static bool Inst_Dcvn(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value>,
+            typename TStack>
+            inline static bool Inst_Dcvn(VMExecutionContext& Context, TStack& Stack)
         {
             T Count{};
-            if (!Context.Stack.Pop(&Count))
+            if (!Stack.Pop(&Count))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2959,7 +3096,7 @@ namespace VM_NAMESPACE
             T Temp{};
             for (T i = 0; i < Count; i++)
             {
-                if (!Context.Stack.Pop(&Temp))
+                if (!Stack.Pop(&Temp))
                 {
                     RaiseException(Context, ExceptionState::T::StackOverflow);
                     return false;
@@ -2971,20 +3108,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Test_e(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Test_e(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             uint8_t Result = (Value1 == Value2);
-            if (!Context.Stack.Push(Result))
+            if (!Stack.Push(Result))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -2995,20 +3133,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Test_ne(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Test_ne(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             uint8_t Result = (Value1 != Value2);
-            if (!Context.Stack.Push(Result))
+            if (!Stack.Push(Result))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3019,20 +3158,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Test_le(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Test_le(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             uint8_t Result = (Value1 <= Value2);
-            if (!Context.Stack.Push(Result))
+            if (!Stack.Push(Result))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3043,20 +3183,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Test_ge(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Test_ge(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             uint8_t Result = (Value1 >= Value2);
-            if (!Context.Stack.Push(Result))
+            if (!Stack.Push(Result))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3067,20 +3208,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Test_l(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Test_l(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             uint8_t Result = (Value1 < Value2);
-            if (!Context.Stack.Push(Result))
+            if (!Stack.Push(Result))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3091,20 +3233,21 @@ namespace VM_NAMESPACE
 
         template <
             typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>>
-            inline static bool Inst_Test_g(VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<T>::value || std::is_floating_point<T>::value>,
+            typename TStack>
+            inline static bool Inst_Test_g(VMExecutionContext& Context, TStack& Stack)
         {
             T Value1{}, Value2{};
 
-            if (!Context.Stack.Pop(&Value2) ||
-                !Context.Stack.Pop(&Value1))
+            if (!Stack.Pop(&Value2) ||
+                !Stack.Pop(&Value1))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
             }
 
             uint8_t Result = (Value1 > Value2);
-            if (!Context.Stack.Push(Result))
+            if (!Stack.Push(Result))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3113,44 +3256,40 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        template <
-            typename TOffset,
-            typename = std::enable_if_t<std::is_integral<TOffset>::value>>
-            inline static bool Inst_Br(TOffset Offset, VMExecutionContext& Context)
-        {
-            VMPointerType RelativeOffset = Base::SignExtend<VMPointerType>(Offset);
+        //
+        // Branch and call targets are resolved when decoded
+        // (see DecodedInstruction::Target).
+        //
 
-            Context.NextIP += RelativeOffset;
+        template <typename TStack>
+        inline static bool Inst_Br(VMPointerType Target, VMExecutionContext& Context, TStack&)
+        {
+            Context.NextIP = Target;
 
             return true;
         }
 
-        template <
-            typename TOffset,
-            typename = std::enable_if_t<std::is_integral<TOffset>::value>>
-            inline static bool Inst_Br_z_Template(TOffset Offset, VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Br_z_Template(VMPointerType Target, VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Br_z<uint64_t>(Offset, Context);
+                return Inst_Br_z<uint64_t>(Target, Context, Stack);
             }
             else
             {
-                return Inst_Br_z<uint32_t>(Offset, Context);
+                return Inst_Br_z<uint32_t>(Target, Context, Stack);
             }
         }
 
         template <
             typename TCondition,
-            typename TOffset,
-            typename = std::enable_if_t<
-            std::is_integral<TOffset>::value&& std::is_integral<TCondition>::value>>
-            inline static bool Inst_Br_z(TOffset Offset, VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<TCondition>::value>,
+            typename TStack>
+            inline static bool Inst_Br_z(VMPointerType Target, VMExecutionContext& Context, TStack& Stack)
         {
-            VMPointerType RelativeOffset = Base::SignExtend<VMPointerType>(Offset);
-
             TCondition Condition{};
-            if (!Context.Stack.Pop(&Condition))
+            if (!Stack.Pop(&Condition))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3158,38 +3297,33 @@ namespace VM_NAMESPACE
 
             if (!Condition)
             {
-                Context.NextIP += RelativeOffset;
+                Context.NextIP = Target;
             }
 
             return true;
         }
 
-        template <
-            typename TOffset,
-            typename = std::enable_if_t<std::is_integral<TOffset>::value>>
-            inline static bool Inst_Br_nz_Template(TOffset Offset, VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Br_nz_Template(VMPointerType Target, VMExecutionContext& Context, TStack& Stack)
         {
             if (IsStackOper64Bit(Context))
             {
-                return Inst_Br_nz<uint64_t>(Offset, Context);
+                return Inst_Br_nz<uint64_t>(Target, Context, Stack);
             }
             else
             {
-                return Inst_Br_nz<uint32_t>(Offset, Context);
+                return Inst_Br_nz<uint32_t>(Target, Context, Stack);
             }
         }
 
         template <
             typename TCondition,
-            typename TOffset,
-            typename = std::enable_if_t<
-            std::is_integral<TOffset>::value&& std::is_integral<TCondition>::value>>
-            inline static bool Inst_Br_nz(TOffset Offset, VMExecutionContext& Context)
+            typename = std::enable_if_t<std::is_integral<TCondition>::value>,
+            typename TStack>
+            inline static bool Inst_Br_nz(VMPointerType Target, VMExecutionContext& Context, TStack& Stack)
         {
-            VMPointerType RelativeOffset = Base::SignExtend<VMPointerType>(Offset);
-
             TCondition Condition{};
-            if (!Context.Stack.Pop(&Condition))
+            if (!Stack.Pop(&Condition))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3197,21 +3331,17 @@ namespace VM_NAMESPACE
 
             if (!!Condition)
             {
-                Context.NextIP += RelativeOffset;
+                Context.NextIP = Target;
             }
 
             return true;
         }
 
-        template <
-            typename TOffset,
-            typename = std::enable_if_t<std::is_integral<TOffset>::value>>
-            inline static bool Inst_Call(TOffset Offset, VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Call(VMPointerType Target, VMExecutionContext& Context, TStack& Stack)
         {
-            VMPointerType RelativeOffset = Base::SignExtend<VMPointerType>(Offset);
-
             auto ReturnIP = Context.NextIP;
-            if (!Context.Stack.Push(ReturnIP))
+            if (!Stack.Push(ReturnIP))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3221,7 +3351,7 @@ namespace VM_NAMESPACE
             ShadowFrame Frame;
             Frame.ReturnIP = ReturnIP;
             Frame.ReturnSP = Base::IntegerAssertCast
-                <decltype(Frame.ReturnSP)>(Context.Stack.TopOffset());
+                <decltype(Frame.ReturnSP)>(Stack.TopOffset());
             Frame.LVTP = Base::IntegerAssertCast
                 <decltype(Frame.LVTP)>(Context.LocalVariableStack.TopOffset());
             Frame.ATP = 0;
@@ -3233,15 +3363,16 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            Context.NextIP += RelativeOffset;
+            Context.NextIP = Target;
 
             return true;
         }
 
-        inline static bool Inst_Ret(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Ret(VMExecutionContext& Context, TStack& Stack)
         {
             VMPointerType ReturnIP{};
-            if (!Context.Stack.Pop(&ReturnIP))
+            if (!Stack.Pop(&ReturnIP))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3266,20 +3397,35 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Inv(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Inv(VMExecutionContext& Context, TStack&)
         {
             RaiseException(Context, ExceptionState::T::InvalidInstruction);
             return true;
         }
 
-        inline static bool Inst_Bp(VMExecutionContext& Context)
+        template <typename TStack>
+        inline static bool Inst_Bp(VMExecutionContext& Context, TStack&)
         {
             RaiseException(Context, ExceptionState::T::Breakpoint);
             return true;
         }
 
+        //
+        // vmcall is serviced by the host after ExecuteUntilEvent() halts with
+        // HaltEvent::T::Vmcall. Execute() ignores it (TBD).
+        //
+
+        template <typename TStack>
+        inline bool Inst_Vmcall(VMExecutionContext&, TStack&, uint32_t Identifier)
+        {
+            Event_.VmcallId = Identifier;
+            return true;
+        }
+
 
-        inline static bool Inst_Ldvmsr(VMExecutionContext& Context, uint16_t Index)
+        template <typename TStack>
+        inline static bool Inst_Ldvmsr(VMExecutionContext& Context, TStack& Stack, uint16_t Index)
         {
             if (!(0 <= Index && Index < std::size(Context.VMSR)))
             {
@@ -3287,7 +3433,7 @@ namespace VM_NAMESPACE
                 return false;
             }
 
-            if (!Context.Stack.Push(Context.VMSR[Index]))
+            if (!Stack.Push(Context.VMSR[Index]))
             {
                 RaiseException(Context, ExceptionState::T::StackOverflow);
                 return false;
@@ -3296,7 +3442,8 @@ namespace VM_NAMESPACE
             return true;
         }
 
-        inline static bool Inst_Stvmsr(VMExecutionContext& Context, uint16_t Index)
+        template <typename TStack>
+        inline static bool Inst_Stvmsr(VMExecutionContext& Context, TStack& Stack, uint16_t Index)
         {
             if (!(0 <= Index && Index < std::size(Context.VMSR)))
             {
@@ -3308,7 +3455,7 @@ namespace VM_NAMESPACE
             RaiseException(Context, ExceptionState::T::InvalidInstruction);
             return false;
 
-            //if (!Context.Stack.Pop(&Context.VMSR[Index]))
+            //if (!Stack.Pop(&Context.VMSR[Index]))
             //{
             //	RaiseException(Context, ExceptionState::T::StackOverflow);
             //	return false;
@@ -3318,8 +3465,27 @@ namespace VM_NAMESPACE
         }
 
 private:
+        struct EventState
+        {
+            HaltEvent::T Event;
+            uint32_t VmcallId;
+            uint32_t ShadowStackTop;                            //< shadow stack top offset at entry
+            uint32_t ClockCountdown;                            //< budget checks until next deadline check
+            std::chrono::steady_clock::time_point Deadline;
+            bool MeterFuel;
+        };
+
         VMMemoryManager& MemoryManager_;
+        VMDecodeCache DecodeCache_;
+        EventState Event_;                                      //< state of ExecuteUntilEvent()
+#if M_VM_JIT
+        VMJit Jit_;
+        bool JitActive_;    //< ExecuteJit() is running
+#endif
     };
 
+    using VMBytecodeInterpreter = VMBytecodeInterpreterT<
+        std::conditional_t<M_VM_TRACE, SinkTracePolicy, NoTracePolicy>>;
+
 }
 
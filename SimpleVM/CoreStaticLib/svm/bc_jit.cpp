@@ -0,0 +1,733 @@
+#include "vmbase.h"
+#include "bc_jit.h"
+
+#if M_VM_JIT
+
+#include "bc_jit_x64.h"
+#include "bc_verifier.h"
+#include "bc_decoder.h"
+
+#include <cstddef>
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
+#include <windows.h>
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+#include <sys/mman.h>
+#endif
+
+namespace VM_NAMESPACE
+{
+    namespace
+    {
+        using Register = X64Register::T;
+
+        //
+        // Register usage of compiled code.
+        //
+        //  rbx     JitFrame*
+        //  rbp     PrevIP
+        //  r12     operand stack top (host address)
+        //  r13     operand stack base
+        //  r14     operand stack limit
+        //  r15d    remaining step count
+        //  rax, rcx scratch
+        //
+
+        const Register SavedRegisters[] =
+        {
+            Register::Rbx, Register::Rbp, Register::R12, Register::R13, Register::R14, Register::R15,
+        };
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
+        const Register ArgumentRegister0 = Register::Rcx;
+        const Register ArgumentRegister1 = Register::Rdx;
+#else
+        const Register ArgumentRegister0 = Register::Rdi;
+        const Register ArgumentRegister1 = Register::Rsi;
+#endif
+
+        struct TemplateKind
+        {
+            enum T : uint8_t
+            {
+                None,
+                Nop,
+                Ldimm,
+                Binary,
+                Multiply,
+                Not,
+                Neg,
+                Compare,
+                Dup,
+                Xch,
+                Br,
+                Br_z,
+                Br_nz,
+            };
+        };
+
+        struct Template
+        {
+            TemplateKind::T Kind;
+            uint8_t Size;           //< operand size in bytes (immediate size for ldimm and branches)
+            bool Signed;            //< 4-byte result is sign-extended to 8-byte stack slot
+            uint8_t Op;             //< X64AluOp::T or X64Condition::T
+        };
+
+        Template GetTemplate(Opcode::T Opcode) noexcept
+        {
+#define TEMPLATE(_op, _kind, _size, _signed, _x64op) \
+            case Opcode::T::_op: return { TemplateKind::T::_kind, _size, _signed, _x64op };
+
+            switch (Opcode)
+            {
+            TEMPLATE(Nop,           Nop,        0, false, 0)
+
+            TEMPLATE(Ldimm_I1,      Ldimm,      1, true, 0)
+            TEMPLATE(Ldimm_I2,      Ldimm,      2, true, 0)
+            TEMPLATE(Ldimm_I4,      Ldimm,      4, true, 0)
+            TEMPLATE(Ldimm_I8,      Ldimm,      8, true, 0)
+
+            TEMPLATE(Add_I4,        Binary,     4, true, X64AluOp::T::Add)
+            TEMPLATE(Add_I8,        Binary,     8, true, X64AluOp::T::Add)
+            TEMPLATE(Add_U4,        Binary,     4, false, X64AluOp::T::Add)
+            TEMPLATE(Add_U8,        Binary,     8, false, X64AluOp::T::Add)
+            TEMPLATE(Sub_I4,        Binary,     4, true, X64AluOp::T::Sub)
+            TEMPLATE(Sub_I8,        Binary,     8, true, X64AluOp::T::Sub)
+            TEMPLATE(Sub_U4,        Binary,     4, false, X64AluOp::T::Sub)
+            TEMPLATE(Sub_U8,        Binary,     8, false, X64AluOp::T::Sub)
+            TEMPLATE(Mul_I4,        Multiply,   4, true, 0)
+            TEMPLATE(Mul_I8,        Multiply,   8, true, 0)
+            TEMPLATE(Mul_U4,        Multiply,   4, false, 0)
+            TEMPLATE(Mul_U8,        Multiply,   8, false, 0)
+            TEMPLATE(And_X4,        Binary,     4, false, X64AluOp::T::And)
+            TEMPLATE(And_X8,        Binary,     8, false, X64AluOp::T::And)
+            TEMPLATE(Or_X4,         Binary,     4, false, X64AluOp::T::Or)
+            TEMPLATE(Or_X8,         Binary,     8, false, X64AluOp::T::Or)
+            TEMPLATE(Xor_X4,        Binary,     4, false, X64AluOp::T::Xor)
+            TEMPLATE(Xor_X8,        Binary,     8, false, X64AluOp::T::Xor)
+            TEMPLATE(Not_X4,        Not,        4, false, 0)
+            TEMPLATE(Not_X8,        Not,        8, false, 0)
+            TEMPLATE(Neg_I4,        Neg,        4, true, 0)
+            TEMPLATE(Neg_I8,        Neg,        8, true, 0)
+
+            TEMPLATE(Test_e_I4,     Compare,    4, false, X64Condition::T::E)
+            TEMPLATE(Test_e_I8,     Compare,    8, false, X64Condition::T::E)
+            TEMPLATE(Test_ne_I4,    Compare,    4, false, X64Condition::T::NE)
+            TEMPLATE(Test_ne_I8,    Compare,    8, false, X64Condition::T::NE)
+            TEMPLATE(Test_le_I4,    Compare,    4, false, X64Condition::T::LE)
+            TEMPLATE(Test_le_I8,    Compare,    8, false, X64Condition::T::LE)
+            TEMPLATE(Test_le_U4,    Compare,    4, false, X64Condition::T::BE)
+            TEMPLATE(Test_le_U8,    Compare,    8, false, X64Condition::T::BE)
+            TEMPLATE(Test_ge_I4,    Compare,    4, false, X64Condition::T::GE)
+            TEMPLATE(Test_ge_I8,    Compare,    8, false, X64Condition::T::GE)
+            TEMPLATE(Test_ge_U4,    Compare,    4, false, X64Condition::T::AE)
+            TEMPLATE(Test_ge_U8,    Compare,    8, false, X64Condition::T::AE)
+            TEMPLATE(Test_l_I4,     Compare,    4, false, X64Condition::T::L)
+            TEMPLATE(Test_l_I8,     Compare,    8, false, X64Condition::T::L)
+            TEMPLATE(Test_l_U4,     Compare,    4, false, X64Condition::T::B)
+            TEMPLATE(Test_l_U8,     Compare,    8, false, X64Condition::T::B)
+            TEMPLATE(Test_g_I4,     Compare,    4, false, X64Condition::T::G)
+            TEMPLATE(Test_g_I8,     Compare,    8, false, X64Condition::T::G)
+            TEMPLATE(Test_g_U4,     Compare,    4, false, X64Condition::T::A)
+            TEMPLATE(Test_g_U8,     Compare,    8, false, X64Condition::T::A)
+
+            TEMPLATE(Dup,           Dup,        0, false, 0)
+            TEMPLATE(Xch,           Xch,        0, false, 0)
+
+            TEMPLATE(Br_I1,         Br,         1, true, 0)
+            TEMPLATE(Br_I2,         Br,         2, true, 0)
+            TEMPLATE(Br_I4,         Br,         4, true, 0)
+            TEMPLATE(Br_z_I1,       Br_z,       1, true, 0)
+            TEMPLATE(Br_z_I2,       Br_z,       2, true, 0)
+            TEMPLATE(Br_z_I4,       Br_z,       4, true, 0)
+            TEMPLATE(Br_nz_I1,      Br_nz,      1, true, 0)
+            TEMPLATE(Br_nz_I2,      Br_nz,      2, true, 0)
+            TEMPLATE(Br_nz_I4,      Br_nz,      4, true, 0)
+
+            default:
+                break;
+            }
+
+#undef TEMPLATE
+
+            return { TemplateKind::T::None, 0, false, 0 };
+        }
+
+        // Sign-extends Size bytes of zero-extended immediate Value
+        int64_t SignExtendImmediate(uint64_t Value, uint32_t Size) noexcept
+        {
+            switch (Size)
+            {
+            case 1: return static_cast<int8_t>(Value);
+            case 2: return static_cast<int16_t>(Value);
+            case 4: return static_cast<int32_t>(Value);
+            default: return static_cast<int64_t>(Value);
+            }
+        }
+
+        struct CompiledInstruction
+        {
+            Template Info;
+            uint64_t Operand;
+            uint32_t IP;
+            uint32_t NextIP;
+        };
+
+        //
+        // Emits a non-branch template. An operand of Size bytes occupies
+        // max(Size, Slot) bytes of the operand stack; results narrower than
+        // the slot are extended like VMStack::Push() does.
+        //
+
+        void EmitTemplate(VMX64Assembler& Assembler, const CompiledInstruction& Instruction, uint32_t Slot)
+        {
+            const auto& Info = Instruction.Info;
+            const uint32_t Size = Info.Size;
+            const int32_t Width = static_cast<int32_t>(Size > Slot ? Size : Slot);
+
+            auto StoreResult = [&]()
+            {
+                if (Width > static_cast<int32_t>(Size) && Info.Signed)
+                    Assembler.SignExtend32(Register::Rax);
+
+                Assembler.Store(Width, Register::R12, 0, Register::Rax);
+            };
+
+            switch (Info.Kind)
+            {
+            case TemplateKind::T::Nop:
+                break;
+
+            case TemplateKind::T::Ldimm:
+            {
+                int64_t Value = SignExtendImmediate(Instruction.Operand, Size);
+
+                Assembler.Lea(Register::R12, Register::R12, -Width);
+
+                if (Value == static_cast<int32_t>(Value))
+                {
+                    Assembler.StoreImmediate(Width, Register::R12, 0, static_cast<int32_t>(Value));
+                }
+                else
+                {
+                    Assembler.MoveImmediate(Register::Rax, static_cast<uint64_t>(Value));
+                    Assembler.Store(Width, Register::R12, 0, Register::Rax);
+                }
+            }
+            break;
+
+            case TemplateKind::T::Binary:
+            case TemplateKind::T::Multiply:
+                // rax = op1 (below top) op op2 (top)
+                Assembler.Load(Size, Register::Rax, Register::R12, Width);
+
+                if (Info.Kind == TemplateKind::T::Multiply)
+                    Assembler.Imul(Size, Register::Rax, Register::R12, 0);
+                else
+                    Assembler.Alu(static_cast<X64AluOp::T>(Info.Op), Size, Register::Rax, Register::R12, 0);
+
+                Assembler.Lea(Register::R12, Register::R12, Width);
+                StoreResult();
+                break;
+
+            case TemplateKind::T::Not:
+            case TemplateKind::T::Neg:
+                Assembler.Load(Size, Register::Rax, Register::R12, 0);
+
+                if (Info.Kind == TemplateKind::T::Not)
+                    Assembler.Not(Size, Register::Rax);
+                else
+                    Assembler.Neg(Size, Register::Rax);
+
+                StoreResult();
+                break;
+
+            case TemplateKind::T::Compare:
+                // uint8_t result occupies one slot
+                Assembler.Load(Size, Register::Rax, Register::R12, Width);
+                Assembler.Alu(X64AluOp::T::Cmp, Size, Register::Rax, Register::R12, 0);
+                Assembler.SetCondition(static_cast<X64Condition::T>(Info.Op), Register::Rax);
+                Assembler.Lea(Register::R12, Register::R12, Width * 2 - static_cast<int32_t>(Slot));
+                Assembler.Store(Slot, Register::R12, 0, Register::Rax);
+                break;
+
+            case TemplateKind::T::Dup:
+                Assembler.Load(Slot, Register::Rax, Register::R12, 0);
+                Assembler.Lea(Register::R12, Register::R12, -static_cast<int32_t>(Slot));
+                Assembler.Store(Slot, Register::R12, 0, Register::Rax);
+                break;
+
+            case TemplateKind::T::Xch:
+                Assembler.Load(Slot, Register::Rax, Register::R12, 0);
+                Assembler.Load(Slot, Register::Rcx, Register::R12, Slot);
+                Assembler.Store(Slot, Register::R12, 0, Register::Rcx);
+                Assembler.Store(Slot, Register::R12, Slot, Register::Rax);
+                break;
+
+            default:
+                DASSERT(false);
+                break;
+            }
+        }
+    }
+
+    VMJit::VMJit(VMMemoryManager& MemoryManager) :
+        Counters_(), Entries_(), Regions_(), Generation_(MemoryManager.CodeGeneration()),
+        MemoryManager_(MemoryManager)
+    {
+    }
+
+    VMJit::~VMJit()
+    {
+        Flush();
+    }
+
+    void VMJit::Profile(uint64_t Target, uint32_t Mode, bool Verified)
+    {
+        CheckGeneration();
+
+        auto& Counter = Counters_[Key(Target, Mode)];
+        if (Counter < HotThreshold && ++Counter == HotThreshold)
+            Compile(Target, Mode, Verified);
+    }
+
+    const JitEntry* VMJit::Lookup(uint64_t IP, uint32_t Mode)
+    {
+        CheckGeneration();
+
+        auto Iterator = Entries_.find(Key(IP, Mode));
+        if (Iterator == Entries_.end())
+            return nullptr;
+
+        return &Iterator->second;
+    }
+
+    bool VMJit::Compile(uint64_t IP, uint32_t Mode, bool Verified)
+    {
+        CheckGeneration();
+
+        MemoryInfo Info{};
+        if (!MemoryManager_.Query(IP, Info) ||
+            Info.Type != MemoryType::Bytecode ||
+            !(IP - Info.Base < Info.Size))
+            return false;
+
+        // Regions match their blocks after CheckGeneration()
+        auto& Compiled = Regions_.emplace(Info.Base, Region{ Info.Size, Info.Generation, {}, nullptr }).first->second;
+        DASSERT(Compiled.Generation == Info.Generation);
+
+        if (!Info.Image)
+        {
+            auto Bytecode = reinterpret_cast<uint8_t*>(
+                MemoryManager_.HostAddress(Info.Base, static_cast<size_t>(Info.Size)));
+            if (!Bytecode)
+                return false;
+
+            return CompileUnit(IP, Mode, Verified, Info, Bytecode, Entries_, Compiled.Units);
+        }
+
+        //
+        // Compiled code depends on the address of the image only.
+        //
+
+        static const char SharedCodeKind = 0;
+        VMCodeImage::SharedKey SharedKey(&SharedCodeKind, Info.Base, 0);
+
+        auto Shared = std::static_pointer_cast<SharedCode>(Info.Image->Shared(SharedKey, []()
+            {
+                return std::static_pointer_cast<void>(std::make_shared<SharedCode>());
+            }));
+
+        std::lock_guard<std::mutex> Lock(Shared->Mutex);
+
+        if (Shared->Entries.find(Key(IP, Mode)) == Shared->Entries.end() &&
+            !CompileUnit(IP, Mode, Verified, Info, const_cast<uint8_t*>(Info.Image->Data()), Shared->Entries, Shared->Units))
+            return false;
+
+        // Use all units compiled so far
+        Entries_.insert(Shared->Entries.begin(), Shared->Entries.end());
+        Compiled.Shared = Shared;
+
+        return true;
+    }
+
+    bool VMJit::CompileUnit(uint64_t IP, uint32_t Mode, bool Verified, const MemoryInfo& Info, uint8_t* Bytecode,
+        std::map<uint64_t, JitEntry>& Entries, std::vector<Unit>& Units)
+    {
+        using Label = VMX64Assembler::Label;
+
+        const uint32_t Slot =
+            (Mode & ModeBits::T::VMStackOper64Bit) ? sizeof(int64_t) : sizeof(int32_t);
+
+        VMX64Assembler Assembler;
+        Label ExitLabel = Assembler.NewLabel();
+
+        //
+        // Prologue: void Entry(JitFrame* Frame, const void* Target)
+        //
+
+        for (auto Saved : SavedRegisters)
+            Assembler.Push(Saved);
+
+        Assembler.Move(8, Register::Rbx, ArgumentRegister0);
+        Assembler.Load(8, Register::R12, Register::Rbx, offsetof(JitFrame, StackTop));
+        Assembler.Load(8, Register::R13, Register::Rbx, offsetof(JitFrame, StackBase));
+        Assembler.Load(8, Register::R14, Register::Rbx, offsetof(JitFrame, StackLimit));
+        Assembler.Load(4, Register::R15, Register::Rbx, offsetof(JitFrame, Budget));
+        Assembler.Load(4, Register::Rbp, Register::Rbx, offsetof(JitFrame, PrevIP));
+        Assembler.JumpRegister(ArgumentRegister1);
+
+        //
+        // Epilogue. JitFrame::IP is stored by exit stubs.
+        //
+
+        Assembler.Bind(ExitLabel);
+        Assembler.Store(8, Register::Rbx, offsetof(JitFrame, StackTop), Register::R12);
+        Assembler.Store(4, Register::Rbx, offsetof(JitFrame, Budget), Register::R15);
+        Assembler.Store(4, Register::Rbx, offsetof(JitFrame, PrevIP), Register::Rbp);
+
+        for (size_t i = std::size(SavedRegisters); i > 0; i--)
+            Assembler.Pop(SavedRegisters[i - 1]);
+
+        Assembler.Ret();
+
+        //
+        // Blocks.
+        //
+
+        std::map<uint64_t, Label> Blocks;       // block address -> label
+        std::map<uint64_t, Label> Exits;        // exit IP -> stub label
+        std::vector<uint64_t> Worklist;
+        std::vector<uint64_t> Compiled;         // blocks with at least one instruction
+        VMDecodedStream Stream;                 // instructions of current block
+        uint32_t Length = 0;
+
+        auto ExitTo = [&](uint64_t Target)
+        {
+            auto Iterator = Exits.find(Target);
+            if (Iterator != Exits.end())
+                return Iterator->second;
+
+            Label Stub = Assembler.NewLabel();
+            Exits.emplace(Target, Stub);
+            return Stub;
+        };
+
+        auto BlockAt = [&](uint64_t Target)
+        {
+            if (!(Target - Info.Base < Info.Size))
+                return ExitTo(Target);
+
+            auto Iterator = Blocks.find(Target);
+            if (Iterator != Blocks.end())
+                return Iterator->second;
+
+            Label Block = Assembler.NewLabel();
+            Blocks.emplace(Target, Block);
+            Worklist.push_back(Target);
+            return Block;
+        };
+
+        BlockAt(IP);
+
+        while (!Worklist.empty())
+        {
+            uint64_t Address = Worklist.back();
+            Worklist.pop_back();
+
+            Assembler.Bind(Blocks[Address]);
+
+            //
+            // Decode instructions with templates up to the end of the
+            // verified block.
+            //
+
+            std::vector<CompiledInstruction> Block;
+            VMBlockVerifier Verifier(Mode);
+            uint64_t Next = Address;
+            size_t Offset = static_cast<size_t>(Address - Info.Base);
+
+            Stream.Decode(Address, Bytecode + Offset, static_cast<size_t>(Info.Size) - Offset,
+                std::min<size_t>(VMBlockVerifier::MaximumLength, MaximumUnitLength - Length));
+
+            for (size_t i = 0; i < Stream.Count(); i++)
+            {
+                auto Op = static_cast<Opcode::T>(Stream.Opcodes[i]);
+
+                if (!IsCompilable(Op) ||
+                    !Verifier.Append(Op))
+                    break;
+
+                CompiledInstruction Instruction{};
+                Instruction.Info = GetTemplate(Op);
+                Instruction.Operand = Stream.Operands[i];
+                Instruction.IP = static_cast<uint32_t>(Next);
+                Instruction.NextIP = static_cast<uint32_t>(Next + Stream.Lengths[i]);
+                Block.push_back(Instruction);
+
+                Next += Stream.Lengths[i];
+
+                if (Verifier.Ended())
+                    break;
+            }
+
+            if (Block.empty())
+            {
+                Assembler.Jump(ExitTo(Address));
+                continue;
+            }
+
+            Length += static_cast<uint32_t>(Block.size());
+            Compiled.push_back(Address);
+
+            //
+            // Entry checks; the interpreter executes the block if one fails.
+            // Stack bounds of a verified unit were checked when entering it.
+            //
+
+            Label Fail = ExitTo(Address);
+            int32_t BlockLength = static_cast<int32_t>(Block.size());
+
+            Assembler.AluImmediate(X64AluOp::T::Cmp, 4, Register::R15, BlockLength);
+            Assembler.Jump(X64Condition::T::L, Fail);
+
+            if (!Verified && Verifier.PopSize())
+            {
+                Assembler.Lea(Register::Rax, Register::R12, static_cast<int32_t>(Verifier.PopSize()));
+                Assembler.Alu(X64AluOp::T::Cmp, 8, Register::Rax, Register::R14);
+                Assembler.Jump(X64Condition::T::A, Fail);
+            }
+
+            if (!Verified && Verifier.PushSize())
+            {
+                Assembler.Lea(Register::Rax, Register::R12, -static_cast<int32_t>(Verifier.PushSize()));
+                Assembler.Alu(X64AluOp::T::Cmp, 8, Register::Rax, Register::R13);
+                Assembler.Jump(X64Condition::T::B, Fail);
+            }
+
+            Assembler.AluImmediate(X64AluOp::T::Sub, 4, Register::R15, BlockLength);
+
+            //
+            // Body.
+            //
+
+            const auto& Last = Block.back();
+            auto LastKind = Last.Info.Kind;
+            bool EndsWithBranch =
+                LastKind == TemplateKind::T::Br ||
+                LastKind == TemplateKind::T::Br_z ||
+                LastKind == TemplateKind::T::Br_nz;
+
+            for (size_t i = 0; i < Block.size() - (EndsWithBranch ? 1 : 0); i++)
+                EmitTemplate(Assembler, Block[i], Slot);
+
+            Assembler.MoveImmediate(Register::Rbp, Last.IP);
+
+            if (EndsWithBranch)
+            {
+                uint32_t Target = Last.NextIP +
+                    static_cast<uint32_t>(SignExtendImmediate(Last.Operand, Last.Info.Size));
+
+                if (LastKind == TemplateKind::T::Br)
+                {
+                    Assembler.Jump(BlockAt(Target));
+                }
+                else
+                {
+                    // Condition occupies one slot
+                    Assembler.Load(Slot, Register::Rax, Register::R12, 0);
+                    Assembler.Lea(Register::R12, Register::R12, Slot);
+                    Assembler.Test(Slot, Register::Rax, Register::Rax);
+                    Assembler.Jump(
+                        LastKind == TemplateKind::T::Br_z ? X64Condition::T::E : X64Condition::T::NE,
+                        BlockAt(Target));
+                    Assembler.Jump(BlockAt(Last.NextIP));
+                }
+            }
+            else if (Verifier.Ended())
+            {
+                // MaximumLength reached
+                Assembler.Jump(BlockAt(Next));
+            }
+            else
+            {
+                // Next instruction has no template
+                Assembler.Jump(ExitTo(Next));
+            }
+        }
+
+        if (Compiled.empty())
+            return false;
+
+        for (const auto& Exit : Exits)
+        {
+            Assembler.Bind(Exit.second);
+            Assembler.StoreImmediate(4, Register::Rbx, offsetof(JitFrame, IP), static_cast<int32_t>(Exit.first));
+            Assembler.Jump(ExitLabel);
+        }
+
+        if (!Assembler.Finalize())
+        {
+            DASSERT(false);
+            return false;
+        }
+
+        Unit NewUnit{};
+        NewUnit.Code = AllocateCode(Assembler.Code(), NewUnit.Size);
+        if (!NewUnit.Code)
+            return false;
+
+        Units.push_back(NewUnit);
+
+        auto Code = reinterpret_cast<const uint8_t*>(NewUnit.Code);
+
+        for (auto Address : Compiled)
+        {
+            JitEntry Entry{};
+            Entry.Prologue = Code;
+            Entry.Target = Code + Assembler.Offset(Blocks[Address]);
+            Entry.Verified = Verified;
+
+            // Keep entries of units compiled earlier
+            Entries.emplace(Key(Address, Mode), Entry);
+        }
+
+        return true;
+    }
+
+    void VMJit::Run(const JitEntry& Entry, JitFrame& Frame)
+    {
+        using EntryFunction = void (*)(JitFrame*, const void*);
+
+        auto Function = reinterpret_cast<EntryFunction>(const_cast<void*>(Entry.Prologue));
+        Function(&Frame, Entry.Target);
+    }
+
+    bool VMJit::IsCompilable(Opcode::T Opcode) noexcept
+    {
+        return GetTemplate(Opcode).Kind != TemplateKind::T::None;
+    }
+
+    void VMJit::Flush()
+    {
+        for (const auto& Compiled : Regions_)
+        {
+            for (const auto& Code : Compiled.second.Units)
+                FreeCode(Code.Code, Code.Size);
+        }
+
+        Regions_.clear();
+        Entries_.clear();
+        Counters_.clear();
+        Generation_ = MemoryManager_.CodeGeneration();
+    }
+
+    VMJit::SharedCode::~SharedCode()
+    {
+        for (const auto& Compiled : Units)
+            FreeCode(Compiled.Code, Compiled.Size);
+    }
+
+    uint64_t VMJit::Key(uint64_t IP, uint32_t Mode) noexcept
+    {
+        return (IP << 8) | VMBlockVerifier::ModeKey(Mode);
+    }
+
+    void VMJit::CheckGeneration()
+    {
+        if (Generation_ == MemoryManager_.CodeGeneration())
+            return;
+
+        for (auto Iterator = Regions_.begin(); Iterator != Regions_.end(); )
+        {
+            MemoryInfo Info{};
+            if (!MemoryManager_.Query(Iterator->first, Info) ||
+                Info.Type != MemoryType::Bytecode ||
+                Info.Base != Iterator->first ||
+                Info.Size != Iterator->second.Size ||
+                Info.Generation != Iterator->second.Generation)
+            {
+                Iterator = DropRegion(Iterator);
+                continue;
+            }
+
+            ++Iterator;
+        }
+
+        Generation_ = MemoryManager_.CodeGeneration();
+    }
+
+    std::map<uint64_t, VMJit::Region>::iterator VMJit::DropRegion(std::map<uint64_t, Region>::iterator Iterator)
+    {
+        uint64_t Base = Iterator->first;
+        uint64_t End = Base + Iterator->second.Size;
+
+        // Keys are ordered by IP
+        Entries_.erase(Entries_.lower_bound(Key(Base, 0)), Entries_.lower_bound(Key(End, 0)));
+        Counters_.erase(Counters_.lower_bound(Key(Base, 0)), Counters_.lower_bound(Key(End, 0)));
+
+        for (const auto& Code : Iterator->second.Units)
+            FreeCode(Code.Code, Code.Size);
+
+        return Regions_.erase(Iterator);
+    }
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
+    void* VMJit::AllocateCode(const std::vector<uint8_t>& Code, size_t& Size)
+    {
+        Size = (Code.size() + VMMemoryManager::PageMask) & ~static_cast<size_t>(VMMemoryManager::PageMask);
+
+        auto Address = VirtualAlloc(nullptr, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (!Address)
+            return nullptr;
+
+        std::memcpy(Address, Code.data(), Code.size());
+
+        // W^X: the code is never written after this
+        DWORD OldProtect = 0;
+        if (!VirtualProtect(Address, Size, PAGE_EXECUTE_READ, &OldProtect))
+        {
+            VirtualFree(Address, 0, MEM_RELEASE);
+            return nullptr;
+        }
+
+        FlushInstructionCache(GetCurrentProcess(), Address, Size);
+
+        return Address;
+    }
+
+    void VMJit::FreeCode(void* Code, size_t Size)
+    {
+        VirtualFree(Code, 0, MEM_RELEASE);
+    }
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+    void* VMJit::AllocateCode(const std::vector<uint8_t>& Code, size_t& Size)
+    {
+        Size = (Code.size() + VMMemoryManager::PageMask) & ~static_cast<size_t>(VMMemoryManager::PageMask);
+
+        auto Address = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (Address == MAP_FAILED)
+            return nullptr;
+
+        std::memcpy(Address, Code.data(), Code.size());
+
+        // W^X: the code is never written after this
+        if (mprotect(Address, Size, PROT_READ | PROT_EXEC))
+        {
+            munmap(Address, Size);
+            return nullptr;
+        }
+
+        return Address;
+    }
+
+    void VMJit::FreeCode(void* Code, size_t Size)
+    {
+        munmap(Code, Size);
+    }
+#endif
+}
+
+#endif
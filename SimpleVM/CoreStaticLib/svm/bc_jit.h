@@ -0,0 +1,166 @@
+#pragma once
+
+#include "vmbase.h"
+#include "vmmemory.h"
+
+//
+// Baseline JIT.
+//
+// If M_VM_JIT is 1, VMBytecodeInterpreter::ExecuteJit() compiles hot guest
+// code to x86-64 machine code (see VMJit). Requires x86-64 host.
+//
+
+#if !defined(M_VM_JIT)
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__)
+#define M_VM_JIT                    1
+#else
+#define M_VM_JIT                    0
+#endif
+#elif M_VM_JIT && !(defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__))
+#error M_VM_JIT requires x86-64 host
+#endif
+
+namespace VM_NAMESPACE
+{
+    //
+    // State passed to compiled code.
+    //
+
+    struct JitFrame
+    {
+        uint64_t StackBase;     //< host address of operand stack
+        uint64_t StackLimit;    //< host address of operand stack end
+        uint64_t StackTop;      //< host address of operand stack top (in/out)
+        int32_t Budget;         //< remaining step count (in/out)
+        uint32_t IP;            //< IP of the instruction to execute next (out)
+        uint32_t PrevIP;        //< IP of the last executed instruction (in/out)
+    };
+
+    static_assert(
+        std::is_standard_layout<JitFrame>::value,
+        "type is not standard layout");
+
+    struct JitEntry
+    {
+        const void* Prologue;   //< prologue of the compiled unit
+        const void* Target;     //< code of the block at the entry IP
+        bool Verified;          //< compiled without operand stack checks (see VMJit::Compile())
+    };
+
+    class VMJit
+    {
+        //
+        // Baseline template JIT.
+        //
+        // Targets of calls and backward branches are counted by Profile();
+        // a target which reaches HotThreshold is compiled with the code
+        // reachable from it through branches (a unit). Each instruction is
+        // translated by a fixed machine code template working on the operand
+        // stack in memory.
+        //
+        // Compiled code never raises exceptions. Blocks check the step budget
+        // and operand stack bounds once at entry (see VMBlockVerifier), and
+        // leave to the interpreter at the block if a check fails, and before
+        // any instruction without template (calls, guest memory access,
+        // floating point, bp, ...). The interpreter then executes or faults
+        // on the instruction with the exact context state.
+        //
+        // A unit never contains calls or rets, so all of it runs in one call
+        // of a function. In a region which passed VMModuleVerifier, blocks
+        // skip the stack checks; the interpreter enters such a unit only if
+        // the function bounds at the entry IP hold instead.
+        //
+        // Only MemoryType::Bytecode memory is compiled. Code compiled from a
+        // block is dropped when MemoryInfo::Generation of the block changes,
+        // which is checked whenever VMMemoryManager::CodeGeneration() does.
+        //
+        // Units compiled from a VMCodeImage are kept by the image and shared
+        // with every VMJit which runs it at the same address; a target which
+        // becomes hot uses a unit compiled by another VMJit if one exists.
+        //
+
+    public:
+        constexpr static const uint32_t HotThreshold = 64;
+        constexpr static const uint32_t MaximumUnitLength = 1024;  //< instructions compiled per unit
+
+        VMJit(VMMemoryManager& MemoryManager);
+        ~VMJit();
+
+        VMJit(const VMJit&) = delete;
+        VMJit& operator=(const VMJit&) = delete;
+
+        // Counts a control transfer to Target; compiles Target when it becomes hot
+        void Profile(uint64_t Target, uint32_t Mode, bool Verified = false);
+
+        // Compiled entry at IP for Mode (ModeBits::T), or nullptr
+        const JitEntry* Lookup(uint64_t IP, uint32_t Mode);
+
+        //
+        // Compiles code reachable from IP for Mode; returns false if nothing
+        // is compiled. If Verified is true, the region of IP passed
+        // VMModuleVerifier for Mode, and the unit is compiled without stack
+        // checks (JitEntry::Verified) unless IP has a unit already.
+        //
+
+        bool Compile(uint64_t IP, uint32_t Mode, bool Verified = false);
+
+        // Runs compiled code until it leaves to the interpreter
+        static void Run(const JitEntry& Entry, JitFrame& Frame);
+
+        // Tests whether Opcode has a machine code template
+        static bool IsCompilable(Opcode::T Opcode) noexcept;
+
+        void Flush();
+
+    private:
+        struct Unit
+        {
+            void* Code;
+            size_t Size;
+        };
+
+        // Units compiled from a VMCodeImage (see VMCodeImage::Shared())
+        struct SharedCode
+        {
+            ~SharedCode();
+
+            std::mutex Mutex;                                   //< protects Entries and Units
+            std::map<uint64_t, JitEntry> Entries;
+            std::vector<Unit> Units;
+        };
+
+        // Code compiled from a MemoryType::Bytecode block
+        struct Region
+        {
+            uint64_t Size;
+            uint64_t Generation;                                //< MemoryInfo::Generation of the block compiled
+            std::vector<Unit> Units;
+            std::shared_ptr<SharedCode> Shared;                 //< shared code which entries of the region refer to
+        };
+
+        static uint64_t Key(uint64_t IP, uint32_t Mode) noexcept;
+
+        // Compiles code of Info reachable from IP to a new unit of Units
+        static bool CompileUnit(uint64_t IP, uint32_t Mode, bool Verified, const MemoryInfo& Info, uint8_t* Bytecode,
+            std::map<uint64_t, JitEntry>& Entries, std::vector<Unit>& Units);
+
+        // Drops regions whose blocks changed since they were compiled
+        void CheckGeneration();
+
+        // Drops code, entries and counters of the region at Iterator
+        std::map<uint64_t, Region>::iterator DropRegion(std::map<uint64_t, Region>::iterator Iterator);
+
+        //
+        // Host specific.
+        //
+
+        static void* AllocateCode(const std::vector<uint8_t>& Code, size_t& Size);
+        static void FreeCode(void* Code, size_t Size);
+
+        std::map<uint64_t, uint32_t> Counters_;
+        std::map<uint64_t, JitEntry> Entries_;
+        std::map<uint64_t, Region> Regions_;                    //< regions by block base address
+        uint64_t Generation_;
+        VMMemoryManager& MemoryManager_;
+    };
+}
@@ -0,0 +1,284 @@
+#include "vmbase.h"
+#include "bc_jit_x64.h"
+
+namespace VM_NAMESPACE
+{
+    VMX64Assembler::VMX64Assembler() noexcept
+    {
+    }
+
+    VMX64Assembler::Label VMX64Assembler::NewLabel()
+    {
+        Labels_.push_back(-1);
+        return static_cast<Label>(Labels_.size() - 1);
+    }
+
+    void VMX64Assembler::Bind(Label Target)
+    {
+        DASSERT(Target < Labels_.size() && Labels_[Target] < 0);
+        Labels_[Target] = static_cast<int64_t>(Code_.size());
+    }
+
+    bool VMX64Assembler::Finalize()
+    {
+        for (const auto& Fixup : Fixups_)
+        {
+            auto Target = Labels_[Fixup.second];
+            if (Target < 0)
+                return false;
+
+            // rel32 is relative to the end of the jump
+            auto Relative = static_cast<int32_t>(Target - static_cast<int64_t>(Fixup.first + sizeof(int32_t)));
+            Base::ToBytesLe(Relative, &Code_[Fixup.first]);
+        }
+
+        Fixups_.clear();
+
+        return true;
+    }
+
+    size_t VMX64Assembler::Offset(Label Target) const
+    {
+        DASSERT(Target < Labels_.size() && Labels_[Target] >= 0);
+        return static_cast<size_t>(Labels_[Target]);
+    }
+
+    void VMX64Assembler::Push(X64Register::T Register)
+    {
+        EmitRex(false, 0, Register);
+        Emit8(0x50 + (Register & 7));
+    }
+
+    void VMX64Assembler::Pop(X64Register::T Register)
+    {
+        EmitRex(false, 0, Register);
+        Emit8(0x58 + (Register & 7));
+    }
+
+    void VMX64Assembler::Ret()
+    {
+        Emit8(0xc3);
+    }
+
+    void VMX64Assembler::Load(uint32_t Size, X64Register::T Destination, X64Register::T Base, int32_t Displacement)
+    {
+        // mov r, r/m
+        EmitRex(Size == 8, Destination, Base);
+        Emit8(0x8b);
+        EmitModRmMemory(Destination, Base, Displacement);
+    }
+
+    void VMX64Assembler::Store(uint32_t Size, X64Register::T Base, int32_t Displacement, X64Register::T Source)
+    {
+        // mov r/m, r
+        EmitRex(Size == 8, Source, Base);
+        Emit8(0x89);
+        EmitModRmMemory(Source, Base, Displacement);
+    }
+
+    void VMX64Assembler::StoreImmediate(uint32_t Size, X64Register::T Base, int32_t Displacement, int32_t Immediate)
+    {
+        // mov r/m, imm32 (sign-extended if Size is 8)
+        EmitRex(Size == 8, 0, Base);
+        Emit8(0xc7);
+        EmitModRmMemory(0, Base, Displacement);
+        Emit32(static_cast<uint32_t>(Immediate));
+    }
+
+    void VMX64Assembler::Move(uint32_t Size, X64Register::T Destination, X64Register::T Source)
+    {
+        EmitRex(Size == 8, Source, Destination);
+        Emit8(0x89);
+        EmitModRmRegister(Source, Destination);
+    }
+
+    void VMX64Assembler::MoveImmediate(X64Register::T Destination, uint64_t Immediate)
+    {
+        if (Immediate <= 0xffffffffull)
+        {
+            // mov r32, imm32 (zero-extended)
+            EmitRex(false, 0, Destination);
+            Emit8(0xb8 + (Destination & 7));
+            Emit32(static_cast<uint32_t>(Immediate));
+        }
+        else if (static_cast<int64_t>(Immediate) == static_cast<int32_t>(Immediate))
+        {
+            // mov r/m64, imm32 (sign-extended)
+            EmitRex(true, 0, Destination);
+            Emit8(0xc7);
+            EmitModRmRegister(0, Destination);
+            Emit32(static_cast<uint32_t>(Immediate));
+        }
+        else
+        {
+            // mov r64, imm64
+            EmitRex(true, 0, Destination);
+            Emit8(0xb8 + (Destination & 7));
+            Emit64(Immediate);
+        }
+    }
+
+    void VMX64Assembler::SignExtend32(X64Register::T Register)
+    {
+        // movsxd r64, r/m32
+        EmitRex(true, Register, Register);
+        Emit8(0x63);
+        EmitModRmRegister(Register, Register);
+    }
+
+    void VMX64Assembler::Lea(X64Register::T Destination, X64Register::T Base, int32_t Displacement)
+    {
+        EmitRex(true, Destination, Base);
+        Emit8(0x8d);
+        EmitModRmMemory(Destination, Base, Displacement);
+    }
+
+    void VMX64Assembler::Alu(X64AluOp::T Op, uint32_t Size, X64Register::T Destination, X64Register::T Source)
+    {
+        // op r, r/m
+        EmitRex(Size == 8, Destination, Source);
+        Emit8(static_cast<uint8_t>((Op << 3) + 3));
+        EmitModRmRegister(Destination, Source);
+    }
+
+    void VMX64Assembler::Alu(X64AluOp::T Op, uint32_t Size, X64Register::T Destination, X64Register::T Base, int32_t Displacement)
+    {
+        // op r, r/m
+        EmitRex(Size == 8, Destination, Base);
+        Emit8(static_cast<uint8_t>((Op << 3) + 3));
+        EmitModRmMemory(Destination, Base, Displacement);
+    }
+
+    void VMX64Assembler::AluImmediate(X64AluOp::T Op, uint32_t Size, X64Register::T Destination, int32_t Immediate)
+    {
+        // op r/m, imm32
+        EmitRex(Size == 8, 0, Destination);
+        Emit8(0x81);
+        EmitModRmRegister(Op, Destination);
+        Emit32(static_cast<uint32_t>(Immediate));
+    }
+
+    void VMX64Assembler::Imul(uint32_t Size, X64Register::T Destination, X64Register::T Base, int32_t Displacement)
+    {
+        // imul r, r/m
+        EmitRex(Size == 8, Destination, Base);
+        Emit8(0x0f);
+        Emit8(0xaf);
+        EmitModRmMemory(Destination, Base, Displacement);
+    }
+
+    void VMX64Assembler::Not(uint32_t Size, X64Register::T Register)
+    {
+        EmitRex(Size == 8, 0, Register);
+        Emit8(0xf7);
+        EmitModRmRegister(2, Register);
+    }
+
+    void VMX64Assembler::Neg(uint32_t Size, X64Register::T Register)
+    {
+        EmitRex(Size == 8, 0, Register);
+        Emit8(0xf7);
+        EmitModRmRegister(3, Register);
+    }
+
+    void VMX64Assembler::Test(uint32_t Size, X64Register::T Register1, X64Register::T Register2)
+    {
+        EmitRex(Size == 8, Register2, Register1);
+        Emit8(0x85);
+        EmitModRmRegister(Register2, Register1);
+    }
+
+    void VMX64Assembler::SetCondition(X64Condition::T Condition, X64Register::T Register)
+    {
+        // Without REX, 8-bit registers 4-7 are ah, ch, dh, bh
+        DASSERT(Register <= X64Register::T::Rbx);
+
+        // setcc r/m8
+        Emit8(0x0f);
+        Emit8(0x90 + Condition);
+        EmitModRmRegister(0, Register);
+
+        // movzx r32, r/m8
+        Emit8(0x0f);
+        Emit8(0xb6);
+        EmitModRmRegister(Register, Register);
+    }
+
+    void VMX64Assembler::Jump(Label Target)
+    {
+        Emit8(0xe9);
+        EmitRel32(Target);
+    }
+
+    void VMX64Assembler::Jump(X64Condition::T Condition, Label Target)
+    {
+        Emit8(0x0f);
+        Emit8(0x80 + Condition);
+        EmitRel32(Target);
+    }
+
+    void VMX64Assembler::JumpRegister(X64Register::T Register)
+    {
+        EmitRex(false, 0, Register);
+        Emit8(0xff);
+        EmitModRmRegister(4, Register);
+    }
+
+    void VMX64Assembler::Emit8(uint8_t Value)
+    {
+        Code_.push_back(Value);
+    }
+
+    void VMX64Assembler::Emit32(uint32_t Value)
+    {
+        uint8_t Bytes[sizeof(Value)];
+        Base::ToBytesLe(Value, Bytes);
+        Code_.insert(Code_.end(), Bytes, Bytes + sizeof(Bytes));
+    }
+
+    void VMX64Assembler::Emit64(uint64_t Value)
+    {
+        uint8_t Bytes[sizeof(Value)];
+        Base::ToBytesLe(Value, Bytes);
+        Code_.insert(Code_.end(), Bytes, Bytes + sizeof(Bytes));
+    }
+
+    void VMX64Assembler::EmitRex(bool Wide, uint8_t Reg, uint8_t Base)
+    {
+        uint8_t Rex = 0x40;
+
+        if (Wide)
+            Rex |= 0x08;    // REX.W
+        if (Reg & 8)
+            Rex |= 0x04;    // REX.R
+        if (Base & 8)
+            Rex |= 0x01;    // REX.B
+
+        if (Rex != 0x40)
+            Emit8(Rex);
+    }
+
+    void VMX64Assembler::EmitModRmMemory(uint8_t Reg, X64Register::T Base, int32_t Displacement)
+    {
+        // mod=10 (disp32); rsp and r12 as base need SIB
+        Emit8(static_cast<uint8_t>(0x80 | ((Reg & 7) << 3) | (Base & 7)));
+
+        if ((Base & 7) == X64Register::T::Rsp)
+            Emit8(0x24);
+
+        Emit32(static_cast<uint32_t>(Displacement));
+    }
+
+    void VMX64Assembler::EmitModRmRegister(uint8_t Reg, uint8_t Rm)
+    {
+        Emit8(static_cast<uint8_t>(0xc0 | ((Reg & 7) << 3) | (Rm & 7)));
+    }
+
+    void VMX64Assembler::EmitRel32(Label Target)
+    {
+        DASSERT(Target < Labels_.size());
+
+        Fixups_.emplace_back(Code_.size(), Target);
+        Emit32(0);
+    }
+}
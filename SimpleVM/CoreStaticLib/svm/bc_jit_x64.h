@@ -0,0 +1,108 @@
+#pragma once
+
+#include "vmbase.h"
+
+namespace VM_NAMESPACE
+{
+    struct X64Register
+    {
+        enum T : uint8_t
+        {
+            Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi,
+            R8, R9, R10, R11, R12, R13, R14, R15,
+        };
+    };
+
+    struct X64Condition
+    {
+        enum T : uint8_t
+        {
+            O, NO, B, AE, E, NE, BE, A, S, NS, P, NP, L, GE, LE, G,
+        };
+    };
+
+    struct X64AluOp
+    {
+        // ModRM.reg of "op r/m, imm32" (81 /digit)
+        enum T : uint8_t
+        {
+            Add = 0,
+            Or = 1,
+            And = 4,
+            Sub = 5,
+            Xor = 6,
+            Cmp = 7,
+        };
+    };
+
+    class VMX64Assembler
+    {
+        //
+        // Minimal x86-64 assembler for the baseline JIT (see VMJit).
+        //
+        // Memory operands are always [Base + disp32]. Size is the operand size
+        // in bytes (4 or 8); 32-bit operations zero the upper half of the
+        // destination register. Jumps are rel32 to labels, which may be bound
+        // after they are used and are resolved by Finalize().
+        //
+
+    public:
+        using Label = uint32_t;
+
+        VMX64Assembler() noexcept;
+
+        Label NewLabel();
+        void Bind(Label Target);
+
+        // Resolves jumps; returns false if a used label is not bound
+        bool Finalize();
+
+        // Code offset of a bound label
+        size_t Offset(Label Target) const;
+
+        const std::vector<uint8_t>& Code() const noexcept
+        {
+            return Code_;
+        }
+
+        void Push(X64Register::T Register);
+        void Pop(X64Register::T Register);
+        void Ret();
+
+        void Load(uint32_t Size, X64Register::T Destination, X64Register::T Base, int32_t Displacement);
+        void Store(uint32_t Size, X64Register::T Base, int32_t Displacement, X64Register::T Source);
+        void StoreImmediate(uint32_t Size, X64Register::T Base, int32_t Displacement, int32_t Immediate);
+        void Move(uint32_t Size, X64Register::T Destination, X64Register::T Source);
+        void MoveImmediate(X64Register::T Destination, uint64_t Immediate);
+        void SignExtend32(X64Register::T Register);
+        void Lea(X64Register::T Destination, X64Register::T Base, int32_t Displacement);
+
+        void Alu(X64AluOp::T Op, uint32_t Size, X64Register::T Destination, X64Register::T Source);
+        void Alu(X64AluOp::T Op, uint32_t Size, X64Register::T Destination, X64Register::T Base, int32_t Displacement);
+        void AluImmediate(X64AluOp::T Op, uint32_t Size, X64Register::T Destination, int32_t Immediate);
+        void Imul(uint32_t Size, X64Register::T Destination, X64Register::T Base, int32_t Displacement);
+        void Not(uint32_t Size, X64Register::T Register);
+        void Neg(uint32_t Size, X64Register::T Register);
+        void Test(uint32_t Size, X64Register::T Register1, X64Register::T Register2);
+
+        // setcc + movzx; Register must be one of Rax, Rcx, Rdx, Rbx
+        void SetCondition(X64Condition::T Condition, X64Register::T Register);
+
+        void Jump(Label Target);
+        void Jump(X64Condition::T Condition, Label Target);
+        void JumpRegister(X64Register::T Register);
+
+    private:
+        void Emit8(uint8_t Value);
+        void Emit32(uint32_t Value);
+        void Emit64(uint64_t Value);
+        void EmitRex(bool Wide, uint8_t Reg, uint8_t Base);
+        void EmitModRmMemory(uint8_t Reg, X64Register::T Base, int32_t Displacement);
+        void EmitModRmRegister(uint8_t Reg, uint8_t Rm);
+        void EmitRel32(Label Target);
+
+        std::vector<uint8_t> Code_;
+        std::vector<int64_t> Labels_;                       //< offset of bound labels, -1 if not bound
+        std::vector<std::pair<size_t, Label>> Fixups_;      //< rel32 fields to resolve
+    };
+}
@@ -0,0 +1,323 @@
+#include "vmbase.h"
+#include "bc_verifier.h"
+#include "bc_decoder.h"
+
+namespace VM_NAMESPACE
+{
+    namespace
+    {
+        //
+        // State of an instruction for VMModuleVerifier. Depth is in bytes above
+        // the stack top at function entry; Args and Vars hold sizes of the
+        // declared entries.
+        //
+
+        struct ModuleState
+        {
+            bool Reached;
+            int64_t Depth;
+            std::vector<uint32_t> Args;
+            std::vector<uint32_t> Vars;
+        };
+
+        // Merges Source into Target; entries declared differently are dropped
+        bool MergeDeclarations(std::vector<uint32_t>& Target, const std::vector<uint32_t>& Source)
+        {
+            size_t Count = 0;
+
+            while (Count < Target.size() && Count < Source.size() &&
+                Target[Count] == Source[Count])
+                Count++;
+
+            if (Count == Target.size())
+                return false;
+
+            Target.resize(Count);
+            return true;
+        }
+    }
+
+    VMBlockVerifier::VMBlockVerifier(uint32_t Mode) noexcept :
+        Mode_(Mode), Length_(), Depth_(), PopSize_(), PushSize_(), Ended_()
+    {
+    }
+
+    bool VMBlockVerifier::Append(Opcode::T Opcode) noexcept
+    {
+        if (Ended_)
+            return false;
+
+        auto Effect = GetStackEffect(Opcode, Mode_);
+        if (Effect.Dynamic)
+        {
+            Ended_ = true;
+            return false;
+        }
+
+        // Values are popped before results are pushed
+        Depth_ -= Effect.PopSize;
+        if (-Depth_ > PopSize_)
+            PopSize_ = -Depth_;
+
+        Depth_ += Effect.PushSize;
+        if (Depth_ > PushSize_)
+            PushSize_ = Depth_;
+
+        Length_++;
+
+        if (Effect.EndsBlock || Length_ >= MaximumLength)
+            Ended_ = true;
+
+        return true;
+    }
+
+    StackEffect VMBlockVerifier::GetStackEffect(Opcode::T Opcode, uint32_t Mode) noexcept
+    {
+        StackEffect Effect{};
+
+        auto Info = VMInstruction::Info(Opcode);
+        if (!Info)
+        {
+            Effect.Dynamic = true;
+            return Effect;
+        }
+
+        const uint32_t ModeIndex = Mode & (ModeBits::T::VMStackOper64Bit | ModeBits::T::VMPointer64Bit);
+
+        Effect.PopSize = Info->PopSize[ModeIndex];
+        Effect.PushSize = Info->PushSize[ModeIndex];
+        Effect.Dynamic = !!(Info->Flags & InstructionFlags::T::StackDynamic);
+        Effect.EndsBlock = !!(Info->Flags & InstructionFlags::T::EndsBlock);
+
+        return Effect;
+    }
+
+    ModuleVerifyResult VMModuleVerifier::Verify(uint64_t Base, const uint8_t* Bytecode, size_t Size, uint32_t Mode,
+        std::vector<ModuleStackDepth>* Depths)
+    {
+        const uint32_t ModeIndex = Mode & (ModeBits::T::VMStackOper64Bit | ModeBits::T::VMPointer64Bit);
+        const uint32_t Alignment =
+            (Mode & ModeBits::T::VMStackOper64Bit) ? sizeof(int64_t) : sizeof(int32_t);
+
+        auto Align = [Alignment](uint32_t Size)
+        {
+            return static_cast<int64_t>((static_cast<uint64_t>(Size) + Alignment - 1) & ~static_cast<uint64_t>(Alignment - 1));
+        };
+
+        //
+        // Every byte of the region belongs to an instruction.
+        //
+
+        VMDecodedStream Stream;
+        if (Stream.Decode(Base, Bytecode, Size) != DecodeStatus::T::Complete)
+            return { ModuleVerifyStatus::T::InvalidInstruction, Base + Stream.DecodedSize(), 0 };
+
+        const size_t Count = Stream.Count();
+
+        // (instruction index + 1) of the instruction at each offset, 0 if none
+        std::vector<uint32_t> Index(Size);
+        for (size_t i = 0; i < Count; i++)
+            Index[static_cast<size_t>(Stream.Addresses[i] - Base)] = static_cast<uint32_t>(i + 1);
+
+        //
+        // Targets are instruction boundaries.
+        //
+
+        std::vector<uint32_t> Targets(Count);
+
+        for (size_t i = 0; i < Count; i++)
+        {
+            auto Op = static_cast<Opcode::T>(Stream.Opcodes[i]);
+            uint64_t NextIP = Stream.Addresses[i] + Stream.Lengths[i];
+            uint64_t Target = VMDecodedStream::ResolveTarget(Op, NextIP, Stream.Operands[i]);
+
+            if (!Target)
+                continue; // not a relative branch or call
+
+            if (!(Target - Base < Size) ||
+                !Index[static_cast<size_t>(Target - Base)])
+                return { ModuleVerifyStatus::T::InvalidTarget, Stream.Addresses[i], 0 };
+
+            Targets[i] = Index[static_cast<size_t>(Target - Base)];
+        }
+
+        //
+        // Stack heights and declarations, propagated from function entries
+        // until nothing changes. Depth must agree where paths merge;
+        // declarations are narrowed to the common ones.
+        //
+
+        std::vector<ModuleState> States(Count);
+        std::vector<uint32_t> Worklist;
+        ModuleVerifyResult Fault{ ModuleVerifyStatus::T::Verified, 0, 0 };
+
+        auto Propagate = [&](uint32_t Successor, const ModuleState& State, size_t From)
+        {
+            auto& Target = States[Successor];
+
+            if (!Target.Reached)
+            {
+                Target = State;
+                Target.Reached = true;
+                Worklist.push_back(Successor);
+                return true;
+            }
+
+            if (Target.Depth != State.Depth)
+            {
+                Fault = { ModuleVerifyStatus::T::StackMismatch, Stream.Addresses[From], 0 };
+                return false;
+            }
+
+            bool Changed = MergeDeclarations(Target.Args, State.Args);
+            Changed = MergeDeclarations(Target.Vars, State.Vars) || Changed;
+
+            if (Changed)
+                Worklist.push_back(Successor);
+
+            return true;
+        };
+
+        const ModuleState EntryState{ true, 0, {}, {} };
+
+        if (Count)
+        {
+            States[0] = EntryState;
+            Worklist.push_back(0);
+        }
+
+        while (!Worklist.empty())
+        {
+            uint32_t i = Worklist.back();
+            Worklist.pop_back();
+
+            ModuleState State = States[i];
+            auto Op = static_cast<Opcode::T>(Stream.Opcodes[i]);
+            auto Info = VMInstruction::Info(Op);
+            uint64_t Address = Stream.Addresses[i];
+            uint32_t Operand = static_cast<uint32_t>(Stream.Operands[i]);
+
+            int64_t PopSize = Info->PopSize[ModeIndex];
+            int64_t PushSize = Info->PushSize[ModeIndex];
+            bool Fallthrough = true;
+
+            switch (Op)
+            {
+            case Opcode::T::Ldarg:
+            case Opcode::T::Starg:
+            case Opcode::T::Ldargp:
+            case Opcode::T::Ldvar:
+            case Opcode::T::Stvar:
+            case Opcode::T::Ldvarp:
+            {
+                bool IsArg = Op == Opcode::T::Ldarg || Op == Opcode::T::Starg || Op == Opcode::T::Ldargp;
+                const auto& Declared = IsArg ? State.Args : State.Vars;
+
+                if (!(Operand < Declared.size()))
+                    return { ModuleVerifyStatus::T::InvalidIndex, Address, 0 };
+
+                if (Op == Opcode::T::Ldarg || Op == Opcode::T::Ldvar)
+                    PushSize = Align(Declared[Operand]);
+                else if (Op == Opcode::T::Starg || Op == Opcode::T::Stvar)
+                    PopSize = Align(Declared[Operand]);
+                else
+                    PushSize = 2 * Alignment; // valueref, size
+                break;
+            }
+
+            case Opcode::T::Arg:
+            case Opcode::T::Var:
+            {
+                bool IsArg = Op == Opcode::T::Arg;
+                auto& Declared = IsArg ? State.Args : State.Vars;
+
+                if (Operand == 0 ||
+                    Operand > (IsArg ? Constants::MaximumSizeSingleArgument : Constants::MaximumSizeSingleLocalVariable) ||
+                    Declared.size() >= (IsArg ? Constants::MaximumFunctionArgumentCount : Constants::MaximumFunctionLocalVariableCount))
+                    return { ModuleVerifyStatus::T::InvalidDeclaration, Address, 0 };
+
+                // Value of the entry is reserved on the operand stack
+                Declared.push_back(Operand);
+                PushSize = Align(Operand);
+                break;
+            }
+
+            case Opcode::T::Initarg:
+                State.Args.clear();
+                break;
+
+            case Opcode::T::Call_I1:
+            case Opcode::T::Call_I2:
+            case Opcode::T::Call_I4:
+            {
+                // Callee pops the return address at ret; tables are changed by the callee
+                if (!Propagate(Targets[i] - 1, EntryState, i))
+                    return Fault;
+
+                PushSize = 0;
+                State.Args.clear();
+                State.Vars.clear();
+                break;
+            }
+
+            case Opcode::T::Ret:
+                if (State.Depth != 0)
+                    return { ModuleVerifyStatus::T::StackMismatch, Address, 0 };
+
+                continue;
+
+            case Opcode::T::Br_I1:
+            case Opcode::T::Br_I2:
+            case Opcode::T::Br_I4:
+                Fallthrough = false;
+                break;
+
+            default:
+                if (Info->Flags & InstructionFlags::T::StackDynamic)
+                    return { ModuleVerifyStatus::T::Unsupported, Address, 0 };
+                break;
+            }
+
+            if (State.Depth < PopSize)
+                return { ModuleVerifyStatus::T::StackUnderflow, Address, 0 };
+
+            State.Depth += PushSize - PopSize;
+
+            // Never negative past the check above
+            if (static_cast<uint64_t>(State.Depth) > Fault.MaximumDepth)
+                Fault.MaximumDepth = static_cast<uint64_t>(State.Depth);
+
+            if (Targets[i] &&
+                Op != Opcode::T::Call_I1 && Op != Opcode::T::Call_I2 && Op != Opcode::T::Call_I4)
+            {
+                if (!Propagate(Targets[i] - 1, State, i))
+                    return Fault;
+            }
+
+            if (Fallthrough)
+            {
+                if (i + 1 < Count)
+                {
+                    if (!Propagate(i + 1, State, i))
+                        return Fault;
+                }
+                else if (Op != Opcode::T::Bp && Op != Opcode::T::Inv)
+                {
+                    // Runs off the end of the region
+                    return { ModuleVerifyStatus::T::InvalidTarget, Address, 0 };
+                }
+            }
+        }
+
+        if (Depths)
+        {
+            for (size_t i = 0; i < Count; i++)
+            {
+                if (States[i].Reached)
+                    Depths->push_back({ Stream.Addresses[i], static_cast<uint64_t>(States[i].Depth) });
+            }
+        }
+
+        return Fault;
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "vmbase.h"
+#include "vmmemory.h"
+
+namespace VM_NAMESPACE
+{
+    struct StackEffect
+    {
+        uint8_t PopSize;        //< bytes popped from the operand stack
+        uint8_t PushSize;       //< bytes pushed to the operand stack
+        bool Dynamic;           //< effect is not known before execution
+        bool EndsBlock;         //< instruction transfers control or writes guest memory
+    };
+
+    class VMBlockVerifier
+    {
+        //
+        // Computes operand stack bounds of a basic block from the stack
+        // effects of its instructions (see inst_stack_table.inc).
+        //
+        // A block may start at any instruction. It ends after an instruction
+        // which transfers control or writes guest memory, before an
+        // instruction with dynamic stack effect, or at MaximumLength
+        // instructions. If the operand stack has PopSize() bytes above the top
+        // (toward the stack base) and PushSize() bytes free below it at block
+        // entry, no instruction of the block can overflow or underflow it.
+        //
+
+    public:
+        constexpr static const uint32_t MaximumLength = 64;
+
+        VMBlockVerifier(uint32_t Mode) noexcept;
+
+        // Appends next instruction; returns false if the block ends before it
+        bool Append(Opcode::T Opcode) noexcept;
+
+        bool Ended() const noexcept
+        {
+            return Ended_;
+        }
+
+        uint32_t Length() const noexcept
+        {
+            return Length_;
+        }
+
+        uint32_t PopSize() const noexcept
+        {
+            return static_cast<uint32_t>(PopSize_);
+        }
+
+        uint32_t PushSize() const noexcept
+        {
+            return static_cast<uint32_t>(PushSize_);
+        }
+
+        // Stack effect of Opcode in Mode (ModeBits::T)
+        static StackEffect GetStackEffect(Opcode::T Opcode, uint32_t Mode) noexcept;
+
+        // Key of Mode stored to DecodedInstruction::BlockMode (never 0)
+        static uint8_t ModeKey(uint32_t Mode) noexcept
+        {
+            return static_cast<uint8_t>(
+                (Mode & (ModeBits::T::VMStackOper64Bit | ModeBits::T::VMPointer64Bit)) + 1);
+        }
+
+    private:
+        uint32_t Mode_;
+        uint32_t Length_;
+        int32_t Depth_;         // bytes pushed - bytes popped since block entry
+        int32_t PopSize_;
+        int32_t PushSize_;
+        bool Ended_;
+    };
+
+    struct ModuleVerifyStatus
+    {
+        enum T : uint32_t
+        {
+            Verified,
+            InvalidInstruction,     // instruction is truncated or undefined
+            InvalidTarget,          // branch or call target is not an instruction of the region
+            StackUnderflow,         // pops a value pushed before the function was entered
+            StackMismatch,          // stack heights differ at a merge point or at ret
+            InvalidIndex,           // argument or local variable index is not declared
+            InvalidDeclaration,     // arg or var has invalid size, or too many are declared
+            Unsupported,            // stack effect cannot be determined (dcvn, vmcall, ...)
+        };
+    };
+
+    struct ModuleVerifyResult
+    {
+        ModuleVerifyStatus::T Status;
+        uint64_t FaultAddress;      //< address of the offending instruction
+        uint64_t MaximumDepth;      //< largest operand stack bytes pushed since function entry, in any function
+
+        bool Verified() const noexcept
+        {
+            return Status == ModuleVerifyStatus::T::Verified;
+        }
+    };
+
+    struct ModuleStackDepth
+    {
+        uint64_t Address;           //< address of an instruction reached from a function entry
+        uint64_t Depth;             //< operand stack bytes pushed since function entry, before the instruction
+    };
+
+    class VMModuleVerifier
+    {
+        //
+        // Verifies a whole MemoryType::Bytecode region before it runs:
+        //
+        //  - the region decodes to instructions up to its end
+        //  - relative branch and call targets are instructions of the region
+        //  - the operand stack height at each instruction is the same on every
+        //    path from the function entry, never drops below the entry height,
+        //    and equals it at ret
+        //  - ldarg/starg/ldargp and ldvar/stvar/ldvarp indexes are below the
+        //    count of arg/var declared on every path in the same function
+        //
+        // Functions are entered at the start of the region and at call
+        // targets. Argument and local variable tables are assumed empty at
+        // function entry and after a call returns.
+        //
+        // If Depths is not nullptr, the stack height of every reached
+        // instruction is appended to it when the region is verified. Within
+        // one call of a function (up to its next call or ret), the operand
+        // stack never holds fewer bytes than at function entry nor more than
+        // MaximumDepth bytes above it.
+        //
+
+    public:
+        static ModuleVerifyResult Verify(uint64_t Base, const uint8_t* Bytecode, size_t Size, uint32_t Mode,
+            std::vector<ModuleStackDepth>* Depths = nullptr);
+    };
+}
@@ -7,10 +7,10 @@
 	Opcode::T::_op, #_mnemonic
 
 #define DEFINE_INST(_op, _mnemonic)	\
-	{ INSTRUCTION_BASE_PARAMS(_op, _mnemonic), },
+	MakeInstructionInfo(INSTRUCTION_BASE_PARAMS(_op, _mnemonic), OperandType::T::None),
 
 #define DEFINE_INST_O1(_op, _mnemonic, _operand)	\
-	{ INSTRUCTION_BASE_PARAMS(_op, _mnemonic), { OperandType::T::_operand } },
+	MakeInstructionInfo(INSTRUCTION_BASE_PARAMS(_op, _mnemonic), OperandType::T::_operand),
 
 
 
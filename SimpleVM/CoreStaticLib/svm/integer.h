@@ -4,13 +4,29 @@
 #include <cstdint>
 #include <type_traits>
 
+//
+// With GCC and Clang, Add(), Subtract() and Multiply() detect overflow with
+// __builtin_*_overflow, and Multiply() takes the high part of the product
+// from a double-width multiply (__int128 for 64-bit integers). These compile
+// to the flags of add, sub and mul without branches. Define
+// M_INTEGER_BUILTIN_OVERFLOW=0 to use the portable code.
+//
+
+#if !defined(M_INTEGER_BUILTIN_OVERFLOW)
+#if M_COMPILER_TYPE == M_COMPILER_GCC && defined(__SIZEOF_INT128__)
+#define M_INTEGER_BUILTIN_OVERFLOW  1
+#else
+#define M_INTEGER_BUILTIN_OVERFLOW  0
+#endif
+#endif
+
 template <
     typename T,
     std::enable_if_t<std::is_integral<T>::value, bool> = true>
 class BaseInteger // for integers
 {
 public:
-    using TIntegerState = typename uint8_t;
+    using TIntegerState = uint8_t;
 
     struct StateFlags
     {
@@ -68,6 +84,24 @@ public:
 
 protected:
 
+    constexpr static TIntegerState OverflowState(bool Overflow)
+    {
+        return static_cast<TIntegerState>(Overflow) * StateFlags::Overflow;
+    }
+
+#if M_INTEGER_BUILTIN_OVERFLOW
+    // High part of the double-width product of v1 and v2
+    static T MultiplyHigh(T v1, T v2)
+    {
+        using TWide = std::conditional_t<
+            (sizeof(T) < sizeof(uint64_t)),
+            std::conditional_t<std::is_signed<T>::value, int64_t, uint64_t>,
+            std::conditional_t<std::is_signed<T>::value, __int128, unsigned __int128>>;
+
+        return static_cast<T>((static_cast<TWide>(v1) * v2) >> (sizeof(T) << 3));
+    }
+#endif
+
     bool Equal(const BaseInteger<T> rhs, bool CompareInvalidState = false)
     {
         if (CompareInvalidState)
@@ -120,10 +154,12 @@ template <typename T>
         : public BaseInteger<T>
 {
 public:
-    using type = typename T;
+    using type = T;
     using TSigned = typename std::make_signed_t<T>;
     using TUnsigned = typename std::make_unsigned_t<T>;
     using TIntegerState = typename BaseInteger<T>::TIntegerState;
+    using StateFlags = typename BaseInteger<T>::StateFlags;
+    using BaseInteger<T>::Invalid;
 
     constexpr Integer() :
         BaseInteger<T>()
@@ -145,6 +181,10 @@ public:
         if (Invalid() || Value.Invalid())
             return{};
 
+#if M_INTEGER_BUILTIN_OVERFLOW
+        T vr = 0;
+        TIntegerState State = BaseInteger<T>::OverflowState(__builtin_add_overflow(Value_, Value.Value_, &vr));
+#else
         TUnsigned v1 = Value_;
         TUnsigned v2 = Value.Value_;
         TUnsigned vr = v1 + v2;
@@ -152,6 +192,7 @@ public:
         TIntegerState State = 0;
         if (vr < v1 || vr < v2)
             State |= StateFlags::Overflow;
+#endif
 
         return BaseInteger<T>(vr, State);
     }
@@ -161,6 +202,10 @@ public:
         if (Invalid() || Value.Invalid())
             return{};
 
+#if M_INTEGER_BUILTIN_OVERFLOW
+        T vr = 0;
+        TIntegerState State = BaseInteger<T>::OverflowState(__builtin_sub_overflow(Value_, Value.Value_, &vr));
+#else
         TUnsigned v1 = Value_;
         TUnsigned v2 = Value.Value_;
         TUnsigned vr = v1 + ~v2 + 1;
@@ -168,13 +213,25 @@ public:
         TIntegerState State = 0;
         if (v1 < v2)
             State |= StateFlags::Overflow;
+#endif
 
         return BaseInteger<T>(vr, State);
     }
 
     Integer<T> Multiply(const Integer<T> Value, Integer<T>* HighPart = nullptr) const
     {
-#if 1
+#if M_INTEGER_BUILTIN_OVERFLOW
+        if (Invalid() || Value.Invalid())
+            return{};
+
+        T vr = 0;
+        TIntegerState State = BaseInteger<T>::OverflowState(__builtin_mul_overflow(Value_, Value.Value_, &vr));
+
+        if (HighPart)
+            *HighPart = BaseInteger<T>::MultiplyHigh(Value_, Value.Value_);
+
+        return BaseInteger<T>(vr, State);
+#elif 1
         if (Invalid() || Value.Invalid())
             return{};
 
@@ -575,6 +632,10 @@ public:
     bool operator!() const = delete;
     bool operator&&(const Integer<T> rhs) const = delete;
     bool operator||(const Integer<T> rhs) const = delete;
+
+protected:
+    // Members of the dependent base are not found by unqualified lookup
+    using BaseInteger<T>::Value_;
 };
 
 static_assert(
@@ -609,10 +670,12 @@ class Integer<
     : public BaseInteger<T>
 {
 public:
-    using type = typename T;
+    using type = T;
     using TSigned = typename std::make_signed_t<T>;
     using TUnsigned = typename std::make_unsigned_t<T>;
     using TIntegerState = typename BaseInteger<T>::TIntegerState;
+    using StateFlags = typename BaseInteger<T>::StateFlags;
+    using BaseInteger<T>::Invalid;
 
     constexpr Integer() :
         BaseInteger<T>()
@@ -634,6 +697,12 @@ public:
         if (Invalid() || Value.Invalid())
             return{};
 
+#if M_INTEGER_BUILTIN_OVERFLOW
+        T vr = 0;
+        TIntegerState State = BaseInteger<T>::OverflowState(__builtin_add_overflow(Value_, Value.Value_, &vr));
+
+        return BaseInteger<T>(vr, State);
+#else
         constexpr const TUnsigned SignBit =
             static_cast<TUnsigned>(1) << ((sizeof(T) << 3) - 1);
 
@@ -650,6 +719,7 @@ public:
         }
 
         return BaseInteger<T>(vr, State);
+#endif
     }
 
     Integer<T> Subtract(const Integer<T> Value) const
@@ -657,6 +727,12 @@ public:
         if (Invalid() || Value.Invalid())
             return{};
 
+#if M_INTEGER_BUILTIN_OVERFLOW
+        T vr = 0;
+        TIntegerState State = BaseInteger<T>::OverflowState(__builtin_sub_overflow(Value_, Value.Value_, &vr));
+
+        return BaseInteger<T>(vr, State);
+#else
         constexpr const TUnsigned SignBit =
             static_cast<TUnsigned>(1) << ((sizeof(T) << 3) - 1);
 
@@ -673,10 +749,23 @@ public:
         }
 
         return BaseInteger<T>(vr, State);
+#endif
     }
 
     Integer<T> Multiply(const Integer<T> Value, Integer<T>* HighPart = nullptr) const
     {
+#if M_INTEGER_BUILTIN_OVERFLOW
+        if (Invalid() || Value.Invalid())
+            return{};
+
+        T vr = 0;
+        TIntegerState State = BaseInteger<T>::OverflowState(__builtin_mul_overflow(Value_, Value.Value_, &vr));
+
+        if (HighPart)
+            *HighPart = BaseInteger<T>::MultiplyHigh(Value_, Value.Value_);
+
+        return BaseInteger<T>(vr, State);
+#else
         if (Invalid() || Value.Invalid())
             return{};
 
@@ -768,6 +857,7 @@ public:
             *HighPart = signed_res_hi;
 
         return BaseInteger<T>(vr, State);
+#endif
     }
 
     Integer<T> Divide(const Integer<T> Value) const
@@ -1141,6 +1231,10 @@ public:
     bool operator!() const = delete;
     bool operator&&(const Integer<T> rhs) const = delete;
     bool operator||(const Integer<T> rhs) const = delete;
+
+protected:
+    // Members of the dependent base are not found by unqualified lookup
+    using BaseInteger<T>::Value_;
 };
 
 static_assert(
@@ -9,6 +9,7 @@
 #include <type_traits>
 #include <string>
 #include <algorithm>
+#include <chrono>
 
 #define DASSERT(_x)          if (!(_x)) { __debugbreak(); }
 
@@ -127,6 +128,8 @@ namespace VM_NAMESPACE
         };
     };
 
+    class VMTraceSink;
+
     struct VMExecutionContext
     {
         alignas(16) uint32_t Lock;
@@ -177,6 +180,19 @@ namespace VM_NAMESPACE
         //
 
         uint32_t Mode;							// Mode bits. See ModeBits::T.
+
+        //
+        // Fuel.
+        //
+
+        uint64_t Fuel;                          // Instructions left to execute if fuel is metered.
+                                                // See VMBytecodeInterpreterT::ExecuteUntilEvent().
+
+        //
+        // Host Specific.
+        //
+
+        VMTraceSink* TraceSink;                 // Trace sink (optional). See vmtrace.h.
     };
 
     static_assert(
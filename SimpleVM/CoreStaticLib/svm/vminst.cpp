@@ -4,11 +4,142 @@
 
 namespace VM_NAMESPACE
 {
-    const InstructionInfo VMInstruction::InstructionList[]
+    namespace
+    {
+        struct StackEffectEntry
+        {
+            Opcode::T Opcode;
+            const char* Pop;
+            const char* Push;
+            uint8_t Flags;
+        };
+
+        constexpr StackEffectEntry StackEffectTable[] =
+        {
+#define DEFINE_STACK_EFFECT(_op, _pop, _push)       { Opcode::T::_op, _pop, _push, InstructionFlags::T::None },
+#define DEFINE_STACK_EFFECT_END(_op, _pop, _push)   { Opcode::T::_op, _pop, _push, InstructionFlags::T::EndsBlock },
+#define DEFINE_STACK_EFFECT_DYNAMIC(_op)            { Opcode::T::_op, "", "", InstructionFlags::T::StackDynamic },
+#include "inst_stack_table.inc"
+#undef DEFINE_STACK_EFFECT_DYNAMIC
+#undef DEFINE_STACK_EFFECT_END
+#undef DEFINE_STACK_EFFECT
+        };
+
+        // First instructions of superinstructions
+        constexpr Opcode::T FusibleTable[] =
+        {
+#define DEFINE_FUSED_INST2(_op, _op1, _op2)                 Opcode::T::_op1,
+#define DEFINE_FUSED_INST3(_op, _op1, _op2, _op3)           Opcode::T::_op1,
+#define DEFINE_FUSED_INST4(_op, _op1, _op2, _op3, _op4)     Opcode::T::_op1,
+#include "inst_fused_table.inc"
+#undef DEFINE_FUSED_INST4
+#undef DEFINE_FUSED_INST3
+#undef DEFINE_FUSED_INST2
+        };
+
+        //
+        // Bytes of operand stack occupied by Values (see inst_stack_table.inc)
+        // for ModeIndex, which is Mode & (VMStackOper64Bit | VMPointer64Bit).
+        //
+
+        constexpr uint8_t StackValuesSize(const char* Values, uint32_t ModeIndex)
+        {
+            const uint32_t Alignment =
+                (ModeIndex & ModeBits::T::VMStackOper64Bit) ? sizeof(int64_t) : sizeof(int32_t);
+            const uint32_t PointerSize =
+                (ModeIndex & ModeBits::T::VMPointer64Bit) ? sizeof(int64_t) : sizeof(int32_t);
+
+            uint32_t Size = 0;
+
+            for (; *Values; Values++)
+            {
+                uint32_t ValueSize = 0;
+
+                switch (*Values)
+                {
+                case '1': ValueSize = 1; break;
+                case '2': ValueSize = 2; break;
+                case '4': ValueSize = 4; break;
+                case '8': ValueSize = 8; break;
+                case 'n': ValueSize = Alignment; break;
+                case 'p': ValueSize = PointerSize; break;
+                default:
+                    break;
+                }
+
+                Size += (ValueSize > Alignment) ? ValueSize : Alignment;
+            }
+
+            return static_cast<uint8_t>(Size);
+        }
+
+        constexpr uint8_t ImmediateSize(OperandType::T Operand)
+        {
+            return
+                (Operand == OperandType::T::Imm8) ? 1 :
+                (Operand == OperandType::T::Imm16) ? 2 :
+                (Operand == OperandType::T::Imm32) ? 4 :
+                (Operand == OperandType::T::Imm64) ? 8 : 0;
+        }
+
+        constexpr bool IsFusible(Opcode::T Opcode)
+        {
+            for (auto First : FusibleTable)
+            {
+                if (First == Opcode)
+                    return true;
+            }
+
+            return false;
+        }
+
+        constexpr InstructionInfo MakeInstructionInfo(Opcode::T Opcode, const char* Mnemonic, OperandType::T Operand)
+        {
+            const auto& Effect = StackEffectTable[Opcode];
+
+            return InstructionInfo
+            {
+                Mnemonic,
+                Operand,
+                static_cast<uint16_t>(Opcode),
+                ImmediateSize(Operand),
+                static_cast<uint8_t>(Effect.Flags | (IsFusible(Opcode) ? InstructionFlags::T::Fusible : 0)),
+                {
+                    StackValuesSize(Effect.Pop, 0), StackValuesSize(Effect.Pop, 1),
+                    StackValuesSize(Effect.Pop, 2), StackValuesSize(Effect.Pop, 3),
+                },
+                {
+                    StackValuesSize(Effect.Push, 0), StackValuesSize(Effect.Push, 1),
+                    StackValuesSize(Effect.Push, 2), StackValuesSize(Effect.Push, 3),
+                },
+            };
+        }
+
+        constexpr bool IsStackEffectTableOrdered()
+        {
+            for (uint32_t i = 0; i < std::size(StackEffectTable); i++)
+            {
+                if (StackEffectTable[i].Opcode != i)
+                    return false;
+            }
+
+            return true;
+        }
+
+        static_assert(std::size(StackEffectTable) == VMInstruction::InstructionCount,
+            "inst_stack_table.inc must have an entry for each instruction");
+        static_assert(IsStackEffectTableOrdered(),
+            "inst_stack_table.inc must be in the same order as inst_table.inc");
+    }
+
+    constexpr InstructionInfo VMInstruction::InstructionList[]
     {
         #include "inst_table.h" // instruction table
     };
 
+    static_assert(std::size(VMInstruction::InstructionList) == VMInstruction::InstructionCount,
+        "inst_table.inc must have an entry for each instruction");
+
     const size_t VMInstruction::InstructionMaximumSize = 0x10; // Prefix(1) + Opcode(2) + Imm64(8) + Reserved(5)
 
 
@@ -123,21 +254,10 @@ namespace VM_NAMESPACE
         if (!Valid_)
             return false;
 
-        DASSERT(0 <= Opcode_ && Opcode_ < std::size(InstructionList));
+        DASSERT(0 <= Opcode_ && Opcode_ < InstructionCount);
 
         const auto& Entry = InstructionList[Opcode_];
-        bool HasOperand = false;
-
-        switch (Entry.Operands.size())
-        {
-        case 0: // no operands
-            break;
-        case 1: // 1 operand
-            HasOperand = true;
-            break;
-        default: // invalid
-            return false;
-        }
+        bool HasOperand = Entry.Operand != OperandType::T::None;
 
         size_t BytecodeSize = OpcodeSize_;
         if (HasOperand)
@@ -192,60 +312,54 @@ namespace VM_NAMESPACE
         if (!Valid_)
             return false;
 
-        DASSERT(0 <= Opcode_ && Opcode_ < std::size(InstructionList));
+        DASSERT(0 <= Opcode_ && Opcode_ < InstructionCount);
 
         const auto& Entry = InstructionList[Opcode_];
 
         char String[64]{};
-        strcpy_s(String, Entry.Mnemonic.c_str());
+        strcpy_s(String, Entry.Mnemonic);
 
-        if (Entry.Operands.size())
+        if (Entry.Operand != OperandType::T::None)
         {
             strcat_s(String, " ");
 
-            for (int i = 0; i < Entry.Operands.size(); i++)
-            {
-                char Value[32];
-
-                if (i > 0)
-                    strcat_s(String, ", ");
+            char Value[32];
 
-                switch (Entry.Operands[i])
-                {
-                case OperandType::T::Imm8:
-                {
-                    uint8_t Imm = 0;
-                    DASSERT(Operand(i, Imm));
-                    sprintf_s(Value, "0x%02hhx", Imm);
-                    break;
-                }
-                case OperandType::T::Imm16:
-                {
-                    uint16_t Imm = 0;
-                    DASSERT(Operand(i, Imm));
-                    sprintf_s(Value, "0x%04hx", Imm);
-                    break;
-                }
-                case OperandType::T::Imm32:
-                {
-                    uint32_t Imm = 0;
-                    DASSERT(Operand(i, Imm));
-                    sprintf_s(Value, "0x%08x", Imm);
-                    break;
-                }
-                case OperandType::T::Imm64:
-                {
-                    uint64_t Imm = 0;
-                    DASSERT(Operand(i, Imm));
-                    sprintf_s(Value, "0x%016llx", Imm);
-                    break;
-                }
-                default:
-                    DASSERT(false);
-                }
-
-                strcat_s(String, Value);
+            switch (Entry.Operand)
+            {
+            case OperandType::T::Imm8:
+            {
+                uint8_t Imm = 0;
+                DASSERT(Operand(0, Imm));
+                sprintf_s(Value, "0x%02hhx", Imm);
+                break;
+            }
+            case OperandType::T::Imm16:
+            {
+                uint16_t Imm = 0;
+                DASSERT(Operand(0, Imm));
+                sprintf_s(Value, "0x%04hx", Imm);
+                break;
+            }
+            case OperandType::T::Imm32:
+            {
+                uint32_t Imm = 0;
+                DASSERT(Operand(0, Imm));
+                sprintf_s(Value, "0x%08x", Imm);
+                break;
+            }
+            case OperandType::T::Imm64:
+            {
+                uint64_t Imm = 0;
+                DASSERT(Operand(0, Imm));
+                sprintf_s(Value, "0x%016llx", Imm);
+                break;
             }
+            default:
+                DASSERT(false);
+            }
+
+            strcat_s(String, Value);
         }
 
         if (Buffer)
@@ -307,50 +421,18 @@ namespace VM_NAMESPACE
             Remaining--;
         }
 
-        const auto& Instruction = InstructionList[Opcode];
-        DASSERT(Instruction.Id == Opcode);
-        DASSERT(Instruction.Operands.size() <= 1);
-
-        VMInstruction DecodedOp = VMInstruction(static_cast<Opcode::T>(Opcode));
+        const auto Instruction = Info(Opcode);
+        if (!Instruction)
+            return 0; // undefined opcode
 
-        // Check operators
-        size_t OperandSize = 0;
-        char OperandString[32]{};
+        DASSERT(Instruction->Id == Opcode);
 
-        for (auto& it : Instruction.Operands)
-        {
-            switch (it)
-            {
-            case OperandType::T::Imm8: OperandSize = 1; break;
-            case OperandType::T::Imm16: OperandSize = 2; break;
-            case OperandType::T::Imm32: OperandSize = 4; break;
-            case OperandType::T::Imm64: OperandSize = 8; break;
-            default: DASSERT(false);
-            }
-
-            if (Remaining < OperandSize)
-                return 0;
-
-            switch (it)
-            {
-            case OperandType::T::Imm8:
-                DecodedOp = VMInstruction::Create(static_cast<Opcode::T>(Opcode), Base::FromBytesLe<uint8_t>(p));
-                break;
-            case OperandType::T::Imm16:
-                DecodedOp = VMInstruction::Create(static_cast<Opcode::T>(Opcode), Base::FromBytesLe<uint16_t>(p));
-                break;
-            case OperandType::T::Imm32:
-                DecodedOp = VMInstruction::Create(static_cast<Opcode::T>(Opcode), Base::FromBytesLe<uint32_t>(p));
-                break;
-            case OperandType::T::Imm64:
-                DecodedOp = VMInstruction::Create(static_cast<Opcode::T>(Opcode), Base::FromBytesLe<uint64_t>(p));
-                break;
-            default:
-                DASSERT(false);
-            }
+        size_t OperandSize = Instruction->ImmediateSize;
+        if (Remaining < OperandSize)
+            return 0;
 
-            Remaining -= OperandSize;
-        }
+        VMInstruction DecodedOp = VMInstruction(static_cast<Opcode::T>(Opcode), p, OperandSize);
+        Remaining -= OperandSize;
 
         if (BytecodeOp)
             *BytecodeOp = DecodedOp;
@@ -30,22 +30,36 @@ namespace VM_NAMESPACE
 		uint64_t Value;
 	};
 
-	class InstructionInfo
+	struct InstructionFlags
 	{
-	public:
-		InstructionInfo(uint32_t Id, const char* Mnemonic, std::vector<OperandType::T> Operands = {}) :
-			Id(Id), Mnemonic(Mnemonic), Operands(Operands)
+		enum T : uint8_t
 		{
-		}
+			None = 0,
 
-		InstructionInfo(uint32_t Id, const char* Mnemonic, std::initializer_list<OperandType::T> Operands) :
-			InstructionInfo(Id, Mnemonic, std::vector<OperandType::T>(Operands))
-		{
-		}
+			StackDynamic = 1 << 0,	// stack effect depends on operands or VM state
+			EndsBlock = 1 << 1,		// transfers control or writes guest memory
+			Fusible = 1 << 2,		// first instruction of a superinstruction
+		};
+	};
+
+	//
+	// Instruction metadata, generated at compile time from inst_table.inc,
+	// inst_stack_table.inc and inst_fused_table.inc (see vminst.cpp).
+	//
 
-		uint32_t Id;
-		std::string Mnemonic;
-		std::vector<OperandType::T> Operands;
+	struct InstructionInfo
+	{
+		constexpr static const uint32_t StackModeCount = 4;
+
+		const char* Mnemonic;
+		OperandType::T Operand;					// OperandType::T::None if no operand
+		uint16_t Id;
+		uint8_t ImmediateSize;					// immediate bytes following the opcode
+		uint8_t Flags;							// InstructionFlags::T
+
+		// operand stack bytes, indexed by Mode & (VMStackOper64Bit | VMPointer64Bit)
+		uint8_t PopSize[StackModeCount];
+		uint8_t PushSize[StackModeCount];
 	};
 
 
@@ -300,6 +314,12 @@ namespace VM_NAMESPACE
 
 		static size_t Decode(uint8_t* Bytecode, size_t Size, VMInstruction* BytecodeOp);
 
+		// Metadata of Opcode, or nullptr if Opcode is not defined
+		static const InstructionInfo* Info(uint32_t Opcode)
+		{
+			return Opcode < InstructionCount ? &InstructionList[Opcode] : nullptr;
+		}
+
 	private:
 		bool SetOpcode(Opcode::T Opcode);
 		bool SetOpcode(uint16_t Opcode);
@@ -323,6 +343,7 @@ namespace VM_NAMESPACE
 
 	public:
 		static const InstructionInfo InstructionList[];
+		constexpr static const uint32_t InstructionCount = Opcode::T::Vmxthrow + 1;
 		static const size_t InstructionMaximumSize;
 	};
 
@@ -1,14 +1,398 @@
 
 #include "vmmemory.h"
 
+#include <fstream>
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
 #include <windows.h>
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <mutex>
+#endif
 
 namespace VM_NAMESPACE
 {
-    VMMemoryManager::VMMemoryManager(size_t Size) : 
-        Base_(), Size_(), MemoryMap_(), AllocationBitmap_()
+#if M_TARGET_OS == M_TARGET_OS_LINUX
+    namespace
+    {
+        //
+        // Linux has no SEH; accesses which may fault are run through
+        // GuardedAccess() and Signal_Pagefault() jumps back to it.
+        //
+
+        // Innermost GuardedAccess() of this thread (volatile as it is read by the signal handler)
+        thread_local sigjmp_buf* volatile PagefaultJump;
+
+        // Memory manager of the innermost GuardedAccess(), which may track writes (see TrackWrite())
+        thread_local VMMemoryManager* volatile PagefaultOwner;
+
+        struct sigaction PreviousSegvAction;
+        struct sigaction PreviousBusAction;
+
+        template <typename TFunction>
+        bool GuardedAccess(VMMemoryManager* Owner, TFunction&& Function)
+        {
+            sigjmp_buf Jump;
+            sigjmp_buf* PreviousJump = PagefaultJump;
+            VMMemoryManager* PreviousOwner = PagefaultOwner;
+
+            // Signal mask is not saved (handler is installed with SA_NODEFER)
+            if (sigsetjmp(Jump, 0))
+            {
+                PagefaultJump = PreviousJump;
+                PagefaultOwner = PreviousOwner;
+                return false;
+            }
+
+            PagefaultJump = &Jump;
+            PagefaultOwner = Owner;
+            Function();
+            PagefaultJump = PreviousJump;
+            PagefaultOwner = PreviousOwner;
+
+            return true;
+        }
+    }
+#endif
+
+    namespace
+    {
+        bool IsZeroPage(const uint8_t* Page)
+        {
+            uint64_t Bits = 0;
+
+            for (size_t i = 0; i < VMMemoryManager::PageSize; i += sizeof(Bits))
+            {
+                uint64_t Value;
+                std::memcpy(&Value, Page + i, sizeof(Value));
+                Bits |= Value;
+            }
+
+            return !Bits;
+        }
+
+        //
+        // Snapshot file (see VMMemorySnapshot::Save()), in host byte order:
+        //
+        //   SnapshotFileHeader
+        //   SnapshotFileBlock[BlockCount]      memory map
+        //   MemoryRange[RangeCount]            committed pages of allocated blocks
+        //   VMExecutionContext
+        //   pages at DataOffset + guest address, up to DataOffset + Size
+        //
+        // The committed ranges and the image blocks give the allocation bitmap.
+        //
+
+        // Pages can be mapped with mmap() and MapViewOfFile() (allocation granularity)
+        constexpr const uint64_t SnapshotFileAlignment = 0x10000;
+
+        struct SnapshotFileFlags
+        {
+            constexpr static const uint32_t GuardedAddressSpace = 0x00000001;
+        };
+
+        struct SnapshotFileHeader
+        {
+            uint32_t Magic;             //< VMMemorySnapshot::FileMagic
+            uint32_t Version;           //< VMMemorySnapshot::FileVersion
+            uint32_t PageSize;
+            uint32_t Flags;             //< SnapshotFileFlags
+            uint64_t Size;              //< managed size
+            uint64_t SourceBase;        //< host base of the source memory manager (see VMMemoryManager::Fork())
+            uint64_t BlockCount;
+            uint64_t RangeCount;
+            uint64_t ContextSize;       //< sizeof(VMExecutionContext)
+            uint64_t DataOffset;
+        };
+
+        struct SnapshotFileBlock
+        {
+            uint64_t Base;
+            uint64_t Size;
+            uint64_t MaximumSize;
+            uint64_t Tag;
+            uint32_t Type;
+            uint32_t Reserved;
+            uint64_t ImageSize;         //< size of the mapped code image, 0 if none
+        };
+    }
+
+    VMCodeImage::VMCodeImage() noexcept :
+        Data_(), Size_(), MappedSize_(), Handle_(-1), Mutex_(), SharedData_()
+    {
+    }
+
+    std::shared_ptr<void> VMCodeImage::Shared(const SharedKey& Key, const std::function<std::shared_ptr<void>()>& Create)
+    {
+        std::lock_guard<std::mutex> Lock(Mutex_);
+
+        auto Iterator = SharedData_.find(Key);
+        if (Iterator != SharedData_.end())
+            return Iterator->second;
+
+        // Other users of Key wait until it is created
+        auto Data = Create();
+        if (Data)
+            SharedData_.emplace(Key, Data);
+
+        return Data;
+    }
+
+    VMMemorySnapshot::VMMemorySnapshot() noexcept :
+        Size_(), Guarded_(), SourceBase_(), MemoryMap_(), Images_(), Ranges_(), Cleared_(), Parent_(), SavedSize_(), Context_(),
+        Data_(), MappedSize_(), DataOffset_(), Handle_(-1)
+    {
+    }
+
+    const uint8_t* VMMemorySnapshot::FindPage(uint64_t Address) const
+    {
+        auto Contains = [Address](const std::vector<MemoryRange>& Ranges)
+        {
+            auto Next = std::upper_bound(Ranges.begin(), Ranges.end(), Address,
+                [](uint64_t Address, const MemoryRange& Range) { return Address < Range.Base; });
+
+            return Next != Ranges.begin() && Address - (Next - 1)->Base < (Next - 1)->Size;
+        };
+
+        for (auto Current = this; Current; Current = Current->Parent_.get())
+        {
+            if (Contains(Current->Ranges_))
+                return Current->Data_ + Current->DataOffset_ + Address;
+
+            if (Contains(Current->Cleared_))
+                return nullptr;
+        }
+
+        return nullptr;
+    }
+
+    uint64_t VMMemorySnapshot::WriteHeader(std::vector<uint8_t>& Header) const
+    {
+        SnapshotFileHeader FileHeader{};
+        FileHeader.Magic = FileMagic;
+        FileHeader.Version = FileVersion;
+        FileHeader.PageSize = VMMemoryManager::PageSize;
+        FileHeader.Flags = Guarded_ ? SnapshotFileFlags::GuardedAddressSpace : 0;
+        FileHeader.Size = Size_;
+        FileHeader.SourceBase = SourceBase_;
+        FileHeader.BlockCount = MemoryMap_.size();
+        FileHeader.RangeCount = Ranges_.size();
+        FileHeader.ContextSize = sizeof(VMExecutionContext);
+
+        auto HeaderSize =
+            sizeof(FileHeader) +
+            sizeof(SnapshotFileBlock) * MemoryMap_.size() +
+            sizeof(MemoryRange) * Ranges_.size() +
+            sizeof(VMExecutionContext);
+
+        FileHeader.DataOffset = (HeaderSize + SnapshotFileAlignment - 1) & ~(SnapshotFileAlignment - 1);
+
+        Header.resize(HeaderSize);
+        auto Current = Header.data();
+
+        std::memcpy(Current, &FileHeader, sizeof(FileHeader));
+        Current += sizeof(FileHeader);
+
+        for (const auto& Block : MemoryMap_)
+        {
+            const auto& Info = Block.second;
+
+            SnapshotFileBlock FileBlock{};
+            FileBlock.Base = Info.Base;
+            FileBlock.Size = Info.Size;
+            FileBlock.MaximumSize = Info.MaximumSize;
+            FileBlock.Tag = Info.Tag;
+            FileBlock.Type = static_cast<uint32_t>(Info.Type);
+            FileBlock.ImageSize = Info.Image ? Info.Image->Size() : 0;
+
+            std::memcpy(Current, &FileBlock, sizeof(FileBlock));
+            Current += sizeof(FileBlock);
+        }
+
+        for (const auto& Range : Ranges_)
+        {
+            std::memcpy(Current, &Range, sizeof(Range));
+            Current += sizeof(Range);
+        }
+
+        // Host pointers other than stacks are meaningless in another process
+        auto Context = Context_;
+        Context.TraceSink = nullptr;
+        std::memcpy(Current, &Context, sizeof(Context));
+
+        return FileHeader.DataOffset;
+    }
+
+    bool VMMemorySnapshot::Save(const std::string& Path) const
+    {
+        if (Parent_)
+            return false;
+
+        std::ofstream File(Path, std::ios::binary | std::ios::trunc);
+        if (!File)
+            return false;
+
+        std::vector<uint8_t> Header;
+        auto DataOffset = WriteHeader(Header);
+
+        File.write(reinterpret_cast<const char*>(Header.data()), Header.size());
+
+        auto WritePages = [&File, DataOffset](uint64_t Address, const uint8_t* Pages, size_t Size)
+        {
+            File.seekp(static_cast<std::streamoff>(DataOffset + Address));
+            File.write(reinterpret_cast<const char*>(Pages), Size);
+        };
+
+        for (const auto& Range : Ranges_)
+        {
+            auto Pages = Data_ + DataOffset_;
+            auto RunStart = Range.Base;
+            auto End = Range.Base + Range.Size;
+
+            // Runs of pages which are not zero
+            for (auto Address = Range.Base; Address <= End; Address += VMMemoryManager::PageSize)
+            {
+                if (Address < End && !IsZeroPage(Pages + Address))
+                    continue;
+
+                if (RunStart < Address)
+                    WritePages(RunStart, Pages + RunStart, static_cast<size_t>(Address - RunStart));
+
+                RunStart = Address + VMMemoryManager::PageSize;
+            }
+        }
+
+        for (const auto& Image : Images_)
+            WritePages(Image.first, Image.second->Data(), Image.second->Size());
+
+        // Extend the file to the end of the pages
+        File.seekp(0, std::ios::end);
+        auto FileSize = DataOffset + Size_;
+
+        if (static_cast<uint64_t>(File.tellp()) < FileSize)
+        {
+            File.seekp(static_cast<std::streamoff>(FileSize - 1));
+            File.put(0);
+        }
+
+        File.close();
+
+        return !File.fail();
+    }
+
+    bool VMMemorySnapshot::ReadHeader(const uint8_t* Header, size_t FileSize)
+    {
+        SnapshotFileHeader FileHeader;
+
+        if (FileSize < sizeof(FileHeader))
+            return false;
+
+        std::memcpy(&FileHeader, Header, sizeof(FileHeader));
+
+        if (FileHeader.Magic != FileMagic ||
+            FileHeader.Version != FileVersion ||
+            FileHeader.PageSize != VMMemoryManager::PageSize ||
+            FileHeader.ContextSize != sizeof(VMExecutionContext))
+            return false;
+
+        // Pages end the file
+        if (FileHeader.DataOffset > FileSize ||
+            FileSize - FileHeader.DataOffset != FileHeader.Size ||
+            (FileHeader.DataOffset & (SnapshotFileAlignment - 1)) ||
+            (FileHeader.Size & VMMemoryManager::PageMask))
+            return false;
+
+        // Counts are bounded by the page count, so the header size does not overflow
+        auto PageCount = FileHeader.Size >> VMMemoryManager::PageShift;
+
+        if (FileHeader.BlockCount > PageCount + 1 ||
+            FileHeader.RangeCount > PageCount)
+            return false;
+
+        auto HeaderSize =
+            sizeof(FileHeader) +
+            sizeof(SnapshotFileBlock) * FileHeader.BlockCount +
+            sizeof(MemoryRange) * FileHeader.RangeCount +
+            sizeof(VMExecutionContext);
+
+        if (FileHeader.DataOffset < HeaderSize)
+            return false;
+
+        Size_ = FileHeader.Size;
+        Guarded_ = !!(FileHeader.Flags & SnapshotFileFlags::GuardedAddressSpace);
+        SourceBase_ = FileHeader.SourceBase;
+        DataOffset_ = FileHeader.DataOffset;
+
+        auto Current = Header + sizeof(FileHeader);
+        uint64_t NextBase = 0;
+
+        for (uint64_t i = 0; i < FileHeader.BlockCount; i++)
+        {
+            SnapshotFileBlock FileBlock;
+            std::memcpy(&FileBlock, Current, sizeof(FileBlock));
+            Current += sizeof(FileBlock);
+
+            // Blocks are sorted and cover [0, Size)
+            if (FileBlock.Base != NextBase ||
+                FileBlock.MaximumSize > Size_ - FileBlock.Base ||
+                FileBlock.ImageSize > FileBlock.MaximumSize)
+                return false;
+
+            NextBase = FileBlock.Base + FileBlock.MaximumSize;
+
+            MemoryInfo Info{};
+            Info.Base = FileBlock.Base;
+            Info.Size = FileBlock.Size;
+            Info.MaximumSize = FileBlock.MaximumSize;
+            Info.Tag = static_cast<uintptr_t>(FileBlock.Tag);
+            Info.Type = static_cast<MemoryType>(FileBlock.Type);
+            Info.Image = nullptr;
+
+            if (FileBlock.ImageSize)
+            {
+                auto Image = VMCodeImage::Create(Data_ + DataOffset_ + Info.Base, static_cast<size_t>(FileBlock.ImageSize));
+                if (!Image)
+                    return false;
+
+                Info.Image = Image.get();
+                Images_.emplace(Info.Base, Image);
+            }
+
+            MemoryMap_.emplace(Info.Base, Info);
+        }
+
+        if (NextBase != Size_)
+            return false;
+
+        for (uint64_t i = 0; i < FileHeader.RangeCount; i++)
+        {
+            MemoryRange Range;
+            std::memcpy(&Range, Current, sizeof(Range));
+            Current += sizeof(Range);
+
+            if (((Range.Base | Range.Size) & VMMemoryManager::PageMask) ||
+                Range.Base > Size_ || Range.Size > Size_ - Range.Base)
+                return false;
+
+            Ranges_.push_back(Range);
+            SavedSize_ += static_cast<size_t>(Range.Size);
+        }
+
+        std::memcpy(&Context_, Current, sizeof(Context_));
+
+        return true;
+    }
+
+    VMMemoryManager::VMMemoryManager(size_t Size, bool GuardedAddressSpace) : 
+        Base_(), Size_(), ReservedSize_(), Guarded_(), MemoryMap_(), LastBlock_(MemoryMap_.end()), Images_(), AllocationBitmap_(), BlockBitmap_(), CodeBitmap_(), CodeGeneration_(),
+        Tracking_(), DirtyBitmap_(), Checkpoint_()
     {
-        DASSERT(Initialize(Size));
+        DASSERT(Initialize(Size, GuardedAddressSpace));
     }
 
     VMMemoryManager::~VMMemoryManager()
@@ -18,6 +402,11 @@ namespace VM_NAMESPACE
 
     size_t VMMemoryManager::Read(uint64_t Address, size_t Size, uint8_t* Buffer)
     {
+        // Only faults inside the reservation are handled
+        if (!IsGuestRange(Address, Size))
+            return 0;
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
         __try
         {
             std::memcpy(Buffer, reinterpret_cast<void*>(Base_ + Address), Size);
@@ -26,12 +415,26 @@ namespace VM_NAMESPACE
         {
             return 0;
         }
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+        if (!GuardedAccess(this, [&]()
+            {
+                std::memcpy(Buffer, reinterpret_cast<void*>(Base_ + Address), Size);
+            }))
+        {
+            return 0;
+        }
+#endif
 
         return Size;
     }
 
     size_t VMMemoryManager::Write(uint64_t Address, size_t Size, uint8_t* Buffer)
     {
+        // Only faults inside the reservation are handled
+        if (!IsGuestRange(Address, Size))
+            return 0;
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
         __try
         {
             std::memcpy(reinterpret_cast<void*>(Base_ + Address), Buffer, Size);
@@ -40,12 +443,28 @@ namespace VM_NAMESPACE
         {
             return 0;
         }
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+        if (!GuardedAccess(this, [&]()
+            {
+                std::memcpy(reinterpret_cast<void*>(Base_ + Address), Buffer, Size);
+            }))
+        {
+            return 0;
+        }
+#endif
+
+        NotifyWrite(Address, Size);
 
         return Size;
     }
 
     size_t VMMemoryManager::Fill(uint64_t Address, size_t Size, uint8_t Value)
     {
+        // Only faults inside the reservation are handled
+        if (!IsGuestRange(Address, Size))
+            return 0;
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
         __try
         {
             std::memset(reinterpret_cast<void*>(Base_ + Address), Value, Size);
@@ -54,12 +473,24 @@ namespace VM_NAMESPACE
         {
             return 0;
         }
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+        if (!GuardedAccess(this, [&]()
+            {
+                std::memset(reinterpret_cast<void*>(Base_ + Address), Value, Size);
+            }))
+        {
+            return 0;
+        }
+#endif
+
+        NotifyWrite(Address, Size);
 
         return Size;
     }
 
     bool VMMemoryManager::ExecuteInMemoryContext(void (*Function)(uintptr_t), uintptr_t Param)
     {
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
         __try
         {
             Function(Param);
@@ -70,10 +501,17 @@ namespace VM_NAMESPACE
         }
 
         return true;
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+        return GuardedAccess(this, [&]()
+            {
+                Function(Param);
+            });
+#endif
     }
 
     bool VMMemoryManager::ExecuteInMemoryContext(const std::function<void()>& Function)
     {
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
         __try
         {
             Function();
@@ -84,24 +522,33 @@ namespace VM_NAMESPACE
         }
 
         return true;
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+        return GuardedAccess(this, Function);
+#endif
     }
 
     bool VMMemoryManager::Allocate(uint64_t Address, size_t Size, MemoryType Type, intptr_t Tag, uint32_t Options, uint64_t& ResultAddress)
     {
-        return Reclaim(MemoryType::Freed, Address, Size, Type, Tag,
-            Options | Options::UsePreferredMemoryType, ResultAddress);
+        if (!Reclaim(MemoryType::Freed, Address, Size, Type, Tag,
+            Options | Options::UsePreferredMemoryType, ResultAddress))
+        {
+            return false;
+        }
+
+        if (!CommitPages(ResultAddress, RoundupToBlockSize(Size)))
+        {
+            Free(ResultAddress, 0);
+            return false;
+        }
+
+        MarkDirty(ResultAddress, RoundupToBlockSize(Size));
+
+        return true;
     }
 
     bool VMMemoryManager::Query(uint64_t Address, MemoryInfo& Info)
     {
-        // Search by start address only
-        auto Iterator = std::find_if(MemoryMap_.begin(), MemoryMap_.end(),
-            [Address](auto e)
-            {
-                return
-                    e.second.Base <= Address &&
-                    Address < e.second.Base + e.second.MaximumSize;
-            });
+        auto Iterator = FindBlock(Address);
 
         if (Iterator == MemoryMap_.end())
             return false;
@@ -129,6 +576,14 @@ namespace VM_NAMESPACE
         if (Info.Type == MemoryType::Freed)
             return 0;
 
+        // Image is unmapped as a whole
+        if (Info.Image &&
+            (Base != Info.Base || (Size && Size != Info.MaximumSize)))
+            return 0;
+
+        if (Info.Type == MemoryType::Bytecode)
+            CodeGeneration_++;
+
         size_t FreeSize = Size;
         if (!FreeSize)
         {
@@ -155,7 +610,15 @@ namespace VM_NAMESPACE
             int MergedCount = Merge(FreedAddress, MemoryType::Freed, MergedAddress);
 
             // Free the pages (if committed)
-            VirtualFree(reinterpret_cast<void*>(Base_ + FreedAddress), FreeSize, MEM_DECOMMIT);
+            if (Info.Image)
+            {
+                UnmapImagePages(FreedAddress, FreeSize);
+                Images_.erase(Info.Base);
+            }
+            else
+            {
+                DecommitPages(FreedAddress, FreeSize);
+            }
 
             // Clear allocation bitmap
             uint64_t BitIndex64 = RounddownToBlocks(FreedAddress);
@@ -165,99 +628,458 @@ namespace VM_NAMESPACE
             size_t PageCount = RoundupToBlocks(FreeSize);
             AllocationBitmap_.ClearRange(BitIndex, PageCount);
 
+            MarkDirty(FreedAddress, FreeSize);
+
             return FreeSize;
         }
 
         return 0;
     }
 
-    uintptr_t VMMemoryManager::Base() const
+    bool VMMemoryManager::MapImage(const std::shared_ptr<VMCodeImage>& Image, uint64_t Address, intptr_t Tag, uint32_t Options, uint64_t& ResultAddress)
     {
-        uintptr_t Result{};
-        DASSERT(Base::IntegerTestCast(Base_, Result));
-        return Result;
+        if (!Image || !Image->Size())
+            return false;
+
+        // Whole pages, as Free() expects
+        if (!Reclaim(MemoryType::Freed, Address, Image->MappedSize(), MemoryType::Bytecode, Tag,
+            Options | Options::UsePreferredMemoryType, ResultAddress))
+        {
+            return false;
+        }
+
+        if (!MapImagePages(ResultAddress, *Image))
+        {
+            Free(ResultAddress, 0);
+            return false;
+        }
+
+        auto Iterator = FindBlock(ResultAddress);
+        DASSERT(Iterator != MemoryMap_.end());
+        Iterator->second.Image = Image.get();
+
+        Images_.emplace(ResultAddress, Image);
+        MarkDirty(ResultAddress, Image->MappedSize());
+
+        return true;
     }
 
-    size_t VMMemoryManager::Size() const
+    std::shared_ptr<VMMemorySnapshot> VMMemoryManager::Snapshot(const VMExecutionContext& Context)
     {
-        size_t Result{};
-        DASSERT(Base::IntegerTestCast(Size_, Result));
+        std::shared_ptr<VMMemorySnapshot> Result(new VMMemorySnapshot());
+        Result->Size_ = Size_;
+        Result->Guarded_ = Guarded_;
+        Result->SourceBase_ = Base_;
+        Result->MemoryMap_ = MemoryMap_;
+        Result->Images_ = Images_;
+        Result->Context_ = Context;
+
+        // Forks map images again
+        Result->Ranges_ = CommittedRanges();
+
+        for (const auto& Range : Result->Ranges_)
+            Result->SavedSize_ += static_cast<size_t>(Range.Size);
+
+        if (!SavePages(*Result))
+            return nullptr;
+
         return Result;
     }
 
-    uintptr_t VMMemoryManager::HostAddress(uint64_t GuestAddress, size_t Size)
+    std::unique_ptr<VMMemoryManager> VMMemoryManager::Fork(const VMMemorySnapshot& Snapshot, VMExecutionContext& Context)
     {
-        auto Start = GuestAddress;
-        auto End = GuestAddress + Size - 1;
+        auto Memory = std::make_unique<VMMemoryManager>(static_cast<size_t>(Snapshot.Size_), Snapshot.Guarded_);
 
-        DASSERT(!(GuestAddress & ~0xffffffff));
+        if (!Memory->Base_)
+            return nullptr;
 
-        auto ResultAddress = Base_ + GuestAddress;
+        Memory->MemoryMap_ = Snapshot.MemoryMap_;
+        Memory->LastBlock_ = Memory->MemoryMap_.end();
+        Memory->UpdateBlockBitmap();
+        Memory->Images_ = Snapshot.Images_;
 
-        // check whether Start is in range [0, Size_)
-        if (!(Start < Size_))
-            return 0;
+        // Blocks keep their generations; later ones must differ from them
+        for (const auto& Block : Memory->MemoryMap_)
+            Memory->CodeGeneration_ = (std::max)(Memory->CodeGeneration_, Block.second.Generation);
 
-        if (Size)
+        if (!Memory->RestoreSnapshot(Snapshot))
+            return nullptr;
+
+        for (const auto& Image : Memory->Images_)
         {
-            // check whether [Start, End] is in range [0, Size_)
-            if (!(Start <= End && End < Size_))
-                return 0;
+            if (!Memory->MapImagePages(Image.first, *Image.second))
+                return nullptr;
         }
 
-        return ResultAddress;
-    }
+        Context = Snapshot.Context_;
+        Memory->RelocateContext(Snapshot, Context);
 
+        return Memory;
+    }
 
-    bool VMMemoryManager::Initialize(size_t Size)
+    std::shared_ptr<VMMemorySnapshot> VMMemoryManager::Checkpoint(const VMExecutionContext& Context)
     {
-        DASSERT(!Base_);
-        auto Base = VirtualAlloc(nullptr, static_cast<size_t>(Size), MEM_RESERVE, PAGE_NOACCESS);
+        if (!Tracking_)
+        {
+            auto Result = Snapshot(Context);
+            if (!Result)
+                return nullptr;
 
-        if (!Base)
-            return false;
+            for (const auto& Range : Result->Ranges_)
+            {
+                if (!ProtectPages(Range.Base, static_cast<size_t>(Range.Size), false))
+                    return nullptr;
+            }
 
-        Base_ = reinterpret_cast<uint64_t>(Base);
-        Size_ = Size;
+            DirtyBitmap_ = Bitmap(AllocationBitmap_.Count());
+            Tracking_ = true;
+            Checkpoint_ = Result;
 
-        const uint64_t MemoryStart = 0ull;
+            return Result;
+        }
 
-        MemoryInfo Info;
-        Info.Base = MemoryStart;
-        Info.Size = Size;
-        Info.MaximumSize = Size;
-        Info.Tag = 0;
-        Info.Type = MemoryType::Freed;
+        std::shared_ptr<VMMemorySnapshot> Result(new VMMemorySnapshot());
+        Result->Size_ = Size_;
+        Result->Guarded_ = Guarded_;
+        Result->SourceBase_ = Base_;
+        Result->MemoryMap_ = MemoryMap_;
+        Result->Images_ = Images_;
+        Result->Context_ = Context;
+        Result->Parent_ = Checkpoint_;
+
+        // Dirty pages are saved if committed, or cleared
+        for (const auto& Range : DirtyRanges())
+        {
+            for (auto Address = Range.Base; Address < Range.Base + Range.Size; Address += PageSize)
+            {
+                bool Committed = false;
+                AllocationBitmap_.Get(static_cast<size_t>(RounddownToBlocks(Address)), Committed);
 
-        MemoryMap_ = { { MemoryStart, Info } };
+                auto Block = FindBlock(Address);
+                if (Committed && (Block == MemoryMap_.end() || Block->second.Image))
+                    Committed = false;
 
-        size_t BitCount = RoundupToBlocks(Size);
-        AllocationBitmap_ = Bitmap(BitCount);
+                auto& Ranges = Committed ? Result->Ranges_ : Result->Cleared_;
 
-        return true;
-    }
+                if (!Ranges.empty() && Ranges.back().Base + Ranges.back().Size == Address)
+                    Ranges.back().Size += PageSize;
+                else
+                    Ranges.emplace_back(Address, PageSize);
+            }
+        }
 
-    void VMMemoryManager::Cleanup()
-    {
-        if (Base_)
-        {
-            AllocationBitmap_ = {};
-            MemoryMap_.clear();
+        for (const auto& Range : Result->Ranges_)
+            Result->SavedSize_ += static_cast<size_t>(Range.Size);
 
-            VirtualFree(reinterpret_cast<void*>(Base_), 0, MEM_RELEASE);
-            Base_ = 0;
-            Size_ = 0;
+        if (!SavePages(*Result))
+            return nullptr;
+
+        for (const auto& Range : Result->Ranges_)
+        {
+            if (!ProtectPages(Range.Base, static_cast<size_t>(Range.Size), false))
+                return nullptr;
         }
+
+        DirtyBitmap_.ClearAll();
+        Checkpoint_ = Result;
+
+        return Result;
     }
 
-    bool VMMemoryManager::Reclaim(MemoryType SourceType, uint64_t ReclaimAddress, size_t ReclaimSize, MemoryType ReclaimType, intptr_t Tag, uint32_t ReclaimOptions, uint64_t& ResultAddress)
+    bool VMMemoryManager::Rollback(VMExecutionContext& Context)
     {
-        DASSERT(!MemoryMap_.empty());
+        if (!Tracking_)
+            return false;
 
-        size_t ActualSize = RoundupToBlockSize(ReclaimSize);
-        MemoryType ActualType = SourceType;
+        const auto& Saved = *Checkpoint_;
+        std::vector<uint64_t> ImageBases;
+        std::vector<uint64_t> CodeBases;    // restored bytecode blocks
+        bool CodeModified = false;
 
-        bool IsAddressSpecified = !!(ReclaimOptions & Options::UsePreferredAddress);
+        for (const auto& Range : DirtyRanges())
+        {
+            for (auto Address = Range.Base; Address < Range.Base + Range.Size; Address += PageSize)
+            {
+                auto BitIndex = static_cast<size_t>(RounddownToBlocks(Address));
+
+                bool Committed = false;
+                AllocationBitmap_.Get(BitIndex, Committed);
+
+                auto Current = FindBlock(Address);
+                auto Block = Saved.MemoryMap_.upper_bound(Address);
+                DASSERT(Block != Saved.MemoryMap_.begin());
+                --Block;
+
+                if (Block->second.Type == MemoryType::Bytecode ||
+                    (Current != MemoryMap_.end() && Current->second.Type == MemoryType::Bytecode))
+                    CodeModified = true;
+
+                if (Block->second.Type == MemoryType::Bytecode &&
+                    (CodeBases.empty() || CodeBases.back() != Block->second.Base))
+                    CodeBases.push_back(Block->second.Base);
+
+                auto Page = Block->second.Image ? nullptr : Saved.FindPage(Address);
+
+                if (Page && Committed && Current != MemoryMap_.end() && !Current->second.Image)
+                {
+                    // Dirty pages are writable; restored in place
+                    std::memcpy(reinterpret_cast<void*>(Base_ + Address), Page, PageSize);
+                }
+                else
+                {
+                    // Current contents (or mapping) are dropped first
+                    DecommitPages(Address, PageSize);
+                    AllocationBitmap_.Clear(BitIndex);
+
+                    if (Block->second.Image)
+                    {
+                        // Mapped again as a whole below
+                        if (ImageBases.empty() || ImageBases.back() != Block->second.Base)
+                            ImageBases.push_back(Block->second.Base);
+
+                        continue;
+                    }
+
+                    if (!Page)
+                        continue;
+
+                    // Pages may be committed on first write (see SEH_Pagefault)
+                    if (!CommitPages(Address, PageSize) ||
+                        !ExecuteInMemoryContext([&]() { std::memcpy(reinterpret_cast<void*>(Base_ + Address), Page, PageSize); }))
+                        return false;
+
+                    AllocationBitmap_.Set(BitIndex);
+                }
+
+                if (!ProtectPages(Address, PageSize, false))
+                    return false;
+            }
+        }
+
+        MemoryMap_ = Saved.MemoryMap_;
+        LastBlock_ = MemoryMap_.end();
+        UpdateBlockBitmap();
+        Images_ = Saved.Images_;
+
+        for (auto ImageBase : ImageBases)
+        {
+            if (!MapImagePages(ImageBase, *Images_[ImageBase]))
+                return false;
+        }
+
+        DirtyBitmap_.ClearAll();
+
+        // Regions decoded from restored bytecode are stale
+        for (auto CodeBase : CodeBases)
+            FindBlock(CodeBase)->second.Generation = ++CodeGeneration_;
+
+        if (CodeModified)
+            CodeGeneration_++;
+
+        Context = Saved.Context_;
+        RelocateContext(Saved, Context);
+
+        return true;
+    }
+
+    void VMMemoryManager::DiscardCheckpoints()
+    {
+        if (!Tracking_)
+            return;
+
+        // Clean pages are writable again
+        for (const auto& Range : CommittedRanges())
+            ProtectPages(Range.Base, static_cast<size_t>(Range.Size), true);
+
+        Tracking_ = false;
+        DirtyBitmap_ = {};
+        Checkpoint_.reset();
+    }
+
+    std::vector<MemoryRange> VMMemoryManager::DirtyRanges()
+    {
+        std::vector<MemoryRange> Ranges;
+
+        if (!Tracking_)
+            return Ranges;
+
+        size_t End = DirtyBitmap_.Count();
+        size_t Page = 0;
+
+        while (Page < End)
+        {
+            auto Start = DirtyBitmap_.FindFirstSet(Page);
+            if (Start == Bitmap::Position::Invalid)
+                break;
+
+            Page = DirtyBitmap_.FindFirstClear(Start);
+            if (Page == Bitmap::Position::Invalid)
+                Page = End;
+
+            Ranges.emplace_back(static_cast<uint64_t>(Start) << PageShift, static_cast<uint64_t>(Page - Start) << PageShift);
+        }
+
+        return Ranges;
+    }
+
+    bool VMMemoryManager::Serialize(const VMExecutionContext& Context, const std::string& Path)
+    {
+        auto Saved = Snapshot(Context);
+        return Saved && Saved->Save(Path);
+    }
+
+    std::unique_ptr<VMMemoryManager> VMMemoryManager::Deserialize(const std::string& Path, VMExecutionContext& Context)
+    {
+        auto Loaded = VMMemorySnapshot::Load(Path);
+        if (!Loaded)
+            return nullptr;
+
+        return Fork(*Loaded, Context);
+    }
+
+    void VMMemoryManager::NotifyWrite(uint64_t Address, size_t Size)
+    {
+        if (!Size)
+            return;
+
+        uint64_t End = Address + Size;
+
+        // Most writes are to data and stacks; blocks are looked up only for bytecode pages
+        auto Page = CodeBitmap_.FindFirstSet(
+            static_cast<size_t>(RounddownToBlocks(Address)), static_cast<size_t>(RoundupToBlocks(End)));
+        if (Page == Bitmap::Position::Invalid)
+            return;
+
+        for (auto Iterator = FindBlock(Address);
+            Iterator != MemoryMap_.end() && Iterator->second.Base < End;
+            ++Iterator)
+        {
+            // Decoded instructions of this block are no longer valid
+            if (Iterator->second.Type == MemoryType::Bytecode)
+                Iterator->second.Generation = ++CodeGeneration_;
+        }
+    }
+
+    uintptr_t VMMemoryManager::Base() const
+    {
+        uintptr_t Result{};
+        DASSERT(Base::IntegerTestCast(Base_, Result));
+        return Result;
+    }
+
+    size_t VMMemoryManager::Size() const
+    {
+        size_t Result{};
+        DASSERT(Base::IntegerTestCast(Size_, Result));
+        return Result;
+    }
+
+    uintptr_t VMMemoryManager::HostAddress(uint64_t GuestAddress, size_t Size)
+    {
+        auto Start = GuestAddress;
+        auto End = GuestAddress + Size - 1;
+
+        DASSERT(!(GuestAddress & ~0xffffffff));
+
+        auto ResultAddress = Base_ + GuestAddress;
+
+        // check whether Start is in range [0, Size_)
+        if (!(Start < Size_))
+            return 0;
+
+        if (Size)
+        {
+            // check whether [Start, End] is in range [0, Size_)
+            if (!(Start <= End && End < Size_))
+                return 0;
+        }
+
+        return ResultAddress;
+    }
+
+
+    bool VMMemoryManager::Initialize(size_t Size, bool GuardedAddressSpace)
+    {
+        DASSERT(!Base_);
+
+        uint64_t ReservedSize = Size;
+
+        if (GuardedAddressSpace)
+        {
+#if M_IS_ARCH_64
+            // Managed range must be inside of 32-bit guest address space
+            if (Size > 0x100000000ull)
+                return false;
+
+            ReservedSize = GuardedReservationSize;
+#else
+            return false;
+#endif
+        }
+
+        auto Base = ReservePages(static_cast<size_t>(ReservedSize));
+
+        if (!Base)
+            return false;
+
+        Base_ = reinterpret_cast<uint64_t>(Base);
+        Size_ = Size;
+        ReservedSize_ = ReservedSize;
+        Guarded_ = GuardedAddressSpace;
+
+        const uint64_t MemoryStart = 0ull;
+
+        MemoryInfo Info;
+        Info.Base = MemoryStart;
+        Info.Size = Size;
+        Info.MaximumSize = Size;
+        Info.Tag = 0;
+        Info.Type = MemoryType::Freed;
+        Info.Image = nullptr;
+        Info.Generation = 0;
+
+        MemoryMap_ = { { MemoryStart, Info } };
+        LastBlock_ = MemoryMap_.end();
+
+        size_t BitCount = RoundupToBlocks(Size);
+        AllocationBitmap_ = Bitmap(BitCount);
+        BlockBitmap_ = SummaryBitmap(BitCount);
+        CodeBitmap_ = Bitmap(BitCount);
+
+        return true;
+    }
+
+    void VMMemoryManager::Cleanup()
+    {
+        if (Base_)
+        {
+            AllocationBitmap_ = {};
+            BlockBitmap_ = {};
+            CodeBitmap_ = {};
+            MemoryMap_.clear();
+            LastBlock_ = MemoryMap_.end();
+
+            // Mapped images are unmapped with the reservation
+            ReleasePages(reinterpret_cast<void*>(Base_), static_cast<size_t>(ReservedSize_));
+            Images_.clear();
+            Tracking_ = false;
+            DirtyBitmap_ = {};
+            Checkpoint_.reset();
+            Base_ = 0;
+            Size_ = 0;
+            ReservedSize_ = 0;
+            Guarded_ = false;
+        }
+    }
+
+    bool VMMemoryManager::Reclaim(MemoryType SourceType, uint64_t ReclaimAddress, size_t ReclaimSize, MemoryType ReclaimType, intptr_t Tag, uint32_t ReclaimOptions, uint64_t& ResultAddress)
+    {
+        DASSERT(!MemoryMap_.empty());
+
+        size_t ActualSize = RoundupToBlockSize(ReclaimSize);
+        MemoryType ActualType = SourceType;
+
+        bool IsAddressSpecified = !!(ReclaimOptions & Options::UsePreferredAddress);
         bool IsSourceTypeSpecified = !!(ReclaimOptions & Options::UsePreferredMemoryType);
 
         uint64_t Start = 0;
@@ -277,14 +1099,7 @@ namespace VM_NAMESPACE
             if (Start & PageMask)
                 return false;
 
-            // Search by start address only
-            Iterator = std::find_if(MemoryMap_.begin(), MemoryMap_.end(),
-                [Start](auto e)
-                {
-                    return
-                        e.second.Base <= Start &&
-                        Start < e.second.Base + e.second.MaximumSize;
-                });
+            Iterator = FindBlock(Start);
 
             if (Iterator == MemoryMap_.end())
                 return false;
@@ -300,6 +1115,37 @@ namespace VM_NAMESPACE
                     return false;
             }
         }
+        else if (IsSourceTypeSpecified && ActualType == MemoryType::Freed)
+        {
+            //
+            // First fit from BlockBitmap_. A run of free pages starts at a
+            // freed block and may span freed blocks which are not merged;
+            // it fits if the block which it starts at is large enough.
+            //
+
+            size_t PageCount = static_cast<size_t>(RoundupToBlocks(ActualSize));
+            auto Page = BlockBitmap_.FindFirstClearRange(0, PageCount);
+
+            while (true)
+            {
+                if (Page == SummaryBitmap::Position::Invalid)
+                    return false;
+
+                Iterator = FindBlock(static_cast<uint64_t>(Page) << PageShift);
+                DASSERT(Iterator != MemoryMap_.end() && Iterator->second.Type == MemoryType::Freed);
+
+                if (ActualSize <= Iterator->second.MaximumSize)
+                    break;
+
+                Page = BlockBitmap_.FindFirstClearRange(
+                    static_cast<size_t>(RoundupToBlocks(Iterator->second.Base + Iterator->second.MaximumSize)), PageCount);
+            }
+
+            Start = Iterator->second.Base;
+            End = Iterator->second.Base + ActualSize - 1;
+
+            DASSERT(Start == static_cast<uint64_t>(Page) << PageShift);
+        }
         else
         {
             // Find block
@@ -349,6 +1195,7 @@ namespace VM_NAMESPACE
             Iterator->second.Type = ReclaimType;
             Iterator->second.Tag = Tag;
             Iterator->second.Size = ReclaimSize;
+            Iterator->second.Image = nullptr;
 
             break;
         }
@@ -371,7 +1218,8 @@ namespace VM_NAMESPACE
             //if (OriginalInfo.Base != SourceRange.Base)
             //    std::swap(Info2, Info3);
 
-            MemoryMap_.erase(OriginalInfo.Base);
+            MemoryMap_.erase(Iterator);
+            LastBlock_ = MemoryMap_.end();
 
             for (auto& it : NewInfo)
             {
@@ -403,7 +1251,8 @@ namespace VM_NAMESPACE
             NewInfo[2].Type = OriginalInfo.Type;
             NewInfo[2].Tag = OriginalInfo.Tag;
 
-            MemoryMap_.erase(OriginalInfo.Base);
+            MemoryMap_.erase(Iterator);
+            LastBlock_ = MemoryMap_.end();
 
             for (auto& it : NewInfo)
             {
@@ -417,6 +1266,48 @@ namespace VM_NAMESPACE
             return false;
         }
 
+        if ((ActualType == MemoryType::Freed) != (ReclaimType == MemoryType::Freed))
+        {
+            auto BitIndex = static_cast<size_t>(RounddownToBlocks(SourceRange.Base));
+            auto PageCount = static_cast<size_t>(RoundupToBlocks(ActualSize));
+
+            if (ReclaimType == MemoryType::Freed)
+            {
+                DASSERT(BlockBitmap_.ClearRange(BitIndex, PageCount));
+            }
+            else
+            {
+                DASSERT(BlockBitmap_.SetRange(BitIndex, PageCount));
+            }
+        }
+
+        if ((ActualType == MemoryType::Bytecode) != (ReclaimType == MemoryType::Bytecode))
+        {
+            auto BitIndex = static_cast<size_t>(RounddownToBlocks(SourceRange.Base));
+            auto PageCount = static_cast<size_t>(RoundupToBlocks(ActualSize));
+
+            if (ReclaimType == MemoryType::Bytecode)
+            {
+                DASSERT(CodeBitmap_.SetRange(BitIndex, PageCount));
+            }
+            else
+            {
+                DASSERT(CodeBitmap_.ClearRange(BitIndex, PageCount));
+            }
+        }
+
+        if (ActualType == MemoryType::Bytecode || ReclaimType == MemoryType::Bytecode)
+        {
+            // Regions decoded at these addresses before are stale
+            for (auto Block = FindBlock(OriginalInfo.Base);
+                Block != MemoryMap_.end() && Block->second.Base < OriginalInfo.Base + OriginalInfo.MaximumSize;
+                ++Block)
+            {
+                if (Block->second.Type == MemoryType::Bytecode)
+                    Block->second.Generation = ++CodeGeneration_;
+            }
+        }
+
         ResultAddress = SourceRange.Base;
 
         return true;
@@ -431,13 +1322,7 @@ namespace VM_NAMESPACE
 
         while (true)
         {
-            auto Iterator = std::find_if(MemoryMap_.begin(), MemoryMap_.end(),
-                [TargetAddress](auto e)
-                {
-                    return
-                        e.second.Base <= TargetAddress &&
-                        TargetAddress < e.second.Base + e.second.MaximumSize;
-                });
+            auto Iterator = FindBlock(TargetAddress);
 
             if (Iterator == MemoryMap_.end())
                 break;
@@ -445,10 +1330,9 @@ namespace VM_NAMESPACE
             if (Iterator->second.Type != Type)
                 break;
 
-            auto IteratorPrev = Iterator;
-            --IteratorPrev;
-            if (IteratorPrev != MemoryMap_.end())
+            if (Iterator != MemoryMap_.begin())
             {
+                auto IteratorPrev = std::prev(Iterator);
                 uint64_t ExpectedBase =
                     IteratorPrev->second.Base + IteratorPrev->second.MaximumSize;
                 if (IteratorPrev->second.Type == Iterator->second.Type &&
@@ -459,6 +1343,7 @@ namespace VM_NAMESPACE
                     IteratorPrev->second.MaximumSize += Iterator->second.MaximumSize;
                     IteratorPrev->second.Size += Iterator->second.MaximumSize;
                     MemoryMap_.erase(Iterator); // Delete element by iterator
+                    LastBlock_ = MemoryMap_.end();
                     MergedCount++;
                     continue;
                 }
@@ -478,6 +1363,7 @@ namespace VM_NAMESPACE
                     Iterator->second.MaximumSize += IteratorNext->second.MaximumSize;
                     Iterator->second.Size += IteratorNext->second.MaximumSize;
                     MemoryMap_.erase(IteratorNext); // Delete element by iterator
+                    LastBlock_ = MemoryMap_.end();
                     MergedCount++;
                     continue;
                 }
@@ -491,6 +1377,156 @@ namespace VM_NAMESPACE
         return MergedCount;
     }
     
+    void VMMemoryManager::UpdateBlockBitmap()
+    {
+        BlockBitmap_.ClearAll();
+        CodeBitmap_.ClearAll();
+
+        for (const auto& Block : MemoryMap_)
+        {
+            if (Block.second.Type != MemoryType::Freed)
+            {
+                DASSERT(BlockBitmap_.SetRange(
+                    static_cast<size_t>(RounddownToBlocks(Block.second.Base)),
+                    static_cast<size_t>(RoundupToBlocks(Block.second.MaximumSize))));
+            }
+
+            if (Block.second.Type == MemoryType::Bytecode)
+            {
+                DASSERT(CodeBitmap_.SetRange(
+                    static_cast<size_t>(RounddownToBlocks(Block.second.Base)),
+                    static_cast<size_t>(RoundupToBlocks(Block.second.MaximumSize))));
+            }
+        }
+    }
+
+    std::map<uint64_t, MemoryInfo>::iterator VMMemoryManager::FindBlock(uint64_t Address)
+    {
+        //
+        // Blocks are contiguous and keyed by base address, so the block
+        // which contains Address is the one right before upper_bound(Address).
+        // Consecutive lookups tend to hit the same block; check it first.
+        //
+
+        if (LastBlock_ != MemoryMap_.end() &&
+            LastBlock_->second.Base <= Address &&
+            Address < LastBlock_->second.Base + LastBlock_->second.MaximumSize)
+        {
+            return LastBlock_;
+        }
+
+        auto Iterator = MemoryMap_.upper_bound(Address);
+        if (Iterator == MemoryMap_.begin())
+            return MemoryMap_.end();
+
+        --Iterator;
+
+        if (!(Address < Iterator->second.Base + Iterator->second.MaximumSize))
+            return MemoryMap_.end();
+
+        LastBlock_ = Iterator;
+
+        return Iterator;
+    }
+
+    std::vector<MemoryRange> VMMemoryManager::CommittedRanges()
+    {
+        std::vector<MemoryRange> Ranges;
+
+        for (const auto& Block : MemoryMap_)
+        {
+            const auto& Info = Block.second;
+
+            if (Info.Type == MemoryType::Freed || Info.Image)
+                continue;
+
+            size_t Page = static_cast<size_t>(RounddownToBlocks(Info.Base));
+            size_t End = static_cast<size_t>(RoundupToBlocks(Info.Base + Info.MaximumSize));
+
+            while (Page < End)
+            {
+                auto Start = AllocationBitmap_.FindFirstSet(Page);
+                if (Start == Bitmap::Position::Invalid || Start >= End)
+                    break;
+
+                Page = AllocationBitmap_.FindFirstClear(Start);
+                if (Page == Bitmap::Position::Invalid || Page > End)
+                    Page = End;
+
+                Ranges.emplace_back(static_cast<uint64_t>(Start) << PageShift, static_cast<uint64_t>(Page - Start) << PageShift);
+            }
+        }
+
+        return Ranges;
+    }
+
+    bool VMMemoryManager::RestoreSnapshot(const VMMemorySnapshot& Snapshot)
+    {
+        // A delta applies on top of its parent
+        if (Snapshot.Parent_ && !RestoreSnapshot(*Snapshot.Parent_))
+            return false;
+
+        for (const auto& Range : Snapshot.Cleared_)
+        {
+            DecommitPages(Range.Base, static_cast<size_t>(Range.Size));
+            AllocationBitmap_.ClearRange(static_cast<size_t>(RounddownToBlocks(Range.Base)), static_cast<size_t>(RoundupToBlocks(Range.Size)));
+        }
+
+        return RestorePages(Snapshot);
+    }
+
+    void VMMemoryManager::RelocateContext(const VMMemorySnapshot& Snapshot, VMExecutionContext& Context) const
+    {
+        // Stacks outside of the source memory are left as is
+        auto Delta = static_cast<int64_t>(Base_ - Snapshot.SourceBase_);
+
+        for (auto Stack : { &Context.Stack, &Context.ShadowStack, &Context.LocalVariableStack, &Context.ArgumentStack })
+        {
+            auto StackBase = Stack->Top() - Stack->TopOffset();
+
+            if (StackBase && Base::IsInRange2(Snapshot.SourceBase_, Snapshot.Size_, StackBase))
+                Stack->Relocate(Delta);
+        }
+    }
+
+    void VMMemoryManager::MarkDirty(uint64_t Address, size_t Size)
+    {
+        if (!Tracking_ || !Size)
+            return;
+
+        auto BitIndex = static_cast<size_t>(RounddownToBlocks(Address));
+        DASSERT(DirtyBitmap_.SetRange(BitIndex, static_cast<size_t>(RoundupToBlocks(Address + Size)) - BitIndex));
+    }
+
+    bool VMMemoryManager::TrackWrite(uint64_t HostAddress)
+    {
+        if (!Tracking_ || !Base::IsInRange2(Base_, Size_, HostAddress))
+            return false;
+
+        auto Address = RounddownToBlockSize(HostAddress - Base_);
+        auto BitIndex = static_cast<size_t>(RounddownToBlocks(Address));
+
+        bool Committed = false;
+        bool Dirty = false;
+        AllocationBitmap_.Get(BitIndex, Committed);
+        DirtyBitmap_.Get(BitIndex, Dirty);
+
+        // Clean pages are write-protected; images are always read-only
+        if (!Committed || Dirty)
+            return false;
+
+        auto Block = FindBlock(Address);
+        if (Block == MemoryMap_.end() || Block->second.Image)
+            return false;
+
+        if (!ProtectPages(Address, PageSize, true))
+            return false;
+
+        DirtyBitmap_.Set(BitIndex);
+
+        return true;
+    }
+
     int VMMemoryManager::Split(MemoryRange& SourceRange, uint64_t Address, size_t Size, MemoryRange SplitRange[2])
     {
         uint64_t Start = SourceRange.Base;
@@ -546,46 +1582,532 @@ namespace VM_NAMESPACE
         }
     }
 
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
+    void* VMMemoryManager::ReservePages(size_t Size)
+    {
+        return VirtualAlloc(nullptr, Size, MEM_RESERVE, PAGE_NOACCESS);
+    }
+
+    void VMMemoryManager::ReleasePages(void* Address, size_t Size)
+    {
+        VirtualFree(Address, 0, MEM_RELEASE);
+    }
+
+    bool VMMemoryManager::CommitPages(uint64_t Address, size_t Size)
+    {
+        // Pages are committed on first write (see SEH_Pagefault)
+        return true;
+    }
+
+    void VMMemoryManager::DecommitPages(uint64_t Address, size_t Size)
+    {
+        VirtualFree(reinterpret_cast<void*>(Base_ + Address), Size, MEM_DECOMMIT);
+    }
+
+    bool VMMemoryManager::MapImagePages(uint64_t Address, const VMCodeImage& Image)
+    {
+        auto HostAddress = reinterpret_cast<void*>(Base_ + Address);
+
+        if (!VirtualAlloc(HostAddress, Image.MappedSize(), MEM_COMMIT, PAGE_READWRITE))
+            return false;
+
+        std::memcpy(HostAddress, Image.Data(), Image.Size());
+
+        DWORD OldProtect = 0;
+        if (!VirtualProtect(HostAddress, Image.MappedSize(), PAGE_READONLY, &OldProtect))
+        {
+            DecommitPages(Address, Image.MappedSize());
+            return false;
+        }
+
+        uint64_t BitIndex64 = RounddownToBlocks(Address);
+        size_t BitIndex = static_cast<size_t>(BitIndex64);
+        DASSERT(BitIndex == BitIndex64);
+
+        DASSERT(AllocationBitmap_.SetRange(BitIndex, RoundupToBlocks(Image.MappedSize())));
+
+        return true;
+    }
+
+    void VMMemoryManager::UnmapImagePages(uint64_t Address, size_t Size)
+    {
+        DecommitPages(Address, Size);
+    }
+
+    bool VMMemoryManager::ProtectPages(uint64_t Address, size_t Size, bool Writable)
+    {
+        DWORD OldProtect = 0;
+        return !!VirtualProtect(reinterpret_cast<void*>(Base_ + Address), Size, Writable ? PAGE_READWRITE : PAGE_READONLY, &OldProtect);
+    }
+
+    bool VMMemoryManager::SavePages(VMMemorySnapshot& Snapshot)
+    {
+        auto Data = VirtualAlloc(nullptr, static_cast<size_t>(Snapshot.Size_), MEM_RESERVE, PAGE_NOACCESS);
+        if (!Data)
+            return false;
+
+        Snapshot.Data_ = reinterpret_cast<uint8_t*>(Data);
+
+        // Only pages written before are committed (see SEH_Pagefault)
+        for (const auto& Range : Snapshot.Ranges_)
+        {
+            auto Target = Snapshot.Data_ + Range.Base;
+            auto Size = static_cast<size_t>(Range.Size);
+
+            if (!VirtualAlloc(Target, Size, MEM_COMMIT, PAGE_READWRITE))
+                return false;
+
+            std::memcpy(Target, reinterpret_cast<void*>(Base_ + Range.Base), Size);
+
+            DWORD OldProtect = 0;
+            if (!VirtualProtect(Target, Size, PAGE_READONLY, &OldProtect))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool VMMemoryManager::RestorePages(const VMMemorySnapshot& Snapshot)
+    {
+        for (const auto& Range : Snapshot.Ranges_)
+        {
+            auto Target = reinterpret_cast<void*>(Base_ + Range.Base);
+            auto Size = static_cast<size_t>(Range.Size);
+
+            if (!VirtualAlloc(Target, Size, MEM_COMMIT, PAGE_READWRITE))
+                return false;
+
+            std::memcpy(Target, Snapshot.Data_ + Snapshot.DataOffset_ + Range.Base, Size);
+
+            uint64_t BitIndex64 = RounddownToBlocks(Range.Base);
+            size_t BitIndex = static_cast<size_t>(BitIndex64);
+            DASSERT(BitIndex == BitIndex64);
+
+            DASSERT(AllocationBitmap_.SetRange(BitIndex, RoundupToBlocks(Size)));
+        }
+
+        return true;
+    }
+
     long VMMemoryManager::SEH_Pagefault(long Code, void *ExceptionInfo, void* SEHContext)
     {
         auto Pointers = reinterpret_cast<EXCEPTION_POINTERS*>(ExceptionInfo);
-        if (Pointers->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION)
+        auto This = reinterpret_cast<VMMemoryManager*>(SEHContext);
+
+        // Other exceptions and faults outside of guest memory are host bugs
+        if (Pointers->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+            return EXCEPTION_CONTINUE_SEARCH;
+
+        auto Mode = Pointers->ExceptionRecord->ExceptionInformation[0];
+        uint64_t TargetAddress = Pointers->ExceptionRecord->ExceptionInformation[1];
+
+        if (!This->IsHostAddressReserved(TargetAddress))
+            return EXCEPTION_CONTINUE_SEARCH;
+
+        // Access mode: 0=read, 1=write, 8=DEP violation
+        if (Mode == 1) // Write attempt?
         {
-            auto Mode = Pointers->ExceptionRecord->ExceptionInformation[0];
-            uint64_t TargetAddress = Pointers->ExceptionRecord->ExceptionInformation[1];
+            // First write to a clean page
+            if (This->TrackWrite(TargetAddress))
+                return EXCEPTION_CONTINUE_EXECUTION;
 
-            // Access mode: 0=read, 1=write, 8=DEP violation
-            if (Mode == 1) // Write attempt?
+            if (Base::IsInRange2(This->Base_, This->Size_, TargetAddress))
             {
-                auto This = reinterpret_cast<VMMemoryManager*>(SEHContext);
-                if (Base::IsInRange2(This->Base_, This->Size_, TargetAddress))
+                // Only pages of allocated blocks are committed; images are read-only
+                auto Block = This->FindBlock(TargetAddress - This->Base_);
+                if (Block == This->MemoryMap_.end() ||
+                    Block->second.Type == MemoryType::Freed ||
+                    Block->second.Image)
+                    return EXCEPTION_EXECUTE_HANDLER;
+
+                uint64_t NewAddress = RounddownToBlockSize(TargetAddress);
+
+                // Request 1 page
+                auto p = VirtualAlloc(reinterpret_cast<void*>(NewAddress),
+                    PageSize, MEM_COMMIT, PAGE_READWRITE);
+                if (p)
                 {
-                    uint64_t NewAddress = RounddownToBlockSize(TargetAddress);
+                    uint64_t BitIndex64 = RounddownToBlocks(NewAddress - This->Base_);
+                    DASSERT(!(BitIndex64 & ~0xffffffff));
 
-                    // Request 1 page
-                    auto p = VirtualAlloc(reinterpret_cast<void*>(NewAddress),
-                        PageSize, MEM_COMMIT, PAGE_READWRITE);
-                    if (p)
-                    {
-                        uint64_t BitIndex64 = RounddownToBlocks(NewAddress - This->Base_);
-                        DASSERT(!(BitIndex64 & ~0xffffffff));
+                    size_t BitIndex = static_cast<size_t>(BitIndex64);
+                    uint8_t Flag = 1 << (BitIndex & 7);
 
-                        size_t BitIndex = static_cast<size_t>(BitIndex64);
-                        uint8_t Flag = 1 << (BitIndex & 7);
+                    bool PrevState = false;
+                    DASSERT(This->AllocationBitmap_.Set(BitIndex, PrevState));
 
-                        bool PrevState = false;
-                        DASSERT(This->AllocationBitmap_.Set(BitIndex, PrevState));
+                    if (This->Tracking_)
+                        This->DirtyBitmap_.Set(BitIndex);
 
-                        // Should we check previous state?
-                        // DASSERT(!PrevState);
+                    // Should we check previous state?
+                    // DASSERT(!PrevState);
 
-                        // OK, continue execution
-                        return EXCEPTION_CONTINUE_EXECUTION;
-                    }
+                    // OK, continue execution
+                    return EXCEPTION_CONTINUE_EXECUTION;
                 }
             }
         }
 
+        // Guest access fault; the access fails
         return EXCEPTION_EXECUTE_HANDLER;
     }
+
+    std::shared_ptr<VMCodeImage> VMCodeImage::Create(const uint8_t* Bytecode, size_t Size)
+    {
+        if (!Size)
+            return nullptr;
+
+        std::shared_ptr<VMCodeImage> Image(new VMCodeImage());
+        Image->Size_ = Size;
+        Image->MappedSize_ = (Size + VMMemoryManager::PageMask) & ~static_cast<size_t>(VMMemoryManager::PageMask);
+
+        auto Data = VirtualAlloc(nullptr, Image->MappedSize_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (!Data)
+            return nullptr;
+
+        Image->Data_ = reinterpret_cast<uint8_t*>(Data);
+        std::memcpy(Data, Bytecode, Size);
+
+        DWORD OldProtect = 0;
+        if (!VirtualProtect(Data, Image->MappedSize_, PAGE_READONLY, &OldProtect))
+            return nullptr;
+
+        return Image;
+    }
+
+    VMCodeImage::~VMCodeImage()
+    {
+        if (Data_)
+            VirtualFree(Data_, 0, MEM_RELEASE);
+    }
+
+    std::shared_ptr<VMMemorySnapshot> VMMemorySnapshot::Load(const std::string& Path)
+    {
+        std::shared_ptr<VMMemorySnapshot> Result(new VMMemorySnapshot());
+
+        auto File = CreateFileA(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (File == INVALID_HANDLE_VALUE)
+            return nullptr;
+
+        LARGE_INTEGER FileSize{};
+        HANDLE Mapping = nullptr;
+
+        if (GetFileSizeEx(File, &FileSize) && FileSize.QuadPart)
+            Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+        // The mapping keeps the file open
+        CloseHandle(File);
+
+        if (!Mapping)
+            return nullptr;
+
+        Result->Handle_ = reinterpret_cast<intptr_t>(Mapping);
+
+        // Forks copy the pages from the view (see VMMemoryManager::RestorePages)
+        auto Data = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!Data)
+            return nullptr;
+
+        Result->Data_ = reinterpret_cast<uint8_t*>(Data);
+        Result->MappedSize_ = static_cast<size_t>(FileSize.QuadPart);
+
+        if (!Result->ReadHeader(Result->Data_, Result->MappedSize_))
+            return nullptr;
+
+        return Result;
+    }
+
+    VMMemorySnapshot::~VMMemorySnapshot()
+    {
+        if (Handle_ != -1)
+        {
+            // Loaded from a file
+            if (Data_)
+                UnmapViewOfFile(Data_);
+
+            CloseHandle(reinterpret_cast<HANDLE>(Handle_));
+        }
+        else if (Data_)
+        {
+            VirtualFree(Data_, 0, MEM_RELEASE);
+        }
+    }
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+    void* VMMemoryManager::ReservePages(size_t Size)
+    {
+        InstallPagefaultHandler();
+
+        // Reserve address space only; nothing is accessible until committed
+        auto Base = mmap(nullptr, Size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (Base == MAP_FAILED)
+            return nullptr;
+
+        return Base;
+    }
+
+    void VMMemoryManager::ReleasePages(void* Address, size_t Size)
+    {
+        munmap(Address, Size);
+    }
+
+    bool VMMemoryManager::CommitPages(uint64_t Address, size_t Size)
+    {
+        // Physical pages are not assigned until the first touch,
+        // so sparse allocations only cost the pages actually used
+        if (mprotect(reinterpret_cast<void*>(Base_ + Address), Size, PROT_READ | PROT_WRITE))
+            return false;
+
+        uint64_t BitIndex64 = RounddownToBlocks(Address);
+        size_t BitIndex = static_cast<size_t>(BitIndex64);
+        DASSERT(BitIndex == BitIndex64);
+
+        DASSERT(AllocationBitmap_.SetRange(BitIndex, RoundupToBlocks(Size)));
+
+        return true;
+    }
+
+    void VMMemoryManager::DecommitPages(uint64_t Address, size_t Size)
+    {
+        // Reserve the range again (see ReservePages), which drops the contents.
+        // madvise(MADV_DONTNEED) would not do for pages forked from a snapshot
+        // (see RestorePages), which read the snapshot again.
+        mmap(reinterpret_cast<void*>(Base_ + Address), Size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    }
+
+    bool VMMemoryManager::MapImagePages(uint64_t Address, const VMCodeImage& Image)
+    {
+        // Replaces the reserved range with a read-only view of the image
+        auto HostAddress = mmap(reinterpret_cast<void*>(Base_ + Address), Image.MappedSize(), PROT_READ,
+            MAP_SHARED | MAP_FIXED, static_cast<int>(Image.Handle_), 0);
+
+        if (HostAddress == MAP_FAILED)
+            return false;
+
+        uint64_t BitIndex64 = RounddownToBlocks(Address);
+        size_t BitIndex = static_cast<size_t>(BitIndex64);
+        DASSERT(BitIndex == BitIndex64);
+
+        DASSERT(AllocationBitmap_.SetRange(BitIndex, RoundupToBlocks(Image.MappedSize())));
+
+        return true;
+    }
+
+    void VMMemoryManager::UnmapImagePages(uint64_t Address, size_t Size)
+    {
+        DecommitPages(Address, Size);
+    }
+
+    bool VMMemoryManager::ProtectPages(uint64_t Address, size_t Size, bool Writable)
+    {
+        return !mprotect(reinterpret_cast<void*>(Base_ + Address), Size, Writable ? (PROT_READ | PROT_WRITE) : PROT_READ);
+    }
+
+    bool VMMemoryManager::SavePages(VMMemorySnapshot& Snapshot)
+    {
+        // Forks map the same pages privately (see RestorePages)
+        int Descriptor = memfd_create("svm-snapshot", MFD_CLOEXEC);
+        if (Descriptor < 0)
+            return false;
+
+        Snapshot.Handle_ = Descriptor;
+
+        auto Size = static_cast<size_t>(Snapshot.Size_);
+
+        if (ftruncate(Descriptor, static_cast<off_t>(Size)))
+            return false;
+
+        auto Data = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Descriptor, 0);
+        if (Data == MAP_FAILED)
+            return false;
+
+        Snapshot.Data_ = reinterpret_cast<uint8_t*>(Data);
+        Snapshot.MappedSize_ = Size;
+
+        for (const auto& Range : Snapshot.Ranges_)
+        {
+            for (uint64_t Offset = 0; Offset < Range.Size; Offset += PageSize)
+            {
+                auto Source = reinterpret_cast<const uint8_t*>(Base_ + Range.Base + Offset);
+
+                // Pages never written read as zero; keep them out of the file
+                if (IsZeroPage(Source))
+                    continue;
+
+                std::memcpy(Snapshot.Data_ + Range.Base + Offset, Source, PageSize);
+            }
+        }
+
+        if (mprotect(Data, Size, PROT_READ))
+            return false;
+
+        return true;
+    }
+
+    bool VMMemoryManager::RestorePages(const VMMemorySnapshot& Snapshot)
+    {
+        for (const auto& Range : Snapshot.Ranges_)
+        {
+            auto Size = static_cast<size_t>(Range.Size);
+
+            // Copy-on-write view of the snapshot
+            auto HostAddress = mmap(reinterpret_cast<void*>(Base_ + Range.Base), Size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, static_cast<int>(Snapshot.Handle_), static_cast<off_t>(Snapshot.DataOffset_ + Range.Base));
+
+            if (HostAddress == MAP_FAILED)
+                return false;
+
+            uint64_t BitIndex64 = RounddownToBlocks(Range.Base);
+            size_t BitIndex = static_cast<size_t>(BitIndex64);
+            DASSERT(BitIndex == BitIndex64);
+
+            DASSERT(AllocationBitmap_.SetRange(BitIndex, RoundupToBlocks(Size)));
+        }
+
+        return true;
+    }
+
+    void VMMemoryManager::Signal_Pagefault(int Signal, void* SignalInfo, void* SignalContext)
+    {
+        auto Owner = PagefaultOwner;
+        auto FaultAddress = reinterpret_cast<uint64_t>(reinterpret_cast<siginfo_t*>(SignalInfo)->si_addr);
+
+        // Faults outside of guest memory are host bugs, even inside GuardedAccess()
+        if (PagefaultJump && Owner && Owner->IsHostAddressReserved(FaultAddress))
+        {
+            // First write to a clean page; the access is retried
+            if (Owner->TrackWrite(FaultAddress))
+                return;
+
+            // Fault in GuardedAccess(), fail the access
+            siglongjmp(*PagefaultJump, 1);
+        }
+
+        // Not ours; pass to the previous handler
+        auto& Previous = (Signal == SIGBUS) ? PreviousBusAction : PreviousSegvAction;
+
+        if (Previous.sa_flags & SA_SIGINFO)
+        {
+            Previous.sa_sigaction(Signal, reinterpret_cast<siginfo_t*>(SignalInfo), SignalContext);
+            return;
+        }
+
+        if (Previous.sa_handler != SIG_DFL && Previous.sa_handler != SIG_IGN)
+        {
+            Previous.sa_handler(Signal);
+            return;
+        }
+
+        // Restore the default action; the faulting instruction is executed again
+        struct sigaction Action {};
+        Action.sa_handler = SIG_DFL;
+        sigemptyset(&Action.sa_mask);
+        sigaction(Signal, &Action, nullptr);
+    }
+
+    void VMMemoryManager::InstallPagefaultHandler()
+    {
+        static std::once_flag Installed;
+
+        std::call_once(Installed, []()
+            {
+                struct sigaction Action {};
+                Action.sa_sigaction = [](int Signal, siginfo_t* SignalInfo, void* SignalContext)
+                {
+                    Signal_Pagefault(Signal, SignalInfo, SignalContext);
+                };
+                Action.sa_flags = SA_SIGINFO | SA_NODEFER;
+                sigemptyset(&Action.sa_mask);
+
+                int SegvResult = sigaction(SIGSEGV, &Action, &PreviousSegvAction);
+                int BusResult = sigaction(SIGBUS, &Action, &PreviousBusAction);
+
+                DASSERT(!SegvResult);
+                DASSERT(!BusResult);
+            });
+    }
+
+    std::shared_ptr<VMCodeImage> VMCodeImage::Create(const uint8_t* Bytecode, size_t Size)
+    {
+        if (!Size)
+            return nullptr;
+
+        std::shared_ptr<VMCodeImage> Image(new VMCodeImage());
+        Image->Size_ = Size;
+        Image->MappedSize_ = (Size + VMMemoryManager::PageMask) & ~static_cast<size_t>(VMMemoryManager::PageMask);
+
+        // Memory managers map the same pages (see VMMemoryManager::MapImagePages)
+        int Descriptor = memfd_create("svm-code-image", MFD_CLOEXEC);
+        if (Descriptor < 0)
+            return nullptr;
+
+        Image->Handle_ = Descriptor;
+
+        if (ftruncate(Descriptor, static_cast<off_t>(Image->MappedSize_)))
+            return nullptr;
+
+        auto Data = mmap(nullptr, Image->MappedSize_, PROT_READ | PROT_WRITE, MAP_SHARED, Descriptor, 0);
+        if (Data == MAP_FAILED)
+            return nullptr;
+
+        Image->Data_ = reinterpret_cast<uint8_t*>(Data);
+        std::memcpy(Data, Bytecode, Size);
+
+        if (mprotect(Data, Image->MappedSize_, PROT_READ))
+            return nullptr;
+
+        return Image;
+    }
+
+    VMCodeImage::~VMCodeImage()
+    {
+        if (Data_)
+            munmap(Data_, MappedSize_);
+
+        if (Handle_ >= 0)
+            close(static_cast<int>(Handle_));
+    }
+
+    std::shared_ptr<VMMemorySnapshot> VMMemorySnapshot::Load(const std::string& Path)
+    {
+        std::shared_ptr<VMMemorySnapshot> Result(new VMMemorySnapshot());
+
+        int Descriptor = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (Descriptor < 0)
+            return nullptr;
+
+        Result->Handle_ = Descriptor;
+
+        struct stat Status {};
+        if (fstat(Descriptor, &Status) || !Status.st_size)
+            return nullptr;
+
+        auto FileSize = static_cast<size_t>(Status.st_size);
+
+        // Forks map the pages from the file (see VMMemoryManager::RestorePages)
+        auto Data = mmap(nullptr, FileSize, PROT_READ, MAP_SHARED, Descriptor, 0);
+        if (Data == MAP_FAILED)
+            return nullptr;
+
+        Result->Data_ = reinterpret_cast<uint8_t*>(Data);
+        Result->MappedSize_ = FileSize;
+
+        if (!Result->ReadHeader(Result->Data_, FileSize))
+            return nullptr;
+
+        return Result;
+    }
+
+    VMMemorySnapshot::~VMMemorySnapshot()
+    {
+        if (Data_)
+            munmap(Data_, MappedSize_);
+
+        if (Handle_ >= 0)
+            close(static_cast<int>(Handle_));
+    }
+#endif
 }
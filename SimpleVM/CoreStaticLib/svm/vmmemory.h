@@ -2,6 +2,11 @@
 
 #include "vmbase.h"
 
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <tuple>
+
 namespace VM_NAMESPACE
 {
     enum class MemoryType : uint32_t
@@ -17,6 +22,8 @@ namespace VM_NAMESPACE
         Unspecified = 0xffffffff,
     };
 
+    class VMCodeImage;
+
     struct MemoryInfo
     {
         uint64_t Base;          //< VM Address (0x00000000`00000000 to 0xffffffff`fffff000)
@@ -24,6 +31,8 @@ namespace VM_NAMESPACE
         uint64_t MaximumSize;
         uintptr_t Tag;
         MemoryType Type;
+        VMCodeImage* Image;     //< code image mapped to the block (see VMMemoryManager::MapImage()), or nullptr
+        uint64_t Generation;    //< VMMemoryManager::CodeGeneration() when the MemoryType::Bytecode block was created or last modified
     };
 
     struct MemoryRange
@@ -37,6 +46,171 @@ namespace VM_NAMESPACE
         uint64_t Size;
     };
 
+    class VMCodeImage
+    {
+        //
+        // Immutable bytecode which is mapped into many memory managers at once
+        // (see VMMemoryManager::MapImage()), e.g. by sandboxes running the
+        // same program.
+        //
+        // On Linux, the bytes live in shared memory which every memory manager
+        // maps read-only. On Windows, a view cannot replace part of reserved
+        // address space without placeholder APIs, so the bytes are copied to
+        // read-only pages of each memory manager.
+        //
+        // Data derived from the image which depends only on the bytes and the
+        // mapped address (decoded instructions, compiled code) is shared too;
+        // see Shared().
+        //
+
+    public:
+        //
+        // Key of shared data: (kind, guest address of the image, variant).
+        // Kind tells the users apart (e.g. address of a handler table).
+        //
+
+        using SharedKey = std::tuple<const void*, uint64_t, uint32_t>;
+
+        // Copies Bytecode to a new image; returns nullptr on failure
+        static std::shared_ptr<VMCodeImage> Create(const uint8_t* Bytecode, size_t Size);
+
+        ~VMCodeImage();
+
+        VMCodeImage(const VMCodeImage&) = delete;
+        VMCodeImage& operator=(const VMCodeImage&) = delete;
+
+        const uint8_t* Data() const noexcept
+        {
+            return Data_;
+        }
+
+        size_t Size() const noexcept
+        {
+            return Size_;
+        }
+
+        // Size rounded up to pages
+        size_t MappedSize() const noexcept
+        {
+            return MappedSize_;
+        }
+
+        //
+        // Returns the data shared under Key, which is created by Create() on
+        // first use. Shared data lives as long as the image and is used from
+        // any thread, so it must not be modified unless it synchronizes itself.
+        //
+
+        threadsafe std::shared_ptr<void> Shared(const SharedKey& Key, const std::function<std::shared_ptr<void>()>& Create);
+
+    private:
+        friend class VMMemoryManager;
+
+        VMCodeImage() noexcept;
+
+        uint8_t* Data_;
+        size_t Size_;
+        size_t MappedSize_;
+        intptr_t Handle_;                                       //< host shared memory, -1 if none
+
+        std::mutex Mutex_;                                      //< protects SharedData_
+        std::map<SharedKey, std::shared_ptr<void>> SharedData_;
+    };
+
+    class VMMemorySnapshot
+    {
+        //
+        // Saved state of a memory manager and an execution context (see
+        // VMMemoryManager::Snapshot()), from which new memory managers are
+        // forked (see VMMemoryManager::Fork()).
+        //
+        // On Linux, committed pages are saved to shared memory which forks
+        // map privately, so a fork shares the pages until it writes to them
+        // (copy-on-write) and starts in time proportional to the number of
+        // blocks, not the number of pages. On Windows, a view cannot replace
+        // part of reserved address space without placeholder APIs, so forks
+        // copy the saved pages.
+        //
+        // A snapshot is immutable; it may be forked from any thread.
+        //
+        // A snapshot can be saved to a file (see Save()) and loaded later,
+        // e.g. by another process. The file keeps the pages at page-aligned
+        // offsets, so Load() maps the file and parses its header only; forks
+        // map the pages from the file as they do from shared memory.
+        //
+        // A delta snapshot (see VMMemoryManager::Checkpoint()) saves only the
+        // pages written since its parent; the other pages are found in the
+        // parent.
+        //
+
+    public:
+        constexpr static const uint32_t FileMagic = 0x534d5653;       //< "SVMS"
+        constexpr static const uint32_t FileVersion = 1;
+
+        ~VMMemorySnapshot();
+
+        VMMemorySnapshot(const VMMemorySnapshot&) = delete;
+        VMMemorySnapshot& operator=(const VMMemorySnapshot&) = delete;
+
+        size_t Size() const noexcept
+        {
+            return static_cast<size_t>(Size_);
+        }
+
+        // Size of committed pages saved (by this snapshot only, if it is a delta)
+        size_t SavedSize() const noexcept
+        {
+            return SavedSize_;
+        }
+
+        // Snapshot which this delta is based on, or nullptr
+        const std::shared_ptr<VMMemorySnapshot>& Parent() const noexcept
+        {
+            return Parent_;
+        }
+
+        //
+        // Saves the snapshot to a file at Path, which is replaced. Pages which
+        // are zero are skipped, which leaves holes in the file on file systems
+        // which support sparse files. Host pointers in the saved context
+        // (other than stacks, see VMMemoryManager::Fork()) are not saved.
+        // Delta snapshots cannot be saved; fork and snapshot them instead.
+        //
+
+        bool Save(const std::string& Path) const;
+
+        // Loads a snapshot saved by Save(); returns nullptr on failure
+        static std::shared_ptr<VMMemorySnapshot> Load(const std::string& Path);
+
+    private:
+        friend class VMMemoryManager;
+
+        VMMemorySnapshot() noexcept;
+
+        // Header of the file (everything but the pages); returns the offset of the pages
+        uint64_t WriteHeader(std::vector<uint8_t>& Header) const;
+        bool ReadHeader(const uint8_t* Header, size_t FileSize);
+
+        // Saved contents of the page at Address (searching parents), or nullptr if not committed
+        const uint8_t* FindPage(uint64_t Address) const;
+
+        uint64_t Size_;
+        bool Guarded_;
+        uint64_t SourceBase_;                                   //< host base of the source memory manager
+        std::map<uint64_t, MemoryInfo> MemoryMap_;
+        std::map<uint64_t, std::shared_ptr<VMCodeImage>> Images_;
+        std::vector<MemoryRange> Ranges_;                       //< saved pages (guest address, size), sorted
+        std::vector<MemoryRange> Cleared_;                      //< pages of Parent_ which are not committed, sorted
+        std::shared_ptr<VMMemorySnapshot> Parent_;
+        size_t SavedSize_;
+        VMExecutionContext Context_;
+
+        uint8_t* Data_;                                         //< saved pages at DataOffset_ + guest address
+        size_t MappedSize_;                                     //< size of Data_
+        uint64_t DataOffset_;                                   //< offset of the pages in Data_ and Handle_
+        intptr_t Handle_;                                       //< host shared memory or file, -1 if none
+    };
+
     class VMMemoryManager
     {
     public:
@@ -50,7 +224,18 @@ namespace VM_NAMESPACE
         constexpr static const unsigned int PageSize = 1 << PageShift;
         constexpr static const unsigned int PageMask = PageSize - 1;
 
-        VMMemoryManager(size_t Size);
+        // Host reservation of guarded address space (32-bit guest space + guard area)
+        constexpr static const uint64_t GuardedReservationSize = 0x100000000ull + 0x10000;
+
+        //
+        // If GuardedAddressSpace is true, the whole 32-bit guest address space
+        // is reserved (GuardedReservationSize) even though only [0, Size) is
+        // managed. Any 32-bit guest address then maps to Base_ + Address, and
+        // access outside of committed memory faults instead of touching host
+        // memory (see LoadUnchecked/StoreUnchecked). Requires 64-bit host.
+        //
+
+        VMMemoryManager(size_t Size, bool GuardedAddressSpace = false);
         ~VMMemoryManager();
 
         size_t Read(uint64_t Address, size_t Size, uint8_t* Buffer);
@@ -62,22 +247,192 @@ namespace VM_NAMESPACE
         bool Query(uint64_t Address, MemoryInfo& Info);
         uint64_t Free(uint64_t Base, size_t Size);
 
+        //
+        // Maps Image as read-only MemoryType::Bytecode memory. The memory
+        // manager holds a reference to Image until the memory is freed
+        // (as a whole) with Free(). Guest writes to it fail.
+        //
+
+        bool MapImage(const std::shared_ptr<VMCodeImage>& Image, uint64_t Address, intptr_t Tag, uint32_t Options, uint64_t& ResultAddress);
+
+        // Must be called after guest memory is modified through HostAddress()
+        void NotifyWrite(uint64_t Address, size_t Size);
+
+        //
+        // Incremented whenever bytecode memory is modified or freed. The
+        // block which is modified takes the new value as its
+        // MemoryInfo::Generation, so code decoded from a block stays valid
+        // while its generation does not change.
+        //
+
+        uint64_t CodeGeneration() const
+        {
+            return CodeGeneration_;
+        }
+
         uintptr_t Base() const;
         size_t Size() const;
 
         uintptr_t HostAddress(uint64_t GuestAddress, size_t Size = 0);
 
-        // TODO: Add serialize()
+        bool IsAddressSpaceGuarded() const
+        {
+            return Guarded_;
+        }
+
+        //
+        // Unchecked guest memory access for guarded address space.
+        // Address is not validated; access to memory which is not committed
+        // faults, so these must be called inside ExecuteInMemoryContext().
+        //
+
+        template <
+            typename T,
+            typename = std::enable_if_t<std::is_integral<T>::value>>
+        T LoadUnchecked(uint32_t Address) const
+        {
+            DASSERT(Guarded_);
+
+            T Value;
+
+            // Make prior stores visible to the fault handler
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            std::memcpy(&Value, reinterpret_cast<const void*>(Base_ + Address), sizeof(T));
+
+            return Value;
+        }
+
+        template <
+            typename T,
+            typename = std::enable_if_t<std::is_integral<T>::value>>
+        void StoreUnchecked(uint32_t Address, T Value)
+        {
+            DASSERT(Guarded_);
+
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            std::memcpy(reinterpret_cast<void*>(Base_ + Address), &Value, sizeof(T));
+
+            NotifyWrite(Address, sizeof(T));
+        }
+
+        //
+        // Saves the memory and Context, which must use this memory manager,
+        // so that they can be forked many times. Returns nullptr on failure.
+        //
+
+        std::shared_ptr<VMMemorySnapshot> Snapshot(const VMExecutionContext& Context);
+
+        //
+        // Creates a memory manager with the memory of Snapshot, and sets
+        // Context to the saved context, with stacks moved to the new memory
+        // (other host pointers, e.g. TraceSink, are copied as they are).
+        // Returns nullptr on failure.
+        //
+
+        static std::unique_ptr<VMMemoryManager> Fork(const VMMemorySnapshot& Snapshot, VMExecutionContext& Context);
+
+        //
+        // Checkpoint and restore through a snapshot file (see
+        // VMMemorySnapshot::Save() and VMMemorySnapshot::Load()).
+        //
+
+        bool Serialize(const VMExecutionContext& Context, const std::string& Path);
+        static std::unique_ptr<VMMemoryManager> Deserialize(const std::string& Path, VMExecutionContext& Context);
+
+        //
+        // Incremental checkpoints. The first Checkpoint() saves a snapshot
+        // (see Snapshot()) and write-protects memory; the first write to a
+        // page after it faults and marks the page dirty. Later checkpoints save
+        // only the dirty pages, as a delta on the previous checkpoint, and
+        // Rollback() resets memory and Context to the last checkpoint by
+        // restoring only the dirty pages.
+        //
+        // Rollback() resets the memory manager in place, so host addresses
+        // into guest memory stay valid and the saved deltas are as small as
+        // the writes. It is not a faster reset than Fork(): every first write
+        // to a page pays a fault and a protection change, which costs more
+        // than mapping a snapshot copy-on-write on Linux (see
+        // benchmark_checkpoint_rollback() in the test app).
+        //
+        // While checkpoints are kept, guest memory must be written through
+        // Write(), Fill() or inside ExecuteInMemoryContext() (as interpreters
+        // do), where the faults are handled. Compiled code is not used then,
+        // and vmcall results are pushed through
+        // VMBytecodeInterpreterT::PushVmcallResult().
+        //
+
+        std::shared_ptr<VMMemorySnapshot> Checkpoint(const VMExecutionContext& Context);
+        bool Rollback(VMExecutionContext& Context);
+
+        // Stops tracking writes and drops the last checkpoint
+        void DiscardCheckpoints();
+
+        bool IsTrackingWrites() const
+        {
+            return Tracking_;
+        }
+
+        // Pages written since the last checkpoint
+        std::vector<MemoryRange> DirtyRanges();
 
     private:
-        bool Initialize(size_t Size);
+        bool Initialize(size_t Size, bool GuardedAddressSpace);
         void Cleanup();
 
         bool Reclaim(MemoryType SourceType, uint64_t ReclaimAddress, size_t ReclaimSize, MemoryType ReclaimType, intptr_t Tag, uint32_t ReclaimOptions, uint64_t& ResultAddress);
         int Merge(uint64_t Address, MemoryType Type, uint64_t& ResultAddress);
 
+        std::map<uint64_t, MemoryInfo>::iterator FindBlock(uint64_t Address);
+
+        // Rebuilds BlockBitmap_ and CodeBitmap_ from MemoryMap_
+        void UpdateBlockBitmap();
+
+        // Committed pages of allocated blocks other than images
+        std::vector<MemoryRange> CommittedRanges();
+
+        bool RestoreSnapshot(const VMMemorySnapshot& Snapshot);
+        void RelocateContext(const VMMemorySnapshot& Snapshot, VMExecutionContext& Context) const;
+
+        // Marks pages committed or decommitted while tracking writes
+        void MarkDirty(uint64_t Address, size_t Size);
+
+        // Handles a write fault at HostAddress on a write-protected page; returns false if not tracked
+        bool TrackWrite(uint64_t HostAddress);
+
+        // [Address, Address + Size) is in guest memory [0, Size_)
+        bool IsGuestRange(uint64_t Address, size_t Size) const
+        {
+            return Address <= Size_ && Size <= Size_ - Address;
+        }
+
+        // HostAddress is in the reservation [Base_, Base_ + ReservedSize_), guard area included
+        bool IsHostAddressReserved(uint64_t HostAddress) const
+        {
+            return Base::IsInRange2(Base_, ReservedSize_, HostAddress);
+        }
+
         static int Split(MemoryRange& SourceRange, uint64_t Address, size_t Size, MemoryRange SplitRange[2]);
+
+        //
+        // Host specific.
+        //
+
+        static void* ReservePages(size_t Size);
+        static void ReleasePages(void* Address, size_t Size);
+        bool CommitPages(uint64_t Address, size_t Size);
+        void DecommitPages(uint64_t Address, size_t Size);
+        bool MapImagePages(uint64_t Address, const VMCodeImage& Image);
+        void UnmapImagePages(uint64_t Address, size_t Size);
+        bool SavePages(VMMemorySnapshot& Snapshot);
+        bool RestorePages(const VMMemorySnapshot& Snapshot);
+        bool ProtectPages(uint64_t Address, size_t Size, bool Writable);
+
+#if M_TARGET_OS == M_TARGET_OS_WINDOWS
         static long SEH_Pagefault(long ExceptionCode, void* ExceptionPointers, void* SEHContext);
+#elif M_TARGET_OS == M_TARGET_OS_LINUX
+        static void Signal_Pagefault(int Signal, void* SignalInfo, void* SignalContext);
+        static void InstallPagefaultHandler();
+#endif
 
 
         template <
@@ -113,9 +468,26 @@ namespace VM_NAMESPACE
         }
 
         std::map<uint64_t, MemoryInfo> MemoryMap_;
+        std::map<uint64_t, MemoryInfo>::iterator LastBlock_;    //< last block found by FindBlock()
+        std::map<uint64_t, std::shared_ptr<VMCodeImage>> Images_;   //< mapped images by base address
         Bitmap AllocationBitmap_;
+        SummaryBitmap BlockBitmap_;                             //< pages of blocks which are not freed
+        Bitmap CodeBitmap_;                                     //< pages of MemoryType::Bytecode blocks (see NotifyWrite())
         uint64_t Base_;
         uint64_t Size_;
+        uint64_t ReservedSize_;
+        bool Guarded_;
+        uint64_t CodeGeneration_;
+
+        //
+        // Write tracking (see Checkpoint()). While tracking, a committed page
+        // other than an image is either dirty and writable, or clean and
+        // write-protected.
+        //
+
+        bool Tracking_;
+        Bitmap DirtyBitmap_;
+        std::shared_ptr<VMMemorySnapshot> Checkpoint_;          //< last checkpoint
     };
 }
 
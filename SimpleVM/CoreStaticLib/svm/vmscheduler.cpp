@@ -0,0 +1,253 @@
+#include "vmbase.h"
+#include "vmscheduler.h"
+
+namespace VM_NAMESPACE
+{
+    namespace
+    {
+        // Value at Fraction (0 to 1) of sorted Values
+        double Percentile(std::vector<double>& Values, double Fraction)
+        {
+            if (Values.empty())
+                return 0.0;
+
+            auto Index = static_cast<size_t>(Fraction * (Values.size() - 1));
+            std::nth_element(Values.begin(), Values.begin() + Index, Values.end());
+
+            return Values[Index];
+        }
+    }
+
+    VMScheduler::VMScheduler(uint32_t WorkerCount, uint64_t SliceFuel) :
+        SliceFuel_(SliceFuel), Queued_(), Pending_(), Idle_(), NextWorker_(), Stop_(),
+        StatisticsStart_(std::chrono::steady_clock::now())
+    {
+        DASSERT(WorkerCount && SliceFuel);
+
+        for (uint32_t i = 0; i < WorkerCount; i++)
+        {
+            auto Current = std::make_unique<Worker>();
+            Current->TaskCount = 0;
+            Current->SliceCount = 0;
+            Current->StepCount = 0;
+            Current->StealCount = 0;
+            Workers_.push_back(std::move(Current));
+        }
+
+        // Workers may steal as soon as they start
+        for (uint32_t i = 0; i < WorkerCount; i++)
+            Workers_[i]->Thread = std::thread(&VMScheduler::Run, this, i);
+    }
+
+    VMScheduler::~VMScheduler()
+    {
+        // Tasks which are not completed are dropped
+        {
+            std::lock_guard<std::mutex> Lock(Mutex_);
+            Stop_ = true;
+        }
+
+        WorkAvailable_.notify_all();
+
+        for (auto& Current : Workers_)
+            Current->Thread.join();
+    }
+
+    void VMScheduler::Submit(VMMemoryManager& MemoryManager, VMExecutionContext& Context, Completion OnCompletion)
+    {
+        auto Current = std::make_unique<Task>();
+        Current->Context = &Context;
+        Current->Interpreter = std::make_unique<VMBytecodeInterpreter>(MemoryManager);
+        Current->OnCompletion = std::move(OnCompletion);
+        Current->SubmitTime = std::chrono::steady_clock::now();
+
+        Pending_++;
+
+        auto Index = NextWorker_++ % WorkerCount();
+        Push(Index, std::move(Current));
+    }
+
+    void VMScheduler::Wait()
+    {
+        std::unique_lock<std::mutex> Lock(Mutex_);
+        TasksCompleted_.wait(Lock, [this] { return Pending_ == 0; });
+    }
+
+    SchedulerStatistics VMScheduler::Statistics() const
+    {
+        SchedulerStatistics Result{};
+        std::vector<double> Latencies;
+        auto LastCompletion = StatisticsStart_;
+
+        for (auto& Current : Workers_)
+        {
+            Result.TaskCount += Current->TaskCount;
+            Result.SliceCount += Current->SliceCount;
+            Result.StepCount += Current->StepCount;
+            Result.StealCount += Current->StealCount;
+            Latencies.insert(Latencies.end(), Current->Latencies.begin(), Current->Latencies.end());
+
+            if (Current->TaskCount && Current->LastCompletion > LastCompletion)
+                LastCompletion = Current->LastCompletion;
+        }
+
+        Result.Elapsed = std::chrono::duration<double>(LastCompletion - StatisticsStart_).count();
+
+        if (Result.Elapsed > 0.0)
+        {
+            Result.TasksPerSecond = Result.TaskCount / Result.Elapsed;
+            Result.StepsPerSecond = Result.StepCount / Result.Elapsed;
+        }
+
+        Result.LatencyMedian = Percentile(Latencies, 0.5);
+        Result.Latency99 = Percentile(Latencies, 0.99);
+        Result.Latency999 = Percentile(Latencies, 0.999);
+        Result.LatencyMaximum = Latencies.empty() ? 0.0 : *std::max_element(Latencies.begin(), Latencies.end());
+
+        return Result;
+    }
+
+    void VMScheduler::ResetStatistics()
+    {
+        for (auto& Current : Workers_)
+        {
+            Current->TaskCount = 0;
+            Current->SliceCount = 0;
+            Current->StepCount = 0;
+            Current->StealCount = 0;
+            Current->Latencies.clear();
+        }
+
+        StatisticsStart_ = std::chrono::steady_clock::now();
+    }
+
+    void VMScheduler::Run(uint32_t Index)
+    {
+        auto& Self = *Workers_[Index];
+
+        while (true)
+        {
+            auto Current = Pop(Index);
+
+            if (!Current)
+            {
+                Current = Steal(Index);
+                if (Current)
+                    Self.StealCount++;
+            }
+
+            if (!Current)
+            {
+                std::unique_lock<std::mutex> Lock(Mutex_);
+
+                Idle_++;
+                WorkAvailable_.wait(Lock, [this] { return Stop_ || Queued_ != 0; });
+                Idle_--;
+
+                if (Stop_)
+                    break;
+
+                continue;
+            }
+
+            Current = RunSlice(Self, std::move(Current));
+
+            if (Current)
+                Push(Index, std::move(Current));
+        }
+    }
+
+    std::unique_ptr<VMScheduler::Task> VMScheduler::RunSlice(Worker& Self, std::unique_ptr<Task> Current)
+    {
+        ExecuteBudget Budget{};
+        Budget.MeterFuel = true;
+
+        Current->Context->Fuel = SliceFuel_;
+
+        auto Result = Current->Interpreter->ExecuteUntilEvent(*Current->Context, Budget);
+
+        Self.SliceCount++;
+        Self.StepCount += Result.StepCount;
+
+        if (Result.Event == HaltEvent::T::OutOfFuel)
+            return Current;
+
+        if (Current->OnCompletion &&
+            Current->OnCompletion(*Current->Context, Result))
+            return Current;
+
+        auto Now = std::chrono::steady_clock::now();
+
+        Self.TaskCount++;
+        Self.Latencies.push_back(std::chrono::duration<double>(Now - Current->SubmitTime).count());
+        Self.LastCompletion = Now;
+
+        Current.reset();
+
+        if (--Pending_ == 0)
+        {
+            // Wait() checks Pending_ under the lock
+            std::lock_guard<std::mutex> Lock(Mutex_);
+            TasksCompleted_.notify_all();
+        }
+
+        return nullptr;
+    }
+
+    void VMScheduler::Push(uint32_t Index, std::unique_ptr<Task> Current)
+    {
+        auto& Target = *Workers_[Index];
+
+        {
+            std::lock_guard<std::mutex> Lock(Target.Mutex);
+            Target.Tasks.push_back(std::move(Current));
+        }
+
+        Queued_++;
+
+        if (Idle_ != 0)
+        {
+            // Idle workers check Queued_ under the lock
+            std::lock_guard<std::mutex> Lock(Mutex_);
+            WorkAvailable_.notify_one();
+        }
+    }
+
+    std::unique_ptr<VMScheduler::Task> VMScheduler::Pop(uint32_t Index)
+    {
+        auto& Source = *Workers_[Index];
+        std::lock_guard<std::mutex> Lock(Source.Mutex);
+
+        if (Source.Tasks.empty())
+            return nullptr;
+
+        auto Current = std::move(Source.Tasks.front());
+        Source.Tasks.pop_front();
+        Queued_--;
+
+        return Current;
+    }
+
+    std::unique_ptr<VMScheduler::Task> VMScheduler::Steal(uint32_t Index)
+    {
+        auto Count = WorkerCount();
+
+        for (uint32_t i = 1; i < Count; i++)
+        {
+            auto& Source = *Workers_[(Index + i) % Count];
+            std::lock_guard<std::mutex> Lock(Source.Mutex);
+
+            if (Source.Tasks.empty())
+                continue;
+
+            // The owner takes from the front
+            auto Current = std::move(Source.Tasks.back());
+            Source.Tasks.pop_back();
+            Queued_--;
+
+            return Current;
+        }
+
+        return nullptr;
+    }
+}
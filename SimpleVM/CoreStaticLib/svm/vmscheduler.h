@@ -0,0 +1,133 @@
+#pragma once
+
+#include "vmbase.h"
+#include "vmmemory.h"
+#include "bc_interpreter.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace VM_NAMESPACE
+{
+    struct SchedulerStatistics
+    {
+        uint64_t TaskCount;         //< completed tasks
+        uint64_t SliceCount;        //< executed slices
+        uint64_t StepCount;         //< executed steps
+        uint64_t StealCount;        //< tasks stolen from other workers
+        double Elapsed;             //< seconds from statistics start to the last completion
+        double TasksPerSecond;
+        double StepsPerSecond;
+
+        //
+        // Task latency (Submit() to completion) in seconds.
+        //
+
+        double LatencyMedian;
+        double Latency99;           //< 99th percentile
+        double Latency999;          //< 99.9th percentile
+        double LatencyMaximum;
+    };
+
+    class VMScheduler
+    {
+        //
+        // Runs many independent contexts on a pool of worker threads.
+        //
+        // Each worker owns a deque of tasks. A task runs in slices of
+        // SliceFuel instructions (see VMBytecodeInterpreterT::ExecuteUntilEvent());
+        // when a slice runs out of fuel, the task is queued again at the back
+        // of the deque of the worker which ran it, and the worker continues
+        // with the front, so tasks of a worker are served round robin. A
+        // worker with an empty deque steals from the back of other deques.
+        //
+        // Any other halting event is passed to the completion callback on the
+        // worker thread, which returns true to run the task again (e.g. after
+        // servicing a vmcall), or false to complete it.
+        //
+        // Each task owns its interpreter, so its decode cache stays warm on
+        // any worker. VMMemoryManager is not thread-safe; tasks must not share
+        // one.
+        //
+
+    public:
+        using Completion = std::function<bool(VMExecutionContext& Context, const ExecuteResult& Result)>;
+
+        constexpr static const uint64_t DefaultSliceFuel = 10000;
+
+        VMScheduler(uint32_t WorkerCount, uint64_t SliceFuel = DefaultSliceFuel);
+        ~VMScheduler();
+
+        VMScheduler(const VMScheduler&) = delete;
+        VMScheduler& operator=(const VMScheduler&) = delete;
+
+        // MemoryManager and Context must stay valid until the task completes
+        void Submit(VMMemoryManager& MemoryManager, VMExecutionContext& Context, Completion OnCompletion = nullptr);
+
+        // Waits until all submitted tasks complete
+        void Wait();
+
+        // Statistics of tasks completed since construction or ResetStatistics();
+        // call after Wait()
+        SchedulerStatistics Statistics() const;
+        void ResetStatistics();
+
+        uint32_t WorkerCount() const noexcept
+        {
+            return static_cast<uint32_t>(Workers_.size());
+        }
+
+    private:
+        struct Task
+        {
+            VMExecutionContext* Context;
+            std::unique_ptr<VMBytecodeInterpreter> Interpreter;
+            Completion OnCompletion;
+            std::chrono::steady_clock::time_point SubmitTime;
+        };
+
+        struct Worker
+        {
+            std::mutex Mutex;                                   //< protects Tasks
+            std::deque<std::unique_ptr<Task>> Tasks;
+            std::thread Thread;
+
+            //
+            // Statistics, written by the worker thread only.
+            //
+
+            uint64_t TaskCount;
+            uint64_t SliceCount;
+            uint64_t StepCount;
+            uint64_t StealCount;
+            std::vector<double> Latencies;
+            std::chrono::steady_clock::time_point LastCompletion;
+        };
+
+        void Run(uint32_t Index);
+
+        void Push(uint32_t Index, std::unique_ptr<Task> Current);
+        std::unique_ptr<Task> Pop(uint32_t Index);
+        std::unique_ptr<Task> Steal(uint32_t Index);
+
+        // Runs Current until it completes or runs out of fuel; returns the task to queue again
+        std::unique_ptr<Task> RunSlice(Worker& Self, std::unique_ptr<Task> Current);
+
+        std::vector<std::unique_ptr<Worker>> Workers_;
+        uint64_t SliceFuel_;
+
+        std::mutex Mutex_;                                      //< protects Stop_ and sleeping
+        std::condition_variable WorkAvailable_;
+        std::condition_variable TasksCompleted_;
+        std::atomic<uint64_t> Queued_;                          //< tasks in deques
+        std::atomic<uint64_t> Pending_;                         //< submitted tasks not completed
+        std::atomic<uint32_t> Idle_;                            //< workers waiting for tasks
+        std::atomic<uint32_t> NextWorker_;                      //< worker of next Submit()
+        bool Stop_;
+
+        std::chrono::steady_clock::time_point StatisticsStart_;
+    };
+}
@@ -14,8 +14,12 @@ static_assert(
     "type is not standard layout");
 
 
+class VMCachedStack;
+
 class VMStack : private DataAreaRegister
 {
+    friend class VMCachedStack;
+
 public:
     using BaseType = DataAreaRegister;
     using ByteType = unsigned char;
@@ -257,11 +261,23 @@ public:
         return BaseType::Offset;
     }
 
+    // Host address of the stack end (the top of an empty stack)
+    uint64_t Limit() const noexcept
+    {
+        return BaseType::Base + BaseType::Size;
+    }
+
     auto Alignment() const noexcept
     {
         return BaseType::Alignment;
     }
 
+    // Moves the stack area by Delta bytes (e.g. to a fork of the memory it lives in)
+    void Relocate(int64_t Delta) noexcept
+    {
+        BaseType::Base += Delta;
+    }
+
 private:
 
     unsigned char* Pointer(uint32_t Offset) const noexcept
@@ -486,4 +502,347 @@ static_assert(
     "type is not standard layout");
 
 
+//
+// Operand stack with top-of-stack caching.
+//
+// The two topmost slots (TOS and NOS) are held in Slots_ instead of stack
+// memory, and the stack offset in Offset_; the underlying VMStack is updated
+// only by Flush(). A binary operation pops both operands and pushes its
+// result without touching stack memory; a push spills NOS only when both
+// slots are cached. The slots of cached values are always reserved, so
+// TopOffset() and stack overflow detection are exact. Only values which fit
+// in a slot are cached; other operations flush and fall back to VMStack.
+//
+
+class VMCachedStack
+{
+public:
+    using ByteType = VMStack::ByteType;
+    using SizeType = VMStack::SizeType;
+
+    explicit VMCachedStack(VMStack& Stack) noexcept :
+        Stack_(Stack), Base_(Stack.BaseType::Base), Size_(Stack.BaseType::Size),
+        Alignment_(Stack.BaseType::Alignment), Offset_(Stack.BaseType::Offset), CachedCount_(0), Slots_{}
+    {
+        DASSERT(Alignment_ == sizeof(int32_t) || Alignment_ == sizeof(int64_t));
+    }
+
+    VMCachedStack(const VMCachedStack&) = delete;
+    VMCachedStack& operator=(const VMCachedStack&) = delete;
+
+    template <
+        typename T,
+        std::enable_if_t<
+            std::is_integral<T>::value || std::is_floating_point<T>::value, bool> = true>
+        bool Push(const T& Value) noexcept
+    {
+        if (sizeof(T) > Alignment_)
+            return Fallback([&]() { return Stack_.Push(Value); });
+
+        if (Offset_ < Alignment_)
+            return false;
+
+        PushSlot(Value);
+
+        return true;
+    }
+
+    // Same as Push() but the caller guarantees a free slot (see HasCapacity())
+    template <
+        typename T,
+        std::enable_if_t<
+            std::is_integral<T>::value || std::is_floating_point<T>::value, bool> = true>
+        bool PushUnchecked(const T& Value) noexcept
+    {
+        if (sizeof(T) > Alignment_)
+            return Fallback([&]() { return Stack_.Push(Value); });
+
+        PushSlot(Value);
+
+        return true;
+    }
+
+    bool Push(const ByteType* Buffer, size_t Size) noexcept
+    {
+        return Fallback([&]() { return Stack_.Push(Buffer, Size); });
+    }
+
+    template <
+        typename T,
+        std::enable_if_t<std::is_trivially_copyable<T>::value, bool> = true>
+        bool Pop(T* Value) noexcept
+    {
+        if (sizeof(T) > Alignment_)
+            return Fallback([&]() { return Stack_.Pop(Value); });
+
+        if (!CachedCount_ && Offset_ + Alignment_ > Size_)
+            return false;
+
+        PopSlot(Value);
+
+        return true;
+    }
+
+    // Same as Pop() but the caller guarantees a value on the stack (see HasCapacity())
+    template <
+        typename T,
+        std::enable_if_t<std::is_trivially_copyable<T>::value, bool> = true>
+        bool PopUnchecked(T* Value) noexcept
+    {
+        if (sizeof(T) > Alignment_)
+            return Fallback([&]() { return Stack_.Pop(Value); });
+
+        PopSlot(Value);
+
+        return true;
+    }
+
+    bool Pop(ByteType* Buffer, size_t Size) noexcept
+    {
+        return Fallback([&]() { return Stack_.Pop(Buffer, Size); });
+    }
+
+    template <
+        typename T,
+        std::enable_if_t<std::is_trivially_copyable<T>::value, bool> = true>
+        bool PeekFrom(T* Value, int OffsetFromCurrent) noexcept
+    {
+        if (CachedCount_ && !OffsetFromCurrent && sizeof(T) <= Alignment_)
+        {
+            if (Value)
+                *Value = Base::FromBytes<T>(Slots_[0]);
+
+            return true;
+        }
+
+        return Fallback([&]() { return Stack_.PeekFrom(Value, OffsetFromCurrent); });
+    }
+
+    uint64_t Top() const noexcept
+    {
+        return Base_ + Offset_;
+    }
+
+    uint32_t TopOffset() const noexcept
+    {
+        return Offset_;
+    }
+
+    // Host address of the stack end (the top of an empty stack)
+    uint64_t Limit() const noexcept
+    {
+        return Base_ + Size_;
+    }
+
+    auto Alignment() const noexcept
+    {
+        return Alignment_;
+    }
+
+    // Tests that PopSize bytes can be popped and PushSize bytes can be pushed
+    bool HasCapacity(SizeType PopSize, SizeType PushSize) const noexcept
+    {
+        return PushSize <= Offset_ && PopSize <= Size_ - Offset_;
+    }
+
+    // Writes cached slots and stack offset back to the underlying VMStack
+    void Flush() noexcept
+    {
+        if (CachedCount_ > 1)
+            Spill(1);
+
+        if (CachedCount_ > 0)
+            Spill(0);
+
+        CachedCount_ = 0;
+        Stack_.BaseType::Offset = Offset_;
+    }
+
+private:
+    template <
+        typename TFunction>
+        bool Fallback(TFunction&& Function) noexcept
+    {
+        Flush();
+        bool Result = Function();
+        Offset_ = Stack_.BaseType::Offset;
+
+        return Result;
+    }
+
+    template <
+        typename T>
+        void PushSlot(const T& Value) noexcept
+    {
+        // NOS goes to memory; TOS becomes NOS
+        if (CachedCount_ > 1)
+            Spill(1);
+        else
+            CachedCount_++;
+
+        if (CachedCount_ > 1)
+            std::memcpy(Slots_[1], Slots_[0], sizeof(Slots_[0]));
+
+        Offset_ -= Alignment_;
+        ToSlot(Value);
+    }
+
+    template <
+        typename T>
+        void PopSlot(T* Value) noexcept
+    {
+        if (CachedCount_)
+        {
+            if (Value)
+                *Value = Base::FromBytes<T>(Slots_[0]);
+
+            // NOS becomes TOS
+            if (--CachedCount_)
+                std::memcpy(Slots_[0], Slots_[1], sizeof(Slots_[0]));
+        }
+        else if (Value)
+        {
+            *Value = Base::FromBytes<T>(reinterpret_cast<ByteType*>(Base_ + Offset_));
+        }
+
+        Offset_ += Alignment_;
+    }
+
+    // Writes Slots_[Index] (0 for TOS, 1 for NOS) to its reserved slot in stack memory
+    void Spill(uint32_t Index) noexcept
+    {
+        auto Pointer = reinterpret_cast<ByteType*>(Base_ + Offset_ + Index * Alignment_);
+
+        if (Alignment_ == sizeof(int64_t))
+            std::memcpy(Pointer, Slots_[Index], sizeof(int64_t));
+        else
+            std::memcpy(Pointer, Slots_[Index], sizeof(int32_t));
+    }
+
+    //
+    // Slot layout is same as VMStack::Push() (sign/zero-extended to alignment).
+    //
+
+    template <
+        typename T,
+        std::enable_if_t<
+            std::is_integral<T>::value && std::is_signed<T>::value, bool> = true>
+        void ToSlot(const T& Value) noexcept
+    {
+        if (Alignment_ == sizeof(int64_t))
+            Base::ToBytes(Base::SignExtend<int64_t>(Value), Slots_[0]);
+        else
+            Base::ToBytes(Base::SignExtend<int32_t>(Value), Slots_[0]);
+    }
+
+    template <
+        typename T,
+        std::enable_if_t<
+            std::is_integral<T>::value && !std::is_signed<T>::value, bool> = true>
+        void ToSlot(const T& Value) noexcept
+    {
+        if (Alignment_ == sizeof(int64_t))
+            Base::ToBytes(Base::ZeroExtend<uint64_t>(Value), Slots_[0]);
+        else
+            Base::ToBytes(Base::ZeroExtend<uint32_t>(Value), Slots_[0]);
+    }
+
+    template <
+        typename T,
+        std::enable_if_t<std::is_floating_point<T>::value, bool> = true>
+        void ToSlot(const T& Value) noexcept
+    {
+        using TSignedInt = std::make_signed_t<typename Base::ToIntegralType<T>::type>;
+        ToSlot(Base::BitCast<TSignedInt>(Value));
+    }
+
+    VMStack& Stack_;
+    uint64_t Base_;
+    SizeType Size_;
+    SizeType Alignment_;
+    SizeType Offset_;
+    uint32_t CachedCount_;                                      //< cached slots, 0 to 2
+    alignas(sizeof(int64_t)) ByteType Slots_[2][sizeof(int64_t)];   //< TOS, NOS
+};
+
+
+//
+// Operand stack of a verified block (see VMBlockVerifier).
+//
+// The dispatch loop checks VMCachedStack::HasCapacity() for the whole block
+// at block entry, so pushes and pops of cached values skip bounds checks.
+// Other operations are forwarded to VMCachedStack.
+//
+
+class VMUncheckedStack
+{
+public:
+    using ByteType = VMCachedStack::ByteType;
+    using SizeType = VMCachedStack::SizeType;
+
+    explicit VMUncheckedStack(VMCachedStack& Stack) noexcept :
+        Stack_(Stack)
+    {
+    }
+
+    VMUncheckedStack(const VMUncheckedStack&) = delete;
+    VMUncheckedStack& operator=(const VMUncheckedStack&) = delete;
+
+    template <
+        typename T,
+        std::enable_if_t<
+            std::is_integral<T>::value || std::is_floating_point<T>::value, bool> = true>
+        bool Push(const T& Value) noexcept
+    {
+        return Stack_.PushUnchecked(Value);
+    }
+
+    bool Push(const ByteType* Buffer, size_t Size) noexcept
+    {
+        return Stack_.Push(Buffer, Size);
+    }
+
+    template <
+        typename T,
+        std::enable_if_t<std::is_trivially_copyable<T>::value, bool> = true>
+        bool Pop(T* Value) noexcept
+    {
+        return Stack_.PopUnchecked(Value);
+    }
+
+    bool Pop(ByteType* Buffer, size_t Size) noexcept
+    {
+        return Stack_.Pop(Buffer, Size);
+    }
+
+    template <
+        typename T,
+        std::enable_if_t<std::is_trivially_copyable<T>::value, bool> = true>
+        bool PeekFrom(T* Value, int OffsetFromCurrent) noexcept
+    {
+        return Stack_.PeekFrom(Value, OffsetFromCurrent);
+    }
+
+    uint64_t Top() const noexcept
+    {
+        return Stack_.Top();
+    }
 
+    uint32_t TopOffset() const noexcept
+    {
+        return Stack_.TopOffset();
+    }
+
+    auto Alignment() const noexcept
+    {
+        return Stack_.Alignment();
+    }
+
+    void Flush() noexcept
+    {
+        Stack_.Flush();
+    }
+
+private:
+    VMCachedStack& Stack_;
+};
@@ -0,0 +1,139 @@
+
+#include "vmbase.h"
+#include "vmtrace.h"
+#include "bc_interpreter.h"
+
+namespace VM_NAMESPACE
+{
+    void VMConsoleTraceSink::Trace(const VMExecutionContext& Context, const TraceEvent& Event)
+    {
+        switch (Event.Type)
+        {
+        case TraceEventType::T::ExecuteBegin:
+        {
+            printf("[VM Execute, Step %d]\n", static_cast<int>(Event.Value));
+            break;
+        }
+        case TraceEventType::T::Instruction:
+        {
+            VMInstruction Op = *Event.Instruction;
+            DASSERT(Op.Valid());
+
+            char Mnemonic[64];
+            DASSERT(Op.ToMnemonic(Mnemonic, std::size(Mnemonic), nullptr));
+
+            unsigned char Bytes[32];
+            size_t BytesSize = 0;
+            DASSERT(Op.ToBytes(Bytes, std::size(Bytes), &BytesSize));
+            DASSERT(BytesSize == Event.Value);
+
+            char BytecodeDump[200]{};
+            for (size_t i = 0; i < BytesSize; i++)
+            {
+                char Value[10];
+                sprintf_s(Value, "%02hhx ", Bytes[i]);
+                strcat_s(BytecodeDump, Value);
+            }
+
+            printf("%08x: %-30s%s\n", Event.IP, BytecodeDump, Mnemonic);
+            break;
+        }
+        case TraceEventType::T::Exception:
+        {
+            auto State = static_cast<ExceptionState::T>(Event.Value);
+            printf("Exception (0x%08x): %s\n", State,
+                VMBytecodeInterpreter::ExceptionStateToDescription(State));
+            break;
+        }
+        case TraceEventType::T::ExecuteEnd:
+        {
+            printf(" ==> VM Returned, Step %d\n\n", static_cast<int>(Event.Value));
+            break;
+        }
+        }
+    }
+
+    namespace
+    {
+        const char* const OpcodeNameTable[] =
+        {
+#define DEFINE_INST(_op, _mnemonic)                 #_op,
+#define DEFINE_INST_O1(_op, _mnemonic, _operand)    #_op,
+#include "inst_table.inc"
+#undef DEFINE_INST_O1
+#undef DEFINE_INST
+        };
+    }
+
+    VMNgramTraceSink::VMNgramTraceSink() noexcept :
+        Counts_(), Window_{}, WindowSize_(), NextIP_()
+    {
+    }
+
+    void VMNgramTraceSink::Trace(const VMExecutionContext& Context, const TraceEvent& Event)
+    {
+        if (Event.Type != TraceEventType::T::Instruction)
+        {
+            // Sequence does not continue across Execute() calls or exceptions
+            WindowSize_ = 0;
+            return;
+        }
+
+        if (WindowSize_ && Event.IP != NextIP_)
+            WindowSize_ = 0;
+
+        if (WindowSize_ == std::size(Window_))
+        {
+            std::move(Window_ + 1, Window_ + WindowSize_, Window_);
+            WindowSize_--;
+        }
+
+        Window_[WindowSize_++] = Event.Instruction->Opcode();
+        NextIP_ = Event.IP + static_cast<uint32_t>(Event.Value);
+
+        // Every n-gram which ends at this instruction
+        for (uint32_t Length = 2; Length <= WindowSize_; Length++)
+        {
+            Counts_[Ngram(Window_ + WindowSize_ - Length, Window_ + WindowSize_)]++;
+        }
+    }
+
+    std::vector<std::pair<VMNgramTraceSink::Ngram, uint64_t>> VMNgramTraceSink::Top(size_t Count) const
+    {
+        std::vector<std::pair<Ngram, uint64_t>> Result(Counts_.begin(), Counts_.end());
+
+        std::stable_sort(Result.begin(), Result.end(),
+            [](const auto& Left, const auto& Right)
+            {
+                return Left.second > Right.second;
+            });
+
+        if (Result.size() > Count)
+            Result.resize(Count);
+
+        return Result;
+    }
+
+    void VMNgramTraceSink::Report(size_t Count) const
+    {
+        for (const auto& it : Top(Count))
+        {
+            std::string Name;
+            std::string Operands;
+
+            for (auto Opcode : it.first)
+            {
+                const char* OpcodeName = Opcode < std::size(OpcodeNameTable) ? OpcodeNameTable[Opcode] : "?";
+
+                Name += Name.empty() ? "" : "_";
+                Name += OpcodeName;
+                Operands += ", ";
+                Operands += OpcodeName;
+            }
+
+            printf("DEFINE_FUSED_INST%zu      (%s%s) // %llu\n",
+                it.first.size(), Name.c_str(), Operands.c_str(),
+                static_cast<unsigned long long>(it.second));
+        }
+    }
+}
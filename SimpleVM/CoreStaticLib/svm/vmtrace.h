@@ -0,0 +1,92 @@
+#pragma once
+
+#include "vmbase.h"
+#include "bc_fusion.h"
+
+namespace VM_NAMESPACE
+{
+    struct TraceEventType
+    {
+        enum T : uint32_t
+        {
+            ExecuteBegin,       // Value = requested step count
+            Instruction,        // Instruction at IP is about to be executed. Value = instruction length
+            Exception,          // Exception is being raised at IP. Value = ExceptionState::T
+            ExecuteEnd,         // Value = executed step count
+        };
+    };
+
+    struct TraceEvent
+    {
+        TraceEventType::T Type;
+        uint32_t IP;
+        const VMInstruction* Instruction;   // TraceEventType::T::Instruction only
+        uint64_t Value;
+    };
+
+    //
+    // Receives trace events of the context which refers the sink
+    // (VMExecutionContext::TraceSink).
+    //
+
+    class VMTraceSink
+    {
+    public:
+        virtual ~VMTraceSink() = default;
+        virtual void Trace(const VMExecutionContext& Context, const TraceEvent& Event) = 0;
+    };
+
+    //
+    // Prints disassembly and exceptions to stdout.
+    //
+
+    class VMConsoleTraceSink : public VMTraceSink
+    {
+    public:
+        void Trace(const VMExecutionContext& Context, const TraceEvent& Event) override;
+    };
+
+    //
+    // Counts sequences of 2 to VMFusion::MaximumCount instructions which are
+    // executed back to back and adjacent in memory (n-grams), to choose
+    // superinstructions for inst_fused_table.inc.
+    //
+
+    class VMNgramTraceSink : public VMTraceSink
+    {
+    public:
+        using Ngram = std::vector<Opcode::T>;
+
+        VMNgramTraceSink() noexcept;
+
+        void Trace(const VMExecutionContext& Context, const TraceEvent& Event) override;
+
+        // Returns up to Count most frequent n-grams with their counts
+        std::vector<std::pair<Ngram, uint64_t>> Top(size_t Count) const;
+
+        // Prints Top(Count) to stdout in inst_fused_table.inc format
+        void Report(size_t Count) const;
+
+    private:
+        std::map<Ngram, uint64_t> Counts_;
+        Opcode::T Window_[VMFusion::MaximumCount];
+        uint32_t WindowSize_;
+        uint32_t NextIP_;
+    };
+
+    //
+    // Trace policies for VMBytecodeInterpreterT.
+    //
+
+    struct NoTracePolicy
+    {
+        // Tracing code is not compiled at all.
+        constexpr static const bool TraceEnabled = false;
+    };
+
+    struct SinkTracePolicy
+    {
+        // Events are sent to VMExecutionContext::TraceSink if it is set.
+        constexpr static const bool TraceEnabled = true;
+    };
+}
@@ -4,6 +4,7 @@
 
 #include <stdarg.h>
 #include <conio.h>
+#include <fstream>
 #include <windows.h>
 #include "../CoreStaticLib/svm/arch.h"
 #include "../CoreStaticLib/svm/base.h"
@@ -12,6 +13,9 @@
 #include "../CoreStaticLib/svm/integer.h"
 #include "../CoreStaticLib/svm/bc_interpreter.h"
 #include "../CoreStaticLib/svm/bc_emitter.h"
+#include "../CoreStaticLib/svm/bc_decoder.h"
+#include "../CoreStaticLib/svm/vmtrace.h"
+#include "../CoreStaticLib/svm/vmscheduler.h"
 
 #pragma comment(lib, "../CoreStaticLib.lib")
 
@@ -116,6 +120,72 @@ namespace CoreUnitTest
             }
         }
 
+        TEST_METHOD(Stack_CachedTest)
+        {
+            for (uint32_t StackAlignment : { 4, 8 })
+            {
+                // Same operations on VMStack and VMCachedStack must give same results
+                unsigned char StackBytes[64]{};
+                unsigned char CachedStackBytes[64]{};
+                constexpr const size_t StackSize = sizeof(StackBytes);
+
+                VMStack Stack(PtrToU64(StackBytes), StackSize, StackAlignment);
+                VMStack UnderlyingStack(PtrToU64(CachedStackBytes), StackSize, StackAlignment);
+                VMCachedStack CachedStack(UnderlyingStack);
+
+                auto Verify = [&](bool Result, bool CachedResult)
+                {
+                    Assert::AreEqual(Result, CachedResult, L"result mismatch");
+                    Assert::AreEqual(Stack.TopOffset(), CachedStack.TopOffset(), L"offset mismatch");
+                };
+
+                Verify(Stack.Push<int8_t>(-2), CachedStack.Push<int8_t>(-2));
+                Verify(Stack.Push<uint16_t>(0xfedc), CachedStack.Push<uint16_t>(0xfedc));
+                Verify(Stack.Push<double>(1.5), CachedStack.Push<double>(1.5));
+
+                uint64_t Value = 0, CachedValue = 0;
+                Verify(Stack.Pop(&Value), CachedStack.Pop(&CachedValue));
+                Assert::AreEqual(Value, CachedValue, L"value mismatch");
+
+                int32_t Value32 = 0, CachedValue32 = 0;
+                Verify(Stack.PeekFrom(&Value32, 0), CachedStack.PeekFrom(&CachedValue32, 0));
+                Assert::AreEqual(Value32, CachedValue32, L"value mismatch");
+
+                Verify(Stack.Push<int64_t>(-3), CachedStack.Push<int64_t>(-3));
+                Verify(Stack.Pop(&Value32), CachedStack.Pop(&CachedValue32));
+                Assert::AreEqual(Value32, CachedValue32, L"value mismatch");
+
+                // Operands of a binary operation come from both cached slots
+                Verify(Stack.Push<uint32_t>(7), CachedStack.Push<uint32_t>(7));
+                Verify(Stack.Push<uint32_t>(5), CachedStack.Push<uint32_t>(5));
+                Verify(Stack.Pop(&Value32), CachedStack.Pop(&CachedValue32));
+                Assert::AreEqual(Value32, CachedValue32, L"value mismatch");
+                Verify(Stack.Pop(&Value32), CachedStack.Pop(&CachedValue32));
+                Assert::AreEqual(Value32, CachedValue32, L"value mismatch");
+                Verify(Stack.Push<uint32_t>(12), CachedStack.Push<uint32_t>(12));
+
+                // Overflow must be detected at the same point
+                for (int i = 0; i < 20; i++)
+                {
+                    Verify(Stack.Push<uint32_t>(i), CachedStack.Push<uint32_t>(i));
+                }
+
+                CachedStack.Flush();
+                Assert::AreEqual(Stack.TopOffset(), UnderlyingStack.TopOffset(), L"offset mismatch");
+                Assert::IsTrue(!std::memcmp(StackBytes, CachedStackBytes, StackSize), L"stack memory mismatch");
+
+                // Underflow too
+                for (int i = 0; i < 20; i++)
+                {
+                    Verify(Stack.Pop(&Value32), CachedStack.Pop(&CachedValue32));
+                    Assert::AreEqual(Value32, CachedValue32, L"value mismatch");
+                }
+
+                CachedStack.Flush();
+                Assert::AreEqual(Stack.TopOffset(), UnderlyingStack.TopOffset(), L"offset mismatch");
+            }
+        }
+
     private:
         template <
             typename TPush,
@@ -435,6 +505,172 @@ namespace CoreUnitTest
         }
     };
 
+    TEST_CLASS(BitmapTest)
+    {
+    public:
+
+        TEST_METHOD(Bitmap_MasterTest)
+        {
+            for (size_t BitCount : { 1, 7, 63, 64, 65, 200, 256, 1000, 4099 })
+            {
+                // Ranges and searches must agree with a bit-by-bit reference
+                Bitmap Bits(BitCount);
+                std::vector<bool> Expected(BitCount);
+
+                auto Verify = [&]()
+                {
+                    for (size_t i = 0; i < BitCount; i++)
+                    {
+                        bool State = false;
+                        Assert::IsTrue(Bits.Get(i, State), L"get failed");
+                        Assert::IsTrue(State == Expected[i], Format(L"bit %zu mismatch", i).c_str());
+                    }
+
+                    for (size_t Start = 0; Start <= BitCount; Start++)
+                    {
+                        size_t FirstSet = Bitmap::Position::Invalid;
+                        size_t FirstClear = Bitmap::Position::Invalid;
+                        for (size_t i = Start; i < BitCount; i++)
+                        {
+                            if (Expected[i] && FirstSet == Bitmap::Position::Invalid)
+                                FirstSet = i;
+                            if (!Expected[i] && FirstClear == Bitmap::Position::Invalid)
+                                FirstClear = i;
+                        }
+
+                        // Searches down from Start fail if Start is out of the bitmap
+                        size_t LastSet = Bitmap::Position::Invalid;
+                        size_t LastClear = Bitmap::Position::Invalid;
+                        for (size_t i = 0; i <= Start && Start < BitCount; i++)
+                        {
+                            if (Expected[i])
+                                LastSet = i;
+                            else
+                                LastClear = i;
+                        }
+
+                        Assert::AreEqual<uint64_t>(Bits.FindFirstSet(Start), FirstSet, L"FindFirstSet mismatch");
+                        Assert::AreEqual<uint64_t>(Bits.FindFirstClear(Start), FirstClear, L"FindFirstClear mismatch");
+                        Assert::AreEqual<uint64_t>(Bits.FindLastSet(Start), LastSet, L"FindLastSet mismatch");
+                        Assert::AreEqual<uint64_t>(Bits.FindLastClear(Start), LastClear, L"FindLastClear mismatch");
+
+                        for (size_t Count : { 1, 3, 64, 100 })
+                        {
+                            size_t ClearRange = Bitmap::Position::Invalid;
+                            size_t Run = 0;
+                            for (size_t i = Start; i < BitCount; i++)
+                            {
+                                Run = Expected[i] ? 0 : Run + 1;
+                                if (Run == Count)
+                                {
+                                    ClearRange = i + 1 - Count;
+                                    break;
+                                }
+                            }
+
+                            Assert::AreEqual<uint64_t>(Bits.FindFirstClearRange(Start, Count), ClearRange, L"FindFirstClearRange mismatch");
+                        }
+                    }
+                };
+
+                Verify();
+
+                for (int i = 0; i < 16; i++)
+                {
+                    size_t Index = rand() % BitCount;
+                    size_t Count = 1 + rand() % (BitCount - Index);
+                    bool State = !(i & 3);
+
+                    Assert::IsTrue(
+                        State ? Bits.SetRange(Index, Count) : Bits.ClearRange(Index, Count),
+                        L"range failed");
+                    std::fill(Expected.begin() + Index, Expected.begin() + Index + Count, State);
+
+                    Verify();
+                }
+
+                // Empty ranges and ranges out of the bitmap are rejected
+                Assert::IsTrue(!Bits.SetRange(0, 0), L"empty range");
+                Assert::IsTrue(!Bits.SetRange(BitCount - 1, 2), L"range out of bitmap");
+                Assert::IsTrue(!Bits.ClearRange(1, ~static_cast<size_t>(0)), L"range wraps around");
+                Verify();
+
+                Bits.SetAll();
+                std::fill(Expected.begin(), Expected.end(), true);
+                Verify();
+
+                Bits.ClearAll();
+                std::fill(Expected.begin(), Expected.end(), false);
+                Verify();
+            }
+        }
+
+        TEST_METHOD(SummaryBitmap_MasterTest)
+        {
+            // Sizes with 1, 2 and several words in each summary level
+            for (size_t BitCount : { 1, 65, 4096, 4097, 70000, 300000 })
+            {
+                // Searches must agree with Bitmap (see Bitmap_MasterTest)
+                Bitmap Expected(BitCount);
+                SummaryBitmap Bits(BitCount);
+
+                auto Verify = [&]()
+                {
+                    Assert::IsTrue(memcmp(Bits.Bits().Bits(), Expected.Bits(), (BitCount + 7) >> 3) == 0, L"bits mismatch");
+
+                    for (int i = 0; i < 64; i++)
+                    {
+                        size_t Start = rand() % (BitCount + 1);
+                        size_t Count = 1 + ((i & 3) ? rand() % 130 : rand() % 5000);
+
+                        Assert::AreEqual<uint64_t>(Bits.FindFirstSet(Start), Expected.FindFirstSet(Start), L"FindFirstSet mismatch");
+                        Assert::AreEqual<uint64_t>(Bits.FindFirstClear(Start), Expected.FindFirstClear(Start), L"FindFirstClear mismatch");
+                        Assert::AreEqual<uint64_t>(Bits.FindFirstClearRange(Start, Count), Expected.FindFirstClearRange(Start, Count),
+                            Format(L"FindFirstClearRange(%zu, %zu) mismatch", Start, Count).c_str());
+                    }
+                };
+
+                for (int i = 0; i < 200; i++)
+                {
+                    size_t Index = rand() % BitCount;
+                    size_t Count = 1 + rand() % ((i % 3) ? 300 : BitCount);
+                    if (Count > BitCount - Index)
+                        Count = BitCount - Index;
+
+                    switch (rand() % 4)
+                    {
+                    case 0:
+                        Assert::IsTrue(Bits.SetRange(Index, Count) && Expected.SetRange(Index, Count), L"range failed");
+                        break;
+                    case 1:
+                        Assert::IsTrue(Bits.ClearRange(Index, Count) && Expected.ClearRange(Index, Count), L"range failed");
+                        break;
+                    case 2:
+                        Assert::IsTrue(Bits.Set(Index) && Expected.Set(Index), L"set failed");
+                        break;
+                    default:
+                        Assert::IsTrue(Bits.Clear(Index) && Expected.Clear(Index), L"clear failed");
+                        break;
+                    }
+
+                    Verify();
+                }
+
+                Bits.SetAll();
+                Expected.SetAll();
+                Verify();
+
+                // A single clear run at the end
+                Assert::IsTrue(Bits.Clear(BitCount - 1) && Expected.Clear(BitCount - 1), L"clear failed");
+                Verify();
+
+                Bits.ClearAll();
+                Expected.ClearAll();
+                Verify();
+            }
+        }
+    };
+
     TEST_CLASS(VMMemoryTest)
     {
     public:
@@ -890,6 +1126,160 @@ namespace CoreUnitTest
             }
         }
 
+        TEST_METHOD(Memory_ManyBlocksTest)
+        {
+            const size_t BlockCount = 2048;
+            const size_t BlockSize = VMMemoryManager::PageSize;
+
+            VMMemoryManager Memory(BlockCount * BlockSize * 2);
+            std::vector<uint64_t> BlockAddress(BlockCount);
+
+            for (size_t i = 0; i < BlockCount; i++)
+            {
+                // Leave a 1-page hole after each block
+                Assert::IsTrue(
+                    Memory.Allocate(i * BlockSize * 2, BlockSize,
+                        (i & 1) ? MemoryType::Data : MemoryType::Bytecode, i,
+                        VMMemoryManager::Options::UsePreferredAddress, BlockAddress[i]),
+                    L"memory allocation failure");
+            }
+
+            auto VerifyBlock = [&Memory](uint64_t Address, uint64_t ExpectedBase, MemoryType ExpectedType)
+            {
+                MemoryInfo Info{};
+                Assert::IsTrue(Memory.Query(Address, Info), L"query failure");
+                Assert::IsTrue(Info.Base == ExpectedBase, L"block base mismatch");
+                Assert::IsTrue(Info.Type == ExpectedType, L"block type mismatch");
+            };
+
+            // Query blocks out of order
+            for (size_t i = 0; i < BlockCount; i++)
+            {
+                size_t Index = (i * 7919) % BlockCount;
+                uint64_t Base = BlockAddress[Index];
+                MemoryType Type = (Index & 1) ? MemoryType::Data : MemoryType::Bytecode;
+
+                VerifyBlock(Base, Base, Type);
+                VerifyBlock(Base + BlockSize - 1, Base, Type);
+                VerifyBlock(Base + BlockSize, Base + BlockSize, MemoryType::Freed);
+            }
+
+            // Freed blocks must be merged with neighboring holes
+            for (size_t i = 0; i < BlockCount; i += 2)
+            {
+                Assert::IsTrue(Memory.Free(BlockAddress[i], 0) == BlockSize, L"freed size mismatch");
+            }
+
+            VerifyBlock(0, 0, MemoryType::Freed);
+            for (size_t i = 1; i < BlockCount; i += 2)
+            {
+                uint64_t Base = BlockAddress[i];
+                uint64_t PrevBase = (i > 1) ? BlockAddress[i - 2] + BlockSize : 0;
+                VerifyBlock(Base - 1, PrevBase, MemoryType::Freed);
+                VerifyBlock(Base, Base, MemoryType::Data);
+                VerifyBlock(Base + BlockSize, Base + BlockSize, MemoryType::Freed);
+            }
+
+            MemoryInfo Info{};
+            Assert::IsFalse(Memory.Query(BlockCount * BlockSize * 2, Info), L"query beyond the end succeeded");
+        }
+
+        TEST_METHOD(Memory_FirstFitTest)
+        {
+            const size_t BlockCount = 1024;
+            const size_t BlockSize = VMMemoryManager::PageSize;
+
+            VMMemoryManager Memory(BlockCount * BlockSize * 4);
+
+            // Holes of 1 to 3 pages between 1-page blocks
+            for (size_t i = 0, Offset = 0; i < BlockCount; i++)
+            {
+                uint64_t Address = 0;
+                Offset += (1 + i % 3) * BlockSize;
+                Assert::IsTrue(
+                    Memory.Allocate(Offset, BlockSize, MemoryType::Data, i,
+                        VMMemoryManager::Options::UsePreferredAddress, Address),
+                    L"memory allocation failure");
+                Offset += BlockSize;
+            }
+
+            // Allocations without an address take the first freed block which fits
+            for (size_t i = 0; i < 3 * BlockCount; i++)
+            {
+                size_t Size = (1 + (i * 7) % 5) * BlockSize;
+
+                uint64_t Expected = ~0ull;
+                MemoryInfo Info{};
+                for (uint64_t Address = 0; Memory.Query(Address, Info); Address = Info.Base + Info.MaximumSize)
+                {
+                    if (Info.Type == MemoryType::Freed && Info.MaximumSize >= Size)
+                    {
+                        Expected = Info.Base;
+                        break;
+                    }
+                }
+
+                uint64_t Address = 0;
+                bool Allocated = Memory.Allocate(0, Size, MemoryType::Data, i, 0, Address);
+
+                Assert::IsTrue(Allocated == (Expected != ~0ull), L"allocation result mismatch");
+                if (!Allocated)
+                    continue;
+
+                Assert::AreEqual<uint64_t>(Address, Expected, L"not the first fit");
+
+                // Free some of them to fragment memory again
+                if (i % 3 == 0)
+                    Assert::IsTrue(Memory.Free(Address, 0) != 0, L"free failure");
+            }
+        }
+
+        TEST_METHOD(Memory_AccessTest)
+        {
+            const size_t PageSize = VMMemoryManager::PageSize;
+
+            VMMemoryManager Memory(PageSize * 16);
+
+            uint64_t Address = 0;
+            Assert::IsTrue(
+                Memory.Allocate(PageSize * 4, PageSize * 2, MemoryType::Data, 0,
+                    VMMemoryManager::Options::UsePreferredAddress, Address),
+                L"memory allocation failure");
+
+            uint8_t Buffer[0x20]{};
+            uint8_t Expected[0x20];
+            std::memset(Expected, 0xcc, sizeof(Expected));
+
+            // Access across the page boundary
+            uint64_t TestAddress = Address + PageSize - sizeof(Buffer) / 2;
+            Assert::IsTrue(Memory.Fill(TestAddress, sizeof(Buffer), 0xcc) == sizeof(Buffer), L"fill failure");
+            Assert::IsTrue(Memory.Read(TestAddress, sizeof(Buffer), Buffer) == sizeof(Buffer), L"read failure");
+            Assert::IsTrue(!std::memcmp(Buffer, Expected, sizeof(Buffer)), L"read data mismatch");
+
+            // Freed pages are not accessible
+            Assert::IsTrue(Memory.Free(Address, 0) == PageSize * 2, L"freed size mismatch");
+            Assert::IsTrue(Memory.Read(TestAddress, sizeof(Buffer), Buffer) == 0, L"read of freed memory succeeded");
+
+            bool Completed = false;
+            Assert::IsFalse(
+                Memory.ExecuteInMemoryContext([&]()
+                    {
+                        *reinterpret_cast<volatile uint8_t*>(Memory.HostAddress(Address)) = 0;
+                        Completed = true;
+                    }),
+                L"access to freed memory succeeded");
+            Assert::IsFalse(Completed, L"access to freed memory completed");
+
+            // Reallocated pages are accessible again
+            Assert::IsTrue(
+                Memory.Allocate(Address, PageSize * 2, MemoryType::Data, 0,
+                    VMMemoryManager::Options::UsePreferredAddress, Address),
+                L"memory allocation failure");
+            Assert::IsTrue(Memory.Write(TestAddress, sizeof(Expected), Expected) == sizeof(Expected), L"write failure");
+            Assert::IsTrue(Memory.Read(TestAddress, sizeof(Buffer), Buffer) == sizeof(Buffer), L"read failure");
+            Assert::IsTrue(!std::memcmp(Buffer, Expected, sizeof(Buffer)), L"read data mismatch");
+        }
+
     private:
     };
 
@@ -986,6 +1376,11 @@ namespace CoreUnitTest
         }
 
         TEST_METHOD_INITIALIZE(MethodInitialize)
+        {
+            InitializeGuest(false);
+        }
+
+        void InitializeGuest(bool GuardedAddressSpace)
         {
             struct AllocateParams
             {
@@ -1019,7 +1414,7 @@ namespace CoreUnitTest
             //
 
             size_t MemorySize = 0x4000000;
-            auto VMM = std::make_unique<VMMemoryManager>(MemorySize);
+            auto VMM = std::make_unique<VMMemoryManager>(MemorySize, GuardedAddressSpace);
             auto& Memory = *VMM.get();
 
             for (auto& it : AllocParamTable)
@@ -1050,6 +1445,7 @@ namespace CoreUnitTest
             ExecutionContext.XTableState = 0;
             ExecutionContext.ExceptionState = ExceptionState::T::None;
             ExecutionContext.Mode = 0;
+            ExecutionContext.TraceSink = &ConsoleTraceSink_;
 
             ExecutionContext.Stack = VMStack(
                 Memory.HostAddress(GuestStack.ResultAddress), GuestStack.Size, DefaultAlignment);
@@ -1872,6 +2268,27 @@ namespace CoreUnitTest
                 StackState(), StackState());
         }
 
+        TEST_METHOD(Inst_CheckOverflow)
+        {
+            // results wrap around without the prefix
+            Test_LoadImm2_Op<uint32_t>(Opcode::T::Add_I4, 0x7fffffff, 1, 0x80000000, true);
+            Test_LoadImm2_Op<uint32_t>(Opcode::T::Sub_U4, 0, 1, 0xffffffff, false);
+            Test_LoadImm2_Op<uint64_t>(Opcode::T::Mul_I8, 0x80000000'00000000, 2, 0, true);
+
+            VMExecutionContext InitialContext = ExecutionContextInitial_;
+            VMExecutionContext ResultContext;
+            InitialContext.FetchedPrefix = InstructionPrefixBits::T::CheckOverflow;
+
+            Test_LoadImm2_Op<uint32_t>(InitialContext, ResultContext, Opcode::T::Add_I4, 0x7ffffffe, 1, 0x7fffffff, true);
+            Test_LoadImm2_Op_Exception<uint32_t>(InitialContext, ResultContext, Opcode::T::Add_I4, 0x7fffffff, 1, ExceptionState::T::IntegerOverflow);
+            Test_LoadImm2_Op_Exception<uint64_t>(InitialContext, ResultContext, Opcode::T::Add_U8, ~0ull, 1, ExceptionState::T::IntegerOverflow);
+            Test_LoadImm2_Op_Exception<uint32_t>(InitialContext, ResultContext, Opcode::T::Sub_U4, 0, 1, ExceptionState::T::IntegerOverflow);
+            Test_LoadImm2_Op_Exception<uint64_t>(InitialContext, ResultContext, Opcode::T::Mul_I8, 0x80000000'00000000, 2, ExceptionState::T::IntegerOverflow);
+
+            // divide by zero is raised regardless of the prefix
+            Test_LoadImm2_Op_Exception<uint32_t>(InitialContext, ResultContext, Opcode::T::Div_I4, 1, 0, ExceptionState::T::IntegerDivideByZero);
+        }
+
         TEST_METHOD(Inst_Abs)
         {
             Test_LoadImm1_Op<uint32_t>(Opcode::T::Abs_I4, ~0x44332211 + 1, 0x44332211, true);
@@ -2380,6 +2797,12 @@ namespace CoreUnitTest
             Test_LoadImm2_Op<float>(Opcode::T::Test_l_F4, 123.456f, 123.456f - 0.00001f, Expected, true);
             Test_LoadImm2_Op<double>(Opcode::T::Test_l_F8, 123.456, 123.456 - 0.00001, Expected, true);
 
+            // unsigned operands differing only in the high 32 bits
+            Expected = 1;
+            Test_LoadImm2_Op<uint64_t>(Opcode::T::Test_l_U8, 0x00000001'44332211, 0x00000002'44332211, Expected, true);
+            Expected = 0;
+            Test_LoadImm2_Op<uint64_t>(Opcode::T::Test_l_U8, 0x00000002'44332211, 0x00000001'44332211, Expected, true);
+
             // stack overflow test
             std::vector<Opcode::T> TestOpList
             {
@@ -2733,97 +3156,1795 @@ namespace CoreUnitTest
                 StackState(), StackState(), StackState());
         }
 
+        TEST_METHOD(DecodeCache_Invalidation)
+        {
+            unsigned char Bytecode[0x20]{};
+            size_t ResultSize = 0;
 
-    private:
-        std::unique_ptr<VMMemoryManager> Memory_;
-        VMExecutionContext ExecutionContext_;
-        VMExecutionContext ExecutionContextInitial_;
+            VMBytecodeEmitter Emitter;
+            VMBytecodeInterpreter Interpreter(*Memory_.get());
 
-        GuestMemory GuestCode_;
-        GuestMemory GuestStack_;
-        GuestMemory GuestShadowStack_;
-        GuestMemory GuestLocalVarStack_;
-        GuestMemory GuestArgumentStack_;
+            for (uint8_t Value : { 0x11, 0x22, 0x33 })
+            {
+                // Rewriting the code through VMMemoryManager::Write() must drop
+                // instructions decoded by the previous run of the same interpreter
+                Assert::IsTrue(
+                    Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I1, Value)
+                    .Emit(Opcode::T::Bp)
+                    .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                    L"emit failed");
 
-        const uint32_t SizeOfBpInst = 1;
-    };
+                Assert::IsTrue(
+                    Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                    L"write failed");
 
-    TEST_CLASS(IntegerTest)
-    {
-    public:
-        template <
-            typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-            struct Testcase
-        {
-            Integer<T> v1;
-            Integer<T> v2;
-            Integer<T> ResultExpected;
-            uint8_t StateExpected;
-        };
+                VMExecutionContext Context = ExecutionContextInitial_;
+                Interpreter.Execute(Context, 2);
 
-        enum class TestType : uint32_t
+                Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+                VerifyStack<intptr_t>(Context.Stack, Value);
+            }
+        }
+
+        TEST_METHOD(DecodeCache_Links)
         {
-            Equ,	// a == b
-            Neq,	// a != b
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
 
-            Equ2,	// a == b (with state)
-            Neq2,	// a != b (with state)
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(5))      // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            const uint64_t Base = GuestCode_.Address;
+            ExceptionState::T Exception = ExceptionState::T::None;
+            VMDecodeCache Cache(*Memory_.get());
+
+            // Targets are resolved when decoded
+            auto Branch = Cache.Fetch(Base + 6, Exception);
+            Assert::IsTrue(Branch != nullptr, L"fetch failed");
+            Assert::AreEqual<uint64_t>(Branch->Target, Base + 21, L"target mismatch");
+
+            Branch = Cache.Fetch(Base + 15, Exception);
+            Assert::IsTrue(Branch != nullptr, L"fetch failed");
+            Assert::AreEqual<uint64_t>(Branch->Target, Base + 5, L"target mismatch");
+
+            // First transfer links the successor
+            auto Target = Cache.FetchNext(Branch, Base + 5, Exception);
+            Assert::IsTrue(Target != nullptr, L"fetch failed");
+            Assert::AreEqual<uint32_t>(Target->Op.Opcode(), Opcode::T::Dup, L"opcode mismatch");
+
+            // Entries may be moved by decoding
+            Branch = Cache.Fetch(Base + 15, Exception);
+            Assert::AreEqual<uint64_t>(Branch->LinkIP[0], Base + 5, L"link mismatch");
+            Assert::IsTrue(Branch->Link[0] != 0, L"not linked");
+            Assert::IsTrue(Cache.FetchNext(Branch, Base + 5, Exception) == Cache.Fetch(Base + 5, Exception), L"link mismatch");
+
+            // Second successor takes the other link
+            Branch = Cache.Fetch(Base + 15, Exception);
+            Target = Cache.FetchNext(Branch, Base + 21, Exception);
+            Assert::AreEqual<uint32_t>(Target->Op.Opcode(), Opcode::T::Bp, L"opcode mismatch");
+
+            Branch = Cache.Fetch(Base + 15, Exception);
+            Assert::AreEqual<uint64_t>(Branch->LinkIP[1], Base + 21, L"link mismatch");
+            Assert::IsTrue(Branch->Link[0] != 0 && Branch->Link[1] != 0, L"not linked");
+
+            // Links are dropped with the code
+            Bytecode[5] = Opcode::T::Nop;
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
 
-            Add,    // a + b
-            Sub,    // a - b
+            Target = Cache.FetchNext(Branch, Base + 5, Exception);
+            Assert::IsTrue(Target != nullptr, L"fetch failed");
+            Assert::AreEqual<uint32_t>(Target->Op.Opcode(), Opcode::T::Nop, L"opcode mismatch");
+        }
 
-            Mul,    // a * b
-            Div,    // a / b
-            Rem,    // a % b
+        TEST_METHOD(DecodeCache_HandlerTables)
+        {
+            unsigned char Bytecode[0x20]{};
+            size_t ResultSize = 0;
 
-            Shl,    // a << b
-            Shr,    // a >> b
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Bp)
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
 
-            And,    // a & b
-            Or,     // a | b
-            Xor,    // a ^ b
+            int Handlers[2]{};
+            std::vector<const void*> Tables[2] =
+            {
+                std::vector<const void*>(VMInstruction::InstructionCount, &Handlers[0]),
+                std::vector<const void*>(VMInstruction::InstructionCount, &Handlers[1]),
+            };
 
-            Neg,    // -a
-            Not,    // ~a
-            Inc,    // a++, ++a
-            Dec,    // a--, --a
-        };
+            ExceptionState::T Exception = ExceptionState::T::None;
+            VMDecodeCache Cache(*Memory_.get());
+
+            Cache.SetHandlerTable(Tables[0].data());
+            auto First = Cache.Fetch(GuestCode_.Address, Exception);
+            Assert::IsTrue(First != nullptr, L"fetch failed");
+            Assert::IsTrue(First->Handler == &Handlers[0], L"handler mismatch");
+
+            // Each table has its own entries
+            Cache.SetHandlerTable(Tables[1].data());
+            auto Second = Cache.Fetch(GuestCode_.Address, Exception);
+            Assert::IsTrue(Second != nullptr, L"fetch failed");
+            Assert::IsTrue(Second->Handler == &Handlers[1], L"handler mismatch");
+            Assert::IsTrue(Second != First, L"entry is shared");
+
+            // Switching back keeps the entries decoded for the table
+            Cache.SetHandlerTable(Tables[0].data());
+            Assert::IsTrue(Cache.Fetch(GuestCode_.Address, Exception) == First, L"entry is decoded again");
+            Assert::IsTrue(First->Handler == &Handlers[0], L"handler mismatch");
+        }
 
-        template <
-            typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value>>
-        T Shr_Signed_Helper(T v1, T v2)
+        TEST_METHOD(DecodeCache_VerifiedRegions)
         {
-            T vr = 0;
-            constexpr const T signbit = static_cast<T>(1) << ((sizeof(T) << 3) - 1);
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
 
-            if (v2 >= (sizeof(T) << 3))
-            {
-                vr = (v1 & signbit) ? ~0 : 0;
-            }
-            else
-            {
-                vr = v1 >> v2;
-                if (v1 & signbit)
-                    vr |= ~(static_cast<T>(~0) >> v2);
-            }
-            return vr;
-        };
+            // Loop of Jit_CompareWithInterpreter; at most 4 values are pushed
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(7))      // +0: acc
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +5: counter
+                .Emit(Opcode::T::Xch)                                       // +10: loop
+                .Emit(Opcode::T::Ldimm_I1, 3)                               // +11
+                .Emit(Opcode::T::Mul_I4)                                    // +13
+                .Emit(Opcode::T::Ldimm_I1, 0x55)                            // +14
+                .Emit(Opcode::T::Xor_X4)                                    // +16
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +17
+                .Emit(Opcode::T::Sub_I4)                                    // +19
+                .Emit(Opcode::T::Xch)                                       // +20
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +21
+                .Emit(Opcode::T::Sub_I4)                                    // +23
+                .Emit(Opcode::T::Dup)                                       // +24
+                .Emit(Opcode::T::Ldimm_I1, 0)                               // +25
+                .Emit(Opcode::T::Test_g_I4)                                 // +27
+                .Emit(Opcode::T::Br_nz_I4, OperandHelper<uint32_t>(-25))    // +29
+                .Emit(Opcode::T::Bp)                                        // +35: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+
+            // A block of just the code passes VMModuleVerifier; GuestCode_ has undefined bytes after it
+            uint64_t VerifiedCode = 0;
+            Assert::IsTrue(
+                Memory_->Allocate(0, ResultSize, MemoryType::Bytecode, 0, 0, VerifiedCode),
+                L"allocate failed");
+            Assert::IsTrue(
+                Memory_->Write(VerifiedCode, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            const uint32_t Mode = ExecutionContextInitial_.Mode;
+            const uint32_t Slot = ExecutionContextInitial_.Stack.Alignment();
+            ExceptionState::T Exception = ExceptionState::T::None;
+            VMDecodeCache Cache(*Memory_.get());
+            Cache.SetMode(Mode);
+
+            // Function bounds cover the deepest point of the loop
+            auto Entry = Cache.Fetch(VerifiedCode, Exception);
+            Assert::IsTrue(Entry != nullptr, L"fetch failed");
+            Assert::IsTrue(Cache.IsVerified(VerifiedCode, Mode), L"region is not verified");
+            Assert::AreEqual<uint32_t>(Entry->FunctionMode, VMBlockVerifier::ModeKey(Mode), L"function mode mismatch");
+            Assert::AreEqual<uint32_t>(Entry->FunctionPopSize, 0, L"pop size mismatch");
+            Assert::AreEqual<uint32_t>(Entry->FunctionPushSize, 4 * Slot, L"push size mismatch");
+
+            auto Loop = Cache.Fetch(VerifiedCode + 10, Exception);
+            Assert::IsTrue(Loop != nullptr, L"fetch failed");
+            Assert::AreEqual<uint32_t>(Loop->FunctionPopSize, 2 * Slot, L"pop size mismatch");
+            Assert::AreEqual<uint32_t>(Loop->FunctionPushSize, 2 * Slot, L"push size mismatch");
+
+            auto Unverified = Cache.Fetch(GuestCode_.Address, Exception);
+            Assert::IsTrue(Unverified != nullptr, L"fetch failed");
+            Assert::IsFalse(Cache.IsVerified(GuestCode_.Address, Mode), L"region is verified");
+            Assert::AreEqual<uint32_t>(Unverified->FunctionMode, 0, L"function mode mismatch");
+
+            // Writing another block keeps the region
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+            Assert::IsTrue(Cache.Fetch(VerifiedCode + 10, Exception) == Loop, L"region is decoded again");
 
-        template <
-            typename T,
-            typename = std::enable_if_t<std::is_integral<T>::value>>
-        void DoTest(TestType Type, const Testcase<T> Testcases[], size_t Count)
-        {
-            T Bitwidth = sizeof(T);
+#if M_VM_JIT
+            // Compiled code is dropped with its own block only
+            VMJit Jit(*Memory_.get());
+            Assert::IsTrue(Jit.Compile(VerifiedCode + 10, Mode, true), L"compile failed");
+            Assert::IsTrue(Jit.Compile(GuestCode_.Address + 10, Mode), L"compile failed");
 
-            for (size_t i = 0; i < Count; i++)
+            auto Compiled = Jit.Lookup(VerifiedCode + 10, Mode);
+            Assert::IsTrue(Compiled != nullptr && Compiled->Verified, L"entry mismatch");
+            Assert::IsFalse(Jit.Lookup(GuestCode_.Address + 10, Mode)->Verified, L"entry mismatch");
+
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+            Assert::IsTrue(Jit.Lookup(VerifiedCode + 10, Mode) != nullptr, L"entry is dropped");
+            Assert::IsTrue(Jit.Lookup(GuestCode_.Address + 10, Mode) == nullptr, L"entry is kept");
+#endif
+
+            //
+            // Runs as the unverified copy, also when the operand stack cannot
+            // hold the function and it overflows on the second push.
+            //
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+
+            auto ReadStack = [&](const VMExecutionContext& Context)
             {
-                Testcase<T> Entry = Testcases[i];
-                std::vector<Integer<T>> Results;
+                std::vector<uint8_t> Buffer(GuestStack_.Size);
+                Memory_->Read(GuestStack_.Address, Buffer.size(), &Buffer[0]);
+                Buffer.erase(Buffer.begin(), Buffer.begin() + Context.Stack.TopOffset());
+                return Buffer;
+            };
 
-                switch (Type)
+            for (uint32_t TopOffset : { ExecutionContextInitial_.Stack.TopOffset(), Slot })
+            {
+                VMExecutionContext Expected = ExecutionContextInitial_;
+                Expected.Stack.SetTopOffset(TopOffset);
+                int ExpectedStepCount = Interpreter.Execute(Expected, 4000);
+                auto ExpectedStack = ReadStack(Expected);
+
+                Assert::AreEqual<uint32_t>(Expected.ExceptionState,
+                    TopOffset == Slot ? ExceptionState::T::StackOverflow : ExceptionState::T::Breakpoint,
+                    L"exception state mismatch");
+
+                auto Run = [&](int(VMBytecodeInterpreterT<NoTracePolicy>::*Execute)(VMExecutionContext&, int))
+                {
+                    VMExecutionContext Context = ExecutionContextInitial_;
+                    Context.IP = static_cast<uint32_t>(VerifiedCode);
+                    Context.Stack.SetTopOffset(TopOffset);
+
+                    int StepCount = (Interpreter.*Execute)(Context, 4000);
+
+                    Assert::AreEqual<uint32_t>(Context.ExceptionState, Expected.ExceptionState, L"exception state mismatch");
+                    Assert::AreEqual<int>(StepCount, ExpectedStepCount, L"step count mismatch");
+                    Assert::AreEqual<uint64_t>(Context.IP - VerifiedCode, Expected.IP - GuestCode_.Address, L"IP mismatch");
+                    Assert::IsTrue(ReadStack(Context) == ExpectedStack, L"stack mismatch");
+                };
+
+                Run(&VMBytecodeInterpreterT<NoTracePolicy>::Execute);
+#if M_VM_JIT
+                Run(&VMBytecodeInterpreterT<NoTracePolicy>::ExecuteJit);
+#endif
+            }
+        }
+
+        TEST_METHOD(DecodeCache_VerifiedSelfModifyingRegion)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            // The store rewrites the Nops at +16 to 4 pushes; the function bounds must be checked again
+            uint64_t Pushes = 0;
+            for (int i = 0; i < 4; i++)
+                Pushes |= (static_cast<uint64_t>(Opcode::T::Ldimm_I1) | (static_cast<uint64_t>(Opcode::T::Nop) << 8)) << (16 * i);
+
+            uint64_t VerifiedCode = 0;
+            Assert::IsTrue(
+                Memory_->Allocate(0, 25, MemoryType::Bytecode, 0, 0, VerifiedCode),
+                L"allocate failed");
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(static_cast<uint32_t>(VerifiedCode + 16)))  // +0
+                .Emit(Opcode::T::Ldimm_I8, OperandHelper<uint64_t>(Pushes))                                    // +5
+                .Emit(Opcode::T::Stpv_X8)                                                                       // +14
+                .Emit(Opcode::T::Nop)                                                                           // +15
+                .Emit(Opcode::T::Nop).Emit(Opcode::T::Nop).Emit(Opcode::T::Nop).Emit(Opcode::T::Nop)           // +16
+                .Emit(Opcode::T::Nop).Emit(Opcode::T::Nop).Emit(Opcode::T::Nop).Emit(Opcode::T::Nop)
+                .Emit(Opcode::T::Bp)                                                                            // +24
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::AreEqual<size_t>(ResultSize, 25, L"size mismatch");
+
+            const uint32_t Slot = ExecutionContextInitial_.Stack.Alignment();
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+
+            auto Run = [&](int(VMBytecodeInterpreterT<NoTracePolicy>::*Execute)(VMExecutionContext&, int))
+            {
+                Assert::IsTrue(
+                    Memory_->Write(VerifiedCode, ResultSize, Bytecode) == ResultSize,
+                    L"write failed");
+
+                VMExecutionContext Context = ExecutionContextInitial_;
+                Context.IP = static_cast<uint32_t>(VerifiedCode);
+                Context.Stack.SetTopOffset(2 * Slot);
+
+                (Interpreter.*Execute)(Context, 100);
+
+                Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::StackOverflow, L"exception state mismatch");
+                Assert::AreEqual<uint64_t>(Context.IP - VerifiedCode, 20, L"IP mismatch");
+            };
+
+            Run(&VMBytecodeInterpreterT<NoTracePolicy>::Execute);
+#if M_VM_JIT
+            Run(&VMBytecodeInterpreterT<NoTracePolicy>::ExecuteJit);
+#endif
+        }
+
+
+        TEST_METHOD(Trace_Sink)
+        {
+            class RecordTraceSink : public VMTraceSink
+            {
+            public:
+                void Trace(const VMExecutionContext& Context, const TraceEvent& Event) override
+                {
+                    Events.push_back(Event);
+                    Opcodes.push_back(Event.Instruction ? Event.Instruction->Opcode() : Opcode::T::Inv);
+                }
+
+                std::vector<TraceEvent> Events;
+                std::vector<Opcode::T> Opcodes;
+            };
+
+            unsigned char Bytecode[0x20]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Nop)
+                .Emit(Opcode::T::Bp)
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<SinkTracePolicy> Interpreter(*Memory_.get());
+            RecordTraceSink Sink;
+
+            // No events without sink
+            VMExecutionContext Context = ExecutionContextInitial_;
+            Context.TraceSink = nullptr;
+            Interpreter.Execute(Context, 3);
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+
+            Context = ExecutionContextInitial_;
+            Context.TraceSink = &Sink;
+            Interpreter.Execute(Context, 3);
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+
+            std::vector<TraceEventType::T> ExpectedType
+            {
+                TraceEventType::T::ExecuteBegin,
+                TraceEventType::T::Instruction,
+                TraceEventType::T::Instruction,
+                TraceEventType::T::Instruction,
+                TraceEventType::T::Exception,
+                TraceEventType::T::ExecuteEnd,
+            };
+
+            Assert::AreEqual(Sink.Events.size(), ExpectedType.size(), L"event count mismatch");
+            for (size_t i = 0; i < ExpectedType.size(); i++)
+            {
+                Assert::AreEqual<uint32_t>(Sink.Events[i].Type, ExpectedType[i], L"event type mismatch");
+            }
+
+            Assert::AreEqual<uint32_t>(Sink.Opcodes[1], Opcode::T::Ldimm_I1, L"opcode mismatch");
+            Assert::AreEqual<uint32_t>(Sink.Opcodes[2], Opcode::T::Nop, L"opcode mismatch");
+            Assert::AreEqual<uint32_t>(Sink.Opcodes[3], Opcode::T::Bp, L"opcode mismatch");
+            Assert::AreEqual<uint32_t>(Sink.Events[4].IP, Sink.Events[3].IP, L"exception IP mismatch");
+            Assert::IsTrue(Sink.Events[4].Value == ExceptionState::T::Breakpoint, L"exception mismatch");
+            Assert::IsTrue(Sink.Events[5].Value == 2, L"step count mismatch");
+
+            // Nothing is traced by NoTracePolicy
+            Sink.Events.clear();
+            VMBytecodeInterpreterT<NoTracePolicy> SilentInterpreter(*Memory_.get());
+            Context = ExecutionContextInitial_;
+            Context.TraceSink = &Sink;
+            SilentInterpreter.Execute(Context, 3);
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+            Assert::IsTrue(Sink.Events.empty(), L"unexpected trace event");
+        }
+
+
+        TEST_METHOD(Inst_Ldpv_Stpv)
+        {
+            // Run with both checked access and guarded address space
+            for (bool GuardedAddressSpace : { false, true })
+            {
+                MethodCleanup();
+                InitializeGuest(GuardedAddressSpace);
+
+                uint64_t DataAddress = 0;
+                Assert::IsTrue(
+                    Memory_->Allocate(0x00800000, 0x1000, MemoryType::Data, 0,
+                        VMMemoryManager::Options::UsePreferredAddress, DataAddress),
+                    L"memory allocation failure");
+
+                VMBytecodeInterpreter Interpreter(*Memory_.get());
+
+                auto Run = [&](VMBytecodeEmitter& Emitter, int Count, int ExpectedStepCount,
+                    ExceptionState::T ExpectedExceptionState) -> VMExecutionContext
+                {
+                    unsigned char Bytecode[0x40]{};
+                    size_t ResultSize = 0;
+
+                    Assert::IsTrue(Emitter.EndEmit(Bytecode, std::size(Bytecode), &ResultSize), L"emit failed");
+                    Assert::IsTrue(
+                        Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                        L"write failed");
+
+                    VMExecutionContext Context = ExecutionContextInitial_;
+                    int StepCount = Interpreter.Execute(Context, Count);
+
+                    Assert::AreEqual(StepCount, ExpectedStepCount, L"step count mismatch");
+                    Assert::AreEqual<uint32_t>(Context.ExceptionState, ExpectedExceptionState, L"exception state mismatch");
+
+                    return Context;
+                };
+
+                uint32_t Reference = static_cast<uint32_t>(DataAddress + 0xffe);
+
+                // Store and load back
+                VMBytecodeEmitter Emitter;
+                Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper(Reference))
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(0x12345678))
+                    .Emit(Opcode::T::Stpv_X2)
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper(Reference))
+                    .Emit(Opcode::T::Ldpv_X2)
+                    .Emit(Opcode::T::Bp);
+
+                auto Context = Run(Emitter, 6, 5, ExceptionState::T::Breakpoint);
+                VerifyStack<uint64_t>(Context.Stack, 0x5678);
+
+                uint16_t Stored = 0;
+                Assert::IsTrue(
+                    Memory_->Read(Reference, sizeof(Stored), reinterpret_cast<uint8_t*>(&Stored)) == sizeof(Stored),
+                    L"read failure");
+                Assert::AreEqual<uint32_t>(Stored, 0x5678, L"stored value mismatch");
+
+                // Access crossing the end of the block
+                Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper(Reference))
+                    .Emit(Opcode::T::Ldpv_X4)
+                    .Emit(Opcode::T::Bp);
+
+                Context = Run(Emitter, 3, 1, ExceptionState::T::InvalidAccess);
+                Assert::AreEqual<uint32_t>(Context.IP, static_cast<uint32_t>(GuestCode_.Address + 5), L"IP mismatch");
+
+                Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper(Reference))
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(0))
+                    .Emit(Opcode::T::Stpv_X4)
+                    .Emit(Opcode::T::Bp);
+
+                Context = Run(Emitter, 4, 2, ExceptionState::T::InvalidAccess);
+                Assert::AreEqual<uint32_t>(Context.IP, static_cast<uint32_t>(GuestCode_.Address + 10), L"IP mismatch");
+
+                // Address beyond the managed range
+                Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I8, OperandHelper<uint64_t>(0xfffffffc))
+                    .Emit(Opcode::T::Ldpv_X8)
+                    .Emit(Opcode::T::Bp);
+
+                Run(Emitter, 3, 1, ExceptionState::T::InvalidAccess);
+
+                // Managed memory which is not allocated
+                Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(static_cast<uint32_t>(DataAddress + 0x10000)))
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(0))
+                    .Emit(Opcode::T::Stpv_X4)
+                    .Emit(Opcode::T::Bp);
+
+                Run(Emitter, 4, 2, ExceptionState::T::InvalidAccess);
+            }
+        }
+
+        TEST_METHOD(BlockVerifier_StackBounds)
+        {
+            const uint32_t Mode = ExecutionContextInitial_.Mode;
+            const uint32_t Slot = ExecutionContextInitial_.Stack.Alignment();
+
+            // Ldimm, Ldimm, Add, Br: two slots pushed at most, block ends at branch
+            VMBlockVerifier Verifier(Mode);
+            Assert::IsTrue(Verifier.Append(Opcode::T::Ldimm_I4), L"append failed");
+            Assert::IsTrue(Verifier.Append(Opcode::T::Ldimm_I4), L"append failed");
+            Assert::IsTrue(Verifier.Append(Opcode::T::Add_I4), L"append failed");
+            Assert::IsTrue(Verifier.Append(Opcode::T::Br_I1), L"append failed");
+            Assert::IsTrue(Verifier.Ended(), L"block not ended");
+            Assert::IsFalse(Verifier.Append(Opcode::T::Nop), L"appended after end");
+            Assert::AreEqual<uint32_t>(Verifier.Length(), 4, L"length mismatch");
+            Assert::AreEqual<uint32_t>(Verifier.PushSize(), 2 * Slot, L"push size mismatch");
+            Assert::AreEqual<uint32_t>(Verifier.PopSize(), 0, L"pop size mismatch");
+
+            // Values consumed from the caller's stack
+            VMBlockVerifier PopVerifier(Mode);
+            Assert::IsTrue(PopVerifier.Append(Opcode::T::Xch), L"append failed");
+            Assert::IsTrue(PopVerifier.Append(Opcode::T::Dcv), L"append failed");
+            Assert::IsTrue(PopVerifier.Append(Opcode::T::Dcv), L"append failed");
+            Assert::AreEqual<uint32_t>(PopVerifier.PopSize(), 2 * Slot, L"pop size mismatch");
+            Assert::AreEqual<uint32_t>(PopVerifier.PushSize(), 0, L"push size mismatch");
+
+            // Dynamic stack effect ends the block before the instruction
+            VMBlockVerifier DynamicVerifier(Mode);
+            Assert::IsFalse(DynamicVerifier.Append(Opcode::T::Dcvn), L"dynamic instruction appended");
+            Assert::AreEqual<uint32_t>(DynamicVerifier.Length(), 0, L"length mismatch");
+
+            // A block which does not fit must still raise overflow at the faulting instruction
+            unsigned char Bytecode[0x20]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Ldimm_I1, 2)
+                .Emit(Opcode::T::Add_I4)
+                .Emit(Opcode::T::Bp)
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreter Interpreter(*Memory_.get());
+
+            for (int Run = 0; Run < 2; Run++)
+            {
+                // Second run uses the cached verification result
+                VMExecutionContext Context = ExecutionContextInitial_;
+                Context.Stack.SetTopOffset(Slot); // one free slot
+
+                int StepCount = Interpreter.Execute(Context, 4);
+
+                Assert::AreEqual(StepCount, 1, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::StackOverflow, L"exception state mismatch");
+                Assert::AreEqual<uint32_t>(Context.IP, static_cast<uint32_t>(GuestCode_.Address + 2), L"IP mismatch");
+
+                // Enough room runs the whole block
+                Context = ExecutionContextInitial_;
+                StepCount = Interpreter.Execute(Context, 4);
+
+                Assert::AreEqual(StepCount, 3, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+                VerifyStack<intptr_t>(Context.Stack, 3);
+            }
+        }
+
+        TEST_METHOD(ModuleVerifier_Verify)
+        {
+            const uint32_t Mode = ExecutionContextInitial_.Mode;
+            const uint64_t Base = GuestCode_.Address;
+
+            auto Verify = [Mode, Base](VMBytecodeEmitter& Emitter, size_t Truncate = 0)
+            {
+                unsigned char Bytecode[0x40]{};
+                size_t ResultSize = 0;
+
+                Assert::IsTrue(Emitter.EndEmit(Bytecode, std::size(Bytecode), &ResultSize), L"emit failed");
+                return VMModuleVerifier::Verify(Base, Bytecode, ResultSize - Truncate, Mode);
+            };
+
+            // Counts down from 100; loop and exit agree on the stack height
+            VMBytecodeEmitter Emitter;
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(100))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Dcv)                                       // +21: exit
+                .Emit(Opcode::T::Ret);                                      // +22
+            auto Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::Verified, L"status mismatch");
+            Assert::AreEqual<uint64_t>(Result.MaximumDepth, 2 * ExecutionContextInitial_.Stack.Alignment(), L"maximum depth mismatch");
+
+            // Local variable declared before use
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Var, OperandHelper<uint32_t>(4))
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(7))
+                .Emit(Opcode::T::Stvar, OperandHelper<uint16_t>(0))
+                .Emit(Opcode::T::Ldvar, OperandHelper<uint16_t>(0))
+                .Emit(Opcode::T::Dcv)
+                .Emit(Opcode::T::Dcv)
+                .Emit(Opcode::T::Ret);
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::Verified, L"status mismatch");
+
+            // Last instruction is cut off
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +0
+                .Emit(Opcode::T::Dcv)                                       // +2
+                .Emit(Opcode::T::Ret);                                      // +3
+            Result = Verify(Emitter, 1);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::InvalidInstruction, L"status mismatch");
+            Assert::AreEqual<uint64_t>(Result.FaultAddress, Base + 3, L"fault address mismatch");
+
+            // Branch into the immediate of the next instruction
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(1))
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(0))
+                .Emit(Opcode::T::Dcv)
+                .Emit(Opcode::T::Ret);
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::InvalidTarget, L"status mismatch");
+            Assert::AreEqual<uint64_t>(Result.FaultAddress, Base, L"fault address mismatch");
+
+            // Runs off the end of the region
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Nop);
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::InvalidTarget, L"status mismatch");
+
+            // Pops a value the function did not push
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +0
+                .Emit(Opcode::T::Add_I4)                                    // +2
+                .Emit(Opcode::T::Ret);
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::StackUnderflow, L"status mismatch");
+            Assert::AreEqual<uint64_t>(Result.FaultAddress, Base + 2, L"fault address mismatch");
+
+            // Returns with a value left on the stack
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +0
+                .Emit(Opcode::T::Ret);                                      // +2
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::StackMismatch, L"status mismatch");
+            Assert::AreEqual<uint64_t>(Result.FaultAddress, Base + 2, L"fault address mismatch");
+
+            // Local variable which is not declared
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldvar, OperandHelper<uint16_t>(0))
+                .Emit(Opcode::T::Dcv)
+                .Emit(Opcode::T::Ret);
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::InvalidIndex, L"status mismatch");
+            Assert::AreEqual<uint64_t>(Result.FaultAddress, Base, L"fault address mismatch");
+
+            // Stack effect known at run time only
+            Emitter.BeginEmit()
+                .Emit(Opcode::T::Dcvn)
+                .Emit(Opcode::T::Ret);
+            Result = Verify(Emitter);
+            Assert::AreEqual<uint32_t>(Result.Status, ModuleVerifyStatus::T::Unsupported, L"status mismatch");
+        }
+
+        TEST_METHOD(Superinstruction_Dispatch)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            // Countdown loop; dup + br_z.i4 and ldimm.i1 + sub.i4 are fused
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(5))      // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+
+            VMExecutionContext Context = ExecutionContextInitial_;
+            int StepCount = Interpreter.Execute(Context, 100);
+
+            Assert::AreEqual(StepCount, 1 + 5 * 5 + 2, L"step count mismatch");
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+            VerifyStack<intptr_t>(Context.Stack, 0);
+
+            // Step count may end inside a superinstruction
+            for (int Count : { 2, 4 })
+            {
+                Context = ExecutionContextInitial_;
+                StepCount = Interpreter.Execute(Context, Count);
+
+                Assert::AreEqual(StepCount, Count, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Context.IP, static_cast<uint32_t>(GuestCode_.Address + (Count == 2 ? 6 : 14)), L"IP mismatch");
+            }
+
+            // Exception in the second instruction is raised at its IP
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Add_I4)
+                .Emit(Opcode::T::Bp)
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            Context = ExecutionContextInitial_;
+            StepCount = Interpreter.Execute(Context, 3);
+
+            Assert::AreEqual(StepCount, 1, L"step count mismatch");
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::StackOverflow, L"exception state mismatch");
+            Assert::AreEqual<uint32_t>(Context.IP, static_cast<uint32_t>(GuestCode_.Address + 2), L"IP mismatch");
+        }
+
+        TEST_METHOD(Trace_NgramSink)
+        {
+            unsigned char Bytecode[0x20]{};
+            size_t ResultSize = 0;
+
+            // ldimm.i1 + add.i4 runs three times, then bp
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 0)
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Add_I4)
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Add_I4)
+                .Emit(Opcode::T::Ldimm_I1, 1)
+                .Emit(Opcode::T::Add_I4)
+                .Emit(Opcode::T::Bp)
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<SinkTracePolicy> Interpreter(*Memory_.get());
+            VMNgramTraceSink Sink;
+
+            VMExecutionContext Context = ExecutionContextInitial_;
+            Context.TraceSink = &Sink;
+            Interpreter.Execute(Context, 8);
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+
+            auto Top = Sink.Top(1);
+            Assert::AreEqual<size_t>(Top.size(), 1, L"n-gram count mismatch");
+            Assert::AreEqual<uint64_t>(Top[0].second, 3, L"frequency mismatch");
+            Assert::IsTrue(
+                Top[0].first == VMNgramTraceSink::Ngram{ Opcode::T::Ldimm_I1, Opcode::T::Add_I4 },
+                L"n-gram mismatch");
+        }
+
+#if M_VM_JIT
+        TEST_METHOD(Jit_CompareWithInterpreter)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            // acc = acc * 3 ^ 0x55 - 1 for 200 iterations; loop entry is hot
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(7))      // +0: acc
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +5: counter
+                .Emit(Opcode::T::Xch)                                       // +10: loop
+                .Emit(Opcode::T::Ldimm_I1, 3)                               // +11
+                .Emit(Opcode::T::Mul_I4)                                    // +13
+                .Emit(Opcode::T::Ldimm_I1, 0x55)                            // +14
+                .Emit(Opcode::T::Xor_X4)                                    // +16
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +17
+                .Emit(Opcode::T::Sub_I4)                                    // +19
+                .Emit(Opcode::T::Xch)                                       // +20
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +21
+                .Emit(Opcode::T::Sub_I4)                                    // +23
+                .Emit(Opcode::T::Dup)                                       // +24
+                .Emit(Opcode::T::Ldimm_I1, 0)                               // +25
+                .Emit(Opcode::T::Test_g_I4)                                 // +27
+                .Emit(Opcode::T::Br_nz_I4, OperandHelper<uint32_t>(-25))    // +29
+                .Emit(Opcode::T::Bp)                                        // +35: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+            VMBytecodeInterpreterT<NoTracePolicy> JitInterpreter(*Memory_.get());
+
+            auto ReadStack = [&](const VMExecutionContext& Context)
+            {
+                std::vector<uint8_t> Buffer(GuestStack_.Size);
+                Memory_->Read(GuestStack_.Address, Buffer.size(), &Buffer[0]);
+                Buffer.erase(Buffer.begin(), Buffer.begin() + Context.Stack.TopOffset());
+                return Buffer;
+            };
+
+            // Runs to the end at once, then in chunks which may end inside compiled code
+            for (int Count : { 4000, 1, 3, 7, 64 })
+            {
+                VMExecutionContext Expected = ExecutionContextInitial_;
+                int ExpectedStepCount = Interpreter.Execute(Expected, 4000);
+                auto ExpectedStack = ReadStack(Expected);
+
+                Assert::AreEqual<uint32_t>(Expected.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+
+                VMExecutionContext Context = ExecutionContextInitial_;
+                int StepCount = 0;
+                while (Context.ExceptionState == ExceptionState::T::None)
+                {
+                    int Result = JitInterpreter.ExecuteJit(Context, Count);
+                    if (!Result)
+                        break;
+
+                    StepCount += Result;
+                }
+
+                Assert::AreEqual(StepCount, ExpectedStepCount, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Context.ExceptionState, Expected.ExceptionState, L"exception state mismatch");
+                Assert::AreEqual<uint32_t>(Context.IP, Expected.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Context.PrevIP, Expected.PrevIP, L"PrevIP mismatch");
+                Assert::AreEqual<uint32_t>(Context.Stack.TopOffset(), Expected.Stack.TopOffset(), L"stack top mismatch");
+                Assert::IsTrue(ReadStack(Context) == ExpectedStack, L"stack mismatch");
+            }
+
+            VMJit Jit(*Memory_.get());
+            Assert::IsTrue(Jit.Compile(GuestCode_.Address + 10, ExecutionContextInitial_.Mode), L"compile failed");
+            Assert::IsTrue(Jit.Lookup(GuestCode_.Address + 10, ExecutionContextInitial_.Mode) != nullptr, L"entry not found");
+            Assert::IsTrue(Jit.Lookup(GuestCode_.Address + 35, ExecutionContextInitial_.Mode) == nullptr, L"bp is compiled");
+        }
+#endif
+
+        TEST_METHOD(ExecuteUntilEvent_Halts)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            // Function called by the host: counts down from 100, then vmcall and ret
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(100))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Vmcall, OperandHelper<uint32_t>(0x1234))   // +21: exit
+                .Emit(Opcode::T::Xch)                                       // +27
+                .Emit(Opcode::T::Ret)                                       // +28
+                .Emit(Opcode::T::Bp)                                        // +30: return address
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+            VMExecutionContext Context = ExecutionContextInitial_;
+
+            // Call frame of the host
+            auto ReturnIP = static_cast<decltype(Context.IP)>(GuestCode_.Address + 30);
+            ShadowFrame Frame{};
+            Frame.ReturnIP = ReturnIP;
+            Frame.ReturnSP = Context.Stack.TopOffset();
+            Frame.LVTP = Context.LocalVariableStack.TopOffset();
+            Assert::IsTrue(Context.Stack.Push(ReturnIP), L"push failed");
+            Assert::IsTrue(Context.ShadowStack.Push(Frame), L"push failed");
+
+            // Budget is checked at the backward branch
+            ExecuteBudget Budget{};
+            Budget.StepCount = 100;
+            auto Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::StepBudget, L"event mismatch");
+            Assert::AreEqual<uint64_t>(Result.StepCount, 101, L"step count mismatch");
+            Assert::AreEqual<uint32_t>(Context.IP, GuestCode_.Address + 5, L"IP mismatch");
+
+            uint64_t StepCount = Result.StepCount;
+
+            // vmcall completes before the halt
+            Budget.StepCount = 0;
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            StepCount += Result.StepCount;
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Vmcall, L"event mismatch");
+            Assert::AreEqual<uint32_t>(Result.VmcallId, 0x1234, L"vmcall id mismatch");
+            Assert::AreEqual<uint64_t>(StepCount, 504, L"step count mismatch");
+            Assert::AreEqual<uint32_t>(Context.IP, GuestCode_.Address + 27, L"IP mismatch");
+
+            Budget.Deadline = std::chrono::steady_clock::now() + std::chrono::hours(1);
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Return, L"event mismatch");
+            Assert::AreEqual<uint64_t>(Result.StepCount, 2, L"step count mismatch");
+            Assert::AreEqual<uint32_t>(Context.IP, ReturnIP, L"IP mismatch");
+
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+
+
+            // Infinite loop ends by the deadline
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Nop)                                       // +0: loop
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-7))        // +1
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            Context = ExecutionContextInitial_;
+            Budget.Deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(10);
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::TimeBudget, L"event mismatch");
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::None, L"exception state mismatch");
+        }
+
+        TEST_METHOD(ExecuteUntilEvent_Fuel)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(20))     // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+
+            VMExecutionContext Expected = ExecutionContextInitial_;
+            int ExpectedStepCount = Interpreter.Execute(Expected, 1000);
+
+            // Slices which do and do not end at block boundaries
+            for (uint64_t Slice : { 1, 3, 5, 7, 64 })
+            {
+                VMExecutionContext Context = ExecutionContextInitial_;
+                ExecuteBudget Budget{};
+                Budget.MeterFuel = true;
+
+                uint64_t StepCount = 0;
+
+                while (true)
+                {
+                    Context.Fuel = Slice;
+
+                    auto Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+                    StepCount += Result.StepCount;
+
+                    if (Result.Event != HaltEvent::T::OutOfFuel)
+                    {
+                        Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+                        break;
+                    }
+
+                    // Fuel is used up exactly
+                    Assert::AreEqual<uint64_t>(Result.StepCount, Slice, L"step count mismatch");
+                    Assert::AreEqual<uint64_t>(Context.Fuel, 0, L"fuel mismatch");
+                }
+
+                Assert::AreEqual<uint64_t>(StepCount, ExpectedStepCount, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Context.ExceptionState, Expected.ExceptionState, L"exception state mismatch");
+                Assert::AreEqual<uint32_t>(Context.IP, Expected.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Context.Stack.TopOffset(), Expected.Stack.TopOffset(), L"stack top mismatch");
+            }
+        }
+
+        TEST_METHOD(Scheduler_RunsContexts)
+        {
+            //
+            // Each task needs its own memory manager (VMMemoryManager is not thread-safe).
+            //
+
+            struct Guest
+            {
+                std::unique_ptr<VMMemoryManager> Memory;
+                VMExecutionContext Initial;
+                VMExecutionContext Context;
+                VMExecutionContext Expected;
+                int ExpectedStepCount;
+            };
+
+            const size_t TaskCount = 16;
+            const size_t StackSize = 0x1000;
+            const int DefaultAlignment = sizeof(intptr_t);
+
+            std::vector<Guest> Guests(TaskCount);
+
+            for (size_t i = 0; i < TaskCount; i++)
+            {
+                auto& Current = Guests[i];
+                Current.Memory = std::make_unique<VMMemoryManager>(0x100000, false);
+
+                uint64_t CodeAddress = 0;
+                Assert::IsTrue(
+                    Current.Memory->Allocate(0x1000, 0x1000, MemoryType::Bytecode, 0,
+                        VMMemoryManager::Options::UsePreferredAddress, CodeAddress),
+                    L"failed to allocate code");
+
+                VMStack* Stacks[] =
+                {
+                    &Current.Initial.Stack, &Current.Initial.ShadowStack,
+                    &Current.Initial.LocalVariableStack, &Current.Initial.ArgumentStack,
+                };
+
+                for (auto Stack : Stacks)
+                {
+                    uint64_t StackAddress = 0;
+                    Assert::IsTrue(
+                        Current.Memory->Allocate(0, StackSize, MemoryType::Stack, 0, 0, StackAddress),
+                        L"failed to allocate stack");
+                    *Stack = VMStack(Current.Memory->HostAddress(StackAddress), StackSize, DefaultAlignment);
+                }
+
+                // Loop counts differ so that tasks complete at different times
+                unsigned char Bytecode[0x40]{};
+                size_t ResultSize = 0;
+
+                VMBytecodeEmitter Emitter;
+                Assert::IsTrue(
+                    Emitter.BeginEmit()
+                    .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(static_cast<uint32_t>(100 * i)))
+                    .Emit(Opcode::T::Dup)                                       // +5: loop
+                    .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                    .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                    .Emit(Opcode::T::Sub_I4)                                    // +14
+                    .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                    .Emit(Opcode::T::Bp)                                        // +21: exit
+                    .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                    L"emit failed");
+                Assert::IsTrue(
+                    Current.Memory->Write(CodeAddress, ResultSize, Bytecode) == ResultSize,
+                    L"write failed");
+
+                Current.Initial.IP = static_cast<uint32_t>(CodeAddress);
+                Current.Initial.ExceptionState = ExceptionState::T::None;
+                if (DefaultAlignment == sizeof(int64_t))
+                    Current.Initial.Mode |= ModeBits::T::VMStackOper64Bit;
+
+                Current.Expected = Current.Initial;
+                VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Current.Memory);
+                Current.ExpectedStepCount = Interpreter.Execute(Current.Expected, INT_MAX);
+
+                Current.Context = Current.Initial;
+            }
+
+            // Small slices so that tasks are requeued and stolen
+            VMScheduler Scheduler(4, 7);
+            std::atomic<uint32_t> CompletionCount(0);
+
+            for (auto& Current : Guests)
+            {
+                Scheduler.Submit(*Current.Memory, Current.Context,
+                    [&CompletionCount](VMExecutionContext& Context, const ExecuteResult& Result)
+                    {
+                        CompletionCount++;
+                        return Result.Event != HaltEvent::T::Exception;
+                    });
+            }
+
+            Scheduler.Wait();
+
+            Assert::AreEqual<uint32_t>(CompletionCount, TaskCount, L"completion count mismatch");
+
+            uint64_t ExpectedStepCount = 0;
+
+            for (auto& Current : Guests)
+            {
+                ExpectedStepCount += Current.ExpectedStepCount;
+
+                Assert::AreEqual<uint32_t>(Current.Context.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+                Assert::AreEqual<uint32_t>(Current.Context.IP, Current.Expected.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Current.Context.Stack.TopOffset(), Current.Expected.Stack.TopOffset(), L"stack top mismatch");
+            }
+
+            auto Statistics = Scheduler.Statistics();
+            Assert::AreEqual<uint64_t>(Statistics.TaskCount, TaskCount, L"task count mismatch");
+            Assert::AreEqual<uint64_t>(Statistics.StepCount, ExpectedStepCount, L"step count mismatch");
+            Assert::IsTrue(Statistics.SliceCount > TaskCount, L"slice count mismatch");
+        }
+
+        TEST_METHOD(CodeImage_Shared)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMExecutionContext Expected = ExecutionContextInitial_;
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+            int ExpectedStepCount = Interpreter.Execute(Expected, INT_MAX);
+
+            auto Image = VMCodeImage::Create(Bytecode, ResultSize);
+            Assert::IsTrue(Image != nullptr, L"failed to create image");
+
+            //
+            // Map the image where the fixture has its code; stacks are private.
+            //
+
+            struct Guest
+            {
+                std::unique_ptr<VMMemoryManager> Memory;
+                VMExecutionContext Context;
+            };
+
+            const size_t StackSize = 0x10000;        // as the fixture, so that stack offsets match
+            const int DefaultAlignment = sizeof(intptr_t);
+
+            Guest Guests[2];
+
+            for (auto& Current : Guests)
+            {
+                Current.Memory = std::make_unique<VMMemoryManager>(0x100000, false);
+
+                uint64_t CodeAddress = 0;
+                Assert::IsTrue(
+                    Current.Memory->MapImage(Image, GuestCode_.Address, 0,
+                        VMMemoryManager::Options::UsePreferredAddress, CodeAddress),
+                    L"failed to map image");
+
+                MemoryInfo Info{};
+                Assert::IsTrue(Current.Memory->Query(CodeAddress, Info), L"query failed");
+                Assert::IsTrue(Info.Type == MemoryType::Bytecode, L"memory type mismatch");
+                Assert::IsTrue(Info.Image == Image.get(), L"image mismatch");
+
+                // Read-only
+                Assert::IsTrue(Current.Memory->Write(CodeAddress, 1, Bytecode) == 0, L"image is written");
+
+                Current.Context = ExecutionContextInitial_;
+                Current.Context.TraceSink = nullptr;
+
+                VMStack* Stacks[] =
+                {
+                    &Current.Context.Stack, &Current.Context.ShadowStack,
+                    &Current.Context.LocalVariableStack, &Current.Context.ArgumentStack,
+                };
+
+                for (auto Stack : Stacks)
+                {
+                    uint64_t StackAddress = 0;
+                    Assert::IsTrue(
+                        Current.Memory->Allocate(0, StackSize, MemoryType::Stack, 0, 0, StackAddress),
+                        L"failed to allocate stack");
+                    *Stack = VMStack(Current.Memory->HostAddress(StackAddress), StackSize, DefaultAlignment);
+                }
+            }
+
+            Assert::AreEqual<long>(Image.use_count(), 3, L"reference count mismatch");
+
+            for (auto& Current : Guests)
+            {
+                VMBytecodeInterpreterT<NoTracePolicy> GuestInterpreter(*Current.Memory);
+
+                // Twice, with the region decoded by the first guest
+                for (int i = 0; i < 2; i++)
+                {
+                    VMExecutionContext Context = Current.Context;
+                    int StepCount = GuestInterpreter.Execute(Context, INT_MAX);
+
+                    Assert::AreEqual(StepCount, ExpectedStepCount, L"step count mismatch");
+                    Assert::AreEqual<uint32_t>(Context.ExceptionState, Expected.ExceptionState, L"exception state mismatch");
+                    Assert::AreEqual<uint32_t>(Context.IP, Expected.IP, L"IP mismatch");
+                    Assert::AreEqual<uint32_t>(Context.Stack.TopOffset(), Expected.Stack.TopOffset(), L"stack top mismatch");
+                }
+            }
+
+#if M_VM_JIT
+            // Code compiled for one guest is used by the other
+            VMJit Jit0(*Guests[0].Memory);
+            VMJit Jit1(*Guests[1].Memory);
+
+            uint64_t LoopAddress = GuestCode_.Address + 5;
+            uint32_t Mode = ExecutionContextInitial_.Mode;
+
+            Assert::IsTrue(Jit0.Compile(LoopAddress, Mode), L"compile failed");
+            Assert::IsTrue(Jit1.Lookup(LoopAddress, Mode) == nullptr, L"entry found before compile");
+            Assert::IsTrue(Jit1.Compile(LoopAddress, Mode), L"compile failed");
+            Assert::IsTrue(
+                Jit0.Lookup(LoopAddress, Mode)->Target == Jit1.Lookup(LoopAddress, Mode)->Target,
+                L"compiled code is not shared");
+#endif
+
+            Assert::IsTrue(Guests[0].Memory->Free(GuestCode_.Address, 0) == Image->MappedSize(), L"free failed");
+            Assert::AreEqual<long>(Image.use_count(), 2, L"reference count mismatch");
+        }
+
+        TEST_METHOD(Snapshot_Fork)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+            ExecuteBudget Budget{};
+
+            VMExecutionContext Expected = ExecutionContextInitial_;
+            auto Result = Interpreter.ExecuteUntilEvent(Expected, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+            uint64_t ExpectedStepCount = Result.StepCount;
+
+            //
+            // Warm up: stop in the middle of the loop, with data written.
+            //
+
+            VMExecutionContext Context = ExecutionContextInitial_;
+            Budget.StepCount = 100;
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::StepBudget, L"event mismatch");
+            uint64_t WarmStepCount = Result.StepCount;
+
+            const size_t DataSize = 0x3000;
+            uint64_t DataAddress = 0;
+            Assert::IsTrue(
+                Memory_->Allocate(0, DataSize, MemoryType::Data, 0, 0, DataAddress),
+                L"failed to allocate data");
+
+            uint8_t Value = 0x11;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+            uint32_t Counter = 0;
+            uint64_t CounterAddress = Context.Stack.Top() - Memory_->Base();
+            Assert::IsTrue(
+                Memory_->Read(CounterAddress, sizeof(Counter), reinterpret_cast<uint8_t*>(&Counter)) == sizeof(Counter),
+                L"read failed");
+
+            auto Snapshot = Memory_->Snapshot(Context);
+            Assert::IsTrue(Snapshot != nullptr, L"snapshot failed");
+
+            // Changes after the snapshot are not seen by forks
+            Value = 0x22;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+            for (int i = 0; i < 2; i++)
+            {
+                VMExecutionContext Forked{};
+                auto Memory = VMMemoryManager::Fork(*Snapshot, Forked);
+                Assert::IsTrue(Memory != nullptr, L"fork failed");
+                Assert::IsTrue(Memory->Base() != Memory_->Base(), L"fork shares the memory");
+
+                MemoryInfo Info{};
+                Assert::IsTrue(Memory->Query(DataAddress, Info), L"query failed");
+                Assert::IsTrue(Info.Type == MemoryType::Data, L"memory type mismatch");
+
+                uint8_t Forked1[DataSize]{};
+                Assert::IsTrue(Memory->Read(DataAddress, DataSize, Forked1) == DataSize, L"read failed");
+                Assert::AreEqual<uint32_t>(Forked1[0], 0x11, L"data mismatch");
+                Assert::AreEqual<uint32_t>(Forked1[DataSize - 1], 0, L"data mismatch");
+
+                // Written by the previous fork
+                Value = 0x33;
+                Assert::IsTrue(Memory->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+                // Stacks are moved to the fork
+                Assert::IsTrue(
+                    Forked.Stack.Top() - Memory->Base() == Context.Stack.Top() - Memory_->Base(),
+                    L"stack is not moved");
+
+                VMBytecodeInterpreterT<NoTracePolicy> ForkedInterpreter(*Memory);
+                Budget.StepCount = 0;
+                Result = ForkedInterpreter.ExecuteUntilEvent(Forked, Budget);
+
+                Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+                Assert::AreEqual<uint64_t>(WarmStepCount + Result.StepCount, ExpectedStepCount, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Forked.ExceptionState, Expected.ExceptionState, L"exception state mismatch");
+                Assert::AreEqual<uint32_t>(Forked.IP, Expected.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Forked.Stack.TopOffset(), Expected.Stack.TopOffset(), L"stack top mismatch");
+
+                // Memory freed and allocated again is zero
+                Assert::IsTrue(Memory->Free(DataAddress, 0) == DataSize, L"free failed");
+                uint64_t Address = 0;
+                Assert::IsTrue(
+                    Memory->Allocate(DataAddress, DataSize, MemoryType::Data, 0,
+                        VMMemoryManager::Options::UsePreferredAddress, Address),
+                    L"failed to allocate data");
+                Assert::IsTrue(Memory->Read(Address, 1, &Value) == 1, L"read failed");
+                Assert::AreEqual<uint32_t>(Value, 0, L"data mismatch");
+            }
+
+            // Forks ran on their own stacks
+            uint32_t SourceCounter = 0;
+            Assert::IsTrue(
+                Memory_->Read(CounterAddress, sizeof(SourceCounter), reinterpret_cast<uint8_t*>(&SourceCounter)) == sizeof(SourceCounter),
+                L"read failed");
+            Assert::AreEqual(SourceCounter, Counter, L"source stack is modified");
+
+            Assert::IsTrue(Memory_->Read(DataAddress, 1, &Value) == 1, L"read failed");
+            Assert::AreEqual<uint32_t>(Value, 0x22, L"data mismatch");
+        }
+
+        TEST_METHOD(Serialize_Deserialize)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+            ExecuteBudget Budget{};
+
+            VMExecutionContext Expected = ExecutionContextInitial_;
+            auto Result = Interpreter.ExecuteUntilEvent(Expected, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+            uint64_t ExpectedStepCount = Result.StepCount;
+
+            //
+            // Checkpoint in the middle of the loop, with data and an image.
+            //
+
+            VMExecutionContext Context = ExecutionContextInitial_;
+            Budget.StepCount = 100;
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::StepBudget, L"event mismatch");
+            uint64_t CheckpointStepCount = Result.StepCount;
+
+            const size_t DataSize = 0x3000;
+            uint64_t DataAddress = 0;
+            Assert::IsTrue(
+                Memory_->Allocate(0, DataSize, MemoryType::Data, 0, 0, DataAddress),
+                L"failed to allocate data");
+
+            uint8_t Value = 0x11;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+            auto Image = VMCodeImage::Create(Bytecode, ResultSize);
+            Assert::IsTrue(Image != nullptr, L"failed to create image");
+
+            uint64_t ImageAddress = 0;
+            Assert::IsTrue(Memory_->MapImage(Image, 0, 0, 0, ImageAddress), L"failed to map image");
+
+            const std::string Path = "svm_serialize_test.bin";
+            Assert::IsTrue(Memory_->Serialize(Context, Path), L"serialize failed");
+
+            for (int i = 0; i < 2; i++)
+            {
+                VMExecutionContext Restored{};
+                auto Memory = VMMemoryManager::Deserialize(Path, Restored);
+                Assert::IsTrue(Memory != nullptr, L"deserialize failed");
+
+                MemoryInfo Info{};
+                Assert::IsTrue(Memory->Query(DataAddress, Info), L"query failed");
+                Assert::IsTrue(Info.Type == MemoryType::Data, L"memory type mismatch");
+
+                uint8_t Data[DataSize]{};
+                Assert::IsTrue(Memory->Read(DataAddress, DataSize, Data) == DataSize, L"read failed");
+                Assert::AreEqual<uint32_t>(Data[0], 0x11, L"data mismatch");
+                Assert::AreEqual<uint32_t>(Data[DataSize - 1], 0, L"data mismatch");
+
+                // Image is restored as a new read-only image
+                Assert::IsTrue(Memory->Query(ImageAddress, Info), L"query failed");
+                Assert::IsTrue(Info.Image != nullptr && Info.Image != Image.get(), L"image mismatch");
+                Assert::IsTrue(Memory->Read(ImageAddress, ResultSize, Data) == ResultSize, L"read failed");
+                Assert::IsTrue(memcmp(Data, Bytecode, ResultSize) == 0, L"image mismatch");
+                Assert::IsTrue(Memory->Write(ImageAddress, 1, Bytecode) == 0, L"image is written");
+
+                Assert::IsTrue(
+                    Restored.Stack.Top() - Memory->Base() == Context.Stack.Top() - Memory_->Base(),
+                    L"stack is not moved");
+
+                VMBytecodeInterpreterT<NoTracePolicy> RestoredInterpreter(*Memory);
+                Budget.StepCount = 0;
+                Result = RestoredInterpreter.ExecuteUntilEvent(Restored, Budget);
+
+                Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+                Assert::AreEqual<uint64_t>(CheckpointStepCount + Result.StepCount, ExpectedStepCount, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Restored.IP, Expected.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Restored.Stack.TopOffset(), Expected.Stack.TopOffset(), L"stack top mismatch");
+            }
+
+            // Files of another format are rejected
+            {
+                std::fstream File(Path, std::ios::binary | std::ios::in | std::ios::out);
+                File.put(0);
+            }
+
+            VMExecutionContext Restored{};
+            Assert::IsTrue(VMMemoryManager::Deserialize(Path, Restored) == nullptr, L"bad file is loaded");
+
+            std::remove(Path.c_str());
+        }
+
+        TEST_METHOD(Checkpoint_Rollback)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+            ExecuteBudget Budget{};
+
+            VMExecutionContext Expected = ExecutionContextInitial_;
+            auto Result = Interpreter.ExecuteUntilEvent(Expected, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+            uint64_t ExpectedStepCount = Result.StepCount;
+
+            VMExecutionContext Context = ExecutionContextInitial_;
+            Budget.StepCount = 100;
+            Result = Interpreter.ExecuteUntilEvent(Context, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::StepBudget, L"event mismatch");
+            uint64_t WarmStepCount = Result.StepCount;
+
+            const size_t DataSize = 0x3000;
+            uint64_t DataAddress = 0;
+            Assert::IsTrue(
+                Memory_->Allocate(0, DataSize, MemoryType::Data, 0, 0, DataAddress),
+                L"failed to allocate data");
+
+            uint8_t Value = 0x11;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+            uint32_t Counter = 0;
+            uint64_t CounterAddress = Context.Stack.Top() - Memory_->Base();
+            Assert::IsTrue(
+                Memory_->Read(CounterAddress, sizeof(Counter), reinterpret_cast<uint8_t*>(&Counter)) == sizeof(Counter),
+                L"read failed");
+
+            auto Baseline = Memory_->Checkpoint(Context);
+            Assert::IsTrue(Baseline != nullptr, L"checkpoint failed");
+            Assert::IsTrue(Memory_->IsTrackingWrites(), L"writes are not tracked");
+            Assert::IsTrue(Memory_->DirtyRanges().empty(), L"pages are dirty");
+
+            //
+            // Run to the end, writing data and allocating memory.
+            //
+
+            Value = 0x22;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+            uint64_t NewAddress = 0;
+            Assert::IsTrue(
+                Memory_->Allocate(0, DataSize, MemoryType::Data, 0, 0, NewAddress),
+                L"failed to allocate data");
+
+            VMExecutionContext Current = Context;
+            Budget.StepCount = 0;
+            Result = Interpreter.ExecuteUntilEvent(Current, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+
+            auto IsDirty = [&](uint64_t Address)
+            {
+                for (const auto& Range : Memory_->DirtyRanges())
+                {
+                    if (Range.Base <= Address && Address < Range.Base + Range.Size)
+                        return true;
+                }
+
+                return false;
+            };
+
+            Assert::IsTrue(IsDirty(DataAddress), L"data page is not dirty");
+            Assert::IsTrue(IsDirty(CounterAddress), L"stack page is not dirty");
+            Assert::IsTrue(!IsDirty(GuestCode_.Address), L"code page is dirty");
+
+            //
+            // Rollback restores memory and context, and runs the same again.
+            //
+
+            for (int i = 0; i < 2; i++)
+            {
+                Assert::IsTrue(Memory_->Rollback(Current), L"rollback failed");
+                Assert::IsTrue(Memory_->DirtyRanges().empty(), L"pages are dirty");
+
+                Assert::IsTrue(Memory_->Read(DataAddress, 1, &Value) == 1, L"read failed");
+                Assert::AreEqual<uint32_t>(Value, 0x11, L"data mismatch");
+
+                uint32_t RestoredCounter = 0;
+                Assert::IsTrue(
+                    Memory_->Read(CounterAddress, sizeof(RestoredCounter), reinterpret_cast<uint8_t*>(&RestoredCounter)) == sizeof(RestoredCounter),
+                    L"read failed");
+                Assert::AreEqual(RestoredCounter, Counter, L"stack mismatch");
+
+                MemoryInfo Info{};
+                Assert::IsTrue(Memory_->Query(NewAddress, Info), L"query failed");
+                Assert::IsTrue(Info.Type == MemoryType::Freed, L"memory is not freed");
+
+                Assert::AreEqual<uint32_t>(Current.IP, Context.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Current.Stack.TopOffset(), Context.Stack.TopOffset(), L"stack top mismatch");
+
+                Result = Interpreter.ExecuteUntilEvent(Current, Budget);
+                Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+                Assert::AreEqual<uint64_t>(WarmStepCount + Result.StepCount, ExpectedStepCount, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Current.IP, Expected.IP, L"IP mismatch");
+            }
+
+            //
+            // Delta checkpoint saves the dirty pages only.
+            //
+
+            Assert::IsTrue(Memory_->Rollback(Current), L"rollback failed");
+
+            Value = 0x44;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+
+            auto Delta = Memory_->Checkpoint(Current);
+            Assert::IsTrue(Delta != nullptr, L"checkpoint failed");
+            Assert::IsTrue(Delta->Parent() == Baseline, L"parent mismatch");
+            Assert::AreEqual<size_t>(Delta->SavedSize(), VMMemoryManager::PageSize, L"saved size mismatch");
+            Assert::IsTrue(!Delta->Save("checkpoint_delta.bin"), L"delta is saved");
+
+            VMExecutionContext Forked{};
+            auto Memory = VMMemoryManager::Fork(*Delta, Forked);
+            Assert::IsTrue(Memory != nullptr, L"fork failed");
+            Assert::IsTrue(Memory->Read(DataAddress, 1, &Value) == 1, L"read failed");
+            Assert::AreEqual<uint32_t>(Value, 0x44, L"data mismatch");
+
+            VMBytecodeInterpreterT<NoTracePolicy> ForkedInterpreter(*Memory);
+            Result = ForkedInterpreter.ExecuteUntilEvent(Forked, Budget);
+            Assert::AreEqual<uint32_t>(Result.Event, HaltEvent::T::Exception, L"event mismatch");
+            Assert::AreEqual<uint64_t>(WarmStepCount + Result.StepCount, ExpectedStepCount, L"step count mismatch");
+
+            Value = 0x55;
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+            Assert::IsTrue(Memory_->Rollback(Current), L"rollback failed");
+            Assert::IsTrue(Memory_->Read(DataAddress, 1, &Value) == 1, L"read failed");
+            Assert::AreEqual<uint32_t>(Value, 0x44, L"data mismatch");
+
+            // Memory is writable as usual afterwards
+            Memory_->DiscardCheckpoints();
+            Assert::IsTrue(!Memory_->IsTrackingWrites(), L"writes are tracked");
+            Assert::IsTrue(!Memory_->Rollback(Current), L"rollback without checkpoint");
+            Assert::IsTrue(Memory_->Write(DataAddress, 1, &Value) == 1, L"write failed");
+        }
+
+#if M_VM_JIT
+        TEST_METHOD(Checkpoint_ExecuteJit)
+        {
+            unsigned char Bytecode[0x40]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I4, OperandHelper<uint32_t>(200))    // +0
+                .Emit(Opcode::T::Dup)                                       // +5: loop
+                .Emit(Opcode::T::Br_z_I4, OperandHelper<uint32_t>(9))       // +6
+                .Emit(Opcode::T::Ldimm_I1, 1)                               // +12
+                .Emit(Opcode::T::Sub_I4)                                    // +14
+                .Emit(Opcode::T::Br_I4, OperandHelper<uint32_t>(-16))       // +15
+                .Emit(Opcode::T::Bp)                                        // +21: exit
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+            Assert::IsTrue(
+                Memory_->Write(GuestCode_.Address, ResultSize, Bytecode) == ResultSize,
+                L"write failed");
+
+            VMBytecodeInterpreterT<NoTracePolicy> Interpreter(*Memory_.get());
+
+            VMExecutionContext Expected = ExecutionContextInitial_;
+            int ExpectedStepCount = Interpreter.Execute(Expected, 4000);
+            Assert::AreEqual<uint32_t>(Expected.ExceptionState, ExceptionState::T::Breakpoint, L"exception state mismatch");
+
+            // The loop is compiled before the checkpoint
+            VMExecutionContext Context = ExecutionContextInitial_;
+            int WarmStepCount = Interpreter.ExecuteJit(Context, 300);
+            Assert::AreEqual(WarmStepCount, 300, L"step count mismatch");
+            Assert::AreEqual<uint32_t>(Context.ExceptionState, ExceptionState::T::None, L"exception state mismatch");
+
+            auto Baseline = Memory_->Checkpoint(Context);
+            Assert::IsTrue(Baseline != nullptr, L"checkpoint failed");
+
+            //
+            // Stack pages are write-protected now; the run writes them
+            // without faulting outside the memory context.
+            //
+
+            VMExecutionContext Current = Context;
+
+            for (int i = 0; i < 2; i++)
+            {
+                int StepCount = WarmStepCount;
+                while (Current.ExceptionState == ExceptionState::T::None)
+                {
+                    int Result = Interpreter.ExecuteJit(Current, 64);
+                    if (!Result)
+                        break;
+
+                    StepCount += Result;
+                }
+
+                Assert::AreEqual(StepCount, ExpectedStepCount, L"step count mismatch");
+                Assert::AreEqual<uint32_t>(Current.ExceptionState, Expected.ExceptionState, L"exception state mismatch");
+                Assert::AreEqual<uint32_t>(Current.IP, Expected.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Current.Stack.TopOffset(), Expected.Stack.TopOffset(), L"stack top mismatch");
+                Assert::IsTrue(!Memory_->DirtyRanges().empty(), L"stack page is not dirty");
+
+                Assert::IsTrue(Memory_->Rollback(Current), L"rollback failed");
+                Assert::IsTrue(Memory_->DirtyRanges().empty(), L"pages are dirty");
+                Assert::AreEqual<uint32_t>(Current.IP, Context.IP, L"IP mismatch");
+                Assert::AreEqual<uint32_t>(Current.Stack.TopOffset(), Context.Stack.TopOffset(), L"stack top mismatch");
+            }
+
+            // The host pushes a vmcall result to a write-protected page
+            uint32_t VmcallResult = 0x1234;
+            Assert::IsTrue(Interpreter.PushVmcallResult(Current, VmcallResult), L"push failed");
+            Assert::IsTrue(!Memory_->DirtyRanges().empty(), L"stack page is not dirty");
+
+            uint32_t Pushed = 0;
+            Assert::IsTrue(
+                Memory_->Read(Current.Stack.Top() - Memory_->Base(), sizeof(Pushed), reinterpret_cast<uint8_t*>(&Pushed)) == sizeof(Pushed),
+                L"read failed");
+            Assert::AreEqual(Pushed, VmcallResult, L"stack mismatch");
+
+            Assert::IsTrue(Memory_->Rollback(Current), L"rollback failed");
+            Assert::AreEqual<uint32_t>(Current.Stack.TopOffset(), Context.Stack.TopOffset(), L"stack top mismatch");
+
+            Memory_->DiscardCheckpoints();
+        }
+#endif
+
+
+    private:
+        std::unique_ptr<VMMemoryManager> Memory_;
+        VMExecutionContext ExecutionContext_;
+        VMExecutionContext ExecutionContextInitial_;
+
+        GuestMemory GuestCode_;
+        GuestMemory GuestStack_;
+        GuestMemory GuestShadowStack_;
+        GuestMemory GuestLocalVarStack_;
+        GuestMemory GuestArgumentStack_;
+
+        const uint32_t SizeOfBpInst = 1;
+
+        VMConsoleTraceSink ConsoleTraceSink_;
+    };
+
+    TEST_CLASS(IntegerTest)
+    {
+    public:
+        template <
+            typename T,
+            typename = std::enable_if_t<std::is_integral<T>::value>>
+            struct Testcase
+        {
+            Integer<T> v1;
+            Integer<T> v2;
+            Integer<T> ResultExpected;
+            uint8_t StateExpected;
+        };
+
+        enum class TestType : uint32_t
+        {
+            Equ,	// a == b
+            Neq,	// a != b
+
+            Equ2,	// a == b (with state)
+            Neq2,	// a != b (with state)
+
+            Add,    // a + b
+            Sub,    // a - b
+
+            Mul,    // a * b
+            Div,    // a / b
+            Rem,    // a % b
+
+            Shl,    // a << b
+            Shr,    // a >> b
+
+            And,    // a & b
+            Or,     // a | b
+            Xor,    // a ^ b
+
+            Neg,    // -a
+            Not,    // ~a
+            Inc,    // a++, ++a
+            Dec,    // a--, --a
+        };
+
+        template <
+            typename T,
+            typename = std::enable_if_t<std::is_integral<T>::value && std::is_unsigned<T>::value>>
+        T Shr_Signed_Helper(T v1, T v2)
+        {
+            T vr = 0;
+            constexpr const T signbit = static_cast<T>(1) << ((sizeof(T) << 3) - 1);
+
+            if (v2 >= (sizeof(T) << 3))
+            {
+                vr = (v1 & signbit) ? ~0 : 0;
+            }
+            else
+            {
+                vr = v1 >> v2;
+                if (v1 & signbit)
+                    vr |= ~(static_cast<T>(~0) >> v2);
+            }
+            return vr;
+        };
+
+        template <
+            typename T,
+            typename = std::enable_if_t<std::is_integral<T>::value>>
+        void DoTest(TestType Type, const Testcase<T> Testcases[], size_t Count)
+        {
+            T Bitwidth = sizeof(T);
+
+            for (size_t i = 0; i < Count; i++)
+            {
+                Testcase<T> Entry = Testcases[i];
+                std::vector<Integer<T>> Results;
+
+                switch (Type)
                 {
                 case TestType::Equ:	   // a == b
                 {
@@ -4236,6 +6357,50 @@ namespace CoreUnitTest
             DoMultipleTest<uint64_t>();
         }
 
+        //
+        // Compares Add(), Subtract() and Multiply() (with high part) of all
+        // pairs of 8-bit values, and of 16-bit values with a step, with
+        // 64-bit arithmetic.
+        //
+
+        template <typename T>
+        void DoExhaustiveTest(int64_t Step)
+        {
+            constexpr const int64_t Minimum = std::numeric_limits<T>::min();
+            constexpr const int64_t Maximum = std::numeric_limits<T>::max();
+            constexpr const uint8_t s_ovf = Integer<T>::StateFlags::Overflow;
+
+            auto Verify = [&](const Integer<T>& Result, int64_t Expected, const wchar_t* Name)
+            {
+                uint8_t State = (Expected < Minimum || Expected > Maximum) ? s_ovf : 0;
+
+                Assert::AreEqual<int64_t>(Result.Value(), static_cast<T>(Expected), Name);
+                Assert::AreEqual<uint8_t>(Result.State(), State, Name);
+            };
+
+            for (int64_t v1 = Minimum; v1 <= Maximum; v1++)
+            {
+                for (int64_t v2 = Minimum; v2 <= Maximum; v2 += Step)
+                {
+                    Integer<T> HighPart;
+
+                    Verify(Integer<T>(static_cast<T>(v1)).Add(static_cast<T>(v2)), v1 + v2, L"Add mismatch");
+                    Verify(Integer<T>(static_cast<T>(v1)).Subtract(static_cast<T>(v2)), v1 - v2, L"Subtract mismatch");
+                    Verify(Integer<T>(static_cast<T>(v1)).Multiply(static_cast<T>(v2), &HighPart), v1 * v2, L"Multiply mismatch");
+
+                    Assert::AreEqual<int64_t>(HighPart.Value(), static_cast<T>((v1 * v2) >> (sizeof(T) << 3)), L"Multiply high part mismatch");
+                }
+            }
+        }
+
+        TEST_METHOD(Integer_ExhaustiveTest)
+        {
+            DoExhaustiveTest<int8_t>(1);
+            DoExhaustiveTest<uint8_t>(1);
+            DoExhaustiveTest<int16_t>(251);
+            DoExhaustiveTest<uint16_t>(251);
+        }
+
     };
 
     TEST_CLASS(MiscTest)
@@ -4287,6 +6452,94 @@ namespace CoreUnitTest
 
         }
 
+        TEST_METHOD(InstructionInfo_Table)
+        {
+            for (uint32_t i = 0; i < VMInstruction::InstructionCount; i++)
+                Assert::AreEqual<uint32_t>(VMInstruction::Info(i)->Id, i, L"opcode mismatch");
+
+            Assert::IsNull(VMInstruction::Info(VMInstruction::InstructionCount), L"undefined opcode has info");
+
+            auto Add = VMInstruction::Info(Opcode::T::Add_I8);
+            Assert::AreEqual(Add->Mnemonic, "add.i8", false, L"mnemonic mismatch");
+            Assert::AreEqual<uint32_t>(Add->ImmediateSize, 0, L"immediate size mismatch");
+            Assert::AreEqual<uint32_t>(Add->PopSize[0], 16, L"pop size mismatch");
+            Assert::AreEqual<uint32_t>(Add->PushSize[0], 8, L"push size mismatch");
+
+            auto Ldimm = VMInstruction::Info(Opcode::T::Ldimm_I2);
+            Assert::AreEqual<uint32_t>(Ldimm->Operand, OperandType::T::Imm16, L"operand type mismatch");
+            Assert::AreEqual<uint32_t>(Ldimm->ImmediateSize, 2, L"immediate size mismatch");
+            Assert::AreEqual<uint32_t>(Ldimm->PushSize[0], 4, L"push size mismatch");
+            Assert::AreEqual<uint32_t>(Ldimm->PushSize[ModeBits::T::VMStackOper64Bit], 8, L"push size mismatch");
+
+            Assert::IsTrue(!!(VMInstruction::Info(Opcode::T::Br_I1)->Flags & InstructionFlags::T::EndsBlock), L"branch does not end block");
+            Assert::IsTrue(!!(VMInstruction::Info(Opcode::T::Dcvn)->Flags & InstructionFlags::T::StackDynamic), L"dcvn is not dynamic");
+            Assert::IsTrue(!!(VMInstruction::Info(Opcode::T::Ldimm_I1)->Flags & InstructionFlags::T::Fusible), L"ldimm.i1 is not fusible");
+            Assert::IsFalse(!!(VMInstruction::Info(Opcode::T::Nop)->Flags & InstructionFlags::T::Fusible), L"nop is fusible");
+
+            // Undefined opcode (2-byte encoding of InstructionCount) is not decoded
+            uint8_t Bytecode[] = { 0x80 | (VMInstruction::InstructionCount & 0x7f), VMInstruction::InstructionCount >> 7 };
+            Assert::AreEqual<size_t>(VMInstruction::Decode(Bytecode, std::size(Bytecode), nullptr), 0, L"undefined opcode decoded");
+        }
+
+        TEST_METHOD(DecodedStream_Decode)
+        {
+            unsigned char Bytecode[0x20]{};
+            size_t ResultSize = 0;
+
+            VMBytecodeEmitter Emitter;
+            Assert::IsTrue(
+                Emitter.BeginEmit()
+                .Emit(Opcode::T::Ldimm_I1, 0x12)
+                .Emit(Opcode::T::Ldimm_I4, Operand(OperandType::Imm32, 0x11223344))
+                .Emit(Opcode::T::Add_I4)
+                .Emit(Opcode::T::Vmxthrow)
+                .EndEmit(Bytecode, std::size(Bytecode), &ResultSize),
+                L"emit failed");
+
+            const uint64_t Address = 0x1000;
+            VMDecodedStream Stream;
+
+            Assert::AreEqual<uint32_t>(Stream.Decode(Address, Bytecode, ResultSize), DecodeStatus::T::Complete, L"status mismatch");
+            Assert::AreEqual<size_t>(Stream.Count(), 4, L"count mismatch");
+            Assert::AreEqual<size_t>(Stream.DecodedSize(), ResultSize, L"decoded size mismatch");
+
+            const uint16_t Opcodes[] = { Opcode::T::Ldimm_I1, Opcode::T::Ldimm_I4, Opcode::T::Add_I4, Opcode::T::Vmxthrow };
+            const uint64_t Operands[] = { 0x12, 0x11223344, 0, 0 };
+            uint64_t Next = Address;
+
+            for (size_t i = 0; i < Stream.Count(); i++)
+            {
+                // Same result as decoding one instruction at a time
+                VMInstruction Op;
+                size_t Length = VMInstruction::Decode(Bytecode + (Next - Address), ResultSize - static_cast<size_t>(Next - Address), &Op);
+
+                Assert::AreEqual<uint32_t>(Stream.Opcodes[i], Opcodes[i], L"opcode mismatch");
+                Assert::AreEqual<uint32_t>(Stream.Opcodes[i], Op.Opcode(), L"opcode mismatch");
+                Assert::AreEqual<uint64_t>(Stream.Operands[i], Operands[i], L"operand mismatch");
+                Assert::AreEqual<size_t>(Stream.Lengths[i], Length, L"length mismatch");
+                Assert::AreEqual<uint64_t>(Stream.Addresses[i], Next, L"address mismatch");
+
+                Next += Length;
+            }
+
+            // Count limit
+            Assert::AreEqual<uint32_t>(Stream.Decode(Address, Bytecode, ResultSize, 2), DecodeStatus::T::CountLimit, L"status mismatch");
+            Assert::AreEqual<size_t>(Stream.Count(), 2, L"count mismatch");
+            Assert::AreEqual<size_t>(Stream.DecodedSize(), 7, L"decoded size mismatch");
+
+            // Immediate crosses the end of the range
+            Assert::AreEqual<uint32_t>(Stream.Decode(Address, Bytecode, 4), DecodeStatus::T::Truncated, L"status mismatch");
+            Assert::AreEqual<size_t>(Stream.Count(), 1, L"count mismatch");
+            Assert::AreEqual<size_t>(Stream.DecodedSize(), 2, L"decoded size mismatch");
+
+            // Undefined opcode
+            Bytecode[2] = 0x80 | (VMInstruction::InstructionCount & 0x7f);
+            Bytecode[3] = VMInstruction::InstructionCount >> 7;
+            Assert::AreEqual<uint32_t>(Stream.Decode(Address, Bytecode, ResultSize), DecodeStatus::T::InvalidInstruction, L"status mismatch");
+            Assert::AreEqual<size_t>(Stream.Count(), 1, L"count mismatch");
+            Assert::AreEqual<size_t>(Stream.DecodedSize(), 2, L"decoded size mismatch");
+        }
+
     private:
     };
 